@@ -15,14 +15,32 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <time.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "catalog/pg_control.h"
 #include "common/controldata_utils.h"
 #include "pgut/pgut-port.h"
 
 #define TIMEOUT_ARCHIVE		10		/* wait 10 sec until WAL archive complete */
+#define ARCHIVE_WAIT_MIN	10		/* first interval to recheck archive in msec */
+#define ARCHIVE_WAIT_MAX	1000	/* longest interval to recheck archive in msec */
+
+/*
+ * The database files completed so far are appended to RESUME_FILE_LIST of
+ * the backup every RESUME_CHECKPOINT_INTERVAL seconds, so that --resume
+ * reuses them if the backup fails.
+ */
+#define RESUME_FILE_LIST			DATABASE_FILE_LIST ".partial"
+#define RESUME_CHECKPOINT_INTERVAL	10
 
 static bool		 in_backup = false;	/* TODO: more robust logic */
 static parray	*cleanup_list;		/* list of command to execute at error processing for snapshot */
@@ -41,8 +59,18 @@ static void backup_cleanup(bool fatal, void *userdata);
 static void delete_old_files(const char *root, parray *files, int keep_files,
 							 int keep_days, bool is_arclog);
 static void backup_files(const char *from_root, const char *to_root,
-	parray *files, parray *prev_files, const XLogRecPtr *lsn, bool compress, const char *prefix);
+	parray *files, parray *prev_files, const pgBackup *prev_backup,
+	const XLogRecPtr *lsn, bool compress, const char *prefix);
 static parray *do_backup_database(parray *backup_list, pgBackupOption bkupopt);
+static parray *do_backup_database_replication(parray *backup_list,
+											  bool smooth_checkpoint);
+static pgBackup *get_prev_database_backup(parray *backup_list);
+static pgBackup *get_resume_backup(parray *backup_list,
+								   const pgBackup *prev_backup);
+static parray *read_resume_file_list(const pgBackup *backup);
+static void write_mkdirs_sh(parray *files, const char *root);
+static void finish_database_backup(parray *files);
+static void remove_base_backup_dir(const char *root);
 static parray *do_backup_arclog(parray *backup_list);
 static parray *do_backup_srvlog(parray *backup_list);
 static void confirm_block_size(const char *name, int blcksz);
@@ -70,8 +98,71 @@ static void add_files(parray *files, const char *root, bool add_root, bool is_pg
 static int strCompare(const void *str1, const void *str2);
 static void create_file_list(parray *files, const char *root, const char *prefix, bool is_append);
 static void check_server_version(void);
+static char *get_server_setting(const char *name);
+static void set_tablespace_max_rate(void);
+static int open_archive_watch(const char *path);
 
 static int wal_segment_size = 0;
+static pgBlockMap *block_map = NULL;	/* blocks modified since the previous backup */
+static const char *base_backup_root = NULL;	/* files received by --replication */
+static char resume_root[MAXPGPATH];	/* database directory of the failed
+									 * backup to resume by --resume */
+static parray *resume_files = NULL;	/* files completed in resume_root */
+
+/* the server may be a standby, on which txid_current() is not allowed */
+#define REPLICATION_XID_SQL \
+	"SELECT CASE WHEN pg_is_in_recovery()" \
+	" THEN txid_snapshot_xmax(txid_current_snapshot()) ELSE txid_current() END"
+
+/*
+ * Entry of the index of the previous file list by the path relative to the
+ * root directory, which is the path written in the file list.
+ */
+typedef struct PrevFileEntry
+{
+	const char *path;
+	pgFile	   *file;
+} PrevFileEntry;
+
+/* arguments and shared state of backup_files() workers */
+typedef struct backup_files_arg
+{
+	const char		   *from_root;
+	const char		   *to_root;
+	parray			   *files;			/* all the listed files */
+	parray			   *prev_files;
+	PrevFileEntry	   *prev_index;		/* prev_files sorted by relative path */
+	int					num_prev;
+	char				link_root[MAXPGPATH];	/* directory of the previous
+												 * backup to link unchanged
+												 * files from, or empty */
+	bool				link_data_files;	/* data file images in link_root
+											 * have all blocks */
+	PrevFileEntry	   *resume_index;	/* resume_files sorted by relative
+										 * path, or NULL */
+	int					num_resume;
+	const XLogRecPtr   *lsn;
+	const pgBlockMap   *block_map;		/* NULL if all blocks should be read */
+	bool				received;		/* from_root is base_backup_root */
+	bool				arclog;			/* from_root is arclog_path */
+	bool				compress;
+	bool				dedup;			/* store other files than data
+										 * files by --dedup too */
+	const char		   *prefix;
+	struct timeval		tv;				/* time when backup_files() started */
+
+	parray			   *copy_files;		/* regular files to be copied */
+
+	/* protected by lock */
+	pthread_mutex_t		lock;
+	int					next_file;		/* index of next file in copy_files */
+	int					num_workers;	/* workers which took any file */
+	int					num_processed;
+	int					num_skipped;
+	FILE			   *checkpoint;		/* RESUME_FILE_LIST, or NULL */
+	parray			   *completed;		/* files not written into checkpoint */
+	time_t				checkpoint_time;	/* when checkpoint was written */
+} backup_files_arg;
 
 /*
  * Take a backup of database.
@@ -82,7 +173,7 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	int			i;
 	parray	   *files;				/* backup file list from non-snapshot */
 	parray	   *prev_files = NULL;	/* file list of previous database backup */
-	FILE	   *fp;
+	pgBackup   *prev_backup = NULL;
 	char		path[MAXPGPATH];
 	char		label[1024];
 	XLogRecPtr *lsn = NULL;
@@ -94,6 +185,8 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	check_server_version();
 
 	init_data_checksum_enabled();
+	if (verify_checksums && !data_checksum_enabled)
+		elog(INFO, _("--verify-checksums is ignored because data checksums are disabled"));
 
 	if (!HAVE_DATABASE(&current))
 	{
@@ -132,6 +225,9 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	current.total_data_bytes = 0;
 	current.read_data_bytes = 0;
 
+	if (use_replication)
+		return do_backup_database_replication(backup_list, smooth_checkpoint);
+
 	/* notify start of backup to PostgreSQL server */
 	time2iso(label, lengthof(label), current.start_time);
 	strncat(label, " with pg_rman", lengthof(label) - strlen(label) - 1);
@@ -150,6 +246,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			 errmsg("could not execute restartpoint")));
 	}
 
+	/* limit the reads of each tablespace given by --tablespace-max-rate */
+	if (tablespace_max_rate)
+		set_tablespace_max_rate();
+
 	/*
 	 * Generate mkdirs.sh required to recreate the directory structure of
 	 * PGDATA when restoring.  Omits $PGDATA from being listed in the
@@ -158,24 +258,7 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	 */
 	files = parray_new();
 	dir_list_file(files, pgdata, NULL, false, false);
-
-	if (!check)
-	{
-		pgBackupGetPath(&current, path, lengthof(path), MKDIRS_SH_FILE);
-		fp = fopen(path, "wt");
-		if (fp == NULL)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not open make directory script \"%s\": %s",
-						path, strerror(errno))));
-		dir_print_mkdirs_sh(fp, files, pgdata);
-		fclose(fp);
-		if (chmod(path, DIR_PERMISSION) == -1)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not change mode of \"%s\": %s", path,
-						strerror(errno))));
-	}
+	write_mkdirs_sh(files, pgdata);
 
 	/* Free no longer needed memory. */
 	parray_walk(files, pgFileFree);
@@ -192,29 +275,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 	 */
 	if (current.backup_mode < BACKUP_MODE_FULL)
 	{
-		pgBackup   *prev_backup;
 		uint32		xlogid, xrecoff;
 
-		/* find last completed database backup */
-		prev_backup = catalog_get_last_data_backup(backup_list);
-		if (prev_backup == NULL || prev_backup->tli != current.tli)
-		{
-			if (current.full_backup_on_error)
-			{
-				ereport(NOTICE,
-					(errmsg("turn to take a full backup"),
-					 errdetail("There is no validated full backup with current timeline.")));
-				current.backup_mode = BACKUP_MODE_FULL;
-			}
-			else
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("cannot take an incremental backup"),
-					 errdetail("There is no validated full backup with current timeline."),
-					 errhint("Please take a full backup and validate it before doing an incremental backup. "
-						"Or use with --full-backup-on-error command line option.")));
-		}
-		else
+		prev_backup = get_prev_database_backup(backup_list);
+		if (prev_backup)
 		{
 			pgBackupGetPath(prev_backup, prev_file_txt, lengthof(prev_file_txt),
 				DATABASE_FILE_LIST);
@@ -228,6 +292,15 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			xrecoff = (uint32) *lsn;
 			elog(DEBUG, _("backup only the page updated after LSN(%X/%08X)"),
 							xlogid, xrecoff);
+
+			/*
+			 * Find the pages updated after the LSN from WAL, so that only
+			 * they are read from the data files.
+			 */
+			block_map = xlog_build_block_map(current.tli, *lsn,
+											 current.start_lsn, wal_segment_size);
+			if (block_map == NULL)
+				elog(INFO, _("could not find updated pages from WAL, read whole of updated data files"));
 		}
 	}
 
@@ -256,11 +329,36 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		else if (current.backup_mode == BACKUP_MODE_INCREMENTAL)
 			elog(DEBUG, "taking incremental backup of database files");
 
+		/* reuse the files the last failed backup completed */
+		if (resume_backup && !check)
+		{
+			pgBackup   *failed = get_resume_backup(backup_list, prev_backup);
+
+			if (failed)
+			{
+				time2iso(label, lengthof(label), failed->start_time);
+				elog(INFO, _("resuming backup \"%s\""), label);
+				pgBackupGetPath(failed, resume_root, lengthof(resume_root),
+								DATABASE_DIR);
+				resume_files = read_resume_file_list(failed);
+			}
+		}
+
 		/* Construct the directory for this backup within BACKUP_PATH. */
 		pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
 
 		/* Save the files listed above. */
-		backup_files(pgdata, path, files, prev_files, lsn, current.compress_data, NULL);
+		stats_begin(STATS_COPY_FILES);
+		backup_files(pgdata, path, files, prev_files, prev_backup, lsn,
+					 current.compress_data, NULL);
+		stats_end(STATS_COPY_FILES);
+
+		if (resume_files)
+		{
+			parray_walk(resume_files, pgFileFree);
+			parray_free(resume_files);
+			resume_files = NULL;
+		}
 
 		/*
 		 * Notify end of backup and save the backup_label and tablespace_map
@@ -378,7 +476,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 
 		/* backup files from non-snapshot */
 		pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
-		backup_files(pgdata, path, files, prev_files, lsn, current.compress_data, NULL);
+		stats_begin(STATS_COPY_FILES);
+		backup_files(pgdata, path, files, prev_files, prev_backup, lsn,
+					 current.compress_data, NULL);
+		stats_end(STATS_COPY_FILES);
 
 		/*
 		 * Notify end of backup and write backup_label and tablespace_map
@@ -437,7 +538,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 				/* append DB cluster to backup file list */
 				add_files(snapshot_files, mp, false, true);
 				/* backup files of DB cluster from snapshot volume */
-				backup_files(mp, path, snapshot_files, prev_files, lsn, current.compress_data, NULL);
+				stats_begin(STATS_COPY_FILES);
+				backup_files(mp, path, snapshot_files, prev_files, NULL, lsn,
+							 current.compress_data, NULL);
+				stats_end(STATS_COPY_FILES);
 				/* create file list of snapshot objects (DB cluster) */
 				create_file_list(snapshot_files, mp, NULL, true);
 				/* remove the detected tablespace("PG-DATA") from tblspcmp_list */
@@ -468,7 +572,10 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 						/* backup files of TABLESPACE from snapshot volume */
 						join_path_components(prefix, PG_TBLSPC_DIR, oid);
 						join_path_components(dest, path, prefix);
-						backup_files(mp, dest, snapshot_files, prev_files, lsn, current.compress_data, prefix);
+						stats_begin(STATS_COPY_FILES);
+						backup_files(mp, dest, snapshot_files, prev_files, NULL, lsn,
+									 current.compress_data, prefix);
+						stats_end(STATS_COPY_FILES);
 
 						/* create file list of snapshot objects (TABLESPACE) */
 						create_file_list(snapshot_files, mp, prefix, true);
@@ -511,7 +618,342 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 		PQclear(tblspc_res);
 	}
 
-	/* Update various size fields in current. */
+	xlog_free_block_map(block_map);
+	block_map = NULL;
+
+	finish_database_backup(files);
+
+	return files;
+}
+
+/*
+ * Take a backup of database with the files sent by the server through the
+ * replication protocol instead of reading PGDATA, see basebackup.c.  The
+ * regular files are written into the backup by the receiver as they are
+ * received.  Only the directories are made in BASE_BACKUP_DIR of the backup,
+ * which is the root of the paths in the file list and removed at the end.
+ * The files not modified since the previous backup are not written by the
+ * receiver but passed to backup_files() with the directories as from PGDATA.
+ */
+static parray *
+do_backup_database_replication(parray *backup_list, bool smooth_checkpoint)
+{
+	int			i;
+	parray	   *files;
+	parray	   *received;		/* files written by the receiver */
+	parray	   *unchanged;		/* files not modified since prev_backup */
+	parray	   *links;			/* symbolic links to the tablespaces */
+	parray	   *prev_files = NULL;
+	pgBackup   *prev_backup = NULL;
+	PGresult   *res;
+	char		root[MAXPGPATH];
+	char		path[MAXPGPATH];
+	char		manifest_path[MAXPGPATH];
+	char		prev_manifest[MAXPGPATH];
+	char		label[1024];
+	uint64		sysid;
+
+	join_path_components(path, backup_path, SNAPSHOT_SCRIPT_FILE);
+	if (fileExists(path))
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("cannot take a backup"),
+			 errdetail("Taking backup with snapshot-script is not supported with --replication.")));
+
+	/* the timeline to find the previous backup on */
+	base_backup_identify_system(&sysid, &current.tli);
+
+	if (current.backup_mode < BACKUP_MODE_FULL)
+	{
+		prev_backup = get_prev_database_backup(backup_list);
+		if (prev_backup)
+		{
+			pgBackupGetPath(prev_backup, prev_manifest, lengthof(prev_manifest),
+				BACKUP_MANIFEST_FILE);
+			elog(DEBUG, _("backup only the page updated after LSN(%X/%08X)"),
+				 (uint32) (prev_backup->start_lsn >> 32),
+				 (uint32) prev_backup->start_lsn);
+		}
+	}
+
+	/* nothing to receive the files into */
+	if (check)
+		return parray_new();
+
+	time2iso(label, lengthof(label), current.start_time);
+	strncat(label, " with pg_rman", lengthof(label) - strlen(label) - 1);
+
+	pgBackupGetPath(&current, root, lengthof(root), BASE_BACKUP_DIR);
+	if (prev_backup)
+	{
+		pgBackupGetPath(prev_backup, path, lengthof(path), DATABASE_FILE_LIST);
+		prev_files = dir_read_file_list(root, path);
+		parray_qsort(prev_files, pgFileComparePath);
+	}
+
+	pgBackupGetPath(&current, path, lengthof(path), DATABASE_DIR);
+	pgBackupGetPath(&current, manifest_path, lengthof(manifest_path),
+		BACKUP_MANIFEST_FILE);
+	received = parray_new();
+	unchanged = parray_new();
+	links = parray_new();
+	stats_begin(STATS_BASE_BACKUP);
+	base_backup_receive(label, smooth_checkpoint,
+						prev_backup ? prev_manifest : NULL, prev_files,
+						prev_backup ? &prev_backup->start_lsn : NULL,
+						root, path, manifest_path, received, unchanged, links,
+						&current);
+	stats_end(STATS_BASE_BACKUP);
+
+	/* the server has waited for the WAL to be archived */
+	reconnect();
+	res = execute(REPLICATION_XID_SQL, 0, NULL);
+	get_xid(res, &current.recovery_xid);
+	current.recovery_time = time(NULL);
+	PQclear(res);
+	disconnect();
+
+	/* the tablespaces are made under pg_tblspc, but linked from there */
+	files = parray_new();
+	dir_list_file(files, root, NULL, false, false);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+		int		j;
+
+		for (j = 0; j < parray_num(links); j++)
+		{
+			pgFile *link = (pgFile *) parray_get(links, j);
+
+			if (path_is_prefix_of_path(link->path, file->path))
+			{
+				pgFileFree(parray_remove(files, i));
+				i--;
+				break;
+			}
+		}
+	}
+	parray_concat(files, links);
+	write_mkdirs_sh(files, root);
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+	parray_free(links);
+
+	/*
+	 * Make the directories, and link or skip the unchanged files, as if they
+	 * are in PGDATA.
+	 */
+	files = parray_new();
+	add_files(files, root, false, true);
+	parray_concat(files, unchanged);
+	parray_free(unchanged);
+
+	base_backup_root = root;
+	stats_begin(STATS_COPY_FILES);
+	backup_files(root, path, files, prev_files, prev_backup,
+				 prev_backup ? &prev_backup->start_lsn : NULL,
+				 current.compress_data, NULL);
+	stats_end(STATS_COPY_FILES);
+	base_backup_root = NULL;
+
+	parray_concat(files, received);
+	parray_free(received);
+	parray_qsort(files, pgFileComparePath);
+	create_file_list(files, root, NULL, false);
+
+	remove_base_backup_dir(root);
+
+	if (prev_files)
+	{
+		parray_walk(prev_files, pgFileFree);
+		parray_free(prev_files);
+	}
+
+	finish_database_backup(files);
+
+	return files;
+}
+
+/*
+ * Find the last completed database backup on the current timeline, to take
+ * an incremental backup based on it.  If not found, switch to take a full
+ * backup with --full-backup-on-error, or error out.
+ *
+ * TODO: fix for issue #154
+ * When a backup list is deleted with rm command or pg_rman's delete command with '--force' option,
+ * pg_rman can't detect there is a missing piece of backup.
+ * We need the way tracing the backup chains or something else...
+ */
+static pgBackup *
+get_prev_database_backup(parray *backup_list)
+{
+	pgBackup   *prev_backup;
+
+	/* find last completed database backup */
+	prev_backup = catalog_get_last_data_backup(backup_list);
+	if (prev_backup != NULL && prev_backup->tli == current.tli)
+		return prev_backup;
+
+	if (current.full_backup_on_error)
+	{
+		ereport(NOTICE,
+			(errmsg("turn to take a full backup"),
+			 errdetail("There is no validated full backup with current timeline.")));
+		current.backup_mode = BACKUP_MODE_FULL;
+	}
+	else
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("cannot take an incremental backup"),
+			 errdetail("There is no validated full backup with current timeline."),
+			 errhint("Please take a full backup and validate it before doing an incremental backup. "
+				"Or use with --full-backup-on-error command line option.")));
+
+	return NULL;
+}
+
+/*
+ * Find the backup to resume by --resume, i.e. the latest database backup if
+ * it failed, or NULL if there is none.  The files of it are reused as they
+ * are, so it must have been taken by the same mode and format within the
+ * same timeline, and after prev_backup for an incremental backup.
+ *
+ * The backup itself is not continued since recovery must start from the
+ * backup_label of the backup notified its end, but the files not modified
+ * since it listed them are not copied again.
+ */
+static pgBackup *
+get_resume_backup(parray *backup_list, const pgBackup *prev_backup)
+{
+	int			i;
+	char		timestamp[20];
+	char		path[MAXPGPATH];
+
+	for (i = 0; i < parray_num(backup_list); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backup_list, i);
+
+		/* the current backup, and backups without database files */
+		if (backup->start_time == current.start_time || !HAVE_DATABASE(backup))
+			continue;
+
+		/* a RUNNING backup is left by pg_rman killed, since we hold the lock */
+		if (backup->status != BACKUP_STATUS_ERROR &&
+			backup->status != BACKUP_STATUS_RUNNING)
+			break;
+
+		time2iso(timestamp, lengthof(timestamp), backup->start_time);
+		pgBackupGetPath(backup, path, lengthof(path), RESUME_FILE_LIST);
+		if (!fileExists(path))
+		{
+			elog(INFO, _("backup \"%s\" has no completed files to resume"),
+				 timestamp);
+			return NULL;
+		}
+		if (backup->backup_mode != current.backup_mode ||
+			BACKUP_COMPRESSION(backup) != BACKUP_COMPRESSION(&current) ||
+			backup->dedup != current.dedup ||
+			backup->tli != current.tli ||
+			(prev_backup && backup->start_time < prev_backup->start_time))
+		{
+			elog(INFO, _("backup \"%s\" cannot be resumed by the backup in other mode or format"),
+				 timestamp);
+			return NULL;
+		}
+
+		return backup;
+	}
+
+	elog(INFO, _("there is no failed backup to resume"));
+	return NULL;
+}
+
+/*
+ * Read RESUME_FILE_LIST of backup, which lists the files completed by it.
+ * The last line may be written partially when the backup failed, so the
+ * list is truncated to the last complete line before read.
+ */
+static parray *
+read_resume_file_list(const pgBackup *backup)
+{
+	char		path[MAXPGPATH];
+	char		buf[8192];
+	FILE	   *fp;
+	size_t		len;
+	off_t		offset = 0;
+	off_t		end = 0;
+
+	pgBackupGetPath(backup, path, lengthof(path), RESUME_FILE_LIST);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open \"%s\": %s", path, strerror(errno))));
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		size_t	i;
+
+		for (i = len; i > 0; i--)
+		{
+			if (buf[i - 1] == '\n')
+			{
+				end = offset + i;
+				break;
+			}
+		}
+		offset += len;
+	}
+	if (ferror(fp))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read \"%s\": %s", path, strerror(errno))));
+	fclose(fp);
+
+	if (end < offset && truncate(path, end) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not truncate \"%s\": %s", path, strerror(errno))));
+
+	return dir_read_file_list(pgdata, path);
+}
+
+/*
+ * Generate mkdirs.sh required to recreate the directories and the symbolic
+ * links in files under root when restoring.
+ */
+static void
+write_mkdirs_sh(parray *files, const char *root)
+{
+	FILE	   *fp;
+	char		path[MAXPGPATH];
+
+	if (check)
+		return;
+
+	pgBackupGetPath(&current, path, lengthof(path), MKDIRS_SH_FILE);
+	fp = fopen(path, "wt");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open make directory script \"%s\": %s",
+					path, strerror(errno))));
+	dir_print_mkdirs_sh(fp, files, root);
+	fclose(fp);
+	if (chmod(path, DIR_PERMISSION) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", path,
+					strerror(errno))));
+}
+
+/*
+ * Update various size fields in current with the database files backed up.
+ */
+static void
+finish_database_backup(parray *files)
+{
+	int		i;
+
 	for (i = 0; i < parray_num(files); i++)
 	{
 		pgFile *file = (pgFile *) parray_get(files, i);
@@ -523,14 +965,48 @@ do_backup_database(parray *backup_list, pgBackupOption bkupopt)
 			current.write_bytes += file->write_size;
 	}
 
+	/* the chunks newly stored by --dedup are written too */
+	current.write_bytes += dedup_written_bytes();
+
+	/* list the chunks the backup refers to for dedup_collect_garbage() */
+	if (current.dedup && !check)
+		dedup_write_chunk_list(&current);
+
+	if (checksum_failures() > 0)
+	{
+		if (fail_on_checksum_error)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("checksum verification failed in " INT64_FORMAT " pages",
+					checksum_failures())));
+		elog(WARNING, _("checksum verification failed in " INT64_FORMAT " pages"),
+			 checksum_failures());
+	}
+
 	if (verbose)
 	{
 		printf(_("database backup completed(read: " INT64_FORMAT " write: " INT64_FORMAT ")\n"),
 			current.read_data_bytes, current.write_bytes);
 		printf(_("========================================\n"));
 	}
+}
 
-	return files;
+/*
+ * Remove the files received by --replication, which have been backed up.
+ */
+static void
+remove_base_backup_dir(const char *root)
+{
+	parray *files = parray_new();
+	int		i;
+
+	dir_list_file(files, root, NULL, false, true);
+	parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+	for (i = 0; i < parray_num(files); i++)
+		pgFileDelete((pgFile *) parray_get(files, i));
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
 }
 
 /*
@@ -611,6 +1087,7 @@ do_backup_arclog(parray *backup_list)
 	pgBackup   *prev_backup;
 	int64		arclog_write_bytes = 0;
 	char		last_wal[MAXPGPATH];
+	parray	   *all_files;			/* files in ARCLOG_PATH */
 
 	if (!HAVE_ARCLOG(&current) || check)
 		return NULL;
@@ -644,15 +1121,16 @@ do_backup_arclog(parray *backup_list)
 	}
 
 	/* list files with the logical path. omit ARCLOG_PATH */
-	files = parray_new();
-	dir_list_file(files, arclog_path, NULL, true, false);
+	all_files = parray_new();
+	dir_list_file(all_files, arclog_path, NULL, true, false);
 
 	/* remove WALs archived after pg_backup_stop()/pg_switch_wal() */
 	xlog_fname(last_wal, lengthof(last_wal), current.tli, &current.stop_lsn,
 			   wal_segment_size);
-	for (i = 0; i < parray_num(files); i++)
+	files = parray_new();
+	for (i = 0; i < parray_num(all_files); i++)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
+		pgFile *file = (pgFile *) parray_get(all_files, i);
 		char *fname;
 		if ((fname = last_dir_separator(file->path)))
 			fname++;
@@ -661,16 +1139,18 @@ do_backup_arclog(parray *backup_list)
 
 		/* to backup backup history files, compare tli/lsn portion only */
 		if (strncmp(fname, last_wal, 24) > 0)
-		{
-			parray_remove(files, i);
-			i--;
-		}
+			pgFileFree(file);
+		else
+			parray_append(files, file);
 	}
+	parray_free(all_files);
 
 	elog(DEBUG, "taking backup of archived WAL files");
 	pgBackupGetPath(&current, path, lengthof(path), ARCLOG_DIR);
-	backup_files(arclog_path, path, files, prev_files, NULL,
+	stats_begin(STATS_BACKUP_ARCLOG);
+	backup_files(arclog_path, path, files, prev_files, prev_backup, NULL,
 				 current.compress_data, NULL);
+	stats_end(STATS_BACKUP_ARCLOG);
 
 	/* create file list */
 	if (!check)
@@ -684,6 +1164,7 @@ do_backup_arclog(parray *backup_list)
 					strerror(errno))));
 		dir_print_file_list(fp, files, arclog_path, NULL);
 		fclose(fp);
+		dir_print_file_index(path, files, arclog_path, NULL);
 	}
 
 	/* print summary of size of backup files */
@@ -715,7 +1196,7 @@ do_backup_arclog(parray *backup_list)
 				file->path + strlen(file->path) - strlen(".history"))
 		{
 			elog(DEBUG, _("(timeline history) %s"), file->path);
-			copy_file(arclog_path, timeline_dir, file, NO_COMPRESSION);
+			copy_file(arclog_path, timeline_dir, file, NO_COMPRESSION, COMPRESS_NONE);
 		}
 	}
 
@@ -776,7 +1257,10 @@ do_backup_srvlog(parray *backup_list)
 	dir_list_file(files, srvlog_path, NULL, true, false);
 
 	pgBackupGetPath(&current, path, lengthof(path), SRVLOG_DIR);
-	backup_files(srvlog_path, path, files, prev_files, NULL, false, NULL);
+	stats_begin(STATS_BACKUP_SRVLOG);
+	backup_files(srvlog_path, path, files, prev_files, prev_backup, NULL,
+				 false, NULL);
+	stats_end(STATS_BACKUP_SRVLOG);
 
 	/* create file list */
 	if (!check)
@@ -790,6 +1274,7 @@ do_backup_srvlog(parray *backup_list)
 					strerror(errno))));
 		dir_print_file_list(fp, files, srvlog_path, NULL);
 		fclose(fp);
+		dir_print_file_index(path, files, srvlog_path, NULL);
 	}
 
 	/* print summary of size of backup mode files */
@@ -825,6 +1310,7 @@ do_backup(pgBackupOption bkupopt)
 	parray *files_srvlog;
 	int    ret;
 	char   path[MAXPGPATH];
+	char   stats[STATS_SUMMARY_LEN];
 
 	/* repack the necesary options */
 	int	keep_arclog_files = bkupopt.keep_arclog_files;
@@ -837,8 +1323,8 @@ do_backup(pgBackupOption bkupopt)
 	ControlFileData *controlFile;
 	bool	crc_ok;
 
-	/* PGDATA and BACKUP_MODE are always required */
-	if (pgdata == NULL)
+	/* PGDATA and BACKUP_MODE are always required, PGDATA unless --replication */
+	if (pgdata == NULL && !use_replication)
 		ereport(ERROR,
 			(errcode(ERROR_ARGS),
 			 errmsg("required parameter not specified: PGDATA (-D, --pgdata)")));
@@ -863,8 +1349,9 @@ do_backup(pgBackupOption bkupopt)
 	 * If we are taking backup from standby
 	 * (ie, $PGDATA has recovery.conf or standby.signal),
 	 * check required parameters (ie, standby connection info).
+	 * With --replication, the server sends the files whichever it is.
 	 */
-	if (get_standby_signal_filepath(path, sizeof(path)))
+	if (!use_replication && get_standby_signal_filepath(path, sizeof(path)))
 	{
 		if (!bkupopt.standby_host || !bkupopt.standby_port)
 			ereport(ERROR,
@@ -876,44 +1363,119 @@ do_backup(pgBackupOption bkupopt)
 	else
 		current.is_from_standby = false;
 
-#ifndef HAVE_LIBZ
-	if (current.compress_data)
+	if (current.compress_data &&
+		!compress_algorithm_supported(current.compress_algorithm))
 	{
+		if (current.compress_algorithm != COMPRESS_ZLIB)
+			ereport(ERROR,
+				(errcode(ERROR_ARGS),
+				 errmsg("this pg_rman build does not support %s compression",
+					compress_algorithm_name(current.compress_algorithm)),
+				 errhint("Please build PostgreSQL with %s to use it, or specify another compress-algorithm.",
+					current.compress_algorithm == COMPRESS_LZ4 ? "lz4" : "zstd")));
+
 		ereport(WARNING,
 			(errmsg("this pg_rman build does not support compression"),
 			 errhint("Please build PostgreSQL with zlib to use compression.")));
 		current.compress_data = false;
 	}
-#endif
+	if (current.compress_data &&
+		(current.compress_level < 0 ||
+		 current.compress_level > compress_level_max(current.compress_algorithm)))
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("compress-level for %s must be between 1 and %d, or 0 for the default",
+				compress_algorithm_name(current.compress_algorithm),
+				compress_level_max(current.compress_algorithm))));
 
-	controlFile = get_controlfile(pgdata, &crc_ok);
+	/* the chunks are kept in BACKUP_PATH, which the stream doesn't have */
+	if (current.dedup && backup_output)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("--dedup cannot be used with --output")));
 
-	if (!crc_ok)
-		ereport(WARNING,
-				(errmsg("control file appears to be corrupt"),
-				 errdetail("Calculated CRC checksum does not match value stored in file.")));
-	wal_segment_size = controlFile->xlog_seg_size;
-	pg_free(controlFile);
+	/* the files of the failed backup are linked in BACKUP_PATH */
+	if (resume_backup && backup_output)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("--resume cannot be used with --output")));
 
-	/* Check that we're working with the correct database cluster */
-	check_system_identifier();
+	if (max_rate < 0)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("--max-rate must be a positive number, or 0 for no limit: %d", max_rate)));
+	if (max_iops < 0)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("--max-iops must be a positive number, or 0 for no limit: %d", max_iops)));
 
-	/* show configuration actually used */
-	if (verbose)
+	/*
+	 * With --replication, the server reads the files, and --max-rate is
+	 * passed to it instead.
+	 */
+	if (use_replication)
 	{
-		printf(_("========================================\n"));
-		printf(_("backup start\n"));
-		printf(_("----------------------------------------\n"));
-		pgBackupWriteConfigSection(stderr, &current);
-		printf(_("----------------------------------------\n"));
+		if (max_iops > 0 || tablespace_max_rate)
+			elog(INFO, _("--max-iops and --tablespace-max-rate are ignored with --replication"));
+		if (resume_backup)
+			elog(INFO, _("--resume is ignored with --replication"));
+		resume_backup = false;
+		throttle_init(0, 0);
 	}
+	else
+		throttle_init(max_rate, max_iops);
 
-	/* get exclusive lock of backup catalog */
-	ret = catalog_lock();
-	if (ret == -1)
-		ereport(ERROR,
-			(errcode(ERROR_SYSTEM),
-			 errmsg("could not lock backup catalog")));
+	/* the server verifies checksums of the files it sends by itself */
+	if (fail_on_checksum_error)
+		verify_checksums = true;
+	if (use_replication && verify_checksums)
+	{
+		elog(INFO, _("--verify-checksums and --fail-on-checksum-error are ignored with --replication"));
+		verify_checksums = false;
+		fail_on_checksum_error = false;
+	}
+
+	if (use_replication)
+	{
+		char   *setting = get_server_setting("wal_segment_size");
+
+		wal_segment_size = atoi(setting);
+		free(setting);
+	}
+	else
+	{
+		controlFile = get_controlfile(pgdata, &crc_ok);
+
+		if (!crc_ok)
+			ereport(WARNING,
+					(errmsg("control file appears to be corrupt"),
+					 errdetail("Calculated CRC checksum does not match value stored in file.")));
+		wal_segment_size = controlFile->xlog_seg_size;
+		pg_free(controlFile);
+	}
+
+	/* Check that we're working with the correct database cluster */
+	check_system_identifier();
+
+	/* open --output before anything is printed to stdout */
+	sink_init();
+
+	/* show configuration actually used */
+	if (verbose)
+	{
+		printf(_("========================================\n"));
+		printf(_("backup start\n"));
+		printf(_("----------------------------------------\n"));
+		pgBackupWriteConfigSection(stderr, &current);
+		printf(_("----------------------------------------\n"));
+	}
+
+	/* get exclusive lock of backup catalog */
+	ret = catalog_lock();
+	if (ret == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not lock backup catalog")));
 	else if (ret == 1)
 		ereport(ERROR,
 			(errcode(ERROR_ALREADY_RUNNING),
@@ -935,6 +1497,7 @@ do_backup(pgBackupOption bkupopt)
 	current.wal_block_size = XLOG_BLCKSZ;
 	current.recovery_xid = 0;
 	current.recovery_time = (time_t) 0;
+	current.streamed = (backup_output != NULL && !check);
 
 	/* create backup directory and backup.ini */
 	if (!check)
@@ -946,6 +1509,9 @@ do_backup(pgBackupOption bkupopt)
 		pgBackupWriteIni(&current);
 	}
 
+	/* files of the backup are written into --output from here */
+	sink_begin(&current);
+
 	elog(DEBUG, "destination directories of backup are initialized");
 
 	/* get list of backups already taken */
@@ -975,11 +1541,25 @@ do_backup(pgBackupOption bkupopt)
 
 	pgut_atexit_pop(backup_cleanup, NULL);
 
-	/* update backup status to DONE */
+	/* update backup status to DONE, with the summary of --stats */
 	current.end_time = time(NULL);
 	current.status = BACKUP_STATUS_DONE;
+	stats_summary(stats, lengthof(stats));
 	if (!check)
-		pgBackupWriteIni(&current);
+	{
+		pgBackupGetPath(&current, path, lengthof(path), STATS_FILE);
+		stats_write_json("backup", path);
+		pgBackupWriteIniWithStats(&current, stats);
+
+		/* the completed files are listed in file_database.txt now */
+		pgBackupGetPath(&current, path, lengthof(path), RESUME_FILE_LIST);
+		if (unlink(path) == -1 && errno != ENOENT)
+			elog(WARNING, _("could not remove \"%s\": %s"), path,
+				 strerror(errno));
+	}
+
+	/* followed by the file lists and backup.ini */
+	sink_end(&current);
 
 	if (verbose)
 	{
@@ -1007,9 +1587,6 @@ do_backup(pgBackupOption bkupopt)
 		delete_old_files(srvlog_path, files_srvlog, keep_srvlog_files,
 			keep_srvlog_days, false);
 
-	/* Delete old backup files after all backup operation. */
-	pgBackupDelete(keep_data_generations, keep_data_days);
-
 	/* Cleanup backup mode file list */
 	if (files_database)
 		parray_walk(files_database, pgFileFree);
@@ -1033,6 +1610,12 @@ do_backup(pgBackupOption bkupopt)
 		delete_arclog_link();
 	}
 
+	/*
+	 * Delete old backup files after all backup operation, since the lock is
+	 * released while their files are deleted.
+	 */
+	pgBackupDelete(keep_data_generations, keep_data_days);
+
 	/* release catalog lock */
 	catalog_unlock();
 
@@ -1074,6 +1657,80 @@ check_server_version(void)
 	disconnect();
 }
 
+/*
+ * Return the value of the server setting name, in the base unit.  Used
+ * instead of reading the files in PGDATA with --replication.
+ */
+static char *
+get_server_setting(const char *name)
+{
+	PGresult   *res;
+	char	   *setting;
+
+	reconnect();
+	res = execute("SELECT setting FROM pg_settings WHERE name = $1", 1, &name);
+	if (PQntuples(res) != 1 || PQnfields(res) != 1)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("cannot get %s: %s", name, PQerrorMessage(connection))));
+	setting = pgut_strdup(PQgetvalue(res, 0, 0));
+	PQclear(res);
+	disconnect();
+
+	return setting;
+}
+
+/*
+ * Parse --tablespace-max-rate, a comma separated list of NAME:RATE, and
+ * limit the reads of the files in each tablespace NAME to RATE MB/s.  The
+ * tablespaces are looked up by the connection of the backup.
+ */
+static void
+set_tablespace_max_rate(void)
+{
+	char	   *list = pgut_strdup(tablespace_max_rate);
+	char	   *item;
+	char	   *saveptr;
+
+	for (item = strtok_r(list, ",", &saveptr); item;
+		 item = strtok_r(NULL, ",", &saveptr))
+	{
+		PGresult   *res;
+		char	   *sep;
+		char	   *endp;
+		const char *name;
+		long		rate;
+
+		sep = strrchr(item, ':');
+		if (sep == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_ARGS),
+				 errmsg("invalid --tablespace-max-rate \"%s\", NAME:RATE expected", item)));
+		*sep = '\0';
+		name = item;
+		while (isspace((unsigned char) *name))
+			name++;
+		rate = strtol(sep + 1, &endp, 10);
+		while (isspace((unsigned char) *endp))
+			endp++;
+		if (endp == sep + 1 || *endp != '\0' || rate <= 0 || rate > INT_MAX)
+			ereport(ERROR,
+				(errcode(ERROR_ARGS),
+				 errmsg("invalid rate of tablespace \"%s\" in --tablespace-max-rate: \"%s\"",
+					name, sep + 1)));
+
+		res = execute("SELECT oid FROM pg_tablespace WHERE spcname = $1", 1, &name);
+		if (PQntuples(res) != 1)
+			ereport(ERROR,
+				(errcode(ERROR_ARGS),
+				 errmsg("tablespace \"%s\" in --tablespace-max-rate does not exist", name)));
+		throttle_add_tablespace(atooid(PQgetvalue(res, 0, 0)), (int) rate);
+		elog(DEBUG, "reading tablespace \"%s\" at most %ld MB/s", name, rate);
+		PQclear(res);
+	}
+	free(list);
+}
+
 static void
 confirm_block_size(const char *name, int blcksz)
 {
@@ -1114,6 +1771,7 @@ pg_backup_start(const char *label, bool smooth, pgBackup *backup)
 	params[0] = label;
 
 	elog(DEBUG, "executing pg_backup_start()");
+	stats_begin(STATS_START_BACKUP);
 
 	/*
 	 * Establish new connection to send backup control commands.  The same
@@ -1135,6 +1793,7 @@ pg_backup_start(const char *label, bool smooth, pgBackup *backup)
 			PQgetvalue(res, 0, 0), PQgetvalue(res, 0, 1));
 
 	PQclear(res);
+	stats_end(STATS_START_BACKUP);
 }
 
 /*
@@ -1147,6 +1806,14 @@ pg_backup_start(const char *label, bool smooth, pgBackup *backup)
  * or standby's.  In the latter case, the waiting will continue until
  * the required WAL segment is fully streamed to the standby server and
  * then archived by its archiver process.
+ *
+ * With --replication, PGDATA may be on another host, so waits for the
+ * segment to appear in ARCLOG_PATH instead.
+ *
+ * The directory is watched with inotify where available, so that the wait
+ * ends as soon as the archiver is done.  The file is also rechecked at an
+ * interval growing from ARCHIVE_WAIT_MIN to ARCHIVE_WAIT_MAX msec, which is
+ * all there is without inotify.
  */
 static void
 wait_for_archive(pgBackup *backup, const char *sql, int nParams,
@@ -1154,7 +1821,11 @@ wait_for_archive(pgBackup *backup, const char *sql, int nParams,
 {
 	PGresult	   *res;
 	char			done_path[MAXPGPATH];
-	int				try_count;
+	struct timeval	start;
+	struct timeval	now;
+	long			waited = 0;		/* in msec */
+	int				interval = ARCHIVE_WAIT_MIN;
+	int				watch;
 
 	Assert(connection != NULL);
 
@@ -1168,8 +1839,11 @@ wait_for_archive(pgBackup *backup, const char *sql, int nParams,
 
 	/* get filename from the result of pg_walfile_name_offset() */
 	elog(DEBUG, "waiting for %s is archived", PQgetvalue(res, 0, 0));
-	snprintf(done_path, lengthof(done_path),
-		"%s/pg_wal/archive_status/%s.done", pgdata, PQgetvalue(res, 0, 0));
+	if (use_replication)
+		join_path_components(done_path, arclog_path, PQgetvalue(res, 0, 0));
+	else
+		snprintf(done_path, lengthof(done_path),
+			"%s/pg_wal/archive_status/%s.done", pgdata, PQgetvalue(res, 0, 0));
 
 	PQclear(res);
 
@@ -1181,24 +1855,102 @@ wait_for_archive(pgBackup *backup, const char *sql, int nParams,
 	}
 
 	/* wait until switched WAL is archived */
-	try_count = 0;
+	stats_begin(STATS_WAIT_FOR_ARCHIVE);
+	watch = open_archive_watch(done_path);
+	gettimeofday(&start, NULL);
 	while (!fileExists(done_path))
 	{
-		sleep(1);
+		if (watch != -1)
+		{
+			struct pollfd	pfd;
+			char			events[4096];
+
+			pfd.fd = watch;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, interval) > 0 && (pfd.revents & POLLIN))
+			{
+				ssize_t		len;
+
+				/* drain the events, which only tell to recheck the file */
+				while ((len = read(watch, events, sizeof(events))) > 0)
+					;
+				if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+					errno != EINTR)
+				{
+					int		save_errno = errno;
+
+					close(watch);
+					ereport(ERROR,
+						(errcode(ERROR_SYSTEM),
+						 errmsg("could not read inotify events of \"%s\": %s",
+							done_path, strerror(save_errno))));
+				}
+			}
+		}
+		else
+			usleep(interval * 1000);
+
 		if (interrupted)
+		{
+			if (watch != -1)
+				close(watch);
 			ereport(FATAL,
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during waiting for WAL archiving")));
-		try_count++;
-		if (try_count > TIMEOUT_ARCHIVE)
+		}
+		gettimeofday(&now, NULL);
+		waited = (now.tv_sec - start.tv_sec) * 1000 +
+				 (now.tv_usec - start.tv_usec) / 1000;
+		if (waited > TIMEOUT_ARCHIVE * 1000)
+		{
+			if (watch != -1)
+				close(watch);
 			ereport(ERROR,
 				(errcode(ERROR_ARCHIVE_FAILED),
 				 errmsg("switched WAL could not be archived in %d seconds",
 					TIMEOUT_ARCHIVE)));
+		}
+		interval = Min(interval * 2, ARCHIVE_WAIT_MAX);
 	}
+	if (watch != -1)
+		close(watch);
+	stats_end(STATS_WAIT_FOR_ARCHIVE);
 
-	elog(DEBUG, "WAL file containing backup end point is archived after waiting for %d seconds",
-			try_count);
+	elog(DEBUG, "WAL file containing backup end point is archived after waiting for %ld msec",
+			waited);
+}
+
+/*
+ * Return a non-blocking inotify descriptor notified when a file is created
+ * in or moved into the directory of path, or -1 if not available.  The
+ * archiver renames .ready to .done, and archive_command usually creates
+ * the segment or moves it into place.
+ */
+static int
+open_archive_watch(const char *path)
+{
+#ifdef __linux__
+	char	dir[MAXPGPATH];
+	int		fd;
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	strlcpy(dir, path, lengthof(dir));
+	get_parent_directory(dir);
+	if (inotify_add_watch(fd, dir, IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE) == -1)
+	{
+		elog(DEBUG, "could not watch \"%s\": %s", dir, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	return -1;
+#endif
 }
 
 /*
@@ -1229,6 +1981,7 @@ pg_backup_stop(pgBackup *backup)
 	const char	   *params[1];
 
 	elog(DEBUG, "executing pg_backup_stop()");
+	stats_begin(STATS_STOP_BACKUP);
 
 	/*
 	 * Non-exclusive backup requires to use same connection as the one
@@ -1277,6 +2030,7 @@ pg_backup_stop(pgBackup *backup)
 
 	/* Done with the connection. */
 	disconnect();
+	stats_end(STATS_STOP_BACKUP);
 
 	return result;
 }
@@ -1394,36 +2148,579 @@ backup_cleanup(bool fatal, void *userdata)
 	}
 }
 
-/* take backup about listed file. */
+/*
+ * Print the result of processing a file in verbose mode and the progress in
+ * non-verbose format.  Called by backup_files() and its workers.
+ */
+static void
+backup_files_report(backup_files_arg *args, pgFile *file, bool skipped,
+					const char *status)
+{
+	unsigned long	num_files = (unsigned long) parray_num(args->files);
+
+	pthread_mutex_lock(&args->lock);
+
+	args->num_processed++;
+	if (skipped)
+		args->num_skipped++;
+
+	/* print the result in verbose mode */
+	if (verbose)
+	{
+		if (args->prefix)
+		{
+			char path[MAXPGPATH];
+			join_path_components(path, args->prefix,
+								 file->path + strlen(args->from_root) + 1);
+			printf(_("(%d/%lu) %s %s\n"), args->num_processed, num_files,
+				   path, status);
+		}
+		else
+			printf(_("(%d/%lu) %s %s\n"), args->num_processed, num_files,
+				   file->path + strlen(args->from_root) + 1, status);
+	}
+	/* print progress in non-verbose format */
+	else if (progress)
+	{
+		fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
+				args->num_processed, num_files, args->num_skipped);
+
+		if (args->num_processed < num_files)
+			fprintf(stderr, "\r");
+		else
+			fprintf(stderr, "\n");
+	}
+
+	pthread_mutex_unlock(&args->lock);
+}
+
+static int
+PrevFileEntryCompare(const void *e1, const void *e2)
+{
+	return strcmp(((const PrevFileEntry *) e1)->path,
+				  ((const PrevFileEntry *) e2)->path);
+}
+
+/*
+ * Clone the file at from_path into to_path sharing the extents, on file
+ * systems which support reflinks like XFS and Btrfs.  Returns false with
+ * to_path removed if not supported.
+ */
+bool
+clone_file(const char *from_path, const char *to_path)
+{
+#ifdef FICLONE
+	int		in;
+	int		out;
+	int		ret;
+
+	in = open(from_path, O_RDONLY | PG_BINARY, 0);
+	if (in == -1)
+		return false;
+	out = open(to_path, O_WRONLY | O_CREAT | O_EXCL | PG_BINARY, FILE_PERMISSION);
+	if (out == -1)
+	{
+		close(in);
+		return false;
+	}
+
+	ret = ioctl(out, FICLONE, in);
+	close(in);
+	close(out);
+	if (ret == -1)
+	{
+		unlink(to_path);
+		return false;
+	}
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+/*
+ * Put the image of file in root, the database directory of another backup
+ * which lists it as image, into the backup by a reflink or a hard link.
+ */
+static bool
+link_file_image(const backup_files_arg *args, const char *root, pgFile *file,
+				const pgFile *image)
+{
+	const char *rel_path = JoinPathEnd(file->path, args->from_root);
+	char		from_path[MAXPGPATH];
+	char		to_path[MAXPGPATH];
+
+	join_path_components(from_path, root, rel_path);
+	join_path_components(to_path, args->to_root, rel_path);
+	if (sink_is_streamed(to_path))
+		return false;
+
+	if (!clone_file(from_path, to_path) && link(from_path, to_path) == -1)
+	{
+		elog(DEBUG, "could not link \"%s\" to \"%s\": %s", from_path,
+			 to_path, strerror(errno));
+		return false;
+	}
+
+	file->read_size = 0;
+	file->write_size = image->write_size;
+	file->crc = image->crc;
+	file->is_datafile = image->is_datafile;
+	file->is_entire = image->is_entire;
+
+	return true;
+}
+
+/*
+ * Put the image of file in the previous backup, which is not modified since
+ * then, into the backup by a reflink, or a hard link if not supported,
+ * instead of recording it as not backed up.  So the backup has the entire
+ * image of every file and restore doesn't look back the older backups for
+ * it, at almost no cost of I/O and space.  Returns false if the image can't
+ * be linked, e.g. it's not in the previous backup either or it has only
+ * the pages modified in an incremental backup.
+ */
+static bool
+link_prev_file(const backup_files_arg *args, pgFile *file,
+			   const pgFile *prev_file)
+{
+	if (args->link_root[0] == '\0' || check ||
+		prev_file->write_size == BYTES_INVALID ||
+		(prev_file->is_datafile && !prev_file->is_entire &&
+		 !args->link_data_files))
+		return false;
+
+	if (!link_file_image(args, args->link_root, file, prev_file))
+		return false;
+
+	file->is_entire = prev_file->is_datafile;
+	return true;
+}
+
+/*
+ * Put the image of file completed by the failed backup into the backup, if
+ * the file is not modified since the failed backup listed it, as with the
+ * unchanged files of an incremental backup.  The image is checked to have
+ * the listed size, since the backup files are not synced to disk.
+ */
+static bool
+link_resumed_file(const backup_files_arg *args, pgFile *file,
+				  const pgFile *resumed)
+{
+	char		path[MAXPGPATH];
+	struct stat	st;
+
+	if (resumed->mtime != file->mtime ||
+		resumed->write_size == BYTES_INVALID)
+		return false;
+
+	join_path_components(path, resume_root,
+						 JoinPathEnd(file->path, args->from_root));
+	if (stat(path, &st) == -1 || st.st_size != resumed->write_size)
+		return false;
+
+	return link_file_image(args, resume_root, file, resumed);
+}
+
+/*
+ * Record file as completed in RESUME_FILE_LIST for --resume.  The completed
+ * files are written every RESUME_CHECKPOINT_INTERVAL seconds, or always if
+ * flush is true.  file can be NULL to write only.
+ */
+static void
+checkpoint_backup_file(backup_files_arg *args, pgFile *file, bool flush)
+{
+	time_t		now;
+
+	if (args->checkpoint == NULL)
+		return;
+
+	pthread_mutex_lock(&args->lock);
+
+	if (file)
+		parray_append(args->completed, file);
+
+	now = time(NULL);
+	if (parray_num(args->completed) > 0 &&
+		(flush || now - args->checkpoint_time >= RESUME_CHECKPOINT_INTERVAL))
+	{
+		dir_print_file_list(args->checkpoint, args->completed,
+							args->from_root, NULL);
+		if (fflush(args->checkpoint) != 0 ||
+			fsync(fileno(args->checkpoint)) != 0)
+		{
+			pthread_mutex_unlock(&args->lock);
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write \"%s\": %s", RESUME_FILE_LIST,
+					strerror(errno))));
+		}
+
+		parray_free(args->completed);
+		args->completed = parray_new();
+		args->checkpoint_time = now;
+	}
+
+	pthread_mutex_unlock(&args->lock);
+}
+
+/*
+ * Build the index of files by the path relative to root into *num entries.
+ */
+static PrevFileEntry *
+build_file_index(parray *files, const char *root, int *num)
+{
+	PrevFileEntry  *index;
+	int				i;
+
+	*num = parray_num(files);
+	index = pgut_newarray(PrevFileEntry, Max(*num, 1));
+
+	for (i = 0; i < *num; i++)
+	{
+		pgFile *p = (pgFile *) parray_get(files, i);
+
+		index[i].path = JoinPathEnd(p->path, root);
+		index[i].file = p;
+	}
+
+	qsort(index, *num, sizeof(PrevFileEntry), PrevFileEntryCompare);
+
+	return index;
+}
+
+/*
+ * Build the index of args->prev_files, shared by the backup_files() workers.
+ */
+static void
+build_prev_file_index(backup_files_arg *args)
+{
+	args->prev_index = build_file_index(args->prev_files, args->from_root,
+										&args->num_prev);
+}
+
+
+/*
+ * Find the entry of file in the previous file list, or NULL if not found.
+ */
+static pgFile *
+find_prev_file(const backup_files_arg *args, const pgFile *file)
+{
+	char			path[MAXPGPATH];
+	PrevFileEntry	key;
+	PrevFileEntry  *entry;
+
+	key.path = JoinPathEnd(file->path, args->from_root);
+
+	/*
+	 * If prefix is not NULL, the table space is backup from the snapshot.
+	 * Therefore, adjust file name to correspond to the file list.
+	 */
+	if (args->prefix)
+	{
+		join_path_components(path, args->prefix, key.path);
+		key.path = path;
+	}
+
+	entry = (PrevFileEntry *) bsearch(&key, args->prev_index, args->num_prev,
+									  sizeof(PrevFileEntry),
+									  PrevFileEntryCompare);
+
+	return entry ? entry->file : NULL;
+}
+
+/*
+ * Copy the regular files listed in args->copy_files into the backup until
+ * there is no file left.  This is run by each of the backup_files() workers;
+ * the next file is taken under the lock, so every pgFile is updated by one
+ * worker only.
+ */
+static void
+backup_files_worker(void *arg)
+{
+	backup_files_arg   *args = (backup_files_arg *) arg;
+	struct timeval		tv = args->tv;
+	CompressAlgorithm	compress;
+	bool				took_file = false;
+
+	compress = args->compress ? current.compress_algorithm : COMPRESS_NONE;
+
+	for (;;)
+	{
+		pgFile	   *file;
+		pgFile	   *prev_file = NULL;
+		bool		prev_file_not_found = false;
+		char		status[100];
+		BlockNumber *blocks;
+		int			num_blocks;
+		bool		copied;
+
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during backup")));
+
+		/* another worker failed, the backup is going to be aborted */
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_file >= parray_num(args->copy_files))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		file = (pgFile *) parray_get(args->copy_files, args->next_file++);
+		if (!took_file)
+		{
+			args->num_workers++;
+			took_file = true;
+		}
+		pthread_mutex_unlock(&args->lock);
+
+		/* reuse the image completed by the failed backup with --resume */
+		if (args->resume_index)
+		{
+			PrevFileEntry	key;
+			PrevFileEntry  *entry;
+
+			key.path = JoinPathEnd(file->path, args->from_root);
+			entry = (PrevFileEntry *) bsearch(&key, args->resume_index,
+											  args->num_resume,
+											  sizeof(PrevFileEntry),
+											  PrevFileEntryCompare);
+			if (entry && link_resumed_file(args, file, entry->file))
+			{
+				checkpoint_backup_file(args, file, false);
+				backup_files_report(args, file, false, _("resumed"));
+				continue;
+			}
+		}
+
+		/* skip files which have not been modified since last backup */
+		if (args->prev_files)
+		{
+			prev_file = find_prev_file(args, file);
+
+			if (prev_file)
+			{
+				if(prev_file->mtime == file->mtime)
+				{
+					if (link_prev_file(args, file, prev_file))
+					{
+						checkpoint_backup_file(args, file, false);
+						backup_files_report(args, file, false, _("linked"));
+						continue;
+					}
+
+					/* record as skipped file in file_xxx.txt */
+					file->write_size = BYTES_INVALID;
+					backup_files_report(args, file, true, _("skip"));
+					continue;
+				}
+			}
+			else
+				prev_file_not_found = true;
+		}
+
+		/*
+		 * We will wait until the next second of mtime so that backup
+		 * file should contain all modifications at the clock of mtime.
+		 * timer resolution of ext3 file system is one second.
+		 *
+		 * Such files are deferred to the end of copy_files, so this waits
+		 * at most once in each worker, and usually not at all because the
+		 * second has passed while copying the other files.
+		 */
+		if (!args->received && tv.tv_sec <= file->mtime)
+		{
+			/* update time and recheck */
+			gettimeofday(&tv, NULL);
+			while (tv.tv_sec <= file->mtime)
+			{
+				usleep(1000000 - tv.tv_usec);
+				gettimeofday(&tv, NULL);
+			}
+		}
+
+		/*
+		 * Read only the blocks modified since the previous backup, if the
+		 * file was also backed up as a data file in it.
+		 */
+		blocks = NULL;
+		num_blocks = 0;
+		if (file->is_datafile && args->block_map &&
+			prev_file && prev_file->is_datafile)
+			xlog_block_map_get(args->block_map,
+							   JoinPathEnd(file->path, args->from_root),
+							   &blocks, &num_blocks);
+
+		/* copy the file into backup */
+		if (file->is_datafile)
+			copied = backup_data_file(args->from_root, args->to_root, file,
+									  args->lsn, compress, prev_file_not_found,
+									  blocks, num_blocks);
+		else if (args->arclog && IsXLogFileName(last_dir_separator(file->path) + 1))
+			copied = backup_wal_file(args->from_root, args->to_root, file,
+									 compress);
+		else if (args->dedup)
+			copied = backup_dedup_file(args->from_root, args->to_root, file,
+									   compress);
+		else
+			copied = copy_file(args->from_root, args->to_root, file,
+							   args->compress ? COMPRESSION : NO_COMPRESSION,
+							   compress);
+		free(blocks);
+		if (copied)
+		{
+			stats_add(STATS_BYTES_READ, file->read_size);
+			stats_add(STATS_BYTES_WRITTEN, file->write_size);
+			checkpoint_backup_file(args, file, false);
+		}
+		else
+		{
+			/* record as skipped file in file_xxx.txt */
+			file->write_size = BYTES_INVALID;
+			backup_files_report(args, file, true, _("skip"));
+			continue;
+		}
+
+		/* print compression rate */
+		if (file->write_size != file->size)
+			snprintf(status, lengthof(status), _("compressed %lu (%.2f%% of %lu)"),
+				(unsigned long) file->write_size,
+				100.0 * file->write_size / file->size,
+				(unsigned long) file->size);
+		else
+			snprintf(status, lengthof(status), _("copied %lu"),
+				(unsigned long) file->write_size);
+
+		backup_files_report(args, file, false, status);
+	}
+}
+
+/*
+ * take backup about listed file.
+ *
+ * Directories are created first, then the regular files are copied by
+ * num_threads workers.  The results (write_size, crc, etc.) are stored into
+ * each pgFile of the list, as with a single worker.
+ */
 static void
 backup_files(const char *from_root,
 			 const char *to_root,
 			 parray *files,
 			 parray *prev_files,
+			 const pgBackup *prev_backup,
 			 const XLogRecPtr *lsn,
 			 bool compress,
 			 const char *prefix)
 {
-	int				i;
-	int				num_skipped = 0;
-	struct timeval	tv;
-	bool			prev_file_not_found = false;
+	int					i;
+	backup_files_arg	args;
+	parray			   *deferred_files;
 
 	/* sort pathname ascending */
 	parray_qsort(files, pgFileComparePath);
 
-	gettimeofday(&tv, NULL);
+	args.from_root = from_root;
+	args.to_root = to_root;
+	args.files = files;
+	args.prev_files = prev_files;
+	args.prev_index = NULL;
+	args.num_prev = 0;
+	if (prev_files)
+		build_prev_file_index(&args);
+	args.resume_index = NULL;
+	args.num_resume = 0;
+	args.checkpoint = NULL;
+	args.completed = NULL;
+	args.checkpoint_time = time(NULL);
 
-	/* backup a file or create a directory */
+	/*
+	 * Files of PGDATA are resumed from the failed backup, and checkpointed
+	 * for the next --resume.
+	 */
+	if (prefix == NULL && pgdata && strcmp(from_root, pgdata) == 0 &&
+		!check && !current.streamed)
+	{
+		char	path[MAXPGPATH];
+
+		if (resume_files)
+			args.resume_index = build_file_index(resume_files, from_root,
+												 &args.num_resume);
+
+		pgBackupGetPath(&current, path, lengthof(path), RESUME_FILE_LIST);
+		args.checkpoint = fopen(path, "at");
+		if (args.checkpoint == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\": %s", path, strerror(errno))));
+		args.completed = parray_new();
+	}
+
+	/*
+	 * With --link-unchanged, link the unchanged files from the previous
+	 * backup if they are stored in the same format, i.e. compressed in the
+	 * same way, in the corresponding directory of it.
+	 */
+	args.link_root[0] = '\0';
+	args.link_data_files = false;
+	if (link_unchanged && prev_backup && prefix == NULL &&
+		BACKUP_COMPRESSION(prev_backup) ==
+			(compress ? current.compress_algorithm : COMPRESS_NONE))
+	{
+		char	current_root[MAXPGPATH];
+
+		pgBackupGetPath(&current, current_root, lengthof(current_root), NULL);
+		pgBackupGetPath(prev_backup, args.link_root, lengthof(args.link_root),
+						JoinPathEnd(to_root, current_root));
+		args.link_data_files = (prev_backup->backup_mode == BACKUP_MODE_FULL);
+	}
+	args.lsn = lsn;
+	args.received = (base_backup_root && strcmp(from_root, base_backup_root) == 0);
+	args.arclog = (arclog_path && strcmp(from_root, arclog_path) == 0);
+	args.block_map = (lsn && prefix == NULL && pgdata &&
+					  strcmp(from_root, pgdata) == 0) ?
+		block_map : NULL;
+	args.compress = compress;
+	args.dedup = false;
+	if (current.dedup && !check && !args.arclog)
+	{
+		char	database_dir[MAXPGPATH];
+
+		/* only the files of the database, not the logs */
+		pgBackupGetPath(&current, database_dir, lengthof(database_dir),
+						DATABASE_DIR);
+		args.dedup = path_is_prefix_of_path(database_dir, to_root);
+	}
+	args.prefix = prefix;
+	args.copy_files = parray_new();
+	deferred_files = parray_new();
+	args.next_file = 0;
+	args.num_workers = 0;
+	args.num_processed = 0;
+	args.num_skipped = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	gettimeofday(&args.tv, NULL);
+
+	/* create directories and pick up files to copy */
 	for (i = 0; i < parray_num(files); i++)
 	{
 		int			ret;
 		struct stat	buf;
+		char		status[100];
 
 		pgFile *file = (pgFile *) parray_get(files, i);
 
-		/* If current time is rewinded, abort this backup. */
-		if(tv.tv_sec < file->mtime)
+		/*
+		 * If current time is rewinded, abort this backup.  The received files
+		 * have the mtime of the server, which is not modified any more.
+		 */
+		if (!args.received && args.tv.tv_sec < file->mtime)
 			ereport(FATAL,
 				(errcode(ERROR_SYSTEM),
 				 errmsg("cannot take a backup"),
@@ -1440,48 +2737,34 @@ backup_files(const char *from_root,
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during backup")));
 
-		/* For correct operation of incremental backup, 
-		 * initialize prev_file_not_found variable to false of 
-		 * checking to next backup files.
+		/*
+		 * stat file to get file type, size and modify timestamp.  Archived
+		 * WAL isn't modified after listed, and one removed since then is
+		 * skipped when opened to copy, so the listed type is enough.  The
+		 * received files are not modified either, and the unchanged ones
+		 * are not even extracted.
 		 */
-		prev_file_not_found = false;
-		
-		/* print progress in verbose mode */
-		if (verbose)
+		if (args.arclog || args.received)
 		{
-			if (prefix)
-			{
-				char path[MAXPGPATH];
-				join_path_components(path, prefix, file->path + strlen(from_root) + 1);
-				printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files), path);
-			}
-			else
-				printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
-					file->path + strlen(from_root) + 1);
+			buf.st_mode = file->mode;
+			ret = 0;
 		}
-
-		/* stat file to get file type, size and modify timestamp */
-		ret = stat(file->path, &buf);
+		else
+			ret = stat(file->path, &buf);
 		if (ret == -1)
 		{
 			if (errno == ENOENT)
 			{
 				/* record as skipped file in file_xxx.txt */
 				file->write_size = BYTES_INVALID;
-				num_skipped++;
-				if (verbose)
-					printf(_("skip\n"));
-				goto show_progress;
+				backup_files_report(&args, file, true, _("skip"));
+				continue;
 			}
 			else
-			{
-				if (verbose)
-					printf("\n");
 				ereport(ERROR,
 					(errcode(ERROR_SYSTEM),
 					 errmsg("could not stat \"%s\": %s",
 						file->path, strerror(errno))));
-			}
 		}
 
 		/* if the entry was a directory, create it in the backup */
@@ -1492,129 +2775,53 @@ backup_files(const char *from_root,
 			join_path_components(dirpath, to_root, JoinPathEnd(file->path, from_root));
 
 			if (!check)
-				dir_create_dir(dirpath, DIR_PERMISSION);
+				sink_create_dir(dirpath);
 
-			if (verbose)
-				printf(_("directory\n"));
+			backup_files_report(&args, file, false, _("directory"));
 		}
 		else if (S_ISREG(buf.st_mode))
 		{
-			/* skip files which have not been modified since last backup */
-			if (prev_files)
-			{
-				pgFile *prev_file = NULL;
-
-				/*
-				 * If prefix is not NULL, the table space is backup from the snapshot.
-				 * Therefore, adjust file name to correspond to the file list.
-				 */
-				if (prefix)
-				{
-					int j;
-
-					for (j = 0; j < parray_num(prev_files); j++)
-					{
-						pgFile *p = (pgFile *) parray_get(prev_files, j);
-						char *prev_path;
-						char curr_path[MAXPGPATH];
-
-						prev_path = p->path + strlen(from_root) + 1;
-						join_path_components(curr_path, prefix, file->path + strlen(from_root) + 1);
-						if (strcmp(curr_path, prev_path) == 0)
-						{
-							prev_file = p;
-							break;
-						}
-					}
-				}
-				else
-				{
-					pgFile **p = (pgFile **) parray_bsearch(prev_files, file, pgFileComparePath);
-					if (p)
-						prev_file = *p;
-				}
-
-				if (prev_file)
-				{
-					if(prev_file->mtime == file->mtime)
-					{
-						/* record as skipped file in file_xxx.txt */
-						file->write_size = BYTES_INVALID;
-						num_skipped++;
-						if (verbose)
-							printf(_("skip\n"));
-						goto show_progress;
-					}
-				}
-				else
-					prev_file_not_found = true;
-			}
-
 			/*
-			 * We will wait until the next second of mtime so that backup
-			 * file should contain all modifications at the clock of mtime.
-			 * timer resolution of ext3 file system is one second.
+			 * Files modified in the current second must wait for the next
+			 * second to be copied, so copy them after all the others.
 			 */
-
-			if (tv.tv_sec == file->mtime)
-			{
-				/* update time and recheck */
-				gettimeofday(&tv, NULL);
-				while (tv.tv_sec <= file->mtime)
-				{
-					usleep(1000000 - tv.tv_usec);
-					gettimeofday(&tv, NULL);
-				}
-			}
-
-			/* copy the file into backup */
-			if (!(file->is_datafile
-					? backup_data_file(from_root, to_root, file, lsn, compress, prev_file_not_found)
-					: copy_file(from_root, to_root, file,
-								compress ? COMPRESSION : NO_COMPRESSION)))
-			{
-				/* record as skipped file in file_xxx.txt */
-				file->write_size = BYTES_INVALID;
-				num_skipped++;
-				if (verbose)
-					printf(_("skip\n"));
-				goto show_progress;
-			}
-
-			if (verbose)
-			{
-				/* print compression rate */
-				if (file->write_size != file->size)
-					printf(_("compressed %lu (%.2f%% of %lu)\n"),
-						(unsigned long) file->write_size,
-						100.0 * file->write_size / file->size,
-						(unsigned long) file->size);
-				else
-					printf(_("copied %lu\n"), (unsigned long) file->write_size);
-
-				continue;
-			}
-
-show_progress:
-			/* print progress in non-verbose format */
-			if (progress)
-			{
-				fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
-						i + 1, (unsigned long) parray_num(files), num_skipped);
-
-				if (i + 1 < (unsigned long) parray_num(files))
-					fprintf(stderr, "\r");
-				else
-					fprintf(stderr, "\n");
-			}
-
+			if (!args.received && file->mtime >= args.tv.tv_sec)
+				parray_append(deferred_files, file);
+			else
+				parray_append(args.copy_files, file);
 		}
 		else
 		{
-			if (verbose)
-				printf(_(" unexpected file type %d\n"), buf.st_mode);
+			snprintf(status, lengthof(status), _("unexpected file type %d"),
+					 buf.st_mode);
+			backup_files_report(&args, file, false, status);
 		}
 	}
+
+	parray_concat(args.copy_files, deferred_files);
+	parray_free(deferred_files);
+
+	/*
+	 * Copy regular files.  In check mode, all files are written to the same
+	 * temporary file, so don't run workers in parallel.
+	 */
+	pgut_run_threads(check ? 1 : Min(num_threads, (int) parray_num(args.copy_files)),
+					 backup_files_worker, &args);
+	elog(DEBUG, "%lu files were copied by %d workers",
+		 (unsigned long) parray_num(args.copy_files), args.num_workers);
+
+	/* the backup may still fail while waiting for WAL to be archived */
+	if (args.checkpoint)
+	{
+		checkpoint_backup_file(&args, NULL, true);
+		fclose(args.checkpoint);
+		parray_free(args.completed);
+	}
+
+	parray_free(args.copy_files);
+	free(args.prev_index);
+	free(args.resume_index);
+	pthread_mutex_destroy(&args.lock);
 }
 
 /*
@@ -2035,6 +3242,7 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 	parray	*list_file;
 	int		 i;
 
+	stats_begin(STATS_LIST_FILES);
 	list_file = parray_new();
 
 	/* list files with the logical path. omit $PGDATA */
@@ -2044,33 +3252,42 @@ add_files(parray *files, const char *root, bool add_root, bool is_pgdata)
 	for (i = 0; i < parray_num(list_file); i++)
 	{
 		pgFile *file = (pgFile *) parray_get(list_file, i);
-		char *relative;
-		char *fname;
 
 		/* data file must be a regular file */
 		if (!S_ISREG(file->mode))
 			continue;
 
-		/* data files are under "base", "global", or "pg_tblspc" */
-		relative = file->path + strlen(root) + 1;
-		if (is_pgdata &&
-			!path_is_prefix_of_path("base", relative) &&
-			!path_is_prefix_of_path("global", relative) &&
-			!path_is_prefix_of_path("pg_tblspc", relative))
-			continue;
-
-		/* name of data file start with digit */
-		fname = last_dir_separator(relative);
-		if (fname == NULL)
-			fname = relative;
-		else
-			fname++;
-		if (!isdigit(fname[0]))
-			continue;
-
-		file->is_datafile = true;
+		if (is_datafile_path(file->path + strlen(root) + 1, is_pgdata))
+			file->is_datafile = true;
 	}
 	parray_concat(files, list_file);
+	stats_end(STATS_LIST_FILES);
+}
+
+/*
+ * Return true if the regular file at the relative path is possibly a data
+ * file, in PGDATA if is_pgdata or in a tablespace otherwise.
+ */
+bool
+is_datafile_path(const char *relative, bool is_pgdata)
+{
+	const char *fname;
+
+	/* data files are under "base", "global", or "pg_tblspc" */
+	if (is_pgdata &&
+		!path_is_prefix_of_path("base", relative) &&
+		!path_is_prefix_of_path("global", relative) &&
+		!path_is_prefix_of_path("pg_tblspc", relative))
+		return false;
+
+	/* name of data file start with digit */
+	fname = last_dir_separator(relative);
+	if (fname == NULL)
+		fname = relative;
+	else
+		fname++;
+
+	return isdigit((unsigned char) fname[0]);
 }
 
 /*
@@ -2103,6 +3320,15 @@ create_file_list(parray *files, const char *root, const char *prefix, bool is_ap
 					strerror(errno))));
 		dir_print_file_list(fp, files, root, prefix);
 		fclose(fp);
+
+		/*
+		 * The binary version can't be appended, so remove it to read the
+		 * appended list from the text one.
+		 */
+		if (is_append)
+			dir_remove_file_index(path);
+		else
+			dir_print_file_index(path, files, root, prefix);
 	}
 }
 
@@ -2116,6 +3342,17 @@ init_data_checksum_enabled()
 	char				controlFilePath[MAXPGPATH];
 	ControlFileData    *controlFile;
 
+	if (use_replication)
+	{
+		char   *setting = get_server_setting("data_checksums");
+
+		data_checksum_enabled = (strcmp(setting, "on") == 0);
+		free(setting);
+		elog(DEBUG, "data checksum %s on the initially configured database",
+			 data_checksum_enabled ? "enabled" : "disabled");
+		return;
+	}
+
 	/* Read the value of the setting from the control file in PGDATA. */
 	snprintf(controlFilePath, MAXPGPATH, "%s/global/pg_control", pgdata);
 	if (fileExists(controlFilePath))
@@ -0,0 +1,985 @@
+/*-------------------------------------------------------------------------
+ *
+ * basebackup.c: receive database files through the replication protocol.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <sys/stat.h>
+
+#include "pgtar.h"
+
+/*
+ * With --replication, the files of the database cluster are sent by the
+ * server with BASE_BACKUP instead of read from PGDATA, so that pg_rman can
+ * run on another host than the server.  The server sends a tar archive of
+ * PGDATA and one of each tablespace.  Only the directories of them are
+ * extracted into a staging directory having the layout of PGDATA, and each
+ * regular file is written into the backup directly as it's received, in the
+ * same way as backup_files() does from PGDATA:
+ *
+ * - A data file is written by pages.  In incremental backup mode, the pages
+ *   not modified since the previous backup are skipped by their LSN, as in
+ *   backup_data_file(), if the file is in the previous backup.
+ * - The other files are copied.
+ * - In incremental backup mode, a file not modified since the previous
+ *   backup by its mtime is not written but listed in unchanged, to be
+ *   linked or recorded as not backed up by backup_files().
+ *
+ * If the server summarizes WAL (PostgreSQL 17 or later), the manifest of the
+ * previous backup is uploaded so that the server sends only the blocks
+ * modified since it as an incremental file, the blocks of which are written
+ * as they are.
+ */
+
+/* incremental file of BASE_BACKUP, see basebackup_incremental.c */
+#define INCREMENTAL_MAGIC			0xd3ae1f0d
+#define INCREMENTAL_PREFIX			"INCREMENTAL."
+#define INCREMENTAL_PREFIX_LEN		(sizeof(INCREMENTAL_PREFIX) - 1)
+#define INCREMENTAL_HEADER_SIZE		(sizeof(uint32) * 3)
+
+/* upper limit of MAX_RATE of BASE_BACKUP in kB/s, see basebackup.h */
+#define BASE_BACKUP_MAX_RATE		1048576
+
+/* what is being received in the incremental file */
+typedef enum IncrementalPhase
+{
+	INCR_HEADER,		/* magic, number of blocks and truncation length */
+	INCR_BLOCK_NUMBERS,
+	INCR_PADDING,		/* the header is padded up to BLCKSZ */
+	INCR_PAGES
+} IncrementalPhase;
+
+/* state of extracting the archives sent by BASE_BACKUP */
+typedef struct ArchiveReceiver
+{
+	const char	   *root;		/* staging directory of PGDATA */
+	const char	   *to_root;	/* DATABASE_DIR of the backup */
+	parray		   *prev_files;	/* files of the previous backup sorted by
+								 * path, or NULL in full backup mode */
+	const XLogRecPtr *lsn;		/* start of the previous backup */
+	parray		   *received;	/* files written into to_root */
+	parray		   *unchanged;	/* files not modified since prev_files */
+	parray		   *links;		/* symbolic links to the tablespaces */
+	const char	   *manifest_path;
+	FILE		   *manifest;	/* non-NULL while the manifest is received */
+
+	char			dir[MAXPGPATH];	/* where the archive is extracted */
+
+	/* the tar member being received */
+	char			header[TAR_BLOCK_SIZE];
+	size_t			header_len;
+	bool			in_member;	/* the header has been received */
+	uint64			size;
+	uint64			left;		/* bytes of the contents not received yet */
+	size_t			padding;	/* bytes to skip before the next header */
+	char			path[MAXPGPATH];
+	time_t			mtime;
+	bool			discard;	/* the contents are not written */
+	pgCopyWriter   *copy_writer;	/* file being copied into to_root */
+
+	/* the data file being written into to_root, if data_file is not NULL */
+	pgFile		   *data_file;
+	pgPageWriter   *writer;
+	bool			incremental;	/* data_file is sent as incremental */
+	IncrementalPhase incr_phase;
+	char			incr_header[INCREMENTAL_HEADER_SIZE];
+	uint32			num_blocks;
+	uint32			truncation_len;	/* minimum length in blocks */
+	BlockNumber	   *blocks;
+	size_t			incr_len;	/* bytes received in the current phase, or
+								 * of page for a whole data file */
+	size_t			incr_padding;
+	char		   *page;		/* BLCKSZ bytes */
+	uint32			next_block;	/* index of blocks of page, or the block
+								 * number for a whole data file */
+} ArchiveReceiver;
+
+static void receive_archive(ArchiveReceiver *r, const char *name);
+static void receive_data(ArchiveReceiver *r, const char *data, size_t len);
+static void start_member(ArchiveReceiver *r);
+static void write_member(ArchiveReceiver *r, const char *data, size_t len);
+static void end_member(ArchiveReceiver *r);
+static pgFile *new_file(ArchiveReceiver *r, const char *path, mode_t mode);
+static void make_backup_dir(ArchiveReceiver *r, const char *path,
+							char *to_path);
+static void open_data_file(ArchiveReceiver *r, const char *path, mode_t mode,
+						   const XLogRecPtr *lsn);
+static void write_data_pages(ArchiveReceiver *r, const char *data,
+							 size_t len);
+static void end_data_file(ArchiveReceiver *r);
+static void start_incremental(ArchiveReceiver *r, const char *name,
+							  mode_t mode);
+static void write_incremental(ArchiveReceiver *r, const char *data,
+							  size_t len);
+static void end_incremental(ArchiveReceiver *r);
+static void open_copy_file(ArchiveReceiver *r, mode_t mode);
+static void end_copy_file(ArchiveReceiver *r);
+static pgFile *find_prev_file(ArchiveReceiver *r, const char *path);
+static void upload_manifest(PGconn *conn, const char *path);
+static bool server_summarizes_wal(PGconn *conn);
+static void get_position(PGconn *conn, PGresult *res, const char *what,
+						 TimeLineID *tli, XLogRecPtr *lsn);
+
+/*
+ * Get the system identifier and the current timeline of the server with
+ * IDENTIFY_SYSTEM.
+ */
+void
+base_backup_identify_system(uint64 *sysid, TimeLineID *tli)
+{
+	PGconn	   *conn;
+	PGresult   *res;
+
+	conn = pgut_connect_replication();
+	res = PQexec(conn, "IDENTIFY_SYSTEM");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		PQntuples(res) != 1 || PQnfields(res) < 3)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not identify system: %s", PQerrorMessage(conn))));
+
+	*sysid = strtoull(PQgetvalue(res, 0, 0), NULL, 10);
+	if (tli)
+		*tli = (TimeLineID) strtoul(PQgetvalue(res, 0, 1), NULL, 10);
+	elog(DEBUG, "system identifier of the server is %s, timeline is %s",
+		 PQgetvalue(res, 0, 0), PQgetvalue(res, 0, 1));
+
+	PQclear(res);
+	pgut_disconnect(conn);
+}
+
+/*
+ * Take a base backup of the server by BASE_BACKUP.  The directories of the
+ * archives are made under root, and the symbolic links to the tablespaces
+ * in it are appended to links with their targets instead of created.  The
+ * regular files are written into to_root and appended to received, with the
+ * path under root, except the ones listed in prev_files with the same mtime,
+ * which are appended to unchanged.  The backup manifest is written into
+ * manifest_path.
+ *
+ * In incremental backup mode, prev_files must be the files of the previous
+ * backup sorted by path under root, and lsn its start point.  If
+ * prev_manifest is not NULL, the backup is incremental to the backup of the
+ * manifest if the server supports it.  backup->tli, start_lsn and stop_lsn
+ * are set.
+ */
+void
+base_backup_receive(const char *label, bool smooth, const char *prev_manifest,
+					parray *prev_files, const XLogRecPtr *lsn,
+					const char *root, const char *to_root,
+					const char *manifest_path, parray *received,
+					parray *unchanged, parray *links, pgBackup *backup)
+{
+	PGconn		   *conn;
+	PGresult	   *res;
+	PQExpBufferData	cmd;
+	ArchiveReceiver	r;
+	char		   *escaped;
+	char		   *buf;
+	int				len;
+	bool			incremental = false;
+
+	conn = pgut_connect_replication();
+	if (PQserverVersion(conn) < 150000)
+		ereport(ERROR,
+			(errcode(ERROR_PG_INCOMPATIBLE),
+			 errmsg("--replication requires PostgreSQL 15 or later")));
+
+	/* the server needs to know which blocks are modified since the manifest */
+	if (prev_manifest)
+	{
+		if (PQserverVersion(conn) < 170000 || !server_summarizes_wal(conn))
+			elog(INFO, _("server doesn't summarize WAL, whole of data files are sent"));
+		else if (!fileExists(prev_manifest))
+			elog(INFO, _("previous backup has no backup manifest, whole of data files are sent"));
+		else
+		{
+			upload_manifest(conn, prev_manifest);
+			incremental = true;
+		}
+	}
+
+	escaped = PQescapeLiteral(conn, label, strlen(label));
+	if (escaped == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not escape backup label: %s", PQerrorMessage(conn))));
+	initPQExpBuffer(&cmd);
+	appendPQExpBuffer(&cmd, "BASE_BACKUP (LABEL %s, CHECKPOINT '%s', MANIFEST 'yes'%s",
+					  escaped, smooth ? "spread" : "fast",
+					  incremental ? ", INCREMENTAL" : "");
+	/* the server reads the files, so it keeps --max-rate, given in kB/s */
+	if (max_rate > 0)
+		appendPQExpBuffer(&cmd, ", MAX_RATE %d",
+						  Min(max_rate, BASE_BACKUP_MAX_RATE / 1024) * 1024);
+	appendPQExpBufferChar(&cmd, ')');
+	PQfreemem(escaped);
+
+	elog(DEBUG, "executing %s", cmd.data);
+	if (PQsendQuery(conn, cmd.data) == 0)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not send BASE_BACKUP: %s", PQerrorMessage(conn))));
+	termPQExpBuffer(&cmd);
+
+	/* start point of the backup, then the list of tablespaces */
+	res = PQgetResult(conn);
+	get_position(conn, res, "start", &backup->tli, &backup->start_lsn);
+	PQclear(res);
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not start base backup: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COPY_OUT)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not receive base backup: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	memset(&r, 0, sizeof(r));
+	r.root = root;
+	r.to_root = to_root;
+	r.prev_files = prev_files;
+	r.lsn = lsn;
+	r.received = received;
+	r.unchanged = unchanged;
+	r.links = links;
+	r.manifest_path = manifest_path;
+	r.dir[0] = '\0';
+
+	/*
+	 * Each message starts with its type: 'n' for a new archive, 'd' for the
+	 * contents of the archive or the manifest, 'm' for the start of the
+	 * manifest and 'p' for the progress.
+	 */
+	while ((len = PQgetCopyData(conn, &buf, false)) > 0)
+	{
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during backup")));
+
+		switch (buf[0])
+		{
+			case 'n':
+				if (memchr(buf + 1, '\0', len - 1) == NULL)
+					goto invalid_message;
+				receive_archive(&r, buf + 1);
+				break;
+			case 'd':
+				if (r.manifest)
+				{
+					if (fwrite(buf + 1, 1, len - 1, r.manifest) != (size_t) (len - 1))
+						ereport(ERROR,
+							(errcode(ERROR_SYSTEM),
+							 errmsg("could not write backup manifest \"%s\": %s",
+								manifest_path, strerror(errno))));
+				}
+				else if (r.dir[0] != '\0')
+					receive_data(&r, buf + 1, len - 1);
+				else
+					goto invalid_message;
+				break;
+			case 'm':
+				receive_archive(&r, NULL);
+				r.manifest = fopen(manifest_path, "w");
+				if (r.manifest == NULL)
+					ereport(ERROR,
+						(errcode(ERROR_SYSTEM),
+						 errmsg("could not open backup manifest \"%s\": %s",
+							manifest_path, strerror(errno))));
+				break;
+			case 'p':
+				break;
+			default:
+				goto invalid_message;
+		}
+		PQfreemem(buf);
+	}
+	if (len == -2)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not receive base backup: %s", PQerrorMessage(conn))));
+
+	if (r.manifest)
+	{
+		if (fclose(r.manifest) != 0)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write backup manifest \"%s\": %s",
+					manifest_path, strerror(errno))));
+	}
+	else
+		receive_archive(&r, NULL);
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not receive base backup: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	/* end point of the backup, for which the server has waited archiving */
+	res = PQgetResult(conn);
+	get_position(conn, res, "end", &backup->tli, &backup->stop_lsn);
+	PQclear(res);
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not finish base backup: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	free(r.blocks);
+	free(r.page);
+	pgut_disconnect(conn);
+	return;
+
+invalid_message:
+	ereport(ERROR,
+		(errcode(ERROR_PG_COMMAND),
+		 errmsg("unexpected message of base backup (type %d, %d bytes)",
+			buf[0], len)));
+}
+
+/*
+ * Finish the current archive, and start extracting the archive of name if
+ * not NULL: "base.tar" for PGDATA, or "OID.tar" for the tablespace.
+ */
+static void
+receive_archive(ArchiveReceiver *r, const char *name)
+{
+	Oid		spcoid;
+	char	tail;
+
+	if (r->in_member || r->header_len > 0)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("archive of base backup ends in the middle of \"%s\"",
+				r->in_member ? r->path : r->dir)));
+	r->padding = 0;
+	r->dir[0] = '\0';
+
+	if (name == NULL)
+		return;
+
+	if (strcmp(name, "base.tar") == 0)
+		strlcpy(r->dir, r->root, lengthof(r->dir));
+	else if (sscanf(name, "%u.ta%c", &spcoid, &tail) == 2 && tail == 'r' &&
+			 OidIsValid(spcoid))
+		snprintf(r->dir, lengthof(r->dir), "%s/%s/%u", r->root,
+				 PG_TBLSPC_DIR, spcoid);
+	else
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("unexpected archive \"%s\" in base backup", name)));
+
+	elog(DEBUG, "receiving archive \"%s\"", name);
+	dir_create_dir(r->dir, DIR_PERMISSION);
+}
+
+/*
+ * Extract the tar archive data received.
+ */
+static void
+receive_data(ArchiveReceiver *r, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t	n;
+
+		if (r->padding > 0)
+		{
+			n = Min(len, r->padding);
+			r->padding -= n;
+		}
+		else if (!r->in_member)
+		{
+			n = Min(len, TAR_BLOCK_SIZE - r->header_len);
+			memcpy(r->header + r->header_len, data, n);
+			r->header_len += n;
+			if (r->header_len == TAR_BLOCK_SIZE)
+			{
+				r->header_len = 0;
+				start_member(r);
+			}
+		}
+		else
+		{
+			n = (size_t) Min((uint64) len, r->left);
+			write_member(r, data, n);
+			r->left -= n;
+		}
+
+		if (r->in_member && r->left == 0)
+			end_member(r);
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Start extracting the member of the header received.
+ */
+static void
+start_member(ArchiveReceiver *r)
+{
+	char	name[TAR_BLOCK_SIZE];
+	char	linkname[TAR_BLOCK_SIZE];
+	char	type;
+	mode_t	mode;
+	size_t	len;
+	int		i;
+
+	/* blocks of zeros at the end of the archive */
+	for (i = 0; i < TAR_BLOCK_SIZE && r->header[i] == '\0'; i++)
+		;
+	if (i == TAR_BLOCK_SIZE)
+		return;
+
+	if (read_tar_number(&r->header[TAR_OFFSET_CHECKSUM], 8) !=
+		tarChecksum(r->header))
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("invalid tar header in base backup")));
+
+	strlcpy(name, &r->header[TAR_OFFSET_NAME], 100 + 1);
+	strlcpy(linkname, &r->header[TAR_OFFSET_LINKNAME], 100 + 1);
+	type = r->header[TAR_OFFSET_TYPEFLAG];
+	mode = (mode_t) read_tar_number(&r->header[TAR_OFFSET_MODE], 8);
+	r->size = r->left = read_tar_number(&r->header[TAR_OFFSET_SIZE], 12);
+	r->mtime = (time_t) read_tar_number(&r->header[TAR_OFFSET_MTIME], 12);
+	r->in_member = true;
+
+	/* names are relative to the directory of the archive */
+	len = strlen(name);
+	while (len > 0 && name[len - 1] == '/')
+		name[--len] = '\0';
+	if (len == 0 || is_absolute_path(name) || path_contains_parent_reference(name))
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("unexpected file name \"%s\" in base backup", name)));
+	join_path_components(r->path, r->dir, name);
+
+	switch (type)
+	{
+		case TAR_FILETYPE_DIRECTORY:
+			dir_create_dir(r->path, DIR_PERMISSION);
+			break;
+
+		case TAR_FILETYPE_SYMLINK:
+			{
+				pgFile *file;
+
+				/* the tablespace is extracted there instead */
+				file = (pgFile *) pgut_malloc(offsetof(pgFile, path) +
+											  strlen(r->path) + 1);
+				memset(file, 0, offsetof(pgFile, path));
+				file->mode = S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO;
+				file->mtime = r->mtime;
+				file->linked = pgut_strdup(linkname);
+				strcpy(file->path, r->path);
+				parray_append(r->links, file);
+			}
+			break;
+
+		case TAR_FILETYPE_PLAIN:
+			{
+				const char *fname = last_dir_separator(name);
+				pgFile	   *prev_file;
+
+				fname = fname ? fname + 1 : name;
+				if (strncmp(fname, INCREMENTAL_PREFIX, INCREMENTAL_PREFIX_LEN) == 0)
+				{
+					start_incremental(r, name, mode);
+					break;
+				}
+
+				/* skip files which have not been modified since last backup */
+				prev_file = find_prev_file(r, r->path);
+				if (prev_file && prev_file->mtime == r->mtime)
+				{
+					pgFile *file = new_file(r, r->path, mode);
+
+					file->size = (size_t) r->size;
+					file->is_datafile =
+						is_datafile_path(r->path + strlen(r->root) + 1, true);
+					parray_append(r->unchanged, file);
+					r->discard = true;
+					break;
+				}
+
+				/* a data file of whole pages, see backup_data_file() */
+				if (r->size > 0 && r->size % BLCKSZ == 0 &&
+					is_datafile_path(r->path + strlen(r->root) + 1, true))
+				{
+					open_data_file(r, r->path, mode, prev_file ? r->lsn : NULL);
+					r->incremental = false;
+					r->incr_len = 0;
+					r->next_block = 0;
+					break;
+				}
+
+				open_copy_file(r, mode);
+			}
+			break;
+
+		default:
+			ereport(ERROR,
+				(errcode(ERROR_PG_COMMAND),
+				 errmsg("unexpected type %c of \"%s\" in base backup",
+					type, name)));
+	}
+}
+
+/*
+ * Write the contents of the member.
+ */
+static void
+write_member(ArchiveReceiver *r, const char *data, size_t len)
+{
+	if (r->data_file)
+	{
+		if (r->incremental)
+			write_incremental(r, data, len);
+		else
+			write_data_pages(r, data, len);
+		return;
+	}
+
+	if (r->copy_writer)
+		copy_writer_write(r->copy_writer, data, len);
+	else if (!r->discard)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("unexpected contents of \"%s\" in base backup", r->path)));
+}
+
+/*
+ * Finish the member all the contents of which have been received.
+ */
+static void
+end_member(ArchiveReceiver *r)
+{
+	r->in_member = false;
+	r->padding = tarPaddingBytesRequired(r->size);
+	r->discard = false;
+
+	if (r->data_file)
+	{
+		if (r->incremental)
+			end_incremental(r);
+		else
+			end_data_file(r);
+		return;
+	}
+
+	if (r->copy_writer)
+		end_copy_file(r);
+}
+
+/*
+ * Make the pgFile of the regular file at path in root, with the modification
+ * time of the member to compare with the previous backup.
+ */
+static pgFile *
+new_file(ArchiveReceiver *r, const char *path, mode_t mode)
+{
+	pgFile	   *file;
+
+	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(path) + 1);
+	memset(file, 0, offsetof(pgFile, path));
+	file->mode = S_IFREG | (mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+	file->mtime = r->mtime;
+	strcpy(file->path, path);
+
+	return file;
+}
+
+/*
+ * Make the directory of the backup of the file at path in root, and return
+ * the path of the backup in to_path.
+ */
+static void
+make_backup_dir(ArchiveReceiver *r, const char *path, char *to_path)
+{
+	char		parent[MAXPGPATH];
+
+	join_path_components(to_path, r->to_root, path + strlen(r->root) + 1);
+	if (!sink_is_streamed(to_path))
+	{
+		strlcpy(parent, to_path, lengthof(parent));
+		get_parent_directory(parent);
+		dir_create_dir(parent, DIR_PERMISSION);
+	}
+}
+
+/*
+ * Start writing the backup of the data file at path in root, the pages of
+ * which are received.  If lsn is not NULL, the pages not modified since
+ * then are skipped.
+ */
+static void
+open_data_file(ArchiveReceiver *r, const char *path, mode_t mode,
+			   const XLogRecPtr *lsn)
+{
+	char		to_path[MAXPGPATH];
+	pgFile	   *file;
+
+	file = new_file(r, path, mode);
+	make_backup_dir(r, path, to_path);
+
+	r->data_file = file;
+	r->writer = page_writer_open(to_path, file, current.compress_data ?
+								 current.compress_algorithm : COMPRESS_NONE,
+								 lsn);
+	if (r->page == NULL)
+		r->page = pgut_malloc(BLCKSZ);
+}
+
+/*
+ * Receive the contents of the data file sent as a whole.
+ */
+static void
+write_data_pages(ArchiveReceiver *r, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t	n = Min(len, BLCKSZ - r->incr_len);
+
+		memcpy(r->page + r->incr_len, data, n);
+		r->incr_len += n;
+		if (r->incr_len == BLCKSZ)
+		{
+			page_writer_write(r->writer, r->next_block++, r->page);
+			r->incr_len = 0;
+		}
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Finish the backup of the data file sent as a whole.
+ */
+static void
+end_data_file(ArchiveReceiver *r)
+{
+	page_writer_close(r->writer, r->next_block);
+	r->data_file->size = (size_t) r->size;
+	parray_append(r->received, r->data_file);
+
+	r->writer = NULL;
+	r->data_file = NULL;
+}
+
+/*
+ * Start receiving the incremental file of name, into the backup of the
+ * relation file without the prefix.
+ */
+static void
+start_incremental(ArchiveReceiver *r, const char *name, mode_t mode)
+{
+	char		path[MAXPGPATH];
+	const char *fname = last_dir_separator(r->path) + 1;
+
+	/* path of the relation file in root */
+	strlcpy(path, r->path, lengthof(path));
+	strlcpy(path + (fname - r->path), fname + INCREMENTAL_PREFIX_LEN,
+			lengthof(path) - (fname - r->path));
+
+	open_data_file(r, path, mode, NULL);
+	r->incremental = true;
+	r->incr_phase = INCR_HEADER;
+	r->incr_len = 0;
+	r->num_blocks = 0;
+	r->next_block = 0;
+
+	elog(DEBUG, "receiving incremental file \"%s\"", name);
+}
+
+/*
+ * Receive the contents of the incremental file: the header with the block
+ * numbers, padded to BLCKSZ if any block follows, and the blocks.
+ */
+static void
+write_incremental(ArchiveReceiver *r, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t	n;
+
+		switch (r->incr_phase)
+		{
+			case INCR_HEADER:
+				n = Min(len, INCREMENTAL_HEADER_SIZE - r->incr_len);
+				memcpy(r->incr_header + r->incr_len, data, n);
+				r->incr_len += n;
+				if (r->incr_len == INCREMENTAL_HEADER_SIZE)
+				{
+					uint32	magic;
+					size_t	header_size;
+
+					memcpy(&magic, r->incr_header, sizeof(uint32));
+					memcpy(&r->num_blocks, r->incr_header + sizeof(uint32),
+						   sizeof(uint32));
+					memcpy(&r->truncation_len, r->incr_header + sizeof(uint32) * 2,
+						   sizeof(uint32));
+
+					header_size = INCREMENTAL_HEADER_SIZE +
+						(size_t) r->num_blocks * sizeof(BlockNumber);
+					r->incr_padding = r->num_blocks > 0 ?
+						TYPEALIGN(BLCKSZ, header_size) - header_size : 0;
+					if (magic != INCREMENTAL_MAGIC || r->num_blocks > RELSEG_SIZE ||
+						r->size != header_size + r->incr_padding +
+						(uint64) r->num_blocks * BLCKSZ)
+						ereport(ERROR,
+							(errcode(ERROR_PG_COMMAND),
+							 errmsg("invalid incremental file \"%s\" in base backup",
+								r->path)));
+
+					r->blocks = pgut_realloc(r->blocks,
+						Max(r->num_blocks, 1) * sizeof(BlockNumber));
+					r->incr_phase = r->num_blocks > 0 ? INCR_BLOCK_NUMBERS : INCR_PAGES;
+					r->incr_len = 0;
+				}
+				break;
+
+			case INCR_BLOCK_NUMBERS:
+				n = Min(len, r->num_blocks * sizeof(BlockNumber) - r->incr_len);
+				memcpy((char *) r->blocks + r->incr_len, data, n);
+				r->incr_len += n;
+				if (r->incr_len == r->num_blocks * sizeof(BlockNumber))
+				{
+					r->incr_phase = r->incr_padding > 0 ? INCR_PADDING : INCR_PAGES;
+					r->incr_len = 0;
+				}
+				break;
+
+			case INCR_PADDING:
+				n = Min(len, r->incr_padding - r->incr_len);
+				r->incr_len += n;
+				if (r->incr_len == r->incr_padding)
+				{
+					r->incr_phase = INCR_PAGES;
+					r->incr_len = 0;
+				}
+				break;
+
+			case INCR_PAGES:
+				/* the size has been checked against the header */
+				Assert(r->next_block < r->num_blocks);
+				n = Min(len, BLCKSZ - r->incr_len);
+				memcpy(r->page + r->incr_len, data, n);
+				r->incr_len += n;
+				if (r->incr_len == BLCKSZ)
+				{
+					BlockNumber	blknum = r->blocks[r->next_block++];
+
+					if (r->next_block > 1 && blknum <= r->blocks[r->next_block - 2])
+						ereport(ERROR,
+							(errcode(ERROR_PG_COMMAND),
+							 errmsg("invalid incremental file \"%s\" in base backup",
+								r->path)));
+					page_writer_write(r->writer, blknum, r->page);
+					r->incr_len = 0;
+				}
+				break;
+
+			default:
+				n = len;	/* keep compiler quiet */
+				break;
+		}
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Finish the backup of the incremental file.  The relation is as long as
+ * the truncation length, or up to the last block sent if longer.
+ */
+static void
+end_incremental(ArchiveReceiver *r)
+{
+	BlockNumber	nblocks = r->truncation_len;
+
+	/* the size has been checked against the header */
+	if (r->num_blocks > 0)
+		nblocks = Max(nblocks, r->blocks[r->num_blocks - 1] + 1);
+
+	page_writer_close(r->writer, nblocks);
+	r->data_file->size = (size_t) nblocks * BLCKSZ;
+	parray_append(r->received, r->data_file);
+
+	r->writer = NULL;
+	r->data_file = NULL;
+}
+
+/*
+ * Start copying the regular file of the member, which is not a data file,
+ * into the backup.
+ */
+static void
+open_copy_file(ArchiveReceiver *r, mode_t mode)
+{
+	char		to_path[MAXPGPATH];
+	pgFile	   *file;
+
+	file = new_file(r, r->path, mode);
+	file->size = (size_t) r->size;
+	make_backup_dir(r, r->path, to_path);
+
+	r->copy_writer = copy_writer_open(to_path, file, current.compress_data ?
+									  current.compress_algorithm :
+									  COMPRESS_NONE);
+	parray_append(r->received, file);
+}
+
+/*
+ * Finish copying the regular file.
+ */
+static void
+end_copy_file(ArchiveReceiver *r)
+{
+	copy_writer_close(r->copy_writer);
+	r->copy_writer = NULL;
+}
+
+/*
+ * Return the file at path in root listed in the previous backup, or NULL.
+ */
+static pgFile *
+find_prev_file(ArchiveReceiver *r, const char *path)
+{
+	pgFile	   *key;
+	pgFile	  **found;
+
+	if (r->prev_files == NULL)
+		return NULL;
+
+	key = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(path) + 1);
+	strcpy(key->path, path);
+	found = (pgFile **) parray_bsearch(r->prev_files, key, pgFileComparePath);
+	free(key);
+
+	return found ? *found : NULL;
+}
+
+/*
+ * Upload the backup manifest to take an incremental backup based on it.
+ */
+static void
+upload_manifest(PGconn *conn, const char *path)
+{
+	FILE	   *fp;
+	PGresult   *res;
+	char		buf[65536];
+	size_t		len;
+
+	elog(DEBUG, "uploading backup manifest \"%s\"", path);
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open backup manifest \"%s\": %s", path,
+				strerror(errno))));
+
+	res = PQexec(conn, "UPLOAD_MANIFEST");
+	if (PQresultStatus(res) != PGRES_COPY_IN)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not upload backup manifest: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		if (PQputCopyData(conn, buf, (int) len) < 0)
+			ereport(ERROR,
+				(errcode(ERROR_PG_COMMAND),
+				 errmsg("could not upload backup manifest: %s",
+					PQerrorMessage(conn))));
+	}
+	if (ferror(fp))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read backup manifest \"%s\": %s", path,
+				strerror(errno))));
+	fclose(fp);
+
+	if (PQputCopyEnd(conn, NULL) < 0)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not upload backup manifest: %s", PQerrorMessage(conn))));
+
+	res = PQgetResult(conn);
+	if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not upload backup manifest: %s", PQerrorMessage(conn))));
+	PQclear(res);
+
+	/* no more results */
+	while ((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+}
+
+/*
+ * Return true if summarize_wal is on, which incremental BASE_BACKUP requires.
+ */
+static bool
+server_summarizes_wal(PGconn *conn)
+{
+	PGresult   *res;
+	bool		result;
+
+	res = PQexec(conn, "SHOW summarize_wal");
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) != 1)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not get summarize_wal: %s", PQerrorMessage(conn))));
+	result = (strcmp(PQgetvalue(res, 0, 0), "on") == 0);
+	PQclear(res);
+
+	return result;
+}
+
+/*
+ * Get the LSN and the timeline from the result of BASE_BACKUP.
+ */
+static void
+get_position(PGconn *conn, PGresult *res, const char *what, TimeLineID *tli,
+			 XLogRecPtr *lsn)
+{
+	uint32	xlogid;
+	uint32	xrecoff;
+
+	if (PQresultStatus(res) != PGRES_TUPLES_OK ||
+		PQntuples(res) != 1 || PQnfields(res) != 2 ||
+		sscanf(PQgetvalue(res, 0, 0), "%X/%X", &xlogid, &xrecoff) != 2)
+		ereport(ERROR,
+			(errcode(ERROR_PG_COMMAND),
+			 errmsg("could not get %s point of base backup: %s", what,
+				PQerrorMessage(conn))));
+
+	*lsn = ((uint64) xlogid << 32) | xrecoff;
+	*tli = (TimeLineID) strtoul(PQgetvalue(res, 0, 1), NULL, 10);
+
+	elog(DEBUG, "backup %s point is %s on timeline %s", what,
+		 PQgetvalue(res, 0, 0), PQgetvalue(res, 0, 1));
+}
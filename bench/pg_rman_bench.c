@@ -0,0 +1,502 @@
+/*-------------------------------------------------------------------------
+ *
+ * pg_rman_bench.c: benchmark of the backup and restore hot paths.
+ *
+ * Generates synthetic relation files and runs the functions used by backup
+ * and restore over them stage by stage, reporting the throughput and the
+ * number of read/write system calls of each stage.  Run with "make bench".
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* benchmark configuration */
+static char	   *work_dir = "bench_data";
+static int		num_files = 16;
+static int		num_pages = 1280;
+static int		hole_ratio = 20;		/* percent of a page in hole */
+static int		dirty_ratio = 10;		/* percent of pages modified */
+static bool		keep_work_dir = false;
+static CompressAlgorithm compress = COMPRESS_NONE;
+
+/*
+ * Pages modified after the base of the incremental backup have LSN after
+ * this, and the others before.
+ */
+#define BENCH_INCR_LSN		((XLogRecPtr) 0x10000000)
+
+/* size of the buffer compressed and decompressed at once */
+#define BENCH_COMPRESS_CHUNK	(1024 * 1024)
+
+typedef struct BenchStage
+{
+	const char	   *name;
+	struct timespec	start;
+	long			syscalls;
+} BenchStage;
+
+static void opt_compress_algorithm(pgut_option *opt, const char *arg);
+static void generate_relations(const char *root);
+static void make_page(char *page, BlockNumber blknum, uint32 *seed);
+static void stage_start(BenchStage *stage, const char *name);
+static void stage_end(BenchStage *stage, int64 bytes, int64 pages);
+static parray *list_relations(const char *root);
+static void bench_backup(parray *files, const char *from_root,
+						 const char *to_root, BackupMode mode);
+static void bench_compress(parray *files);
+
+static pgut_option options[] =
+{
+	{ 's', 'D', "directory"			, &work_dir },
+	{ 'i', 1, "files"				, &num_files },
+	{ 'i', 2, "pages"				, &num_pages },
+	{ 'i', 3, "hole-ratio"			, &hole_ratio },
+	{ 'i', 4, "dirty-ratio"			, &dirty_ratio },
+	{ 'f', 5, "compress-algorithm"	, opt_compress_algorithm },
+	{ 'i', 6, "compress-level"		, &current.compress_level },
+	{ 'b', 7, "keep"				, &keep_work_dir },
+	{ 0 }
+};
+
+int
+main(int argc, char *argv[])
+{
+	char		src_root[MAXPGPATH];
+	char		full_root[MAXPGPATH];
+	char		incr_root[MAXPGPATH];
+	char		restore_root[MAXPGPATH];
+	char		list_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	parray	   *files;
+	parray	   *backup_files;
+	BenchStage	stage;
+	struct stat	st;
+	FILE	   *fp;
+	int64		bytes;
+	int			i;
+
+	catalog_init_config(&current);
+
+	i = pgut_getopt(argc, argv, options);
+	if (i < argc)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("too many arguments")));
+	if (num_files <= 0 || num_pages <= 0 ||
+		hole_ratio < 0 || hole_ratio > 90 ||
+		dirty_ratio < 0 || dirty_ratio > 100)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("invalid benchmark parameters"),
+			 errhint("FILES and PAGES must be positive, HOLE-RATIO must be "
+					 "0 to 90, and DIRTY-RATIO must be 0 to 100.")));
+	if (stat(work_dir, &st) == 0)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("\"%s\" already exists", work_dir),
+			 errhint("Remove it, or specify another one with -D.")));
+
+	/* backup_data_file() writes into here in check mode, not used */
+	backup_path = work_dir;
+	current.compress_data = (compress != COMPRESS_NONE);
+	current.compress_algorithm = compress;
+
+	join_path_components(src_root, work_dir, "pgdata");
+	join_path_components(full_root, work_dir, "full");
+	join_path_components(incr_root, work_dir, "incremental");
+	join_path_components(restore_root, work_dir, "restore");
+	join_path_components(list_path, work_dir, DATABASE_FILE_LIST);
+
+	printf("%d files of %d pages, hole %d%%, dirty %d%%, compression %s\n\n",
+		   num_files, num_pages, hole_ratio, dirty_ratio,
+		   compress_algorithm_name(compress));
+	printf("%-28s %10s %12s %10s %9s\n",
+		   "stage", "MB/s", "pages/s", "syscalls", "seconds");
+
+	stage_start(&stage, "generate");
+	generate_relations(src_root);
+	stage_end(&stage, (int64) num_files * num_pages * BLCKSZ,
+			  (int64) num_files * num_pages);
+
+	stage_start(&stage, "dir_list_file");
+	files = list_relations(src_root);
+	stage_end(&stage, 0, 0);
+
+	stage_start(&stage, "backup_data_file full");
+	bench_backup(files, src_root, full_root, BACKUP_MODE_FULL);
+	stage_end(&stage, (int64) num_files * num_pages * BLCKSZ,
+			  (int64) num_files * num_pages);
+
+	stage_start(&stage, "backup_data_file incremental");
+	bench_backup(files, src_root, incr_root, BACKUP_MODE_INCREMENTAL);
+	stage_end(&stage, (int64) num_files * num_pages * BLCKSZ,
+			  (int64) num_files * num_pages);
+
+	stage_start(&stage, "dir_print_file_list");
+	fp = fopen(list_path, "wt");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open \"%s\": %s", list_path, strerror(errno))));
+	dir_print_file_list(fp, files, src_root, NULL);
+	fclose(fp);
+	dir_print_file_index(list_path, files, src_root, NULL);
+	stage_end(&stage, 0, 0);
+
+	stage_start(&stage, "dir_read_file_list index");
+	backup_files = dir_read_file_list(full_root, list_path);
+	stage_end(&stage, 0, 0);
+	parray_walk(backup_files, pgFileFree);
+	parray_free(backup_files);
+
+	stage_start(&stage, "dir_read_file_list text");
+	dir_remove_file_index(list_path);
+	backup_files = dir_read_file_list(full_root, list_path);
+	stage_end(&stage, 0, 0);
+
+	stage_start(&stage, "pgFileGetCRC");
+	bytes = 0;
+	for (i = 0; i < parray_num(backup_files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(backup_files, i);
+
+		pgFileGetCRC(file);
+		bytes += file->write_size;
+	}
+	stage_end(&stage, bytes, 0);
+
+	stage_start(&stage, "restore_data_file");
+	dir_create_dir(restore_root, DIR_PERMISSION);
+	join_path_components(path, restore_root, "base/1");
+	dir_create_dir(path, DIR_PERMISSION);
+	for (i = 0; i < parray_num(backup_files); i++)
+		restore_data_file(full_root, restore_root,
+						  (pgFile *) parray_get(backup_files, i), compress,
+						  false);
+	stage_end(&stage, (int64) num_files * num_pages * BLCKSZ,
+			  (int64) num_files * num_pages);
+
+	if (compress != COMPRESS_NONE)
+		bench_compress(files);
+
+	parray_walk(backup_files, pgFileFree);
+	parray_free(backup_files);
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+
+	if (!keep_work_dir)
+		dir_remove_tree(work_dir, true);
+
+	return 0;
+}
+
+void
+pgut_help(bool details)
+{
+	printf(_("%s measures the backup and restore hot paths of pg_rman.\n\n"), PROGRAM_NAME);
+	printf(_("Usage:\n"));
+	printf(_("  %s [OPTION]\n"), PROGRAM_NAME);
+
+	if (!details)
+		return;
+
+	printf(_("\nOptions:\n"));
+	printf(_("  -D, --directory=PATH      work directory, must not exist (default: bench_data)\n"));
+	printf(_("  --files=NUM               number of relation files (default: 16)\n"));
+	printf(_("  --pages=NUM               number of pages of each file (default: 1280)\n"));
+	printf(_("  --hole-ratio=PERCENT      free space in the middle of each page (default: 20)\n"));
+	printf(_("  --dirty-ratio=PERCENT     pages modified since the full backup (default: 10)\n"));
+	printf(_("  --compress-algorithm=ALGORITHM\n"));
+	printf(_("                            none (default), zlib, lz4, or zstd\n"));
+	printf(_("  --compress-level=LEVEL    compression level, 0 means the default\n"));
+	printf(_("  --keep                    keep the work directory\n"));
+}
+
+static void
+opt_compress_algorithm(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "none") == 0)
+		compress = COMPRESS_NONE;
+	else
+	{
+		compress = parse_compress_algorithm(arg, ERROR);
+		if (!compress_algorithm_supported(compress))
+			ereport(ERROR,
+				(errcode(ERROR_ARGS),
+				 errmsg("this pg_rman is built without %s support",
+					compress_algorithm_name(compress))));
+	}
+}
+
+/*
+ * Write num_files relation files of num_pages pages into root/base/1.
+ */
+static void
+generate_relations(const char *root)
+{
+	char		path[MAXPGPATH];
+	char	   *buf;
+	uint32		seed = 1;
+	int			i;
+
+	join_path_components(path, root, "base/1");
+	dir_create_dir(path, DIR_PERMISSION);
+
+	buf = pgut_malloc(BLCKSZ);
+	for (i = 0; i < num_files; i++)
+	{
+		FILE	   *fp;
+		BlockNumber	blknum;
+
+		snprintf(path, lengthof(path), "%s/base/1/%u", root, 16384 + i);
+		fp = fopen(path, "w");
+		if (fp == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\": %s", path, strerror(errno))));
+		for (blknum = 0; blknum < num_pages; blknum++)
+		{
+			make_page(buf, blknum, &seed);
+			if (fwrite(buf, 1, BLCKSZ, fp) != BLCKSZ)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not write \"%s\": %s", path, strerror(errno))));
+		}
+		if (fclose(fp) != 0)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write \"%s\": %s", path, strerror(errno))));
+	}
+	free(buf);
+}
+
+/*
+ * Build a heap-like page with a hole of hole_ratio percent.  The tuples are
+ * made of a few distinct words so that they compress as well as text does.
+ */
+static void
+make_page(char *page, BlockNumber blknum, uint32 *seed)
+{
+	static const char *words[] = { "pg_rman ", "backup ", "restore ", "12345 " };
+	PageHeader	header = (PageHeader) page;
+	int			hole = MAXALIGN_DOWN(BLCKSZ * hole_ratio / 100);
+	int			lower;
+	int			i;
+	XLogRecPtr	lsn;
+
+	for (i = 0; i < BLCKSZ; )
+	{
+		const char *word;
+		int			len;
+
+		/* xorshift */
+		*seed ^= *seed << 13;
+		*seed ^= *seed >> 17;
+		*seed ^= *seed << 5;
+		word = words[*seed % lengthof(words)];
+		len = Min(strlen(word), BLCKSZ - i);
+		memcpy(page + i, word, len);
+		i += len;
+	}
+
+	/* line pointers take 1/16 of the rest */
+	lower = MAXALIGN(SizeOfPageHeaderData + (BLCKSZ - hole) / 16);
+	if (lower + hole > BLCKSZ)
+		hole = BLCKSZ - lower;
+	memset(page, 0, SizeOfPageHeaderData);
+	memset(page + lower, 0, hole);
+	header->pd_lower = lower;
+	header->pd_upper = lower + hole;
+	header->pd_special = BLCKSZ;
+	PageSetPageSizeAndVersion((Page) page, BLCKSZ, PG_PAGE_LAYOUT_VERSION);
+
+	if ((*seed % 100) < dirty_ratio)
+		lsn = BENCH_INCR_LSN + blknum + 1;
+	else
+		lsn = BENCH_INCR_LSN / 2 + blknum;
+	PageXLogRecPtrSet(header->pd_lsn, lsn);
+}
+
+static void
+stage_start(BenchStage *stage, const char *name)
+{
+	stage->name = name;
+	stage->syscalls = stats_count_syscalls();
+	clock_gettime(CLOCK_MONOTONIC, &stage->start);
+}
+
+/*
+ * Report the stage which processed bytes and pages, 0 if not relevant.
+ */
+static void
+stage_end(BenchStage *stage, int64 bytes, int64 pages)
+{
+	struct timespec	end;
+	double			sec;
+	long			syscalls;
+	char			mbps[32] = "-";
+	char			pps[32] = "-";
+	char			nsys[32] = "-";
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	syscalls = stats_count_syscalls();
+	sec = (end.tv_sec - stage->start.tv_sec) +
+		(end.tv_nsec - stage->start.tv_nsec) / 1e9;
+	if (sec <= 0)
+		sec = 1e-9;
+
+	if (bytes > 0)
+		snprintf(mbps, lengthof(mbps), "%.1f", bytes / sec / (1024 * 1024));
+	if (pages > 0)
+		snprintf(pps, lengthof(pps), "%.0f", pages / sec);
+	if (syscalls >= 0 && stage->syscalls >= 0)
+		snprintf(nsys, lengthof(nsys), "%ld", syscalls - stage->syscalls);
+
+	printf("%-28s %10s %12s %10s %9.3f\n", stage->name, mbps, pps, nsys, sec);
+}
+
+/*
+ * List the generated relation files as backup does.
+ */
+static parray *
+list_relations(const char *root)
+{
+	parray *all = parray_new();
+	parray *files = parray_new();
+	int		i;
+
+	dir_list_file(all, root, NULL, true, false);
+	for (i = 0; i < parray_num(all); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(all, i);
+
+		if (S_ISREG(file->mode))
+		{
+			file->is_datafile = true;
+			parray_append(files, file);
+		}
+		else
+			pgFileFree(file);
+	}
+	parray_free(all);
+	parray_qsort(files, pgFileComparePath);
+
+	return files;
+}
+
+/*
+ * Back up the files, whose sizes and CRCs are kept in the entries of files
+ * for the latter stages.  An incremental backup takes the pages modified
+ * after BENCH_INCR_LSN.
+ */
+static void
+bench_backup(parray *files, const char *from_root, const char *to_root,
+			 BackupMode mode)
+{
+	XLogRecPtr	lsn = BENCH_INCR_LSN;
+	char		path[MAXPGPATH];
+	int			i;
+
+	join_path_components(path, to_root, "base/1");
+	dir_create_dir(path, DIR_PERMISSION);
+
+	current.backup_mode = mode;
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile	   *file = (pgFile *) parray_get(files, i);
+		pgFile		saved = *file;
+
+		if (mode == BACKUP_MODE_FULL)
+			backup_data_file(from_root, to_root, file, NULL, compress, true,
+							 NULL, 0);
+		else
+		{
+			backup_data_file(from_root, to_root, file, &lsn, compress, false,
+							 NULL, 0);
+			/* keep the result of the full backup to be restored */
+			*file = saved;
+		}
+	}
+}
+
+/*
+ * Compress the relation files in memory and decompress the result.
+ */
+static void
+bench_compress(parray *files)
+{
+	BenchStage		stage;
+	FILE		   *tmp;
+	pgCompressor   *comp;
+	pgDecompressor *decomp;
+	char		   *buf;
+	pg_crc32c		crc;
+	size_t			write_size = 0;
+	size_t			read_size = 0;
+	int64			bytes = 0;
+	int				i;
+
+	tmp = tmpfile();
+	if (tmp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not create temporary file: %s", strerror(errno))));
+	buf = pgut_malloc(BENCH_COMPRESS_CHUNK);
+
+	/* the files are likely in the page cache after the former stages */
+	stage_start(&stage, "compressor_write");
+	PGRMAN_INIT_CRC32(crc);
+	comp = compressor_create(compress, current.compress_level, tmp,
+							 "(temporary file)", &crc, &write_size);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(files, i);
+		FILE   *fp = fopen(file->path, "r");
+		size_t	len;
+
+		if (fp == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\": %s", file->path,
+					strerror(errno))));
+		while ((len = fread(buf, 1, BENCH_COMPRESS_CHUNK, fp)) > 0)
+		{
+			compressor_write(comp, buf, len);
+			bytes += len;
+		}
+		fclose(fp);
+	}
+	compressor_end(comp);
+	stage_end(&stage, bytes, bytes / BLCKSZ);
+
+	stage_start(&stage, "decompressor_read");
+	rewind(tmp);
+	decomp = decompressor_create(compress, tmp, "(temporary file)",
+								 &read_size, NULL);
+	bytes = 0;
+	for (;;)
+	{
+		size_t	len = decompressor_read(decomp, buf, BENCH_COMPRESS_CHUNK);
+
+		if (len == 0)
+			break;
+		bytes += len;
+	}
+	decompressor_free(decomp);
+	stage_end(&stage, bytes, bytes / BLCKSZ);
+
+	printf("\ncompression ratio %.1f%%\n",
+		   bytes > 0 ? 100.0 * write_size / bytes : 0.0);
+
+	free(buf);
+	fclose(tmp);
+}
@@ -24,6 +24,8 @@
 #include "pgut/pgut-port.h"
 
 static pgBackup *catalog_read_ini(const char *path);
+static void catalog_update_index(const pgBackup *backup,
+								 const struct stat *st);
 
 #define BOOL_TO_STR(val)	((val) ? "true" : "false")
 
@@ -57,6 +59,7 @@ catalog_lock(void)
 		if (errno == EWOULDBLOCK)
 		{
 			close(lock_fd);
+			lock_fd = -1;
 			return 1;
 		}
 		else
@@ -64,6 +67,7 @@ catalog_lock(void)
 			int errno_tmp = errno;
 
 			close(lock_fd);
+			lock_fd = -1;
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
 				 errmsg("could not lock file \"%s\": %s", id_path,
@@ -75,11 +79,42 @@ catalog_lock(void)
 }
 
 /*
- * Release catalog lock.
+ * Lock of the catalog like catalog_lock(), but if the lock is held by
+ * another one, retry every second for timeout seconds before returning 1.
+ */
+int
+catalog_lock_wait(int timeout)
+{
+	int		ret;
+	int		waited;
+
+	for (waited = 0;; waited++)
+	{
+		ret = catalog_lock();
+		if (ret != 1 || waited >= timeout)
+			return ret;
+
+		if (waited == 0)
+			elog(INFO, _("waiting for another pg_rman to release the backup catalog"));
+
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted while waiting for the backup catalog")));
+
+		sleep(1);
+	}
+}
+
+/*
+ * Release catalog lock, if held.
  */
 void
 catalog_unlock(void)
 {
+	if (lock_fd == -1)
+		return;
 	close(lock_fd);
 	lock_fd = -1;
 }
@@ -129,37 +164,594 @@ IsDir(const char *dirpath, const DIR *dir, const struct dirent *ent)
 }
 
 /*
- * Create list of backups started between begin and end from backup catalog.
- * If range was NULL, all of backup are listed.
- * The list is sorted in order of descending start time.
+ * The catalog index caches the contents of all backup.ini files in a single
+ * file under $BACKUP_PATH, so that listing backups needs only to stat each
+ * backup.ini instead of reading it.  It consists of a header followed by
+ * each date directory with the records of the backups in it.
+ *
+ * Each record is validated with the mtime and size of its backup.ini taken
+ * when it was recorded, and backup.ini is read again if they don't match;
+ * thus backups modified by hand or without the catalog lock are noticed.
+ * The mtime of a date directory is used only to tell whether the set of time
+ * directories in it could have been changed, to read the directory again.
+ *
+ * The fields of pgBackup are recorded one by one in CatalogIndexRecord, not
+ * as the in-memory struct, so CATALOG_INDEX_VERSION must be bumped only when
+ * the record is changed.  An index of another version is ignored and
+ * rebuilt.  The index is written only while holding the catalog lock.
  */
-parray *
-catalog_get_backup_list(const pgBackupRange *range)
+#define CATALOG_INDEX_MAGIC		"PGRMCAT"
+#define CATALOG_INDEX_VERSION	3		/* 3: explicit records */
+#define CATALOG_NAME_LEN		64
+
+/* flags of CatalogIndexRecord */
+#define CATALOG_WITH_SERVERLOG			0x01
+#define CATALOG_COMPRESS_DATA			0x02
+#define CATALOG_FULL_BACKUP_ON_ERROR	0x04
+#define CATALOG_STREAMED				0x08
+#define CATALOG_DEDUP					0x10
+
+typedef struct CatalogIndexHeader
+{
+	char		magic[8];
+	uint32		version;
+	uint32		record_size;	/* sizeof(CatalogIndexRecord) */
+	uint32		ndirs;
+	pg_crc32c	crc;			/* CRC of the rest of the file */
+} CatalogIndexHeader;
+
+typedef struct CatalogIndexDir
+{
+	char		name[CATALOG_NAME_LEN];	/* date directory */
+	int64		mtime;
+	uint32		nbackups;		/* number of records which follow */
+	uint32		padding;
+} CatalogIndexDir;
+
+typedef struct CatalogIndexRecord
+{
+	char		name[CATALOG_NAME_LEN];	/* time directory */
+
+	/* stat of backup.ini the record was made from */
+	int64		ini_mtime;
+	int64		ini_mtime_nsec;
+	int64		ini_size;
+
+	int32		backup_mode;
+	int32		compress_algorithm;
+	int32		compress_level;
+	int32		status;
+	uint32		tli;
+	uint32		recovery_xid;
+	uint64		start_lsn;
+	uint64		stop_lsn;
+	int64		start_time;
+	int64		end_time;
+	int64		recovery_time;
+	int64		total_data_bytes;
+	int64		read_data_bytes;
+	int64		read_arclog_bytes;
+	int64		read_srvlog_bytes;
+	int64		write_bytes;
+	uint32		block_size;
+	uint32		wal_block_size;
+	uint32		flags;			/* CATALOG_xxx */
+	uint32		padding;
+} CatalogIndexRecord;
+
+/* date directory and the backups in it */
+typedef struct CatalogDir
+{
+	char		name[CATALOG_NAME_LEN];
+	time_t		mtime;
+	bool		cacheable;		/* false if it has too long names */
+	parray	   *backups;		/* array of CatalogIndexRecord */
+} CatalogDir;
+
+#ifdef __APPLE__
+#define ST_MTIME_NSEC(st)	((st)->st_mtimespec.tv_nsec)
+#else
+#define ST_MTIME_NSEC(st)	((st)->st_mtim.tv_nsec)
+#endif
+
+static int
+CatalogDirCompare(const void *l, const void *r)
+{
+	return strcmp((*(CatalogDir **) l)->name, (*(CatalogDir **) r)->name);
+}
+
+static int
+CatalogIndexRecordCompare(const void *l, const void *r)
+{
+	return strcmp((*(CatalogIndexRecord **) l)->name,
+				  (*(CatalogIndexRecord **) r)->name);
+}
+
+static void
+catalog_free_dir(void *dir)
+{
+	parray_walk(((CatalogDir *) dir)->backups, free);
+	parray_free(((CatalogDir *) dir)->backups);
+	free(dir);
+}
+
+static void
+catalog_free_dirs(parray *dirs)
+{
+	parray_walk(dirs, catalog_free_dir);
+	parray_free(dirs);
+}
+
+/*
+ * Make the record of the backup, of which backup.ini has the stat "st".
+ */
+static CatalogIndexRecord *
+catalog_make_record(const char *name, const pgBackup *backup,
+					const struct stat *st)
+{
+	CatalogIndexRecord *rec = pgut_new(CatalogIndexRecord);
+
+	memset(rec, 0, sizeof(*rec));
+	strlcpy(rec->name, name, lengthof(rec->name));
+	rec->ini_mtime = (int64) st->st_mtime;
+	rec->ini_mtime_nsec = (int64) ST_MTIME_NSEC(st);
+	rec->ini_size = (int64) st->st_size;
+
+	rec->backup_mode = (int32) backup->backup_mode;
+	rec->compress_algorithm = (int32) backup->compress_algorithm;
+	rec->compress_level = (int32) backup->compress_level;
+	rec->status = (int32) backup->status;
+	rec->tli = backup->tli;
+	rec->recovery_xid = backup->recovery_xid;
+	rec->start_lsn = backup->start_lsn;
+	rec->stop_lsn = backup->stop_lsn;
+	rec->start_time = (int64) backup->start_time;
+	rec->end_time = (int64) backup->end_time;
+	rec->recovery_time = (int64) backup->recovery_time;
+	rec->total_data_bytes = backup->total_data_bytes;
+	rec->read_data_bytes = backup->read_data_bytes;
+	rec->read_arclog_bytes = backup->read_arclog_bytes;
+	rec->read_srvlog_bytes = backup->read_srvlog_bytes;
+	rec->write_bytes = backup->write_bytes;
+	rec->block_size = backup->block_size;
+	rec->wal_block_size = backup->wal_block_size;
+	if (backup->with_serverlog)
+		rec->flags |= CATALOG_WITH_SERVERLOG;
+	if (backup->compress_data)
+		rec->flags |= CATALOG_COMPRESS_DATA;
+	if (backup->full_backup_on_error)
+		rec->flags |= CATALOG_FULL_BACKUP_ON_ERROR;
+	if (backup->streamed)
+		rec->flags |= CATALOG_STREAMED;
+	if (backup->dedup)
+		rec->flags |= CATALOG_DEDUP;
+
+	return rec;
+}
+
+/*
+ * Create pgBackup from the record, as catalog_read_ini() does from backup.ini.
+ */
+static pgBackup *
+catalog_record_to_backup(const CatalogIndexRecord *rec)
+{
+	pgBackup   *backup = pgut_new(pgBackup);
+
+	catalog_init_config(backup);
+	backup->backup_mode = (BackupMode) rec->backup_mode;
+	backup->with_serverlog = (rec->flags & CATALOG_WITH_SERVERLOG) != 0;
+	backup->compress_data = (rec->flags & CATALOG_COMPRESS_DATA) != 0;
+	backup->compress_algorithm = (CompressAlgorithm) rec->compress_algorithm;
+	backup->compress_level = rec->compress_level;
+	backup->full_backup_on_error =
+		(rec->flags & CATALOG_FULL_BACKUP_ON_ERROR) != 0;
+	backup->streamed = (rec->flags & CATALOG_STREAMED) != 0;
+	backup->dedup = (rec->flags & CATALOG_DEDUP) != 0;
+	backup->status = (BackupStatus) rec->status;
+	backup->tli = rec->tli;
+	backup->start_lsn = rec->start_lsn;
+	backup->stop_lsn = rec->stop_lsn;
+	backup->start_time = (time_t) rec->start_time;
+	backup->end_time = (time_t) rec->end_time;
+	backup->recovery_time = (time_t) rec->recovery_time;
+	backup->recovery_xid = rec->recovery_xid;
+	backup->total_data_bytes = rec->total_data_bytes;
+	backup->read_data_bytes = rec->read_data_bytes;
+	backup->read_arclog_bytes = rec->read_arclog_bytes;
+	backup->read_srvlog_bytes = rec->read_srvlog_bytes;
+	backup->write_bytes = rec->write_bytes;
+	backup->block_size = rec->block_size;
+	backup->wal_block_size = rec->wal_block_size;
+
+	return backup;
+}
+
+/*
+ * Return true if the record still describes backup.ini with the stat "st".
+ * As mtime could have a resolution of seconds, backup.ini modified in the
+ * same second as the index was written is read again because it could have
+ * been modified after recorded.
+ */
+static bool
+catalog_record_is_valid(const CatalogIndexRecord *rec, const struct stat *st,
+						const struct stat *index_st)
+{
+	if (rec->ini_mtime != (int64) st->st_mtime ||
+		rec->ini_mtime_nsec != (int64) ST_MTIME_NSEC(st) ||
+		rec->ini_size != (int64) st->st_size)
+		return false;
+
+	return rec->ini_mtime < (int64) index_st->st_mtime ||
+		(rec->ini_mtime == (int64) index_st->st_mtime &&
+		 rec->ini_mtime_nsec < (int64) ST_MTIME_NSEC(index_st));
+}
+
+/*
+ * Read the catalog index into an array of CatalogDir sorted by name.
+ * *index_st is set to the stat of the index.  Returns NULL if there is no
+ * index or it is broken, to scan all the date directories instead.
+ */
+static parray *
+catalog_read_index(struct stat *index_st)
+{
+	char				path[MAXPGPATH];
+	FILE			   *fp;
+	struct stat			st;
+	char			   *buf;
+	char			   *ptr;
+	char			   *buf_end;
+	CatalogIndexHeader	header;
+	pg_crc32c			crc;
+	parray			   *dirs;
+	uint32				i;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_FILE);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, _("could not open \"%s\": %s"), path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fileno(fp), &st) == -1 || st.st_size < sizeof(header))
+	{
+		fclose(fp);
+		elog(WARNING, _("invalid catalog index \"%s\", scan the catalog instead"),
+			 path);
+		return NULL;
+	}
+
+	buf = pgut_malloc(st.st_size);
+	if (fread(buf, 1, st.st_size, fp) != st.st_size)
+	{
+		fclose(fp);
+		free(buf);
+		elog(WARNING, _("could not read \"%s\": %s"), path, strerror(errno));
+		return NULL;
+	}
+	fclose(fp);
+
+	memcpy(&header, buf, sizeof(header));
+	PGRMAN_INIT_CRC32(crc);
+	PGRMAN_COMP_CRC32(crc, buf + sizeof(header), st.st_size - sizeof(header));
+	PGRMAN_FIN_CRC32(crc);
+	if (memcmp(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+		(header.version != CATALOG_INDEX_VERSION ||
+		 header.record_size != sizeof(CatalogIndexRecord)))
+	{
+		/* written by another version of pg_rman, not broken */
+		free(buf);
+		elog(DEBUG, "catalog index \"%s\" is of version %u, scan the catalog instead",
+			 path, header.version);
+		return NULL;
+	}
+	if (memcmp(header.magic, CATALOG_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+		!PGRMAN_EQ_CRC32(crc, header.crc))
+	{
+		free(buf);
+		elog(WARNING, _("invalid catalog index \"%s\", scan the catalog instead"),
+			 path);
+		return NULL;
+	}
+
+	dirs = parray_new();
+	ptr = buf + sizeof(header);
+	buf_end = buf + st.st_size;
+	for (i = 0; i < header.ndirs; i++)
+	{
+		CatalogIndexDir	idir;
+		CatalogDir	   *dir;
+		uint32			j;
+
+		if (buf_end - ptr < sizeof(idir))
+			break;
+		memcpy(&idir, ptr, sizeof(idir));
+		ptr += sizeof(idir);
+		if ((buf_end - ptr) / sizeof(CatalogIndexRecord) < idir.nbackups)
+			break;
+
+		dir = pgut_new(CatalogDir);
+		strlcpy(dir->name, idir.name, lengthof(dir->name));
+		dir->mtime = (time_t) idir.mtime;
+		dir->cacheable = true;
+		dir->backups = parray_new();
+		parray_expand(dir->backups, idir.nbackups);
+		for (j = 0; j < idir.nbackups; j++)
+		{
+			CatalogIndexRecord *rec = pgut_new(CatalogIndexRecord);
+
+			memcpy(rec, ptr, sizeof(CatalogIndexRecord));
+			rec->name[CATALOG_NAME_LEN - 1] = '\0';
+			ptr += sizeof(CatalogIndexRecord);
+			parray_append(dir->backups, rec);
+		}
+		parray_append(dirs, dir);
+	}
+	free(buf);
+
+	if (i < header.ndirs || ptr != buf_end)
+	{
+		catalog_free_dirs(dirs);
+		elog(WARNING, _("invalid catalog index \"%s\", scan the catalog instead"),
+			 path);
+		return NULL;
+	}
+
+	parray_qsort(dirs, CatalogDirCompare);
+	*index_st = st;
+
+	return dirs;
+}
+
+/*
+ * Write the catalog index from the array of CatalogDir.  It is written into
+ * a temporary file and renamed so that readers never see a partial one.
+ * Failures are not fatal because the catalog can be scanned without it.
+ */
+static void
+catalog_write_index(parray *dirs)
+{
+	char				path[MAXPGPATH];
+	char				tmp_path[MAXPGPATH];
+	FILE			   *fp;
+	CatalogIndexHeader	header;
+	CatalogIndexDir		idir;
+	size_t				i;
+	size_t				j;
+	bool				ok = true;
+
+	join_path_components(path, backup_path, CATALOG_INDEX_FILE);
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", path);
+
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL)
+	{
+		elog(WARNING, _("could not open \"%s\": %s"), tmp_path, strerror(errno));
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, CATALOG_INDEX_MAGIC);
+	header.version = CATALOG_INDEX_VERSION;
+	header.record_size = sizeof(CatalogIndexRecord);
+	PGRMAN_INIT_CRC32(header.crc);
+
+	/* leave room for the header, which is written at last with the CRC */
+	if (fwrite(&header, 1, sizeof(header), fp) != sizeof(header))
+		ok = false;
+
+	for (i = 0; ok && i < parray_num(dirs); i++)
+	{
+		CatalogDir *dir = (CatalogDir *) parray_get(dirs, i);
+
+		if (!dir->cacheable)
+			continue;
+
+		memset(&idir, 0, sizeof(idir));
+		strlcpy(idir.name, dir->name, lengthof(idir.name));
+		idir.mtime = (int64) dir->mtime;
+		idir.nbackups = (uint32) parray_num(dir->backups);
+		PGRMAN_COMP_CRC32(header.crc, &idir, sizeof(idir));
+		if (fwrite(&idir, 1, sizeof(idir), fp) != sizeof(idir))
+			ok = false;
+
+		for (j = 0; ok && j < parray_num(dir->backups); j++)
+		{
+			CatalogIndexRecord *rec = parray_get(dir->backups, j);
+
+			PGRMAN_COMP_CRC32(header.crc, rec, sizeof(*rec));
+			if (fwrite(rec, 1, sizeof(*rec), fp) != sizeof(*rec))
+				ok = false;
+		}
+		header.ndirs++;
+	}
+	PGRMAN_FIN_CRC32(header.crc);
+
+	if (ok && (fseek(fp, 0, SEEK_SET) != 0 ||
+			   fwrite(&header, 1, sizeof(header), fp) != sizeof(header)))
+		ok = false;
+	if (fclose(fp) != 0)
+		ok = false;
+
+	if (!ok || rename(tmp_path, path) == -1)
+	{
+		elog(WARNING, _("could not write catalog index \"%s\": %s"), path,
+			 strerror(errno));
+		unlink(tmp_path);
+	}
+}
+
+/*
+ * Get the record of the backup in the time directory "name" of the date
+ * directory, reusing "cached" if it still matches backup.ini.  Returns NULL
+ * if there is no valid backup.ini.  *modified is set to true if backup.ini
+ * has been read.
+ */
+static CatalogIndexRecord *
+catalog_get_record(const char *date_path, const char *name,
+				   CatalogIndexRecord *cached, const struct stat *index_st,
+				   bool *modified)
+{
+	char		ini_path[MAXPGPATH];
+	struct stat	st;
+	pgBackup   *backup;
+	CatalogIndexRecord *rec;
+
+	snprintf(ini_path, MAXPGPATH, "%s/%s/%s", date_path, name,
+			 BACKUP_INI_FILE);
+	if (stat(ini_path, &st) == -1)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, _("could not stat \"%s\": %s"), ini_path,
+				 strerror(errno));
+		if (cached)
+			*modified = true;
+		return NULL;
+	}
+
+	if (cached && index_st && catalog_record_is_valid(cached, &st, index_st))
+	{
+		rec = pgut_new(CatalogIndexRecord);
+		memcpy(rec, cached, sizeof(CatalogIndexRecord));
+		return rec;
+	}
+
+	/* read backup information from backup.ini, ignore corrupted backup */
+	*modified = true;
+	backup = catalog_read_ini(ini_path);
+	if (backup == NULL)
+		return NULL;
+	rec = catalog_make_record(name, backup, &st);
+	pgBackupFree(backup);
+
+	return rec;
+}
+
+/*
+ * Read the date directory "name" and get the backups in it, reusing the
+ * records of "cached" which still match backup.ini.  Returns NULL on error.
+ */
+static CatalogDir *
+catalog_scan_date_dir(const char *name, time_t mtime, CatalogDir *cached,
+					  const struct stat *index_st, bool *modified)
 {
-	const pgBackupRange range_all = { 0, 0 };
-	DIR			   *date_dir = NULL;
-	struct dirent  *date_ent = NULL;
-	DIR			   *time_dir = NULL;
-	struct dirent  *time_ent = NULL;
 	char			date_path[MAXPGPATH];
-	parray		   *backups = NULL;
-	pgBackup	   *backup = NULL;
-	struct tm	   *tm;
-	char			begin_date[100];
-	char			begin_time[100];
-	char			end_date[100];
-	char			end_time[100];
+	DIR			   *time_dir;
+	struct dirent  *time_ent;
+	CatalogDir	   *dir;
+
+	/* open subdirectory (date directory) and search time directory */
+	join_path_components(date_path, backup_path, name);
+	time_dir = opendir(date_path);
+	if (time_dir == NULL)
+	{
+		elog(WARNING, _("could not open directory \"%s\": %s"),
+			name, strerror(errno));
+		return NULL;
+	}
 
-	if (range == NULL)
-		range = &range_all;
+	dir = pgut_new(CatalogDir);
+	strlcpy(dir->name, name, lengthof(dir->name));
+	dir->mtime = mtime;
+	dir->cacheable = (strlen(name) < CATALOG_NAME_LEN);
+	dir->backups = parray_new();
 
-	/* make date/time string */
-	tm = localtime(&range->begin);
-	strftime(begin_date, lengthof(begin_date), "%Y%m%d", tm);
-	strftime(begin_time, lengthof(begin_time), "%H%M%S", tm);
-	tm = localtime(&range->end);
-	strftime(end_date, lengthof(end_date), "%Y%m%d", tm);
-	strftime(end_time, lengthof(end_time), "%H%M%S", tm);
+	for (; (time_ent = readdir(time_dir)) != NULL; errno = 0)
+	{
+		CatalogIndexRecord	key;
+		CatalogIndexRecord **hit = NULL;
+		CatalogIndexRecord *rec;
+
+		/* skip not-directory and hidden directories */
+		if (!IsDir(date_path, time_dir, time_ent) || time_ent->d_name[0] == '.')
+			continue;
+
+		if (strlen(time_ent->d_name) >= CATALOG_NAME_LEN)
+			dir->cacheable = false;
+		else if (cached)
+		{
+			strlcpy(key.name, time_ent->d_name, lengthof(key.name));
+			hit = (CatalogIndexRecord **)
+				parray_bsearch(cached->backups, &key, CatalogIndexRecordCompare);
+		}
+
+		rec = catalog_get_record(date_path, time_ent->d_name,
+								 hit ? *hit : NULL, index_st, modified);
+		if (rec)
+			parray_append(dir->backups, rec);
+	}
+	if (errno && errno != ENOENT)
+	{
+		elog(WARNING, _("could not read date directory \"%s\": %s"),
+			name, strerror(errno));
+		closedir(time_dir);
+		catalog_free_dir(dir);
+		return NULL;
+	}
+	closedir(time_dir);
+
+	parray_qsort(dir->backups, CatalogIndexRecordCompare);
+
+	/* some of the backups have been removed */
+	if (cached && parray_num(dir->backups) != parray_num(cached->backups))
+		*modified = true;
+
+	return dir;
+}
+
+/*
+ * Check each record of the date directory, which has no time directories
+ * added or removed since recorded, against its backup.ini.
+ */
+static void
+catalog_validate_date_dir(CatalogDir *dir, const struct stat *index_st,
+						  bool *modified)
+{
+	char	date_path[MAXPGPATH];
+	parray *backups;
+	size_t	i;
+
+	join_path_components(date_path, backup_path, dir->name);
+	backups = parray_new();
+	for (i = 0; i < parray_num(dir->backups); i++)
+	{
+		CatalogIndexRecord *cached = parray_get(dir->backups, i);
+		CatalogIndexRecord *rec;
+
+		rec = catalog_get_record(date_path, cached->name, cached, index_st,
+								 modified);
+		if (rec)
+			parray_append(backups, rec);
+	}
+	parray_walk(dir->backups, free);
+	parray_free(dir->backups);
+	dir->backups = backups;
+}
+
+/*
+ * Collect the date directories in the range with the backups in them, from
+ * the catalog index if possible.  The date directories out of the range are
+ * returned as recorded in the index without checking.  *modified is set to
+ * true if the index doesn't match the catalog.  Returns NULL on error.
+ */
+static parray *
+catalog_get_dirs(const char *begin_date, const char *end_date, bool ranged,
+				 bool *modified)
+{
+	DIR			   *date_dir;
+	struct dirent  *date_ent;
+	parray		   *cached;
+	parray		   *dirs;
+	struct stat		index_st;
+	size_t			nfound = 0;
+	size_t			i;
+
+	memset(&index_st, 0, sizeof(index_st));
+	cached = catalog_read_index(&index_st);
+	*modified = (cached == NULL);
+	if (cached == NULL)
+		cached = parray_new();
 
 	/* open backup root directory */
 	date_dir = opendir(backup_path);
@@ -167,13 +759,19 @@ catalog_get_backup_list(const pgBackupRange *range)
 	{
 		elog(WARNING, _("could not open directory \"%s\": %s"), backup_path,
 			strerror(errno));
-		goto err_proc;
+		catalog_free_dirs(cached);
+		return NULL;
 	}
 
-	/* scan date/time directories and list backups in the range */
-	backups = parray_new();
+	dirs = parray_new();
 	for (; (date_ent = readdir(date_dir)) != NULL; errno = 0)
 	{
+		char		date_path[MAXPGPATH];
+		struct stat	st;
+		CatalogDir	key;
+		CatalogDir **hit;
+		CatalogDir *dir;
+
 		/* skip not-directory entries and hidden entries */
 		if (!IsDir(backup_path, date_dir, date_ent) || date_ent->d_name[0] == '.')
 			continue;
@@ -186,54 +784,63 @@ catalog_get_backup_list(const pgBackupRange *range)
 		if (strcmp(date_ent->d_name, TIMELINE_HISTORY_DIR) == 0)
 			continue;
 
-		/* If the date is out of range, skip it. */
-		if (pgBackupRangeIsValid(range) &&
-				(strcmp(begin_date, date_ent->d_name) > 0 ||
-								strcmp(end_date, date_ent->d_name) < 0))
+		/* skip the chunk store of --dedup */
+		if (strcmp(date_ent->d_name, DEDUP_DIR) == 0)
 			continue;
 
-		/* open subdirectory (date directory) and search time directory */
 		join_path_components(date_path, backup_path, date_ent->d_name);
-		time_dir = opendir(date_path);
-		if (time_dir == NULL)
+		if (stat(date_path, &st) == -1)
 		{
-			elog(WARNING, _("could not open directory \"%s\": %s"),
-				date_ent->d_name, strerror(errno));
+			/* removed concurrently */
+			if (errno == ENOENT)
+				continue;
+			elog(WARNING, _("could not stat directory \"%s\": %s"),
+				 date_path, strerror(errno));
 			goto err_proc;
 		}
-		for (; (time_ent = readdir(time_dir)) != NULL; errno = 0)
-		{
-			char ini_path[MAXPGPATH];
 
-			/* skip not-directory and hidden directories */
-			if (!IsDir(date_path, date_dir, time_ent) || time_ent->d_name[0] == '.')
-				continue;
+		hit = NULL;
+		if (strlen(date_ent->d_name) < CATALOG_NAME_LEN)
+		{
+			strlcpy(key.name, date_ent->d_name, lengthof(key.name));
+			hit = (CatalogDir **) parray_bsearch(cached, &key,
+												 CatalogDirCompare);
+		}
+		if (hit)
+			nfound++;
 
-			/* If the time is out of range, skip it. */
-			if (pgBackupRangeIsValid(range) &&
-					(strcmp(begin_time, time_ent->d_name) > 0 ||
-									strcmp(end_time, time_ent->d_name) < 0))
+		if (ranged &&
+			(strcmp(begin_date, date_ent->d_name) > 0 ||
+			 strcmp(end_date, date_ent->d_name) < 0))
+		{
+			/* If the date is out of range, keep the recorded one. */
+			if (hit == NULL)
 				continue;
-
-			/* read backup information from backup.ini */
-			snprintf(ini_path, MAXPGPATH, "%s/%s/%s", date_path,
-				time_ent->d_name, BACKUP_INI_FILE);
-			backup = catalog_read_ini(ini_path);
-			/* ignore corrupted backup */
-			if (backup)
-			{
-				parray_append(backups, backup);
-				backup = NULL;
-			}
+			dir = *hit;
+			*hit = NULL;	/* moved to dirs */
 		}
-		if (errno && errno != ENOENT)
+		else if (hit && (*hit)->mtime == st.st_mtime &&
+				 (*hit)->mtime < index_st.st_mtime)
 		{
-			elog(WARNING, _("could not read date directory \"%s\": %s"),
-				date_ent->d_name, strerror(errno));
-			goto err_proc;
+			/*
+			 * No time directory has been added or removed since recorded,
+			 * see catalog_record_is_valid() for the resolution of mtime.
+			 */
+			dir = *hit;
+			*hit = NULL;
+			catalog_validate_date_dir(dir, &index_st, modified);
 		}
-		closedir(time_dir);
-		time_dir = NULL;
+		else
+		{
+			dir = catalog_scan_date_dir(date_ent->d_name, st.st_mtime,
+										hit ? *hit : NULL, &index_st,
+										modified);
+			if (dir == NULL)
+				goto err_proc;
+			/* the mtime of the date directory is to be recorded */
+			*modified = true;
+		}
+		parray_append(dirs, dir);
 	}
 	if (errno)
 	{
@@ -241,25 +848,177 @@ catalog_get_backup_list(const pgBackupRange *range)
 			backup_path, strerror(errno));
 		goto err_proc;
 	}
+	closedir(date_dir);
+
+	/* some of the date directories have been removed */
+	if (nfound < parray_num(cached))
+		*modified = true;
 
+	for (i = 0; i < parray_num(cached); i++)
+	{
+		CatalogDir *dir = (CatalogDir *) parray_get(cached, i);
+
+		if (dir)
+			catalog_free_dir(dir);
+	}
+	parray_free(cached);
+
+	parray_qsort(dirs, CatalogDirCompare);
+
+	return dirs;
+
+err_proc:
 	closedir(date_dir);
-	date_dir = NULL;
+	for (i = 0; i < parray_num(cached); i++)
+	{
+		CatalogDir *dir = (CatalogDir *) parray_get(cached, i);
+
+		if (dir)
+			catalog_free_dir(dir);
+	}
+	parray_free(cached);
+	catalog_free_dirs(dirs);
+	return NULL;
+}
+
+/*
+ * Create list of backups started between begin and end from backup catalog.
+ * If range was NULL, all of backup are listed.
+ * The list is sorted in order of descending start time.
+ */
+parray *
+catalog_get_backup_list(const pgBackupRange *range)
+{
+	const pgBackupRange range_all = { 0, 0 };
+	parray		   *dirs;
+	parray		   *backups;
+	bool			modified;
+	struct tm	   *tm;
+	char			begin_date[100];
+	char			begin_time[100];
+	char			end_date[100];
+	char			end_time[100];
+	size_t			i;
+	size_t			j;
+
+	if (range == NULL)
+		range = &range_all;
+
+	/* make date/time string */
+	tm = localtime(&range->begin);
+	strftime(begin_date, lengthof(begin_date), "%Y%m%d", tm);
+	strftime(begin_time, lengthof(begin_time), "%H%M%S", tm);
+	tm = localtime(&range->end);
+	strftime(end_date, lengthof(end_date), "%Y%m%d", tm);
+	strftime(end_time, lengthof(end_time), "%H%M%S", tm);
+
+	dirs = catalog_get_dirs(begin_date, end_date, pgBackupRangeIsValid(range),
+							&modified);
+	if (dirs == NULL)
+		return NULL;
+
+	/* refresh the index if we are allowed to */
+	if (modified && lock_fd != -1)
+		catalog_write_index(dirs);
+
+	/* list backups in the range */
+	backups = parray_new();
+	for (i = 0; i < parray_num(dirs); i++)
+	{
+		CatalogDir *dir = (CatalogDir *) parray_get(dirs, i);
+
+		/* If the date is out of range, skip it. */
+		if (pgBackupRangeIsValid(range) &&
+				(strcmp(begin_date, dir->name) > 0 ||
+								strcmp(end_date, dir->name) < 0))
+			continue;
+
+		for (j = 0; j < parray_num(dir->backups); j++)
+		{
+			CatalogIndexRecord *rec = parray_get(dir->backups, j);
+
+			/* If the time is out of range, skip it. */
+			if (pgBackupRangeIsValid(range) &&
+					(strcmp(begin_time, rec->name) > 0 ||
+									strcmp(end_time, rec->name) < 0))
+				continue;
+
+			parray_append(backups, catalog_record_to_backup(rec));
+		}
+	}
+	catalog_free_dirs(dirs);
 
 	parray_qsort(backups, pgBackupCompareIdDesc);
 
 	return backups;
+}
 
-err_proc:
-	if (time_dir)
-		closedir(time_dir);
-	if (date_dir)
-		closedir(date_dir);
-	if (backup)
-		pgBackupFree(backup);
-	if (backups)
-		parray_walk(backups, pgBackupFree);
-	parray_free(backups);
-	return NULL;
+/*
+ * Record the backup, of which backup.ini has just been written with the
+ * stat "st", into the catalog index.  Only its record is replaced, without
+ * looking into the catalog.  The index is left as is unless we hold the
+ * catalog lock; then the record doesn't match backup.ini any longer and is
+ * refreshed by the next command holding the lock.
+ */
+static void
+catalog_update_index(const pgBackup *backup, const struct stat *st)
+{
+	parray			   *dirs;
+	struct stat			index_st;
+	struct tm		   *tm;
+	CatalogDir			key;
+	CatalogDir		  **hit;
+	CatalogDir		   *dir;
+	CatalogIndexRecord	rkey;
+	CatalogIndexRecord **rec;
+
+	if (lock_fd == -1)
+		return;
+
+	/* rebuilt by the next listing if there is no valid index */
+	dirs = catalog_read_index(&index_st);
+	if (dirs == NULL)
+		return;
+
+	/* date/time directory of the backup, as pgBackupGetPath() */
+	tm = localtime(&backup->start_time);
+	strftime(key.name, lengthof(key.name), "%Y%m%d", tm);
+	strftime(rkey.name, lengthof(rkey.name), "%H%M%S", tm);
+
+	hit = (CatalogDir **) parray_bsearch(dirs, &key, CatalogDirCompare);
+	if (hit)
+		dir = *hit;
+	else
+	{
+		/* mtime is unknown, so that the directory is read at next listing */
+		dir = pgut_new(CatalogDir);
+		strlcpy(dir->name, key.name, lengthof(dir->name));
+		dir->mtime = 0;
+		dir->cacheable = true;
+		dir->backups = parray_new();
+		parray_append(dirs, dir);
+		parray_qsort(dirs, CatalogDirCompare);
+	}
+
+	rec = (CatalogIndexRecord **) parray_bsearch(dir->backups, &rkey,
+												 CatalogIndexRecordCompare);
+	if (rec)
+	{
+		free(*rec);
+		*rec = catalog_make_record(rkey.name, backup, st);
+	}
+	else
+	{
+		/*
+		 * A new time directory changes the mtime of the date directory, so
+		 * that the directory is read again at next listing.
+		 */
+		parray_append(dir->backups, catalog_make_record(rkey.name, backup, st));
+		parray_qsort(dir->backups, CatalogIndexRecordCompare);
+	}
+
+	catalog_write_index(dirs);
+	catalog_free_dirs(dirs);
 }
 
 /*
@@ -363,13 +1122,24 @@ pgBackupWriteConfigSection(FILE *out, pgBackup *backup)
 	fprintf(out, "FULL_BACKUP_ON_ERROR=%s\n", BOOL_TO_STR(backup->full_backup_on_error));
 	fprintf(out, "WITH_SERVERLOG=%s\n", BOOL_TO_STR(backup->with_serverlog));
 	fprintf(out, "COMPRESS_DATA=%s\n", BOOL_TO_STR(backup->compress_data));
+	if (backup->compress_data)
+	{
+		fprintf(out, "COMPRESS_ALGORITHM=%s\n",
+				compress_algorithm_name(backup->compress_algorithm));
+		fprintf(out, "COMPRESS_LEVEL=%d\n", backup->compress_level);
+	}
+	if (backup->streamed)
+		fprintf(out, "STREAMED=%s\n", BOOL_TO_STR(backup->streamed));
+	if (backup->dedup)
+		fprintf(out, "DEDUP=%s\n", BOOL_TO_STR(backup->dedup));
 }
 
 /*
- * Write result section of backup.in to stream "out".
+ * Write result section of backup.in to stream "out".  "stats" is the summary
+ * of --stats, omitted if NULL or empty.
  */
 void
-pgBackupWriteResultSection(FILE *out, pgBackup *backup)
+pgBackupWriteResultSection(FILE *out, pgBackup *backup, const char *stats)
 {
 	char timestamp[20];
 	uint32	start_xlogid, start_xrecoff;
@@ -423,15 +1193,64 @@ pgBackupWriteResultSection(FILE *out, pgBackup *backup)
 	fprintf(out, "BLOCK_SIZE=%u\n", backup->block_size);
 	fprintf(out, "XLOG_BLOCK_SIZE=%u\n", backup->wal_block_size);
 
+	if (stats && stats[0] != '\0')
+		fprintf(out, "STATS='%s'\n", stats);
+
 	fprintf(out, "STATUS=%s\n", status2str(backup->status));
 }
 
-/* create backup.ini */
+/*
+ * Get the summary of --stats recorded in backup.ini of the backup into buf.
+ * It is kept only in backup.ini, not in pgBackup, so that the catalog index
+ * doesn't carry it.  Empty if not recorded.
+ */
+void
+catalog_read_stats(const pgBackup *backup, char *buf, size_t size)
+{
+	FILE   *fp;
+	char	ini_path[MAXPGPATH];
+	char	line[1024];
+	char	key[1024];
+	char	value[1024];
+
+	buf[0] = '\0';
+	pgBackupGetPath(backup, ini_path, lengthof(ini_path), BACKUP_INI_FILE);
+	if ((fp = pgut_fopen(ini_path, "rt", true)) == NULL)
+		return;
+
+	while (fgets(line, lengthof(line), fp))
+	{
+		size_t		i;
+
+		for (i = strlen(line); i > 0 && IsSpace(line[i - 1]); i--)
+			line[i - 1] = '\0';
+
+		if (parse_pair(line, key, value) && pg_strcasecmp(key, "stats") == 0)
+		{
+			strlcpy(buf, value, size);
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+/* create backup.ini, keeping the summary of --stats already recorded */
 void
 pgBackupWriteIni(pgBackup *backup)
+{
+	char	stats[STATS_SUMMARY_LEN];
+
+	catalog_read_stats(backup, stats, lengthof(stats));
+	pgBackupWriteIniWithStats(backup, stats);
+}
+
+/* create backup.ini with "stats" as the summary of --stats */
+void
+pgBackupWriteIniWithStats(pgBackup *backup, const char *stats)
 {
 	FILE   *fp = NULL;
 	char	ini_path[MAXPGPATH];
+	struct stat	st;
 
 	pgBackupGetPath(backup, ini_path, lengthof(ini_path), BACKUP_INI_FILE);
 	fp = fopen(ini_path, "wt");
@@ -445,9 +1264,18 @@ pgBackupWriteIni(pgBackup *backup)
 	pgBackupWriteConfigSection(fp, backup);
 
 	/* result section */
-	pgBackupWriteResultSection(fp, backup);
+	pgBackupWriteResultSection(fp, backup, stats);
 
+	/* the status must survive a crash, e.g. DELETING once the lock is gone */
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0 ||
+		fstat(fileno(fp), &st) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write INI file \"%s\": %s", ini_path,
+				strerror(errno))));
 	fclose(fp);
+
+	catalog_update_index(backup, &st);
 }
 
 /*
@@ -460,8 +1288,10 @@ catalog_read_ini(const char *path)
 {
 	pgBackup   *backup;
 	char	   *backup_mode = NULL;
+	char	   *compress_algorithm = NULL;
 	char	   *start_lsn = NULL;
 	char	   *stop_lsn = NULL;
+	char	   *stats = NULL;
 	char	   *status = NULL;
 	int			i;
 
@@ -470,7 +1300,11 @@ catalog_read_ini(const char *path)
 		{ 's', 0, "backup-mode"			, NULL, SOURCE_ENV },
 		{ 'b', 0, "with-serverlog"		, NULL, SOURCE_ENV },
 		{ 'b', 0, "compress-data"		, NULL, SOURCE_ENV },
+		{ 's', 0, "compress-algorithm"	, NULL, SOURCE_ENV },
+		{ 'i', 0, "compress-level"		, NULL, SOURCE_ENV },
 		{ 'b', 0, "full-backup-on-error"		, NULL, SOURCE_ENV },
+		{ 'b', 0, "streamed"			, NULL, SOURCE_ENV },
+		{ 'b', 0, "dedup"				, NULL, SOURCE_ENV },
 		{ 'u', 0, "timelineid"			, NULL, SOURCE_ENV },
 		{ 's', 0, "start-lsn"			, NULL, SOURCE_ENV },
 		{ 's', 0, "stop-lsn"			, NULL, SOURCE_ENV },
@@ -485,6 +1319,7 @@ catalog_read_ini(const char *path)
 		{ 'I', 0, "write-bytes"			, NULL, SOURCE_ENV },
 		{ 'u', 0, "block-size"			, NULL, SOURCE_ENV },
 		{ 'u', 0, "xlog-block-size"		, NULL, SOURCE_ENV },
+		{ 's', 0, "stats"				, NULL, SOURCE_ENV },
 		{ 's', 0, "status"				, NULL, SOURCE_ENV },
 		{ 0 }
 	};
@@ -499,7 +1334,11 @@ catalog_read_ini(const char *path)
 	options[i++].var = &backup_mode;
 	options[i++].var = &backup->with_serverlog;
 	options[i++].var = &backup->compress_data;
+	options[i++].var = &compress_algorithm;
+	options[i++].var = &backup->compress_level;
 	options[i++].var = &backup->full_backup_on_error;
+	options[i++].var = &backup->streamed;
+	options[i++].var = &backup->dedup;
 	options[i++].var = &backup->tli;
 	options[i++].var = &start_lsn;
 	options[i++].var = &stop_lsn;
@@ -514,17 +1353,29 @@ catalog_read_ini(const char *path)
 	options[i++].var = &backup->write_bytes;
 	options[i++].var = &backup->block_size;
 	options[i++].var = &backup->wal_block_size;
+	options[i++].var = &stats;
 	options[i++].var = &status;
 	Assert(i == lengthof(options) - 1);
 
 	pgut_readopt(path, options, ERROR_CORRUPTED);
 
+	/* read by catalog_read_stats() when needed */
+	free(stats);
+
 	if (backup_mode)
 	{
 		backup->backup_mode = parse_backup_mode(backup_mode, WARNING);
 		free(backup_mode);
 	}
 
+	/* backups taken by older versions don't have it, they used zlib */
+	if (compress_algorithm)
+	{
+		backup->compress_algorithm = parse_compress_algorithm(compress_algorithm,
+															  WARNING);
+		free(compress_algorithm);
+	}
+
 	if (start_lsn)
 	{
 		uint32 xlogid, xrecoff;
@@ -651,7 +1502,11 @@ catalog_init_config(pgBackup *backup)
 	backup->backup_mode = BACKUP_MODE_INVALID;
 	backup->with_serverlog = false;
 	backup->compress_data = false;
+	backup->compress_algorithm = COMPRESS_ZLIB;
+	backup->compress_level = 0;
 	backup->full_backup_on_error = false;
+	backup->streamed = false;
+	backup->dedup = false;
 	backup->status = BACKUP_STATUS_INVALID;
 	backup->tli = 0;
 	backup->start_lsn = backup->stop_lsn = (XLogRecPtr) 0;
@@ -702,15 +1557,20 @@ check_system_identifier()
 	fclose(fp);
 	Assert(system_identifier > 0);
 
-	controlFile = get_controlfile(pgdata, &crc_ok);
+	if (use_replication)
+		base_backup_identify_system(&controlfile_system_identifier, NULL);
+	else
+	{
+		controlFile = get_controlfile(pgdata, &crc_ok);
 
-	if (!crc_ok)
-		ereport(WARNING,
-				(errmsg("control file appears to be corrupt"),
-				 errdetail("Calculated CRC checksum does not match value stored in file.")));
+		if (!crc_ok)
+			ereport(WARNING,
+					(errmsg("control file appears to be corrupt"),
+					 errdetail("Calculated CRC checksum does not match value stored in file.")));
 
-	controlfile_system_identifier = controlFile->system_identifier;
-	pg_free(controlFile);
+		controlfile_system_identifier = controlFile->system_identifier;
+		pg_free(controlFile);
+	}
 	elog(DEBUG, "the system identifier of current target database : " UINT64_FORMAT,
 				controlfile_system_identifier);
 
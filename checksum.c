@@ -0,0 +1,88 @@
+/*-------------------------------------------------------------------------
+ *
+ * checksum.c: data checksums of pages, and their verification while backing
+ * up data files with --verify-checksums.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <pthread.h>
+
+#include "storage/bufpage.h"
+#include "storage/checksum.h"
+
+/*
+ * The implementation is built only in this file, with the flags PostgreSQL
+ * builds its checksum.c with (see Makefile), so that the loop over the
+ * N_SUMS lanes of pg_checksum_block() is unrolled and vectorized.
+ */
+#include "storage/checksum_impl.h"
+
+static int64			num_failures = 0;
+static pthread_mutex_t	failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Verify the checksums of npages pages in buf, read from the blocks from
+ * blkno, which is the block number in the whole relation.  The result of
+ * each page is stored into results.
+ *
+ * As the server does in BASE_BACKUP, new pages and pages written after the
+ * backup started at start_lsn are not verified, since they may be torn
+ * while being written and WAL replay overwrites them anyway.
+ */
+void
+checksum_verify_pages(char *buf, int npages, BlockNumber blkno,
+					  XLogRecPtr start_lsn, PageChecksumResult *results)
+{
+	int		i;
+
+	for (i = 0; i < npages; i++)
+	{
+		char		   *page = buf + (size_t) i * BLCKSZ;
+		PageHeader		header = (PageHeader) page;
+
+		if (PageIsNew(page) || PageGetLSN(page) >= start_lsn)
+			results[i] = CHECKSUM_SKIPPED;
+		else if (pg_checksum_page(page, blkno + i) == header->pd_checksum)
+			results[i] = CHECKSUM_OK;
+		else
+			results[i] = CHECKSUM_FAILED;
+	}
+}
+
+/*
+ * Report the page of block blkno in the file at path, relative to $PGDATA,
+ * whose checksum is wrong. Called by the workers concurrently.
+ */
+void
+checksum_report_failure(const char *path, BlockNumber blkno)
+{
+	pthread_mutex_lock(&failures_lock);
+	num_failures++;
+	pthread_mutex_unlock(&failures_lock);
+
+	stats_add(STATS_PAGES_CORRUPT, 1);
+	stats_add_corrupt_page(path, blkno);
+
+	elog(WARNING, _("checksum verification failed in block %u of \"%s\""),
+		 blkno, path);
+}
+
+/*
+ * Return the number of pages reported by checksum_report_failure().
+ */
+int64
+checksum_failures(void)
+{
+	int64	count;
+
+	pthread_mutex_lock(&failures_lock);
+	count = num_failures;
+	pthread_mutex_unlock(&failures_lock);
+
+	return count;
+}
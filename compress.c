@@ -0,0 +1,704 @@
+/*-------------------------------------------------------------------------
+ *
+ * compress.c: compression and decompression of backup files with zlib,
+ * lz4 or zstd.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef USE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+/* size of input chunk passed to a compression library at once */
+#define COMPRESS_CHUNK_SIZE		(64 * 1024)
+
+/* maximum compression level of lz4, i.e. LZ4HC_CLEVEL_MAX */
+#define LZ4_LEVEL_MAX			12
+
+/*
+ * A compression stream writing compressed data into a file.
+ */
+struct pgCompressor
+{
+	CompressAlgorithm	algorithm;
+	FILE			   *out;
+	const char		   *path;		/* path of out, for error messages */
+	pg_crc32c		   *crc;		/* CRC of the compressed data */
+	size_t			   *write_size;	/* size of the compressed data */
+	bool				started;	/* some data have been compressed */
+	char			   *outbuf;
+	size_t				outbuf_size;
+#ifdef HAVE_LIBZ
+	z_stream			z;
+#endif
+#ifdef USE_LZ4
+	LZ4F_cctx		   *lz4;
+	LZ4F_preferences_t	lz4_prefs;
+#endif
+#ifdef USE_ZSTD
+	ZSTD_CCtx		   *zstd;
+#endif
+};
+
+/*
+ * A decompression stream reading compressed data from a file.
+ */
+struct pgDecompressor
+{
+	CompressAlgorithm	algorithm;
+	FILE			   *in;
+	const char		   *path;		/* path of in, for error messages */
+	size_t			   *read_size;	/* size of the compressed data read */
+	pg_crc32c		   *crc;		/* CRC of the compressed data, or NULL */
+	bool				finished;	/* end of the compressed data is found */
+	char			   *inbuf;
+	size_t				inbuf_size;
+	size_t				in_pos;		/* consumed bytes in inbuf */
+	size_t				in_len;		/* valid bytes in inbuf */
+#ifdef HAVE_LIBZ
+	z_stream			z;
+#endif
+#ifdef USE_LZ4
+	LZ4F_dctx		   *lz4;
+#endif
+#ifdef USE_ZSTD
+	ZSTD_DCtx		   *zstd;
+#endif
+};
+
+/*
+ * Parse the name of compression algorithm.
+ */
+CompressAlgorithm
+parse_compress_algorithm(const char *value, int elevel)
+{
+	const char *v = value;
+
+	while (IsSpace(*v)) { v++; }
+
+	if (pg_strcasecmp(v, "zlib") == 0)
+		return COMPRESS_ZLIB;
+	else if (pg_strcasecmp(v, "lz4") == 0)
+		return COMPRESS_LZ4;
+	else if (pg_strcasecmp(v, "zstd") == 0)
+		return COMPRESS_ZSTD;
+
+	if (elevel >= ERROR)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("invalid compress-algorithm \"%s\"", value)));
+	else
+		elog(elevel, "invalid compress-algorithm \"%s\"", value);
+
+	return COMPRESS_ZLIB;
+}
+
+const char *
+compress_algorithm_name(CompressAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+		case COMPRESS_NONE:
+			return "NONE";
+		case COMPRESS_ZLIB:
+			return "ZLIB";
+		case COMPRESS_LZ4:
+			return "LZ4";
+		case COMPRESS_ZSTD:
+			return "ZSTD";
+	}
+	return "UNKNOWN";
+}
+
+/*
+ * Return whether this build of pg_rman supports the algorithm.
+ */
+bool
+compress_algorithm_supported(CompressAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+		case COMPRESS_NONE:
+			return true;
+		case COMPRESS_ZLIB:
+#ifdef HAVE_LIBZ
+			return true;
+#else
+			return false;
+#endif
+		case COMPRESS_LZ4:
+#ifdef USE_LZ4
+			return true;
+#else
+			return false;
+#endif
+		case COMPRESS_ZSTD:
+#ifdef USE_ZSTD
+			return true;
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+/*
+ * Return the maximum compression level of the algorithm.  The minimum is 1,
+ * and 0 means the default level of the library.
+ */
+int
+compress_level_max(CompressAlgorithm algorithm)
+{
+	switch (algorithm)
+	{
+		case COMPRESS_ZLIB:
+			return 9;
+		case COMPRESS_LZ4:
+			return LZ4_LEVEL_MAX;
+		case COMPRESS_ZSTD:
+#ifdef USE_ZSTD
+			return ZSTD_maxCLevel();
+#else
+			return 22;
+#endif
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Write len bytes in outbuf of the compressor into the file.
+ */
+static void
+compressor_flush_buffer(pgCompressor *c, size_t len)
+{
+	if (len == 0)
+		return;
+
+	if (fwrite(c->outbuf, 1, len, c->out) != len)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write file \"%s\": %s", c->path,
+				strerror(errno))));
+
+	/* update CRC */
+	PGRMAN_COMP_CRC32(*c->crc, c->outbuf, len);
+	*c->write_size += len;
+}
+
+/*
+ * Start compression into out.  Compressed data are written into out, and
+ * their CRC and size are accumulated into *crc and *write_size.  level 0
+ * means the default level of the algorithm.
+ */
+pgCompressor *
+compressor_create(CompressAlgorithm algorithm, int level, FILE *out,
+				  const char *path, pg_crc32c *crc, size_t *write_size)
+{
+	pgCompressor   *c;
+
+	c = pgut_new(pgCompressor);
+	memset(c, 0, sizeof(pgCompressor));
+	c->algorithm = algorithm;
+	c->out = out;
+	c->path = path;
+	c->crc = crc;
+	c->write_size = write_size;
+	c->started = false;
+
+	switch (algorithm)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_ZLIB:
+			c->z.zalloc = Z_NULL;
+			c->z.zfree = Z_NULL;
+			c->z.opaque = Z_NULL;
+			if (deflateInit(&c->z, level > 0 ? level : Z_DEFAULT_COMPRESSION) != Z_OK)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library: %s", c->z.msg)));
+			c->outbuf_size = COMPRESS_CHUNK_SIZE;
+			break;
+#endif
+#ifdef USE_LZ4
+		case COMPRESS_LZ4:
+		{
+			size_t	status;
+
+			status = LZ4F_createCompressionContext(&c->lz4, LZ4F_VERSION);
+			if (LZ4F_isError(status))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library: %s",
+						LZ4F_getErrorName(status))));
+			memset(&c->lz4_prefs, 0, sizeof(c->lz4_prefs));
+			c->lz4_prefs.compressionLevel = level;
+			c->outbuf_size = Max(LZ4F_compressBound(COMPRESS_CHUNK_SIZE, &c->lz4_prefs),
+								 LZ4F_HEADER_SIZE_MAX);
+			break;
+		}
+#endif
+#ifdef USE_ZSTD
+		case COMPRESS_ZSTD:
+		{
+			size_t	status;
+
+			c->zstd = ZSTD_createCCtx();
+			if (c->zstd == NULL)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library")));
+			status = ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel,
+											level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+			if (ZSTD_isError(status))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not set compression level %d: %s", level,
+						ZSTD_getErrorName(status))));
+			c->outbuf_size = ZSTD_CStreamOutSize();
+			break;
+		}
+#endif
+		default:
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("this pg_rman build does not support %s compression",
+					compress_algorithm_name(algorithm))));
+	}
+
+	c->outbuf = pgut_malloc(c->outbuf_size);
+
+	return c;
+}
+
+/*
+ * Compress len bytes of data.
+ */
+void
+compressor_write(pgCompressor *c, const void *data, size_t len)
+{
+	const char	   *ptr = data;
+	struct timespec	start;
+
+	if (len == 0)
+		return;
+
+	if (stats_enabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+#ifdef USE_LZ4
+	/* lz4 frame header must be written before first block */
+	if (c->algorithm == COMPRESS_LZ4 && !c->started)
+	{
+		size_t	status;
+
+		status = LZ4F_compressBegin(c->lz4, c->outbuf, c->outbuf_size,
+									&c->lz4_prefs);
+		if (LZ4F_isError(status))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not compress data: %s",
+					LZ4F_getErrorName(status))));
+		compressor_flush_buffer(c, status);
+	}
+#endif
+	c->started = true;
+
+	while (len > 0)
+	{
+		size_t	chunk = Min(len, COMPRESS_CHUNK_SIZE);
+
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during compression")));
+
+		switch (c->algorithm)
+		{
+#ifdef HAVE_LIBZ
+			case COMPRESS_ZLIB:
+				c->z.next_in = (void *) ptr;
+				c->z.avail_in = chunk;
+				do
+				{
+					c->z.next_out = (void *) c->outbuf;
+					c->z.avail_out = c->outbuf_size;
+					if (deflate(&c->z, Z_NO_FLUSH) == Z_STREAM_ERROR)
+						ereport(ERROR,
+							(errcode(ERROR_SYSTEM),
+							 errmsg("could not compress data: %s", c->z.msg)));
+					compressor_flush_buffer(c, c->outbuf_size - c->z.avail_out);
+				} while (c->z.avail_in != 0);
+				break;
+#endif
+#ifdef USE_LZ4
+			case COMPRESS_LZ4:
+			{
+				size_t	status;
+
+				status = LZ4F_compressUpdate(c->lz4, c->outbuf, c->outbuf_size,
+											 ptr, chunk, NULL);
+				if (LZ4F_isError(status))
+					ereport(ERROR,
+						(errcode(ERROR_SYSTEM),
+						 errmsg("could not compress data: %s",
+							LZ4F_getErrorName(status))));
+				compressor_flush_buffer(c, status);
+				break;
+			}
+#endif
+#ifdef USE_ZSTD
+			case COMPRESS_ZSTD:
+			{
+				ZSTD_inBuffer	in = { ptr, chunk, 0 };
+
+				while (in.pos < in.size)
+				{
+					ZSTD_outBuffer	out = { c->outbuf, c->outbuf_size, 0 };
+					size_t			status;
+
+					status = ZSTD_compressStream2(c->zstd, &out, &in, ZSTD_e_continue);
+					if (ZSTD_isError(status))
+						ereport(ERROR,
+							(errcode(ERROR_SYSTEM),
+							 errmsg("could not compress data: %s",
+								ZSTD_getErrorName(status))));
+					compressor_flush_buffer(c, out.pos);
+				}
+				break;
+			}
+#endif
+			default:
+				elog(ERROR, "unexpected compression algorithm %d", c->algorithm);
+		}
+
+		ptr += chunk;
+		len -= chunk;
+	}
+
+	if (stats_enabled)
+		stats_add_time(STATS_COMPRESS_USEC, &start);
+}
+
+/*
+ * Finish the compression and free the compressor.  Nothing is written if
+ * no data have been compressed.
+ */
+void
+compressor_end(pgCompressor *c)
+{
+	switch (c->algorithm)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_ZLIB:
+		{
+			int		status = Z_OK;
+
+			c->z.next_in = NULL;
+			c->z.avail_in = 0;
+			while (c->started && status != Z_STREAM_END)
+			{
+				c->z.next_out = (void *) c->outbuf;
+				c->z.avail_out = c->outbuf_size;
+				status = deflate(&c->z, Z_FINISH);
+				if (status == Z_STREAM_ERROR)
+					ereport(ERROR,
+						(errcode(ERROR_SYSTEM),
+						 errmsg("could not compress data: %s", c->z.msg)));
+				compressor_flush_buffer(c, c->outbuf_size - c->z.avail_out);
+			}
+			if (deflateEnd(&c->z) != Z_OK && c->started)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not close compression stream: %s", c->z.msg)));
+			break;
+		}
+#endif
+#ifdef USE_LZ4
+		case COMPRESS_LZ4:
+			if (c->started)
+			{
+				size_t	status;
+
+				status = LZ4F_compressEnd(c->lz4, c->outbuf, c->outbuf_size, NULL);
+				if (LZ4F_isError(status))
+					ereport(ERROR,
+						(errcode(ERROR_SYSTEM),
+						 errmsg("could not close compression stream: %s",
+							LZ4F_getErrorName(status))));
+				compressor_flush_buffer(c, status);
+			}
+			LZ4F_freeCompressionContext(c->lz4);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case COMPRESS_ZSTD:
+			if (c->started)
+			{
+				ZSTD_inBuffer	in = { NULL, 0, 0 };
+				size_t			status;
+
+				do
+				{
+					ZSTD_outBuffer	out = { c->outbuf, c->outbuf_size, 0 };
+
+					status = ZSTD_compressStream2(c->zstd, &out, &in, ZSTD_e_end);
+					if (ZSTD_isError(status))
+						ereport(ERROR,
+							(errcode(ERROR_SYSTEM),
+							 errmsg("could not close compression stream: %s",
+								ZSTD_getErrorName(status))));
+					compressor_flush_buffer(c, out.pos);
+				} while (status != 0);
+			}
+			ZSTD_freeCCtx(c->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	free(c->outbuf);
+	free(c);
+}
+
+/*
+ * Start decompression of the data read from in.  The size of compressed
+ * data read is accumulated into *read_size.  If crc is not NULL, *crc is
+ * also updated with the compressed data read.
+ */
+pgDecompressor *
+decompressor_create(CompressAlgorithm algorithm, FILE *in, const char *path,
+					size_t *read_size, pg_crc32c *crc)
+{
+	pgDecompressor *d;
+
+	d = pgut_new(pgDecompressor);
+	memset(d, 0, sizeof(pgDecompressor));
+	d->algorithm = algorithm;
+	d->in = in;
+	d->path = path;
+	d->read_size = read_size;
+	d->crc = crc;
+	d->finished = false;
+	d->inbuf_size = COMPRESS_CHUNK_SIZE;
+	d->in_pos = d->in_len = 0;
+
+	switch (algorithm)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_ZLIB:
+			d->z.zalloc = Z_NULL;
+			d->z.zfree = Z_NULL;
+			d->z.opaque = Z_NULL;
+			d->z.next_in = Z_NULL;
+			d->z.avail_in = 0;
+			if (inflateInit(&d->z) != Z_OK)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library: %s", d->z.msg)));
+			break;
+#endif
+#ifdef USE_LZ4
+		case COMPRESS_LZ4:
+		{
+			size_t	status;
+
+			status = LZ4F_createDecompressionContext(&d->lz4, LZ4F_VERSION);
+			if (LZ4F_isError(status))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library: %s",
+						LZ4F_getErrorName(status))));
+			break;
+		}
+#endif
+#ifdef USE_ZSTD
+		case COMPRESS_ZSTD:
+			d->zstd = ZSTD_createDCtx();
+			if (d->zstd == NULL)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not initialize compression library")));
+			d->inbuf_size = Max(d->inbuf_size, ZSTD_DStreamInSize());
+			break;
+#endif
+		default:
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("this pg_rman build does not support %s compression",
+					compress_algorithm_name(algorithm))));
+	}
+
+	d->inbuf = pgut_malloc(d->inbuf_size);
+
+	return d;
+}
+
+/*
+ * Read up to len bytes of decompressed data into buf.  Returns the number
+ * of bytes read, which is less than len only at the end of the data.
+ */
+size_t
+decompressor_read(pgDecompressor *d, void *buf, size_t len)
+{
+	size_t			total = 0;
+	struct timespec	start;
+
+	if (stats_enabled)
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (total < len && !d->finished)
+	{
+		size_t	in_size;
+		size_t	out_size;
+
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during decompression")));
+
+		/* input buffer becomes empty, read it from a file. */
+		if (d->in_pos == d->in_len)
+		{
+			d->in_pos = 0;
+			d->in_len = fread(d->inbuf, 1, d->inbuf_size, d->in);
+			if (d->in_len == 0)
+			{
+				if (ferror(d->in))
+					ereport(ERROR,
+						(errcode(ERROR_CORRUPTED),
+						 errmsg("could not read compress file \"%s\": %s",
+							d->path, strerror(errno))));
+
+				/* an empty file has no compressed stream */
+				if (*d->read_size == 0)
+				{
+					d->finished = true;
+					break;
+				}
+				ereport(ERROR,
+					(errcode(ERROR_CORRUPTED),
+					 errmsg("compressed data in \"%s\" is truncated", d->path)));
+			}
+			*d->read_size += d->in_len;
+			if (d->crc)
+				PGRMAN_COMP_CRC32(*d->crc, d->inbuf, d->in_len);
+		}
+
+		in_size = d->in_len - d->in_pos;
+		out_size = len - total;
+
+		switch (d->algorithm)
+		{
+#ifdef HAVE_LIBZ
+			case COMPRESS_ZLIB:
+			{
+				int		status;
+
+				d->z.next_in = (void *) (d->inbuf + d->in_pos);
+				d->z.avail_in = in_size;
+				d->z.next_out = (void *) ((char *) buf + total);
+				d->z.avail_out = out_size;
+				status = inflate(&d->z, Z_NO_FLUSH);
+				if (status == Z_STREAM_END)
+					d->finished = true;
+				else if (status != Z_OK)
+					ereport(ERROR,
+						(errcode(ERROR_CORRUPTED),
+						 errmsg("could not uncompress data in \"%s\": %s",
+							d->path, d->z.msg ? d->z.msg : "unknown error")));
+				in_size -= d->z.avail_in;
+				out_size -= d->z.avail_out;
+				break;
+			}
+#endif
+#ifdef USE_LZ4
+			case COMPRESS_LZ4:
+			{
+				size_t	status;
+
+				status = LZ4F_decompress(d->lz4, (char *) buf + total, &out_size,
+										 d->inbuf + d->in_pos, &in_size, NULL);
+				if (LZ4F_isError(status))
+					ereport(ERROR,
+						(errcode(ERROR_CORRUPTED),
+						 errmsg("could not uncompress data in \"%s\": %s",
+							d->path, LZ4F_getErrorName(status))));
+				if (status == 0)
+					d->finished = true;
+				break;
+			}
+#endif
+#ifdef USE_ZSTD
+			case COMPRESS_ZSTD:
+			{
+				ZSTD_inBuffer	in = { d->inbuf + d->in_pos, in_size, 0 };
+				ZSTD_outBuffer	out = { (char *) buf + total, out_size, 0 };
+				size_t			status;
+
+				status = ZSTD_decompressStream(d->zstd, &out, &in);
+				if (ZSTD_isError(status))
+					ereport(ERROR,
+						(errcode(ERROR_CORRUPTED),
+						 errmsg("could not uncompress data in \"%s\": %s",
+							d->path, ZSTD_getErrorName(status))));
+				if (status == 0)
+					d->finished = true;
+				in_size = in.pos;
+				out_size = out.pos;
+				break;
+			}
+#endif
+			default:
+				elog(ERROR, "unexpected compression algorithm %d", d->algorithm);
+		}
+
+		d->in_pos += in_size;
+		total += out_size;
+	}
+
+	if (stats_enabled)
+		stats_add_time(STATS_COMPRESS_USEC, &start);
+
+	return total;
+}
+
+void
+decompressor_free(pgDecompressor *d)
+{
+	switch (d->algorithm)
+	{
+#ifdef HAVE_LIBZ
+		case COMPRESS_ZLIB:
+			inflateEnd(&d->z);
+			break;
+#endif
+#ifdef USE_LZ4
+		case COMPRESS_LZ4:
+			LZ4F_freeDecompressionContext(d->lz4);
+			break;
+#endif
+#ifdef USE_ZSTD
+		case COMPRESS_ZSTD:
+			ZSTD_freeDCtx(d->zstd);
+			break;
+#endif
+		default:
+			break;
+	}
+
+	free(d->inbuf);
+	free(d);
+}
@@ -0,0 +1,44 @@
+/*-------------------------------------------------------------------------
+ *
+ * config.c: configuration shared by pg_rman and its benchmark.
+ *
+ * The variables are set by the options parsed in pg_rman.c and referenced
+ * by the other modules.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+const char *PROGRAM_VERSION	= "1.3.16";
+const char *PROGRAM_URL		= "http://github.com/ossc-db/pg_rman";
+const char *PROGRAM_ISSUES	= "http://github.com/ossc-db/pg_rman/issues";
+
+/* path configuration */
+char *backup_path;
+char *pgdata;
+char *arclog_path;
+char *srvlog_path;
+char *pgconf_path;
+
+/* common configuration */
+bool verbose = false;
+bool progress = false;
+bool check = false;
+int num_threads = 1;
+bool direct_io = false;
+char *backup_output = NULL;
+bool use_replication = false;
+bool link_unchanged = false;
+int max_rate = 0;
+int max_iops = 0;
+char *tablespace_max_rate = NULL;
+bool verify_checksums = false;
+bool fail_on_checksum_error = false;
+bool resume_backup = false;
+char my_exec_path[MAXPGPATH];	/* path to restore WAL by restore_command */
+
+/* directory configuration */
+pgBackup	current;
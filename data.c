@@ -10,6 +10,7 @@
 
 #include "pg_rman.h"
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
@@ -21,158 +22,10 @@
 #include "storage/block.h"
 #include "storage/bufpage.h"
 #include "storage/checksum.h"
-#include "storage/checksum_impl.h"
 #include "idxpagehdr.h"
 
-#ifdef HAVE_LIBZ
-#include <zlib.h>
-
-#define zlibOutSize 4096
-#define zlibInSize  4096
-
-static int doDeflate(z_stream *zp, size_t in_size, size_t out_size, void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32c *crc, size_t *write_size,
-	int flash);
-static int doInflate(z_stream *zp, size_t in_size, size_t out_size,void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32c *crc, size_t *read_size);
 static BlockNumber figure_out_segno(char *filepath);
 
-static int
-doDeflate(z_stream *zp, size_t in_size, size_t out_size, void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32c *crc, size_t *write_size,
-	int flash)
-{
-	int	status;
-
-	zp->next_in = inbuf;
-	zp->avail_in = in_size;
-
-	/* compresses until an input buffer becomes empty. */
-	do
-	{
-		if (interrupted)
-		{
-			if (in)
-				fclose(in);
-			fclose(out);
-			ereport(FATAL,
-				(errcode(ERROR_INTERRUPTED),
-				 errmsg("interrupted during deflate")));
-		}
-
-		status = deflate(zp, flash);
-
-		if (status == Z_STREAM_ERROR)
-		{
-			if (in)
-				fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not compress data: %s", zp->msg)));
-		}
-
-		if (fwrite(outbuf, 1, out_size - zp->avail_out, out) !=
-				out_size - zp->avail_out)
-		{
-			if (in)
-				fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not write file: %s", strerror(errno))));
-		}
-
-		/* update CRC */
-		PGRMAN_COMP_CRC32(*crc, outbuf, out_size - zp->avail_out);
-
-		*write_size += out_size - zp->avail_out;
-
-		zp->next_out = outbuf;
-		zp->avail_out = out_size;
-	} while (zp->avail_in != 0);
-
-	return status;
-}
-
-static int
-doInflate(z_stream *zp, size_t in_size, size_t out_size,void *inbuf,
-	void *outbuf, FILE *in, FILE *out, pg_crc32c *crc, size_t *read_size)
-{
-	int	status = Z_OK;
-
-	zp->next_out = outbuf;
-	zp->avail_out = out_size;
-
-	/* decompresses until an output buffer becomes full. */
-	for (;;)
-	{
-		if (interrupted)
-			ereport(FATAL,
-				(errcode(ERROR_INTERRUPTED),
-				 errmsg("interrupted during inflate")));
-
-		/* input buffer becomes empty, read it from a file. */
-		if (zp->avail_in == 0)
-		{
-			size_t	read_len;
-
-			read_len = fread(inbuf, 1, in_size, in);
-
-			if (read_len != in_size)
-			{
-				int errno_tmp = errno;
-
-				if (!feof(in))
-				{
-					fclose(in);
-					fclose(out);
-					ereport(ERROR,
-						(errcode(ERROR_CORRUPTED),
-						 errmsg("could not read compress file: %s", strerror(errno_tmp))));
-				}
-
-				if (read_len == 0 && *read_size == 0)
-					return Z_STREAM_END;
-			}
-
-			zp->next_in = inbuf;
-			zp->avail_in = read_len;
-			*read_size += read_len;
-		}
-
-		/* decompresses input file data */
-		status = inflate(zp, Z_NO_FLUSH);
-
-		if (status == Z_STREAM_END)
-		{
-			if (feof(in))
-				break;
-			/* not reached to EOF, read again */
-		}
-		else if (status == Z_OK)
-		{
-			if (zp->avail_out == 0)
-				break;
-			/* more input needed to fill out_buf */
-		}
-		else if (status != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not uncompress data: %s", strerror(errno))));
-		}
-	}
-
-	/* update CRC */
-	PGRMAN_COMP_CRC32(*crc, outbuf, out_size - zp->avail_out);
-
-	return status;
-}
-#endif
-
 /*
  * One page read from a data file.
  */
@@ -248,34 +101,340 @@ parse_page(int blkno,
 	return false;
 }
 
+/*
+ * Returns true if all bytes of the page are zero, as a page of a relation
+ * extended but not written yet.
+ */
+static bool
+page_is_all_zeros(const DataPage *page)
+{
+	const size_t   *words = (const size_t *) page->data;
+	int				i;
+
+	/* quick check, pd_upper of a valid page is never zero */
+	if (page->header.pd_upper != 0)
+		return false;
+
+	for (i = 0; i < BLCKSZ / sizeof(size_t); i++)
+	{
+		if (words[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+/* alignment of the chunk buffers, enough for O_DIRECT */
+#define DATA_CHUNK_ALIGN	4096
+
+/*
+ * Gathers the output of backup_data_file() to write it by one call per
+ * chunk.  With --dedup, the page headers are gathered apart from the page
+ * images, see dedup.c.
+ */
+typedef struct BackupChunkWriter
+{
+	FILE		   *out;
+	const char	   *path;
+	pgCompressor   *comp;		/* NULL if not compressed */
+	bool			dedup;		/* store the chunks by --dedup */
+	CompressAlgorithm	chunk_compress;	/* algorithm of the chunks */
+	pg_crc32c	   *crc;
+	size_t		   *write_size;
+	char		   *buf;		/* DATA_OUTBUF_SIZE bytes */
+	size_t			len;
+	BackupPageHeader   *headers;	/* page headers with --dedup */
+	uint32			nheaders;
+	uint32			max_headers;
+	bool			raw;		/* bytes without header are in buf */
+} BackupChunkWriter;
+
+static char *
+alloc_chunk_buffer(size_t size)
+{
+	void	   *buf;
+	int			rc;
+
+	rc = posix_memalign(&buf, DATA_CHUNK_ALIGN, size);
+	if (rc != 0)
+		ereport(ERROR,
+			(errcode(ERROR_NOMEM),
+			 errmsg("could not allocate memory (%lu bytes): %s",
+				(unsigned long) size, strerror(rc))));
+
+	return buf;
+}
+
+static void
+chunk_writer_init(BackupChunkWriter *w, FILE *out, const char *path,
+				  CompressAlgorithm compress, pg_crc32c *crc,
+				  size_t *write_size)
+{
+	memset(w, 0, sizeof(*w));
+	w->out = out;
+	w->path = path;
+	w->dedup = (current.dedup && !check);
+	w->chunk_compress = compress;
+	w->crc = crc;
+	w->write_size = write_size;
+	w->buf = pgut_malloc(DATA_OUTBUF_SIZE);
+
+	/* with --dedup, each chunk is compressed by itself instead */
+	if (compress != COMPRESS_NONE && !w->dedup)
+		w->comp = compressor_create(compress, current.compress_level, out,
+									path, crc, write_size);
+}
+
+static void
+chunk_writer_flush(BackupChunkWriter *w)
+{
+	if (w->len == 0 && w->nheaders == 0)
+		return;
+
+	if (w->dedup)
+		dedup_write_chunk(w->out, w->path, w->headers, w->nheaders, w->buf,
+						  w->len, w->chunk_compress, w->crc, w->write_size);
+	else if (w->comp)
+		compressor_write(w->comp, w->buf, w->len);
+	else
+	{
+		if (fwrite(w->buf, 1, w->len, w->out) != w->len)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write backup file \"%s\": %s",
+					w->path, strerror(errno))));
+
+		/* update CRC */
+		PGRMAN_COMP_CRC32(*w->crc, w->buf, w->len);
+		*w->write_size += w->len;
+	}
+	w->len = 0;
+	w->nheaders = 0;
+	w->raw = false;
+}
+
+/*
+ * Append a page, i.e. its header and the image of lower_len bytes from
+ * lower and upper_len bytes from upper.  The bytes without header, which
+ * are of a file not a data file, are appended with NULL header.  A page is
+ * never split into two chunks.
+ */
+static void
+chunk_writer_append_page(BackupChunkWriter *w, const BackupPageHeader *header,
+						 const char *lower, size_t lower_len,
+						 const char *upper, size_t upper_len)
+{
+	size_t	header_len = (header ? sizeof(BackupPageHeader) : 0);
+
+	if (w->len + w->nheaders * sizeof(BackupPageHeader) + header_len +
+		lower_len + upper_len > DATA_OUTBUF_SIZE ||
+		(header && w->raw))
+		chunk_writer_flush(w);
+
+	if (header == NULL)
+		w->raw = true;
+	else if (w->dedup)
+	{
+		if (w->nheaders == w->max_headers)
+		{
+			w->max_headers = Max(w->max_headers * 2, DATA_CHUNK_PAGES);
+			w->headers = pgut_realloc(w->headers,
+									  w->max_headers * sizeof(BackupPageHeader));
+		}
+		w->headers[w->nheaders++] = *header;
+	}
+	else
+	{
+		memcpy(w->buf + w->len, header, header_len);
+		w->len += header_len;
+	}
+
+	memcpy(w->buf + w->len, lower, lower_len);
+	w->len += lower_len;
+	memcpy(w->buf + w->len, upper, upper_len);
+	w->len += upper_len;
+}
+
+static void
+chunk_writer_free(BackupChunkWriter *w)
+{
+	free(w->buf);
+	w->buf = NULL;
+	free(w->headers);
+	w->headers = NULL;
+}
+
+/*
+ * Verify the checksums of npages pages in buf read from block start of the
+ * data file at path, and report the pages failed.  A page failed is read
+ * once more from fd first, since it might have been read while written.
+ */
+static void
+verify_data_chunk(int fd, const char *path, char *buf, BlockNumber start,
+				  int npages, BlockNumber segno, PageChecksumResult *results)
+{
+	int		i;
+
+	checksum_verify_pages(buf, npages, start + RELSEG_SIZE * segno,
+						  current.start_lsn, results);
+
+	for (i = 0; i < npages; i++)
+	{
+		char   *page = buf + (size_t) i * BLCKSZ;
+
+		if (results[i] != CHECKSUM_FAILED)
+			continue;
+
+		/* truncated since read, WAL replay truncates it too */
+		if (pread(fd, page, BLCKSZ, (off_t) (start + i) * BLCKSZ) != BLCKSZ)
+		{
+			results[i] = CHECKSUM_SKIPPED;
+			continue;
+		}
+		checksum_verify_pages(page, 1, start + i + RELSEG_SIZE * segno,
+							  current.start_lsn, &results[i]);
+		if (results[i] == CHECKSUM_FAILED)
+			checksum_report_failure(path, start + i);
+	}
+}
+
+/* true if len bytes from p are all zero */
+static bool
+bytes_are_zeros(const char *p, size_t len)
+{
+	size_t	i;
+
+	for (i = 0; i < len; i++)
+	{
+		if (p[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Write the header of a run of npages all-zero pages from block.
+ */
+static void
+append_zero_pages(BackupChunkWriter *w, BlockNumber block, int npages)
+{
+	BackupPageHeader	header;
+
+	Assert(npages > 0 && npages <= PG_UINT16_MAX);
+
+	memset(&header, 0, sizeof(header));
+	header.block = block;
+	header.hole_offset = 0;
+	header.hole_length = BLCKSZ;
+	header.zero_pages = npages;
+	chunk_writer_append_page(w, &header, NULL, 0, NULL, 0);
+}
+
+/*
+ * Open a data file to back up.  With --direct-io, bypass the OS page cache
+ * if the file system allows it.
+ */
+static int
+open_data_file(const char *path)
+{
+#ifdef O_DIRECT
+	if (direct_io)
+	{
+		int		fd;
+
+		fd = open(path, O_RDONLY | PG_BINARY | O_DIRECT, 0);
+
+		/* some file systems, e.g. tmpfs, don't support O_DIRECT */
+		if (fd != -1 || errno != EINVAL)
+			return fd;
+	}
+#endif
+
+	return open(path, O_RDONLY | PG_BINARY, 0);
+}
+
+/*
+ * Read npages pages from blknum into buf.  Returns the number of bytes read,
+ * which is less than requested only at the end of the file, or -1 on error.
+ */
+static ssize_t
+read_data_chunk(int fd, char *buf, BlockNumber blknum, int npages)
+{
+	ssize_t		rc;
+
+	/*
+	 * A read of a regular file is short only at the end of the file, so we
+	 * don't have to continue, which O_DIRECT would refuse at an unaligned
+	 * offset anyway.
+	 */
+	do
+	{
+		rc = pread(fd, buf, (size_t) npages * BLCKSZ, (off_t) blknum * BLCKSZ);
+	} while (rc < 0 && errno == EINTR);
+	stats_add(STATS_DATA_READS, 1);
+
+	return rc;
+}
+
+/*
+ * Release the resources of backup_data_file().
+ */
+static void
+backup_data_file_cleanup(int fd, FILE *out, char *inbuf, BackupChunkWriter *w)
+{
+	if (w->comp)
+		compressor_end(w->comp);
+	free(inbuf);
+	chunk_writer_free(w);
+	close(fd);
+	if (out)
+		fclose(out);
+}
+
 /*
  * Backup data file in the from_root directory to the to_root directory with
  * same relative path.
  * If lsn is not NULL, pages only which are modified after the lsn will be
  * copied.
+ * If blocks is not NULL, only the num_blocks blocks listed in it, which are
+ * known to be modified since the previous backup, are read instead of all
+ * the blocks in the file.
+ *
+ * The file is read by DATA_CHUNK_SIZE, or by runs of consecutive blocks in
+ * blocks, into an aligned buffer, and the pages in the chunk are written at
+ * once.
  */
 bool
 backup_data_file(const char *from_root,
 					const char *to_root,
 					pgFile *file,
 					const XLogRecPtr *lsn,
-					bool compress,
-					bool prev_file_not_found)
+					CompressAlgorithm compress,
+					bool prev_file_not_found,
+					const BlockNumber *blocks,
+					int num_blocks)
 {
 	char				to_path[MAXPGPATH];
-	FILE			   *in;
+	int					in;
 	FILE			   *out;
 	BackupPageHeader	header;
-	DataPage			page;		/* used as read buffer */
-	BlockNumber			blknum;
+	char			   *inbuf;		/* read buffer of DATA_CHUNK_SIZE */
+	DataPage		   *page = NULL;
+	BackupChunkWriter	writer;
+	BlockNumber			blknum = 0;
 	BlockNumber			segno;
-	size_t				read_len;
+	BlockNumber			nblocks = 0;
+	int					i = 0;
+	size_t				read_len = 0;
 	int					errno_tmp = 0;
 	pg_crc32c			crc;
-#ifdef HAVE_LIBZ
-	z_stream			z;
-	char				outbuf[zlibOutSize];
-#endif
+	int64				pages_skipped = 0;
+	int64				pages_with_hole = 0;
+	int64				pages_zero = 0;
+	int					nzero = 0;	/* all-zero pages just before blknum */
+	int					tablespace;
+	bool				verify = (verify_checksums && data_checksum_enabled);
+	PageChecksumResult	results[DATA_CHUNK_PAGES];
+
 	PGRMAN_INIT_CRC32(crc);
 
 	/* reset size summary */
@@ -283,9 +442,9 @@ backup_data_file(const char *from_root,
 	file->write_size = 0;
 
 	/* open backup mode file for read */
-	in = fopen(file->path, "r");
+	in = open_data_file(file->path);
 
-	if (in == NULL)
+	if (in == -1)
 	{
 		PGRMAN_FIN_CRC32(crc);
 		file->crc = crc;
@@ -305,37 +464,21 @@ backup_data_file(const char *from_root,
 		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
 	else
 		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "w");
+	out = sink_open(to_path);
 	if (out == NULL)
 	{
 		errno_tmp = errno;
-		fclose(in);
+		close(in);
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
 			 errmsg("could not open backup file \"%s\": %s", to_path, strerror(errno_tmp))));
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
-	{
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-
-		if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not initialize compression library: %s", z.msg)));
-		}
+	inbuf = alloc_chunk_buffer(DATA_CHUNK_SIZE);
+	chunk_writer_init(&writer, out, to_path, compress, &crc, &file->write_size);
 
-		z.avail_in = 0;
-		z.next_out = (void *) outbuf;
-		z.avail_out = zlibOutSize;
-	}
-#endif
+	/* the padding of the headers is written too */
+	memset(&header, 0, sizeof(header));
 
 	/*
 	 * If this data file is a non-initial segment of a multi-segment relation,
@@ -347,103 +490,187 @@ backup_data_file(const char *from_root,
 	else
 		segno = 0;
 
-	/* read each page and write the page excluding hole */
-	for (blknum = 0;
-		 (read_len = fread(&page, 1, sizeof(page), in)) == sizeof(page);
-		 ++blknum)
-	{
-		XLogRecPtr	page_lsn;
-		int		upper_offset;
-		int		upper_length;
+	tablespace = throttle_tablespace(file->path + strlen(from_root) + 1);
 
-		header.block = blknum;
-		header.endpoint = false;
+	/*
+	 * Blocks appended after this are written after the backup started, so
+	 * they are restored by WAL replay.
+	 */
+	if (blocks)
+	{
+		struct stat	st;
 
-		/*
-		 * If a invalid data page was found, fallback to simple copy to ensure
-		 * all pages in the file don't have BackupPageHeader.
-		 */
-		if (!parse_page(blknum, &page, &page_lsn, &header.hole_offset,
-						&header.hole_length))
+		if (fstat(in, &st) == -1)
 		{
-			if (verbose)
-				elog(DEBUG, "%s fall back to simple copy", file->path);
-			fclose(in);
-			fclose(out);
-			file->is_datafile = false;
-			return copy_file(from_root, to_root, file,
-							 compress ? COMPRESSION : NO_COMPRESSION);
+			errno_tmp = errno;
+			backup_data_file_cleanup(in, out, inbuf, &writer);
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not stat backup mode file \"%s\": %s",
+					file->path, strerror(errno_tmp))));
 		}
+		nblocks = st.st_size / BLCKSZ;
+	}
+#ifdef USE_POSIX_FADVISE
+	else
+		(void) posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 
-		file->read_size += read_len;
-
-		/* if the page has not been modified since last backup, skip it */
-		if (!prev_file_not_found && lsn && !XLogRecPtrIsInvalid(page_lsn) && page_lsn < *lsn)
-			continue;
-
-		/*
-		 * Re-calculate checksum disregarding the hole portion of the page
-		 * and overwrite the value curently present in pd_checksum.
-		 *
-		 * Note: Zero'ing the hole portion is necessary, because that's what
-		 * it will contain once the page is restored into the target
-		 * database.
-		 */
-		memset(page.data + header.hole_offset, 0, header.hole_length);
-		if (data_checksum_enabled)
-			((PageHeader) page.data)->pd_checksum =
-										pg_checksum_page((char *) page.data,
-											 blknum + RELSEG_SIZE * segno);
-
-		upper_offset = header.hole_offset + header.hole_length;
-		upper_length = BLCKSZ - upper_offset;
+	/* read pages chunk by chunk and write them excluding hole */
+	for (;;)
+	{
+		BlockNumber	start;
+		int			npages;
+		ssize_t		nread;
+		int			j;
 
-#ifdef HAVE_LIBZ
-		if (compress)
+		if (blocks)
 		{
-			doDeflate(&z, sizeof(header), sizeof(outbuf), &header, outbuf, in,
-					  out, &crc, &file->write_size, Z_NO_FLUSH);
-			doDeflate(&z, header.hole_offset, sizeof(outbuf), page.data, outbuf,
-					  in, out, &crc, &file->write_size, Z_NO_FLUSH);
-			doDeflate(&z, upper_length, sizeof(outbuf),
-					  page.data + upper_offset, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
+			/* read only the modified blocks, consecutive ones at once */
+			if (i >= num_blocks || blocks[i] >= nblocks)
+			{
+				blknum = nblocks;
+				read_len = 0;
+				break;
+			}
+			start = blocks[i++];
+			npages = 1;
+			while (i < num_blocks && npages < DATA_CHUNK_PAGES &&
+				   blocks[i] == start + npages && blocks[i] < nblocks)
+			{
+				npages++;
+				i++;
+			}
 		}
 		else
-#endif
 		{
-			/* write data page excluding hole */
-			if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
-				fwrite(page.data, 1, header.hole_offset, out) != header.hole_offset ||
-				fwrite(page.data + upper_offset, 1, upper_length, out) != upper_length)
-			{
-				errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not write at block %u of \"%s\": %s",
-						blknum, to_path, strerror(errno_tmp))));
-			}
-
-			/* update CRC */
-			PGRMAN_COMP_CRC32(crc, &header, sizeof(header));
-			PGRMAN_COMP_CRC32(crc, page.data, header.hole_offset);
-			PGRMAN_COMP_CRC32(crc, page.data + upper_offset, upper_length);
+			start = blknum;
+			npages = DATA_CHUNK_PAGES;
+		}
 
-			file->write_size += sizeof(header) + read_len - header.hole_length;
+		throttle_read(tablespace, (size_t) npages * BLCKSZ);
+		nread = read_data_chunk(in, inbuf, start, npages);
+		if (nread < 0)
+		{
+			errno_tmp = errno;
+			backup_data_file_cleanup(in, out, inbuf, &writer);
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read backup mode file \"%s\": %s",
+					file->path, strerror(errno_tmp))));
 		}
 
-	}
-	errno_tmp = errno;
-	if (!feof(in))
-	{
-		fclose(in);
-		fclose(out);
-		ereport(ERROR,
-			(errcode(ERROR_SYSTEM),
-			 errmsg("could not read backup mode file \"%s\": %s", file->path, strerror(errno_tmp))));
+		/* verify the pages of the chunk at once before modifying them */
+		if (verify)
+			verify_data_chunk(in, file->path + strlen(from_root) + 1, inbuf,
+							  start, nread / BLCKSZ, segno, results);
+
+		for (j = 0; j < nread / BLCKSZ; j++)
+		{
+			XLogRecPtr	page_lsn;
+			int			upper_offset;
+			int			upper_length;
+
+			page = (DataPage *) (inbuf + (size_t) j * BLCKSZ);
+			blknum = start + j;
+
+			/*
+			 * Gather all-zero pages, which parse_page() doesn't accept, into a
+			 * run instead of falling back to copy them.  They have no LSN, so
+			 * they are written even in incremental backup.
+			 */
+			if (page_is_all_zeros(page))
+			{
+				nzero++;
+				file->read_size += BLCKSZ;
+				continue;
+			}
+			if (nzero > 0)
+			{
+				append_zero_pages(&writer, blknum - nzero, nzero);
+				pages_zero += nzero;
+				nzero = 0;
+			}
+
+			header.block = blknum;
+			header.endpoint = false;
+
+			/*
+			 * If a invalid data page was found, fallback to simple copy to
+			 * ensure all pages in the file don't have BackupPageHeader.
+			 */
+			if (!parse_page(blknum, page, &page_lsn, &header.hole_offset,
+							&header.hole_length))
+			{
+				if (verbose)
+					elog(DEBUG, "%s fall back to simple copy", file->path);
+				backup_data_file_cleanup(in, out, inbuf, &writer);
+				file->is_datafile = false;
+				if (current.dedup && !check)
+					return backup_dedup_file(from_root, to_root, file,
+											 compress);
+				return copy_file(from_root, to_root, file,
+								 compress != COMPRESS_NONE ? COMPRESSION : NO_COMPRESSION,
+								 compress);
+			}
+
+			file->read_size += BLCKSZ;
+
+			/* if the page has not been modified since last backup, skip it */
+			if (!prev_file_not_found && lsn && !XLogRecPtrIsInvalid(page_lsn) && page_lsn < *lsn)
+			{
+				pages_skipped++;
+				continue;
+			}
+			if (header.hole_length > 0)
+				pages_with_hole++;
+
+			/*
+			 * Re-calculate checksum disregarding the hole portion of the page
+			 * and overwrite the value curently present in pd_checksum.
+			 *
+			 * Note: Zero'ing the hole portion is necessary, because that's
+			 * what it will contain once the page is restored into the target
+			 * database.  The checksum verified stays valid if the hole has
+			 * been zeros already, as it usually is.
+			 */
+			if (!verify || results[j] != CHECKSUM_OK ||
+				!bytes_are_zeros(page->data + header.hole_offset,
+								 header.hole_length))
+			{
+				memset(page->data + header.hole_offset, 0, header.hole_length);
+				if (data_checksum_enabled)
+					((PageHeader) page->data)->pd_checksum =
+						pg_checksum_page((char *) page->data,
+										 blknum + RELSEG_SIZE * segno);
+			}
+
+			upper_offset = header.hole_offset + header.hole_length;
+			upper_length = BLCKSZ - upper_offset;
+
+			/* write data page excluding hole */
+			chunk_writer_append_page(&writer, &header,
+									 page->data, header.hole_offset,
+									 page->data + upper_offset, upper_length);
+		}
+		if (nzero > 0)
+		{
+			append_zero_pages(&writer, start + j - nzero, nzero);
+			pages_zero += nzero;
+			nzero = 0;
+		}
+		chunk_writer_flush(&writer);
+
+		/* the end of the file is found */
+		if (nread < (ssize_t) npages * BLCKSZ)
+		{
+			blknum = start + nread / BLCKSZ;
+			read_len = nread % BLCKSZ;
+			page = (DataPage *) (inbuf + (size_t) (nread / BLCKSZ) * BLCKSZ);
+			break;
+		}
+
+		blknum = start + npages;
 	}
 
 	/*
@@ -458,58 +685,19 @@ backup_data_file(const char *from_root,
 		 * Otherwise treat the page as a datapage with no hole.
 		 */
 		if (blknum == 0)
+		{
 			file->is_datafile = false;
+			chunk_writer_append_page(&writer, NULL, page->data, read_len,
+									 NULL, 0);
+		}
 		else
 		{
+			/* write odd size page image */
 			header.block = blknum;
 			header.hole_offset = 0;
 			header.hole_length = 0;
-
-#ifdef HAVE_LIBZ
-			if (compress)
-				doDeflate(&z, sizeof(header), sizeof(outbuf), &header, outbuf,
-					in, out, &crc, &file->write_size, Z_NO_FLUSH);
-			else
-#endif
-			{
-				if (fwrite(&header, 1, sizeof(header), out) != sizeof(header))
-				{
-					errno_tmp = errno;
-					/* oops */
-					fclose(in);
-					fclose(out);
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not write at block %u of \"%s\": %s",
-							blknum, to_path, strerror(errno_tmp))));
-				}
-				PGRMAN_COMP_CRC32(crc, &header, sizeof(header));
-				file->write_size += sizeof(header);
-			}
-		}
-
-		/* write odd size page image */
-#ifdef HAVE_LIBZ
-		if (compress)
-			doDeflate(&z, read_len, sizeof(outbuf), page.data, outbuf, in, out,
-				&crc, &file->write_size, Z_NO_FLUSH);
-		else
-#endif
-		{
-			if (fwrite(page.data, 1, read_len, out) != read_len)
-			{
-				errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not write at block %u of \"%s\": %s",
-						blknum, to_path, strerror(errno_tmp))));
-			}
-
-			PGRMAN_COMP_CRC32(crc, page.data, read_len);
-			file->write_size += read_len;
+			chunk_writer_append_page(&writer, &header, page->data, read_len,
+									 NULL, 0);
 		}
 
 		file->read_size += read_len;
@@ -527,368 +715,1449 @@ backup_data_file(const char *from_root,
 	{
 		header.block = ++blknum;
 		header.endpoint = true;
+		chunk_writer_append_page(&writer, &header, NULL, 0, NULL, 0);
+	}
+	chunk_writer_flush(&writer);
+
+	/*
+	 * finalize the compressed stream.
+	 *
+	 * NOTE: This writes the trailer only if some pages or the special page
+	 * header have been written.
+	 */
+	if (writer.comp)
+	{
+		compressor_end(writer.comp);
+		writer.comp = NULL;
+	}
+
+	/* don't leave the file in the page cache */
+#ifdef USE_POSIX_FADVISE
+	if (direct_io)
+		(void) posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+	/* out is kept open to be discarded or closed below */
+	backup_data_file_cleanup(in, NULL, inbuf, &writer);
+
+	stats_add(STATS_PAGES_READ, file->read_size / BLCKSZ);
+	stats_add(STATS_PAGES_SKIPPED, pages_skipped);
+	stats_add(STATS_PAGES_WITH_HOLE, pages_with_hole);
+	stats_add(STATS_PAGES_ZERO, pages_zero);
+
+	/* finish CRC calculation and store into pgFile */
+	PGRMAN_FIN_CRC32(crc);
+	file->crc = crc;
+
+	/* Treat empty file as not-datafile */
+	if (file->read_size == 0 && (blocks == NULL || nblocks == 0))
+		file->is_datafile = false;
+
+	/* We do not backup if all pages skipped. */
+	if (file->write_size == 0 && file->read_size > 0)
+	{
+		sink_discard(out, to_path);
+		return false;
+	}
+
+	/*
+	 * update file permission
+	 * FIXME: Should set permission on open?
+	 */
+	if (sink_close(out, to_path, FILE_PERMISSION) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup file \"%s\": %s", to_path,
+				strerror(errno))));
+
+	/* remove $BACKUP_PATH/tmp created during check */
+	if (check)
+		remove(to_path);
+
+	return true;
+}
+
+/*
+ * Writer of the pages of a data file which are given one by one instead of
+ * read from the file, i.e. the blocks of an incremental file or a whole
+ * data file sent by BASE_BACKUP.  The result is the same as
+ * backup_data_file() of the file with only the given blocks modified since
+ * the previous backup.
+ */
+struct pgPageWriter
+{
+	pgFile			   *file;
+	char				to_path[MAXPGPATH];
+	FILE			   *out;
+	BackupChunkWriter	writer;
+	BlockNumber			segno;
+	XLogRecPtr			lsn;		/* skip the pages older than this */
+	pg_crc32c			crc;
+};
+
+/*
+ * Start writing the backup of file into to_path.  If lsn is not NULL, the
+ * pages not modified since the lsn are skipped as in backup_data_file().
+ */
+pgPageWriter *
+page_writer_open(const char *to_path, pgFile *file, CompressAlgorithm compress,
+				 const XLogRecPtr *lsn)
+{
+	pgPageWriter   *w = pgut_new(pgPageWriter);
+
+	PGRMAN_INIT_CRC32(w->crc);
+	w->file = file;
+	w->lsn = lsn ? *lsn : InvalidXLogRecPtr;
+	file->read_size = 0;
+	file->write_size = 0;
+	file->is_datafile = true;
+
+	strlcpy(w->to_path, to_path, lengthof(w->to_path));
+	w->out = sink_open(w->to_path);
+	if (w->out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open backup file \"%s\": %s", w->to_path,
+				strerror(errno))));
+
+	chunk_writer_init(&w->writer, w->out, w->to_path, compress, &w->crc,
+					  &file->write_size);
+
+	/* see backup_data_file() */
+	w->segno = data_checksum_enabled ? figure_out_segno(file->path) : 0;
+
+	return w;
+}
+
+/*
+ * Write the BLCKSZ bytes of the block blknum, which must be larger than the
+ * block written last.  The page is modified as in backup_data_file().
+ */
+void
+page_writer_write(pgPageWriter *w, BlockNumber blknum, char *data)
+{
+	DataPage		   *page = (DataPage *) data;
+	BackupPageHeader	header;
+	XLogRecPtr			page_lsn;
+	int					upper_offset;
+
+	w->file->read_size += BLCKSZ;
+
+	if (page_is_all_zeros(page))
+	{
+		append_zero_pages(&w->writer, blknum, 1);
+		return;
+	}
+
+	memset(&header, 0, sizeof(header));
+	header.block = blknum;
+	header.endpoint = false;
+
+	/*
+	 * Unlike backup_data_file(), we can't fall back to copy the whole file,
+	 * so a page which doesn't look like a data page is written without hole.
+	 */
+	if (parse_page(blknum, page, &page_lsn, &header.hole_offset,
+				   &header.hole_length))
+	{
+		/* if the page has not been modified since last backup, skip it */
+		if (!XLogRecPtrIsInvalid(w->lsn) && !XLogRecPtrIsInvalid(page_lsn) &&
+			page_lsn < w->lsn)
+			return;
+
+		memset(page->data + header.hole_offset, 0, header.hole_length);
+		if (data_checksum_enabled)
+			((PageHeader) page->data)->pd_checksum =
+				pg_checksum_page(page->data, blknum + RELSEG_SIZE * w->segno);
+	}
+
+	upper_offset = header.hole_offset + header.hole_length;
+	chunk_writer_append_page(&w->writer, &header,
+							 page->data, header.hole_offset,
+							 page->data + upper_offset, BLCKSZ - upper_offset);
+}
+
+/*
+ * Finish the backup, with the endpoint of the relation of nblocks blocks in
+ * incremental backup mode.  The results are stored into the pgFile.
+ */
+void
+page_writer_close(pgPageWriter *w, BlockNumber nblocks)
+{
+	if (current.backup_mode == BACKUP_MODE_INCREMENTAL)
+	{
+		BackupPageHeader	header;
+
+		memset(&header, 0, sizeof(header));
+		header.block = nblocks + 1;
+		header.endpoint = true;
+		chunk_writer_append_page(&w->writer, &header, NULL, 0, NULL, 0);
+	}
+	chunk_writer_flush(&w->writer);
+	if (w->writer.comp)
+		compressor_end(w->writer.comp);
+	chunk_writer_free(&w->writer);
+
+	PGRMAN_FIN_CRC32(w->crc);
+	w->file->crc = w->crc;
+	stats_add(STATS_BYTES_WRITTEN, w->file->write_size);
+
+	if (sink_close(w->out, w->to_path, FILE_PERMISSION) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup file \"%s\": %s", w->to_path,
+				strerror(errno))));
+
+	free(w);
+}
+
+/*
+ * Writer of a file which is not a data file, the contents of which are given
+ * in parts instead of read from the file, i.e. a file sent by BASE_BACKUP.
+ * The result is the same as copy_file(), or backup_dedup_file() with
+ * --dedup.
+ */
+struct pgCopyWriter
+{
+	pgFile			   *file;
+	char				to_path[MAXPGPATH];
+	FILE			   *out;
+	BackupChunkWriter	writer;
+	pg_crc32c			crc;
+};
+
+/*
+ * Start writing the backup of file into to_path.
+ */
+pgCopyWriter *
+copy_writer_open(const char *to_path, pgFile *file, CompressAlgorithm compress)
+{
+	pgCopyWriter   *w = pgut_new(pgCopyWriter);
+
+	PGRMAN_INIT_CRC32(w->crc);
+	w->file = file;
+	file->read_size = 0;
+	file->write_size = 0;
+	file->is_datafile = false;
+
+	strlcpy(w->to_path, to_path, lengthof(w->to_path));
+	w->out = sink_open(w->to_path);
+	if (w->out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open destination file \"%s\": %s",
+				w->to_path, strerror(errno))));
+
+	chunk_writer_init(&w->writer, w->out, w->to_path, compress, &w->crc,
+					  &file->write_size);
+
+	return w;
+}
+
+/*
+ * Write the next len bytes of the file.  They are gathered into chunks of
+ * DATA_CHUNK_SIZE, which are stored by --dedup as by backup_dedup_file().
+ */
+void
+copy_writer_write(pgCopyWriter *w, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		size_t	n = Min(len, DATA_CHUNK_SIZE - w->writer.len);
+
+		chunk_writer_append_page(&w->writer, NULL, data, n, NULL, 0);
+		if (w->writer.len == DATA_CHUNK_SIZE)
+			chunk_writer_flush(&w->writer);
+		w->file->read_size += n;
+
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Finish the backup.  The results are stored into the pgFile.
+ */
+void
+copy_writer_close(pgCopyWriter *w)
+{
+	chunk_writer_flush(&w->writer);
+	if (w->writer.comp)
+		compressor_end(w->writer.comp);
+	chunk_writer_free(&w->writer);
+
+	PGRMAN_FIN_CRC32(w->crc);
+	w->file->crc = w->crc;
+	stats_add(STATS_BYTES_WRITTEN, w->file->write_size);
+
+	if (sink_close(w->out, w->to_path, w->file->mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", w->to_path,
+				strerror(errno))));
+
+	free(w);
+}
+
+/*
+ * Reader of the pages in a backup of a data file, written by
+ * backup_data_file().  If raw is set, the backup is a copy of the whole
+ * file instead, whose pages are read in turn.
+ */
+typedef struct BackupPageReader
+{
+	const char	   *path;
+	FILE		   *in;
+	char		   *iobuf;		/* stdio buffer of in */
+	pgDecompressor *decomp;		/* NULL if the backup is not compressed */
+	bool			dedup;		/* the backup lists chunks by --dedup */
+	bool			raw;		/* the backup has no BackupPageHeader */
+	CompressAlgorithm	chunk_compress;
+	char		   *chunk;		/* current chunk, DATA_OUTBUF_SIZE bytes */
+	size_t			chunk_len;
+	size_t			chunk_pos;
+	BlockNumber		blknum;		/* lower bound of the next block number */
+	size_t			read_size;
+	pg_crc32c		crc;		/* CRC of the backup read so far */
+} BackupPageReader;
+
+static void
+open_backup_page_reader(BackupPageReader *reader, const char *path,
+						CompressAlgorithm compress)
+{
+	reader->path = path;
+	reader->decomp = NULL;
+	reader->raw = false;
+	reader->blknum = 0;
+	reader->read_size = 0;
+	PGRMAN_INIT_CRC32(reader->crc);
+
+	/* open backup mode file for read */
+	reader->in = fopen(path, "r");
+	if (reader->in == NULL)
+	{
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open backup file \"%s\": %s", path,
+				strerror(errno))));
+	}
+
+	/* read the backup by large chunks instead of BUFSIZ */
+	reader->iobuf = pgut_malloc(DATA_CHUNK_SIZE);
+	setvbuf(reader->in, reader->iobuf, _IOFBF, DATA_CHUNK_SIZE);
+
+	/* the chunks are compressed by themselves, but the list is not */
+	reader->chunk = NULL;
+	reader->chunk_len = reader->chunk_pos = 0;
+	reader->dedup = dedup_open_ref(reader->in, path, &reader->chunk_compress,
+								   &reader->crc);
+	if (reader->dedup)
+		reader->chunk = pgut_malloc(DATA_OUTBUF_SIZE);
+	else if (compress != COMPRESS_NONE)
+		reader->decomp = decompressor_create(compress, reader->in, path,
+											 &reader->read_size, &reader->crc);
+}
+
+/*
+ * Copy len bytes from the chunks of a backup written by --dedup.  A page
+ * never spans chunks, so the next chunk is loaded only at the beginning of
+ * a page, i.e. if next is true.  Returns false at the end of the backup.
+ */
+static bool
+read_chunk_bytes(BackupPageReader *reader, void *dst, size_t len, bool next)
+{
+	if (next && reader->chunk_pos == reader->chunk_len)
+	{
+		if (!dedup_read_chunk(reader->in, reader->path, reader->chunk_compress,
+							  reader->chunk, DATA_OUTBUF_SIZE,
+							  &reader->chunk_len, &reader->crc))
+			return false;
+		reader->chunk_pos = 0;
+	}
+
+	if (reader->chunk_len - reader->chunk_pos < len)
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("chunk of \"%s\" is broken at block %u", reader->path,
+				reader->blknum)));
+	memcpy(dst, reader->chunk + reader->chunk_pos, len);
+	reader->chunk_pos += len;
 
-#ifdef HAVE_LIBZ
-		if (compress)
+	return true;
+}
+
+/*
+ * Read the next page from the backup.  The hole of the page is filled with
+ * zeros.  Returns false at the end of the backup.  If header->endpoint is
+ * set, the page is not read and no more page follows.  If the header is of
+ * a run of all-zero pages, see IsZeroPagesHeader(), the page is not read
+ * either.
+ */
+static bool
+read_backup_page(BackupPageReader *reader, BackupPageHeader *header,
+				 DataPage *page)
+{
+	size_t		read_len;
+	int			upper_offset;
+	int			upper_length;
+	BlockNumber	blknum = reader->blknum;
+
+	memset(header, 0, sizeof(BackupPageHeader));
+
+	/* a short page at the end of the copy is filled with zeros */
+	if (reader->raw)
+	{
+		if (reader->dedup)
 		{
-			doDeflate(&z, sizeof(header), sizeof(outbuf), &header, outbuf, in,
-					  out, &crc, &file->write_size, Z_NO_FLUSH);
+			/* chunks of a copy are of DATA_CHUNK_SIZE but the last one */
+			read_len = 0;
+			if (reader->chunk_pos < reader->chunk_len ||
+				read_chunk_bytes(reader, page->data, 0, true))
+			{
+				read_len = Min(BLCKSZ, reader->chunk_len - reader->chunk_pos);
+				read_chunk_bytes(reader, page->data, read_len, false);
+			}
 		}
+		else if (reader->decomp)
+			read_len = decompressor_read(reader->decomp, page->data, BLCKSZ);
 		else
-#endif
 		{
-		    if (fwrite(&header, 1, sizeof(header), out) != sizeof(header))
-			{
-				errno_tmp = errno;
-				/* oops */
-				fclose(in);
-				fclose(out);
+			read_len = fread(page->data, 1, BLCKSZ, reader->in);
+			if (ferror(reader->in))
 				ereport(ERROR,
 					(errcode(ERROR_SYSTEM),
-					 errmsg("could not write at block %u of \"%s\": %s to put endpoint",
-						blknum, to_path, strerror(errno_tmp))));
-			}
-			PGRMAN_COMP_CRC32(crc, &header, sizeof(header));
-
-			file->write_size += sizeof(header);
+					 errmsg("could not read block %u of \"%s\": %s",
+						blknum, reader->path, strerror(errno))));
+			PGRMAN_COMP_CRC32(reader->crc, page->data, read_len);
 		}
+		if (read_len == 0)
+			return false;
+		memset(page->data + read_len, 0, BLCKSZ - read_len);
+		header->block = reader->blknum++;
+		return true;
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
+	/* read BackupPageHeader */
+	if (reader->dedup)
 	{
-		/*
-		 * finalize zstream.
-		 *
-		 * NOTE: We need to do this even if we didn't read anything from the
-		 * file but still had to write the special page header.
-		 */
-		if (file->read_size > 0 || header.endpoint)
+		if (!read_chunk_bytes(reader, header, sizeof(*header), true))
+			return false;
+	}
+	else if (reader->decomp)
+	{
+		read_len = decompressor_read(reader->decomp, header, sizeof(*header));
+
+		/* when the stream ends, no more block follows */
+		if (read_len == 0)
+			return false;
+		if (read_len != sizeof(*header))
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("backup has a broken header")));
+	}
+	else
+	{
+		read_len = fread(header, 1, sizeof(*header), reader->in);
+		if (read_len != sizeof(*header))
 		{
-			while (doDeflate(&z, 0, sizeof(outbuf), NULL, outbuf, in, out, &crc,
-							 &file->write_size, Z_FINISH) != Z_STREAM_END)
-			{
-			}
+			int errno_tmp = errno;
+
+			if (read_len == 0 && feof(reader->in))
+				return false;		/* EOF found */
+			else if (read_len != 0 && feof(reader->in))
+				ereport(ERROR,
+					(errcode(ERROR_CORRUPTED),
+					 errmsg("odd size page found at block %u of \"%s\"",
+						blknum, reader->path)));
+			else
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not read block %u of \"%s\": %s",
+						blknum, reader->path, strerror(errno_tmp))));
 		}
+		PGRMAN_COMP_CRC32(reader->crc, header, sizeof(*header));
+	}
+
+	if (header->endpoint)
+		return true;
+
+	if (IsZeroPagesHeader(header))
+	{
+		if (header->block < blknum || header->hole_offset != 0 ||
+			header->zero_pages == 0)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("backup is broken at block %u", blknum)));
+		reader->blknum = header->block + header->zero_pages;
+		return true;
+	}
+
+	if (header->block < blknum || header->hole_offset > BLCKSZ ||
+		(int) header->hole_offset + (int) header->hole_length > BLCKSZ)
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("backup is broken at block %u", blknum)));
+
+	upper_offset = header->hole_offset + header->hole_length;
+	upper_length = BLCKSZ - upper_offset;
+
+	/* read lower/upper into page->data and restore hole */
+	memset(page->data + header->hole_offset, 0, header->hole_length);
+
+	if (reader->dedup)
+	{
+		read_chunk_bytes(reader, page->data, header->hole_offset, false);
+		read_chunk_bytes(reader, page->data + upper_offset, upper_length, false);
+	}
+	else if (reader->decomp)
+	{
+		if (decompressor_read(reader->decomp, page->data,
+							  header->hole_offset) != header->hole_offset ||
+			decompressor_read(reader->decomp, page->data + upper_offset,
+							  upper_length) != upper_length)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("could not read block %u of \"%s\"", blknum,
+					reader->path)));
+	}
+	else
+	{
+		if (fread(page->data, 1, header->hole_offset, reader->in) != header->hole_offset ||
+			fread(page->data + upper_offset, 1, upper_length, reader->in) != upper_length)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read block %u of \"%s\": %s",
+					blknum, reader->path, strerror(errno))));
+		PGRMAN_COMP_CRC32(reader->crc, page->data, header->hole_offset);
+		PGRMAN_COMP_CRC32(reader->crc, page->data + upper_offset, upper_length);
+	}
+
+	reader->blknum = header->block + 1;
+
+	return true;
+}
+
+/*
+ * Update crc with the rest of the backup file, which the reader doesn't need
+ * but is covered by the CRC in the file list.
+ */
+static void
+read_rest_of_backup(FILE *in, const char *path, pg_crc32c *crc)
+{
+	char	buf[BLCKSZ];
+	size_t	len;
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+		PGRMAN_COMP_CRC32(*crc, buf, len);
+	if (ferror(in))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read backup file \"%s\": %s", path,
+				strerror(errno))));
+}
+
+/*
+ * Check the CRC of the backup file computed while restoring it against the
+ * one recorded in the file list, so that a broken backup is not restored
+ * silently.
+ */
+void
+check_backup_file_crc(const char *path, pg_crc32c expected, pg_crc32c crc)
+{
+	if (!PGRMAN_EQ_CRC32(crc, expected))
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("CRC of backup file \"%s\" must be %X but %X",
+				path, expected, crc)));
+}
+
+/*
+ * Close the reader after verifying the whole backup against file->crc.
+ */
+static void
+close_backup_page_reader(BackupPageReader *reader, const pgFile *file)
+{
+	read_rest_of_backup(reader->in, reader->path, &reader->crc);
+	PGRMAN_FIN_CRC32(reader->crc);
+	check_backup_file_crc(reader->path, file->crc, reader->crc);
+
+	if (reader->decomp)
+		decompressor_free(reader->decomp);
+
+	fclose(reader->in);
+	free(reader->iobuf);
+	free(reader->chunk);
+}
+
+/*
+ * Restore target file.  Restored pages of consecutive blocks are gathered
+ * into buf and written by one call.
+ *
+ * With --delta, the file existing in $PGDATA is kept and a restored page is
+ * written only if it differs from the existing one, which is read into cmp
+ * by DATA_CHUNK_SIZE.
+ */
+typedef struct RestoreTarget
+{
+	const char	   *path;
+	int				fd;
+	char		   *buf;		/* DATA_CHUNK_SIZE bytes, allocated on demand */
+	BlockNumber		start;		/* block number of the first page in buf */
+	int				npages;		/* number of pages in buf */
+	bool			delta;		/* compare with the existing file */
+	BlockNumber		existing_blocks;	/* blocks of the existing file */
+	BlockNumber		nblocks;	/* blocks restored, the rest are truncated */
+	char		   *cmp;		/* DATA_CHUNK_SIZE bytes, allocated on demand */
+	BlockNumber		cmp_start;	/* block number of the first page in cmp */
+	int				cmp_npages;	/* number of pages in cmp */
+} RestoreTarget;
+
+/*
+ * Open the restore target file for write.  The existing file is not
+ * truncated to overwrite only modified pages for incremental restore.
+ * With delta, it is also read to compare the restored pages with.
+ */
+static void
+open_restore_target(RestoreTarget *target, const char *to_path, bool delta)
+{
+	struct stat	st;
+
+	memset(target, 0, sizeof(RestoreTarget));
+	target->path = to_path;
+	target->delta = delta;
+
+	target->fd = open(to_path, (delta ? O_RDWR : O_WRONLY) | O_CREAT | PG_BINARY,
+					  S_IRUSR | S_IWUSR);
+	if (target->fd == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open restore target file \"%s\": %s",
+				to_path, strerror(errno))));
+
+	if (delta)
+	{
+		if (fstat(target->fd, &st) == -1)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not stat \"%s\": %s", to_path,
+					strerror(errno))));
+		target->existing_blocks = (st.st_size + BLCKSZ - 1) / BLCKSZ;
+	}
+}
+
+/*
+ * Return true if the existing page of blknum in the restore target file is
+ * the same as page.  The existing pages are read by DATA_CHUNK_SIZE, since
+ * pages are restored in ascending order mostly.  Each block is compared only
+ * once, so the pages in cmp need not follow the writes.
+ */
+static bool
+restored_page_is_unchanged(RestoreTarget *target, BlockNumber blknum,
+						   const DataPage *page)
+{
+	if (blknum >= target->existing_blocks)
+		return false;
+
+	if (blknum < target->cmp_start ||
+		blknum >= target->cmp_start + target->cmp_npages)
+	{
+		int		npages = Min(DATA_CHUNK_PAGES, target->existing_blocks - blknum);
+		ssize_t	len;
+
+		if (target->cmp == NULL)
+			target->cmp = pgut_malloc(DATA_CHUNK_SIZE);
+
+		len = pread(target->fd, target->cmp, (size_t) npages * BLCKSZ,
+					(off_t) blknum * BLCKSZ);
+		if (len < 0)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read block %u of \"%s\": %s",
+					blknum, target->path, strerror(errno))));
+		stats_add(STATS_BYTES_READ, len);
+
+		target->cmp_start = blknum;
+		target->cmp_npages = len / BLCKSZ;
+		if (target->cmp_npages == 0)
+			return false;
+	}
+
+	return memcmp(target->cmp + (size_t) (blknum - target->cmp_start) * BLCKSZ,
+				  page->data, BLCKSZ) == 0;
+}
+
+/*
+ * Write the gathered pages into the restore target file.
+ */
+static void
+flush_restore_target(RestoreTarget *target)
+{
+	size_t	len = (size_t) target->npages * BLCKSZ;
+	size_t	done = 0;
 
-		if (deflateEnd(&z) != Z_OK)
+	while (done < len)
+	{
+		ssize_t	rc;
+
+		rc = pwrite(target->fd, target->buf + done, len - done,
+					(off_t) target->start * BLCKSZ + done);
+		if (rc < 0 && errno == EINTR)
+			continue;
+		if (rc <= 0)
 		{
-			fclose(in);
-			fclose(out);
+			/* if write didn't set errno, assume problem is no disk space */
+			if (rc == 0)
+				errno = ENOSPC;
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
-				 errmsg("could not close compression stream: %s", z.msg)));
+				 errmsg("could not write block %u of \"%s\": %s",
+					(BlockNumber) (target->start + done / BLCKSZ),
+					target->path, strerror(errno))));
 		}
+		done += rc;
+	}
+	stats_add(STATS_BYTES_WRITTEN, len);
+
+	target->npages = 0;
+}
+
+/*
+ * Write the restored page. Backup might have holes in incremental backups.
+ *
+ * Note that a valid checksum was already set by backup_data_file(),
+ * considering the zero'ing of the hole.  See comments in that function.
+ */
+static void
+write_restored_page(RestoreTarget *target, BlockNumber blknum,
+					const DataPage *page)
+{
+	target->nblocks = Max(target->nblocks, blknum + 1);
+
+	if (target->delta && restored_page_is_unchanged(target, blknum, page))
+	{
+		stats_add(STATS_PAGES_SKIPPED, 1);
+		return;
+	}
+
+	if (target->npages > 0 &&
+		(blknum != target->start + target->npages ||
+		 target->npages >= DATA_CHUNK_PAGES))
+		flush_restore_target(target);
+
+	if (target->buf == NULL)
+		target->buf = pgut_malloc(DATA_CHUNK_SIZE);
+
+	if (target->npages == 0)
+		target->start = blknum;
+	memcpy(target->buf + (size_t) target->npages * BLCKSZ, page->data, BLCKSZ);
+	target->npages++;
+}
+
+/*
+ * Make len bytes from offset of the restore target file all zeros by
+ * punching a hole, or by writing zeros if the file system doesn't support
+ * it.
+ */
+static void
+zero_restore_target(RestoreTarget *target, off_t offset, off_t len)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (fallocate(target->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  offset, len) == 0)
+		return;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not punch hole in \"%s\": %s", target->path,
+				strerror(errno))));
+#endif
+	{
+		static const DataPage	zeros;
+		BlockNumber				start = offset / BLCKSZ;
+		BlockNumber				blknum;
+
+		for (blknum = start; blknum < start + len / BLCKSZ; blknum++)
+			write_restored_page(target, blknum, &zeros);
+		flush_restore_target(target);
 	}
+}
+
+/*
+ * Return true if len bytes from offset of the restore target file are in a
+ * hole already, which reads as zeros.
+ */
+static bool
+restore_target_is_hole(RestoreTarget *target, off_t offset, off_t len)
+{
+#ifdef SEEK_DATA
+	off_t	data = lseek(target->fd, offset, SEEK_DATA);
+
+	/* no data after offset */
+	if (data == -1)
+		return errno == ENXIO;
+	return data >= offset + len;
+#else
+	return false;
 #endif
+}
+
+/*
+ * Make npages blocks from start all zeros without writing them.  The part of
+ * the file existing already is zeroed by zero_restore_target(), and the file
+ * is extended over the rest which then reads as zeros.  With delta, the
+ * existing blocks are compared as the restored pages are, and only the runs
+ * of blocks which are not zeros yet are zeroed.
+ */
+static void
+write_zero_pages(RestoreTarget *target, BlockNumber start, int npages)
+{
+	off_t		offset = (off_t) start * BLCKSZ;
+	off_t		end = offset + (off_t) npages * BLCKSZ;
+	struct stat	st;
+
+	target->nblocks = Max(target->nblocks, start + npages);
+	flush_restore_target(target);
+
+	if (fstat(target->fd, &st) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not stat \"%s\": %s", target->path,
+				strerror(errno))));
+
+	if (st.st_size > offset)
+	{
+		off_t	len = Min(st.st_size, end) - offset;
+
+		if (!target->delta)
+			zero_restore_target(target, offset, len);
+		else if (restore_target_is_hole(target, offset, len))
+			stats_add(STATS_PAGES_SKIPPED, (len + BLCKSZ - 1) / BLCKSZ);
+		else
+		{
+			static const DataPage	zeros;
+			BlockNumber				last = (offset + len - 1) / BLCKSZ;
+			BlockNumber				run = InvalidBlockNumber;
+			BlockNumber				blknum;
+
+			for (blknum = start; blknum <= last; blknum++)
+			{
+				if (!restored_page_is_unchanged(target, blknum, &zeros))
+				{
+					if (run == InvalidBlockNumber)
+						run = blknum;
+					continue;
+				}
+				stats_add(STATS_PAGES_SKIPPED, 1);
+				if (run != InvalidBlockNumber)
+					zero_restore_target(target, (off_t) run * BLCKSZ,
+										(off_t) (blknum - run) * BLCKSZ);
+				run = InvalidBlockNumber;
+			}
+			if (run != InvalidBlockNumber)
+				zero_restore_target(target, (off_t) run * BLCKSZ,
+									offset + len - (off_t) run * BLCKSZ);
+		}
+	}
+
+	if (st.st_size < end && ftruncate(target->fd, end) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not extend file \"%s\": %s", target->path,
+				strerror(errno))));
+}
+
+/*
+ * Truncate the restore target file to nblocks blocks.
+ */
+static void
+truncate_restore_target(RestoreTarget *target, BlockNumber nblocks)
+{
+	flush_restore_target(target);
+
+	if (ftruncate(target->fd, (off_t) nblocks * BLCKSZ) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not truncate file \"%s\": %s", target->path,
+				strerror(errno))));
+
+	target->nblocks = nblocks;
+	target->existing_blocks = Min(target->existing_blocks, nblocks);
+}
+
+/*
+ * Write the rest of pages, change the mode and close the restore target file.
+ * With delta, the blocks of the existing file after the restored ones are
+ * truncated.
+ */
+static void
+close_restore_target(RestoreTarget *target, mode_t mode)
+{
+	if (target->delta && target->existing_blocks > target->nblocks)
+		truncate_restore_target(target, target->nblocks);
 
-	/*
-	 * update file permission
-	 * FIXME: Should set permission on open?
-	 */
-	if (!check && chmod(to_path, FILE_PERMISSION) == -1)
-	{
-		errno_tmp = errno;
+	flush_restore_target(target);
+	free(target->buf);
+	free(target->cmp);
 
-		fclose(in);
-		fclose(out);
+	if (close(target->fd) == -1)
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
-			 errmsg("could not change mode of \"%s\": %s", file->path, strerror(errno_tmp))));
-	}
+			 errmsg("could not close \"%s\": %s", target->path,
+				strerror(errno))));
 
-	fclose(in);
-	fclose(out);
+	/* update file permission */
+	if (chmod(target->path, mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", target->path,
+				strerror(errno))));
+}
 
-	/* finish CRC calculation and store into pgFile */
-	PGRMAN_FIN_CRC32(crc);
-	file->crc = crc;
+/*
+ * Restore a file which is not a data file backed up by backup_dedup_file(),
+ * i.e. write the chunks it lists in order.
+ */
+static void
+restore_dedup_file(const char *from_root, const char *to_root, pgFile *file)
+{
+	char				to_path[MAXPGPATH];
+	BackupPageReader	reader;
+	FILE			   *out;
 
-	/* Treat empty file as not-datafile */
-	if (file->read_size == 0)
-		file->is_datafile = false;
+	open_backup_page_reader(&reader, file->path, COMPRESS_NONE);
+	Assert(reader.dedup);
 
-	/* We do not backup if all pages skipped. */
-	if (file->write_size == 0 && file->read_size > 0)
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = fopen(to_path, PG_BINARY_W);
+	if (out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open restore target file \"%s\": %s",
+				to_path, strerror(errno))));
+
+	while (dedup_read_chunk(reader.in, reader.path, reader.chunk_compress,
+							reader.chunk, DATA_OUTBUF_SIZE, &reader.chunk_len,
+							&reader.crc))
 	{
-		if (remove(to_path) == -1)
+		if (fwrite(reader.chunk, 1, reader.chunk_len, out) != reader.chunk_len)
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
-				 errmsg("could not remove file \"%s\": %s", to_path, strerror(errno))));
-		return false;
+				 errmsg("could not write to \"%s\": %s", to_path,
+					strerror(errno))));
 	}
+	if (fclose(out) == EOF)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write to \"%s\": %s", to_path,
+				strerror(errno))));
 
-	/* remove $BACKUP_PATH/tmp created during check */
-	if (check)
-		remove(to_path);
+	close_backup_page_reader(&reader, file);
 
-	return true;
+	/* update file permission */
+	if (chmod(to_path, file->mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", to_path,
+				strerror(errno))));
 }
 
 /*
  * Restore files in the from_root directory to the to_root directory with
- * same relative path.
+ * same relative path.  With delta, only the pages of a data file differing
+ * from the existing file are written.
  */
 void
 restore_data_file(const char *from_root,
 				  const char *to_root,
 				  pgFile *file,
-				  bool compress)
+				  CompressAlgorithm compress,
+				  bool delta)
 {
 	char				to_path[MAXPGPATH];
-	FILE			   *in;
-	FILE			   *out;
+	RestoreTarget		target;
+	BackupPageReader	reader;
 	BackupPageHeader	header;
-	BlockNumber			blknum;
-#ifdef HAVE_LIBZ
-	z_stream			z;
-	int					status;
-	char				inbuf[zlibInSize];
-	pg_crc32c			crc;
-	size_t				read_size;
-#endif
+	DataPage			page;
 
 	/* If the file is not a datafile, just copy it. */
 	if (!file->is_datafile)
 	{
-		copy_file(from_root, to_root, file,
-			compress ? DECOMPRESSION : NO_COMPRESSION);
+		pg_crc32c	crc = file->crc;
+
+		if (dedup_file_is_ref(file->path))
+		{
+			restore_dedup_file(from_root, to_root, file);
+			return;
+		}
+
+		if (copy_file(from_root, to_root, file,
+				compress != COMPRESS_NONE ? DECOMPRESSION : NO_COMPRESSION,
+				compress))
+			check_backup_file_crc(file->path, crc, file->crc);
 		return;
 	}
 
-	/* open backup mode file for read */
-	in = fopen(file->path, "r");
-	if (in == NULL)
-	{
-		ereport(ERROR,
-			(errcode(ERROR_SYSTEM),
-			 errmsg("could not open backup file \"%s\": %s", file->path,
-				strerror(errno))));
-	}
+	open_backup_page_reader(&reader, file->path, compress);
 
-	/*
-	 * Open backup file for write. We use "r+" at first to overwrite only
-	 * modified pages for incremental restore. If the file is not exists,
-	 * re-open it with "w" to create an empty file.
-	 */
 	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
-	out = fopen(to_path, "r+");
+	open_restore_target(&target, to_path, delta);
 
-	if (out == NULL && errno == ENOENT)
-		out = fopen(to_path, "w");
-
-	if (out == NULL)
+	while (read_backup_page(&reader, &header, &page))
 	{
-		int errno_tmp = errno;
+		if (header.endpoint)
+		{
+			/*
+			 * endpoint means there are no pages any more at the point of
+			 * incremental backup, so truncate it.
+			 * This process is necessary for preventing unexpected deleted
+			 * data comeback which happens when a vacuum shrink relations
+			 * between a full backup and an incremental backup.
+			 */
+			elog(DEBUG, "truncating file. %s blknum: %d", to_path, header.block);
+			truncate_restore_target(&target, header.block - 1);
+			break;
+		}
 
-		fclose(in);
-		ereport(ERROR,
-			(errcode(ERROR_SYSTEM),
-			 errmsg("could not open restore target file \"%s\": %s",
-				to_path, strerror(errno_tmp))));
+		if (IsZeroPagesHeader(&header))
+			write_zero_pages(&target, header.block, header.zero_pages);
+		else
+			write_restored_page(&target, header.block, &page);
 	}
 
-#ifdef HAVE_LIBZ
-	if (compress)
+	close_backup_page_reader(&reader, file);
+	close_restore_target(&target, file->mode);
+}
+
+/*
+ * Mark blknum in the bitmap of blocks written by restore_data_file_merged().
+ * Returns false if it has been marked already.
+ */
+static bool
+mark_block_written(uint8 **written, size_t *written_len, BlockNumber blknum)
+{
+	if (blknum / 8 < *written_len &&
+		((*written)[blknum / 8] & (1 << (blknum % 8))) != 0)
+		return false;
+
+	if (blknum / 8 >= *written_len)
 	{
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-		z.next_in = Z_NULL;
-		z.avail_in = 0;
+		size_t	newlen = Max(*written_len * 2, blknum / 8 + 1);
 
-		if (inflateInit(&z) != Z_OK)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not initialize compression library: %s", z.msg)));
-		PGRMAN_INIT_CRC32(crc);
-		read_size = 0;
+		*written = pgut_realloc(*written, newlen);
+		memset(*written + *written_len, 0, newlen - *written_len);
+		*written_len = newlen;
 	}
-#endif
+	(*written)[blknum / 8] |= (1 << (blknum % 8));
+
+	return true;
+}
+
+/*
+ * Restore a data file from the images backed up by a chain of a full backup
+ * and following incremental backups at once.  sources must be ordered from
+ * the newest one, and all of them must be data files.
+ *
+ * The result is the same as restoring each image with restore_data_file()
+ * from the oldest one, but every block is written only once: the newest
+ * image of the block wins, and blocks truncated by the endpoint of a newer
+ * image are discarded.  With delta, see restore_data_file().
+ */
+void
+restore_data_file_merged(const char *to_root, pgRestoreSource *sources,
+						 int num_sources, bool delta)
+{
+	char				to_path[MAXPGPATH];
+	RestoreTarget		target;
+	BackupPageReader	reader;
+	BackupPageHeader	header;
+	DataPage			page;
+	BlockNumber			limit = InvalidBlockNumber;	/* blocks at and after
+													 * this are truncated */
+	BlockNumber			nblocks = InvalidBlockNumber;
+	uint8			   *written = NULL;	/* bitmap of written blocks */
+	size_t				written_len = 0;
+	int					i;
 
-	for (blknum = 0; ; blknum++)
+	Assert(num_sources > 0);
+
+	join_path_components(to_path, to_root,
+		sources[0].file->path + strlen(sources[0].from_root) + 1);
+	open_restore_target(&target, to_path, delta);
+
+	for (i = 0; i < num_sources; i++)
 	{
-		size_t		read_len;
-		DataPage	page;		/* used as read buffer */
-		int			upper_offset;
-		int			upper_length;
+		Assert(sources[i].file->is_datafile);
 
-		/* read BackupPageHeader */
-#ifdef HAVE_LIBZ
-		if (compress)
+		open_backup_page_reader(&reader, sources[i].file->path,
+								sources[i].compress);
+
+		while (read_backup_page(&reader, &header, &page))
 		{
-			status = doInflate(&z, sizeof(inbuf), sizeof(header), inbuf,
-						&header, in, out, &crc, &read_size);
+			BlockNumber	blknum = header.block;
 
-			/* when the stream ends, proceed to next block unless the block is
-			 * flagged as endpoint, which needs an additional truncation process.*/
-			if (status == Z_STREAM_END && !header.endpoint)
+			if (header.endpoint)
 			{
-				if (z.avail_out != sizeof(header))
-					ereport(ERROR,
-						(errcode(ERROR_CORRUPTED),
-						 errmsg("backup has a broken header")));
+				/* see the comments in restore_data_file() */
+				if (i == 0)
+					nblocks = header.block - 1;
+				limit = Min(limit, header.block - 1);
 				break;
 			}
 
-			if (z.avail_out != 0)
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not read block %u of \"%s\"", blknum, file->path)));
-		}
-		else
-#endif
-		{
-			read_len = fread(&header, 1, sizeof(header), in);
-			if (read_len != sizeof(header))
+			if (IsZeroPagesHeader(&header))
 			{
-				int errno_tmp = errno;
-
-				if (read_len == 0 && feof(in))
-					break;		/* EOF found */
-				else if (read_len != 0 && feof(in))
-					ereport(ERROR,
-						(errcode(ERROR_CORRUPTED),
-						 errmsg("odd size page found at block %u of \"%s\"",
-							blknum, file->path)));
-				else
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not read block %u of \"%s\": %s",
-							blknum, file->path, strerror(errno_tmp))));
+				BlockNumber	end = header.block + header.zero_pages;
+				BlockNumber	run = blknum;	/* start of the blocks to zero */
+
+				/* zero the blocks not written by newer images by runs */
+				for (; blknum <= end; blknum++)
+				{
+					if (blknum < end && blknum < limit &&
+						mark_block_written(&written, &written_len, blknum))
+						continue;
+					if (blknum > run)
+						write_zero_pages(&target, run, blknum - run);
+					run = blknum + 1;
+				}
+				continue;
 			}
-		}
-		if (header.endpoint)
-		{
-		/*
-		 * endpoint means there are no pages any more at the point of
-		 * incremental backup, so truncate it.
-		 * This process is necessary for preventing unexpected deleted
-		 * data comeback which happens when a vacuum shrink relations
-		 * between a full backup and an incremental backup.
-		 */
-		    blknum = header.block;
-			elog(DEBUG, "truncating file. %s blknum: %d", to_path, blknum);
-			if(truncate(to_path, (blknum - 1) * BLCKSZ) == -1)
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not truncate file \"%s\": %s", to_path, strerror(errno))));
-			break;
+
+			if (blknum >= limit)
+				continue;
+
+			/* a newer image of the block has been written already */
+			if (!mark_block_written(&written, &written_len, blknum))
+				continue;
+
+			write_restored_page(&target, blknum, &page);
 		}
 
-		if (header.block < blknum || header.hole_offset > BLCKSZ ||
-			(int) header.hole_offset + (int) header.hole_length > BLCKSZ)
-			ereport(ERROR,
-				(errcode(ERROR_CORRUPTED),
-				 errmsg("backup is broken at block %u", blknum)));
+		close_backup_page_reader(&reader, sources[i].file);
+	}
+
+	free(written);
 
-		upper_offset = header.hole_offset + header.hole_length;
-		upper_length = BLCKSZ - upper_offset;
+	if (nblocks != InvalidBlockNumber)
+	{
+		elog(DEBUG, "truncating file. %s blknum: %u", to_path, nblocks + 1);
+		truncate_restore_target(&target, nblocks);
+	}
 
-		/* read lower/upper into page.data and restore hole */
-		memset(page.data + header.hole_offset, 0, header.hole_length);
+	close_restore_target(&target, sources[0].file->mode);
+}
 
-#ifdef HAVE_LIBZ
-		if (compress)
-		{
-			if (verbose)
-				elog(DEBUG, "starting decompress file: %s", file->path);
+/* an image read by merge_data_file() */
+typedef struct MergeSource
+{
+	BackupPageReader	reader;
+	BackupPageHeader	header;		/* current header, of the rest of a run
+									 * of all-zero pages */
+	DataPage			page;
+	bool				done;
+	BlockNumber			limit;		/* blocks at and after this are truncated
+									 * by the endpoint of a newer image */
+} MergeSource;
+
+/*
+ * Return the block number of the current header of the image.  That of an
+ * endpoint is the number of blocks it truncates the relation to.
+ */
+static BlockNumber
+merge_source_block(const MergeSource *source)
+{
+	if (source->header.endpoint)
+		return source->header.block - 1;
+	return source->header.block;
+}
+
+/*
+ * Move the image on to the next block.
+ */
+static void
+merge_source_next(MergeSource *source)
+{
+	if (IsZeroPagesHeader(&source->header) && source->header.zero_pages > 1)
+	{
+		source->header.block++;
+		source->header.zero_pages--;
+	}
+	else if (!read_backup_page(&source->reader, &source->header, &source->page))
+		source->done = true;
+}
+
+/*
+ * Write npages all-zero pages from block into the backup by runs.
+ */
+static void
+merge_write_zero_pages(pgPageWriter *w, BlockNumber block, BlockNumber npages)
+{
+	while (npages > 0)
+	{
+		int		n = Min(npages, PG_UINT16_MAX);
+
+		append_zero_pages(&w->writer, block, n);
+		stats_add(STATS_PAGES_ZERO, n);
+		block += n;
+		npages -= n;
+	}
+}
+
+/*
+ * Write the backup of a data file at to_path in the format of a full
+ * backup, from the images taken by a chain of a full backup and following
+ * incremental backups.  sources must be ordered from the newest one, and
+ * an image which is not of a data file is read as a copy of the whole file.
+ * The results are stored into file as page_writer_open() does.
+ *
+ * Every image has the pages in ascending order, so the images are read in
+ * parallel and for each block the page of the newest image is written, as
+ * restore_data_file_merged() restores it.  The blocks missing in all of the
+ * images are written as all-zero pages so that the result has every block.
+ */
+void
+merge_data_file(const char *to_path, pgFile *file, pgRestoreSource *sources,
+				int num_sources, CompressAlgorithm compress)
+{
+	MergeSource	   *images;
+	pgPageWriter   *w;
+	BlockNumber		next = 0;		/* blocks written so far */
+	BlockNumber		zero_start = 0;	/* run of all-zero pages to write */
+	BlockNumber		zero_count = 0;
+	BlockNumber		nblocks = InvalidBlockNumber;	/* truncated by the
+													 * newest image */
+	int				i;
+
+	Assert(num_sources > 0);
+
+	images = pgut_newarray(MergeSource, num_sources);
+	for (i = 0; i < num_sources; i++)
+	{
+		open_backup_page_reader(&images[i].reader, sources[i].file->path,
+								sources[i].compress);
+		images[i].reader.raw = !sources[i].file->is_datafile;
+		images[i].limit = InvalidBlockNumber;
+		images[i].done = false;
+		memset(&images[i].header, 0, sizeof(BackupPageHeader));
+		if (!read_backup_page(&images[i].reader, &images[i].header,
+							  &images[i].page))
+			images[i].done = true;
+	}
+
+	w = page_writer_open(to_path, file, compress, NULL);
+
+	for (;;)
+	{
+		MergeSource	   *best = NULL;
+		BlockNumber		blknum = InvalidBlockNumber;
+		int				best_index = -1;
 
-			if (header.hole_offset > 0)
+		/*
+		 * Take the lowest block, from the newest image having it.  An
+		 * endpoint goes first so that the blocks it truncates are discarded.
+		 */
+		for (i = 0; i < num_sources; i++)
+		{
+			BlockNumber	block;
+
+			if (images[i].done)
+				continue;
+			block = merge_source_block(&images[i]);
+			if (best == NULL || block < blknum ||
+				(block == blknum && images[i].header.endpoint &&
+				 !best->header.endpoint))
 			{
-				doInflate(&z, sizeof(inbuf), header.hole_offset, inbuf,
-					page.data, in, out, &crc, &read_size);
-				if (z.avail_out != 0)
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not read block %u of \"%s\"", blknum, file->path)));
+				best = &images[i];
+				best_index = i;
+				blknum = block;
 			}
+		}
+		if (best == NULL)
+			break;
+
+		if (best->header.endpoint)
+		{
+			/* see the comments in restore_data_file() */
+			if (best_index == 0)
+				nblocks = blknum;
+			for (i = best_index + 1; i < num_sources; i++)
+				images[i].limit = Min(images[i].limit, blknum);
+			best->done = true;
+			continue;
+		}
 
-			if (upper_length > 0)
+		if (blknum < best->limit)
+		{
+			/* fill the blocks in no image with zeros */
+			if (IsZeroPagesHeader(&best->header) ||
+				page_is_all_zeros(&best->page))
 			{
-				doInflate(&z, sizeof(inbuf), upper_length, inbuf,
-					page.data + upper_offset, in, out, &crc, &read_size);
-				if (z.avail_out != 0)
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not read block %u of \"%s\"", blknum, file->path)));
+				if (zero_count == 0)
+					zero_start = next;
+				zero_count += blknum + 1 - next;
 			}
+			else
+			{
+				if (zero_count == 0 && blknum > next)
+					zero_start = next;
+				zero_count += blknum - next;
+				if (zero_count > 0)
+					merge_write_zero_pages(w, zero_start, zero_count);
+				zero_count = 0;
+				page_writer_write(w, blknum, best->page.data);
+			}
+			next = blknum + 1;
 		}
-		else
-#endif
+
+		/* the older images of the block are overwritten */
+		for (i = best_index; i < num_sources; i++)
 		{
-			if (fread(page.data, 1, header.hole_offset, in) != header.hole_offset ||
-				fread(page.data + upper_offset, 1, upper_length, in) != upper_length)
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not read block %u of \"%s\": %s",
-						blknum, file->path, strerror(errno))));
+			if (!images[i].done && !images[i].header.endpoint &&
+				merge_source_block(&images[i]) == blknum)
+				merge_source_next(&images[i]);
 		}
+	}
 
-		/*
-		 * Seek and write the restored page. Backup might have holes in
-		 * incremental backups.
-		 */
-		blknum = header.block;
-		if (fseek(out, blknum * BLCKSZ, SEEK_SET) < 0)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not seek block %u of \"%s\": %s",
-					blknum, to_path, strerror(errno))));
+	/* file may be the entry of an image, so verify them before writing it */
+	for (i = 0; i < num_sources; i++)
+		close_backup_page_reader(&images[i].reader, sources[i].file);
+	free(images);
 
-		/*
-		 * Note that a valid checksum was already set by backup_data_file(),
-		 * considering the zero'ing of the hole.  See comments in that
-		 * function.
-		 */
-		if (fwrite(page.data, 1, sizeof(page), out) != sizeof(page))
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not write block %u of \"%s\": %s",
-					blknum, file->path, strerror(errno))));
+	/* the relation may have been extended by the truncation */
+	if (nblocks == InvalidBlockNumber)
+		nblocks = next;
+	if (nblocks > next)
+	{
+		if (zero_count == 0)
+			zero_start = next;
+		zero_count += nblocks - next;
 	}
+	if (zero_count > 0)
+		merge_write_zero_pages(w, zero_start, zero_count);
+	page_writer_close(w, nblocks);
+
+	file->is_entire = false;
+}
+
+/*
+ * Copy the backup of a file at from_path, compressed by from, into to_path
+ * compressed by to.  Both are COMPRESS_NONE to copy the backup as is, e.g.
+ * written by --dedup.  The CRC of the source is verified against file->crc,
+ * and then file->write_size and file->crc are set to those of the copy.
+ */
+void
+convert_backup_file(const char *from_path, const char *to_path, pgFile *file,
+					CompressAlgorithm from, CompressAlgorithm to)
+{
+	FILE		   *in;
+	FILE		   *out;
+	char			buf[8192];
+	size_t			len;
+	size_t			read_size = 0;
+	pg_crc32c		in_crc;
+	pg_crc32c		out_crc;
+	pgCompressor   *comp = NULL;
+	pgDecompressor *decomp = NULL;
+
+	PGRMAN_INIT_CRC32(in_crc);
+	PGRMAN_INIT_CRC32(out_crc);
+	file->write_size = 0;
 
-#ifdef HAVE_LIBZ
-	if (compress && inflateEnd(&z) != Z_OK)
+	in = fopen(from_path, "r");
+	if (in == NULL)
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
-			 errmsg("could not close compression stream: %s", z.msg)));
-#endif
-
-	/* update file permission */
-	if (chmod(to_path, file->mode) == -1)
-	{
-		int errno_tmp = errno;
-		fclose(in);
-		fclose(out);
+			 errmsg("could not open backup file \"%s\": %s", from_path,
+				strerror(errno))));
+	out = sink_open(to_path);
+	if (out == NULL)
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
-			 errmsg("could not change mode of \"%s\": %s", to_path,
-				strerror(errno_tmp))));
+			 errmsg("could not open backup file \"%s\": %s", to_path,
+				strerror(errno))));
+
+	if (from != COMPRESS_NONE)
+		decomp = decompressor_create(from, in, from_path, &read_size, &in_crc);
+	if (to != COMPRESS_NONE)
+		comp = compressor_create(to, current.compress_level, out, to_path,
+								 &out_crc, &file->write_size);
+
+	for (;;)
+	{
+		if (decomp)
+			len = decompressor_read(decomp, buf, sizeof(buf));
+		else
+		{
+			len = fread(buf, 1, sizeof(buf), in);
+			if (ferror(in))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not read backup file \"%s\": %s",
+						from_path, strerror(errno))));
+			PGRMAN_COMP_CRC32(in_crc, buf, len);
+		}
+		if (len == 0)
+			break;
+
+		if (comp)
+			compressor_write(comp, buf, len);
+		else
+		{
+			if (fwrite(buf, 1, len, out) != len)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not write to \"%s\": %s", to_path,
+						strerror(errno))));
+			PGRMAN_COMP_CRC32(out_crc, buf, len);
+			file->write_size += len;
+		}
 	}
 
+	if (comp)
+		compressor_end(comp);
+	if (decomp)
+	{
+		/* see copy_file() */
+		read_rest_of_backup(in, from_path, &in_crc);
+		decompressor_free(decomp);
+	}
 	fclose(in);
-	fclose(out);
+
+	PGRMAN_FIN_CRC32(in_crc);
+	check_backup_file_crc(from_path, file->crc, in_crc);
+	PGRMAN_FIN_CRC32(out_crc);
+	file->crc = out_crc;
+
+	if (sink_close(out, to_path, FILE_PERMISSION) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup file \"%s\": %s", to_path,
+				strerror(errno))));
 }
 
+/*
+ * Copy the file into to_root, compressing or decompressing it by mode.
+ * file->crc is set to the CRC of the backup side, i.e. of the written data
+ * on backup and of the read data on restore, so that the caller can check
+ * it against the file list on restore.  Returns false if file is missing.
+ */
 bool
 copy_file(const char *from_root, const char *to_root, pgFile *file,
-	CompressionMode mode)
+	CompressionMode mode, CompressAlgorithm algorithm)
 {
 	char		to_path[MAXPGPATH];
 	FILE	   *in;
 	FILE	   *out;
 	size_t		read_len = 0;
+	size_t		want = 0;
+	off_t		limit = -1;
 	int			errno_tmp = 0;
 	char		buf[8192];
 	struct stat	st;
 	pg_crc32c	crc;
-#ifdef HAVE_LIBZ
-	z_stream	z;
-	int			status;
-	char		outbuf[zlibOutSize];
-	char		inbuf[zlibInSize];
-#endif
+	pgCompressor   *comp = NULL;
+	pgDecompressor *decomp = NULL;
+	int			tablespace;
+
 	PGRMAN_INIT_CRC32(crc);
 
 	/* reset size summary */
@@ -908,8 +2177,19 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
-			 errmsg("could not open source file \"%s\": %s", file->path,
-				strerror(errno))));
+			 errmsg("could not open source file \"%s\": %s", file->path,
+				strerror(errno))));
+	}
+
+	/* stat source file to change mode of destination file */
+	if (fstat(fileno(in), &st) == -1)
+	{
+		errno_tmp = errno;
+		fclose(in);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not execute stat \"%s\": %s", file->path,
+				strerror(errno_tmp))));
 	}
 
 	/* open backup file for write  */
@@ -918,7 +2198,18 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 	else
 		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
 
-	out = fopen(to_path, "w");
+	/*
+	 * A plain copy into the stream has the size in its tar header, so copy
+	 * just the size at the fstat() above, like BASE_BACKUP does for a file
+	 * changed while being sent.  The rest are replayed from WAL on restore.
+	 */
+	if (algorithm == COMPRESS_NONE && sink_is_streamed(to_path))
+	{
+		limit = st.st_size;
+		out = sink_open_sized(to_path, limit, st.st_mode);
+	}
+	else
+		out = sink_open(to_path);
 	if (out == NULL)
 	{
 		errno_tmp = errno;
@@ -929,70 +2220,21 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 				to_path, strerror(errno_tmp))));
 	}
 
-	/* stat source file to change mode of destination file */
-	if (fstat(fileno(in), &st) == -1)
-	{
-		fclose(in);
-		fclose(out);
-		ereport(ERROR,
-			(errcode(ERROR_SYSTEM),
-			 errmsg("could not execute stat \"%s\": %s", file->path, strerror(errno))));
-	}
-
-#ifdef HAVE_LIBZ
-	z.zalloc = Z_NULL;
-	z.zfree = Z_NULL;
-	z.opaque = Z_NULL;
-
-	if (mode == COMPRESSION)
-	{
-		if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not initialize compression library: %s", z.msg)));
-		}
-
-		z.avail_in = 0;
-		z.next_out = (void *) outbuf;
-		z.avail_out = zlibOutSize;
-	}
-	else if (mode == DECOMPRESSION)
-	{
-		z.next_in = Z_NULL;
-		z.avail_in = 0;
-		if (inflateInit(&z) != Z_OK)
-		{
-			fclose(in);
-			fclose(out);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not  initialize compression library: %s", z.msg)));
-		}
-	}
-#endif
+	if (mode == COMPRESSION && algorithm != COMPRESS_NONE)
+		comp = compressor_create(algorithm, current.compress_level, out,
+								 to_path, &crc, &file->write_size);
+	else if (mode == DECOMPRESSION && algorithm != COMPRESS_NONE)
+		decomp = decompressor_create(algorithm, in, file->path,
+									 &file->read_size, &crc);
+	tablespace = throttle_tablespace(file->path + strlen(from_root) + 1);
 
 	/* copy content and calc CRC */
 	for (;;)
 	{
-#ifdef HAVE_LIBZ
-		if (mode == COMPRESSION)
-		{
-			if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
-				break;
-
-			doDeflate(&z, read_len, sizeof(outbuf), buf, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
-			file->read_size += sizeof(buf);
-		}
-		else if (mode == DECOMPRESSION)
+		if (decomp)
 		{
-			status = doInflate(&z, sizeof(inbuf), sizeof(outbuf), inbuf, outbuf,
-						in, out, &crc, &file->read_size);
-			if (fwrite(outbuf, 1, sizeof(outbuf) - z.avail_out, out) !=
-					sizeof(outbuf) - z.avail_out)
+			read_len = decompressor_read(decomp, buf, sizeof(buf));
+			if (read_len > 0 && fwrite(buf, 1, read_len, out) != read_len)
 			{
 				errno_tmp = errno;
 				/* oops */
@@ -1003,17 +2245,27 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 					 errmsg("could not write to \"%s\": %s", to_path,
 						strerror(errno_tmp))));
 			}
-
-			file->write_size += sizeof(outbuf) - z.avail_out;
-			if (status == Z_STREAM_END)
+			file->write_size += read_len;
+			if (read_len != sizeof(buf))
+			{
+				/* the odd part has been written already */
+				read_len = 0;
 				break;
+			}
+			continue;
 		}
+
+		want = sizeof(buf);
+		if (limit >= 0 && limit - (off_t) file->read_size < (off_t) want)
+			want = limit - file->read_size;
+		throttle_read(tablespace, want);
+		if ((read_len = fread(buf, 1, want, in)) != sizeof(buf))
+			break;
+
+		if (comp)
+			compressor_write(comp, buf, read_len);
 		else
-#endif
 		{
-			if ((read_len = fread(buf, 1, sizeof(buf), in)) != sizeof(buf))
-				break;
-
 			if (fwrite(buf, 1, read_len, out) != read_len)
 			{
 				errno_tmp = errno;
@@ -1029,11 +2281,11 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 			PGRMAN_COMP_CRC32(crc, buf, read_len);
 
 			file->write_size += sizeof(buf);
-			file->read_size += sizeof(buf);
 		}
+		file->read_size += sizeof(buf);
 	}
 	errno_tmp = errno;
-	if (!feof(in))
+	if (decomp == NULL && read_len < want && !feof(in))
 	{
 		fclose(in);
 		fclose(out);
@@ -1046,14 +2298,9 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 	/* copy odd part. */
 	if (read_len > 0)
 	{
-#ifdef HAVE_LIBZ
-		if (mode == COMPRESSION)
-		{
-			doDeflate(&z, read_len, sizeof(outbuf), buf, outbuf, in, out, &crc,
-					  &file->write_size, Z_NO_FLUSH);
-		}
+		if (comp)
+			compressor_write(comp, buf, read_len);
 		else
-#endif
 		{
 			if (fwrite(buf, 1, read_len, out) != read_len)
 			{
@@ -1075,60 +2322,326 @@ copy_file(const char *from_root, const char *to_root, pgFile *file,
 		file->read_size += read_len;
 	}
 
-#ifdef HAVE_LIBZ
-	if (mode == COMPRESSION)
+	/* the file shrunk after fstat(), fill up to the size in the tar header */
+	while (limit >= 0 && (off_t) file->write_size < limit)
 	{
-		if (file->read_size > 0)
-		{
-			while (doDeflate(&z, 0, sizeof(outbuf), NULL, outbuf, in, out, &crc,
-							 &file->write_size, Z_FINISH) != Z_STREAM_END)
-			{
-			}
-		}
-
-		if (deflateEnd(&z) != Z_OK)
+		read_len = Min(sizeof(buf), limit - file->write_size);
+		memset(buf, 0, read_len);
+		if (fwrite(buf, 1, read_len, out) != read_len)
 		{
+			errno_tmp = errno;
 			fclose(in);
 			fclose(out);
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
-				 errmsg("could not close compression stream: %s", z.msg)));
+				 errmsg("could not write to \"%s\": %s", to_path,
+					strerror(errno_tmp))));
 		}
+		PGRMAN_COMP_CRC32(crc, buf, read_len);
+		file->write_size += read_len;
+	}
+
+	if (comp)
+		compressor_end(comp);
+	if (decomp)
+	{
+		/* CRC of the compressed file covers also the rest after the stream */
+		read_rest_of_backup(in, file->path, &crc);
+		decompressor_free(decomp);
+	}
+
+	/* finish CRC calculation and store into pgFile */
+	PGRMAN_FIN_CRC32(crc);
+	file->crc = crc;
+
+	/* update file permission */
+	fclose(in);
+	if (sink_close(out, to_path, st.st_mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", to_path,
+				strerror(errno))));
+
+	if (check)
+		remove(to_path);
+
+	return true;
+}
+
+/*
+ * Archived WAL segments are read in chunks of this size, i.e. in one read
+ * for the default wal_segment_size.
+ */
+#define WAL_CHUNK_SIZE		(16 * 1024 * 1024)
+
+/*
+ * Copy an archived WAL segment into the backup, compressed with compress
+ * unless it's COMPRESS_NONE.  Unlike copy_file(), which is for files of
+ * any size, the segment is read and written in chunks of WAL_CHUNK_SIZE
+ * without stdio, and dropped from the page cache after copying as it will
+ * not be read again soon.  Returns false if file is missing.
+ */
+bool
+backup_wal_file(const char *from_root, const char *to_root, pgFile *file,
+				CompressAlgorithm compress)
+{
+	char			to_path[MAXPGPATH];
+	int				in;
+	FILE		   *out;
+	char		   *buf;
+	size_t			bufsize;
+	struct stat		st;
+	pg_crc32c		crc;
+	pgCompressor   *comp = NULL;
+	int				errno_tmp;
+
+	PGRMAN_INIT_CRC32(crc);
+
+	/* reset size summary */
+	file->read_size = 0;
+	file->write_size = 0;
+
+	in = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (in == -1)
+	{
+		PGRMAN_FIN_CRC32(crc);
+		file->crc = crc;
+
+		/* maybe removed by archive cleanup, it's not error */
+		if (errno == ENOENT)
+			return false;
+
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open source file \"%s\": %s", file->path,
+				strerror(errno))));
+	}
+	if (fstat(in, &st) == -1)
+	{
+		errno_tmp = errno;
+		close(in);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not execute stat \"%s\": %s", file->path,
+				strerror(errno_tmp))));
+	}
+#ifdef USE_POSIX_FADVISE
+	(void) posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+	if (check)
+		snprintf(to_path, lengthof(to_path), "%s/tmp", backup_path);
+	else
+		join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+
+	/* an archived segment is not modified, write it into the stream as is */
+	if (compress == COMPRESS_NONE)
+		out = sink_open_sized(to_path, st.st_size, st.st_mode);
+	else
+		out = sink_open(to_path);
+	if (out == NULL)
+	{
+		errno_tmp = errno;
+		close(in);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open destination file \"%s\": %s",
+				to_path, strerror(errno_tmp))));
 	}
-	else if (mode == DECOMPRESSION)
+
+	if (compress != COMPRESS_NONE)
+		comp = compressor_create(compress, current.compress_level, out,
+								 to_path, &crc, &file->write_size);
+
+	bufsize = Max(Min(st.st_size, WAL_CHUNK_SIZE), XLOG_BLCKSZ);
+	buf = pgut_malloc(bufsize);
+	for (;;)
 	{
-		if (inflateEnd(&z) != Z_OK)
+		size_t	len = 0;
+		ssize_t	ret = 0;
+
+		/* fill the buffer, read() may return a part for a large request */
+		while (len < bufsize)
 		{
-			fclose(in);
+			throttle_read(-1, bufsize - len);
+			if ((ret = read(in, buf + len, bufsize - len)) <= 0)
+				break;
+			len += ret;
+		}
+		if (ret == -1)
+		{
+			errno_tmp = errno;
+			free(buf);
+			close(in);
 			fclose(out);
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
-				 errmsg("could not close compression stream: %s", z.msg)));
+				 errmsg("could not read archived WAL file \"%s\": %s",
+					file->path, strerror(errno_tmp))));
+		}
+		if (len == 0)
+			break;
+
+		if (comp)
+			compressor_write(comp, buf, len);
+		else
+		{
+			if (fwrite(buf, 1, len, out) != len)
+			{
+				errno_tmp = errno;
+				free(buf);
+				close(in);
+				fclose(out);
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not write to \"%s\": %s", to_path,
+						strerror(errno_tmp))));
+			}
+			PGRMAN_COMP_CRC32(crc, buf, len);
+			file->write_size += len;
 		}
+		file->read_size += len;
+
+		if (len < bufsize)
+			break;
 	}
+	free(buf);
+
+	if (comp)
+		compressor_end(comp);
 
-#endif
-	/* finish CRC calculation and store into pgFile */
 	PGRMAN_FIN_CRC32(crc);
 	file->crc = crc;
 
-	/* update file permission */
-	if (chmod(to_path, st.st_mode) == -1)
+#ifdef USE_POSIX_FADVISE
+	(void) posix_fadvise(in, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+	close(in);
+	if (sink_close(out, to_path, st.st_mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", to_path,
+				strerror(errno))));
+
+	if (check)
+		remove(to_path);
+
+	return true;
+}
+
+/*
+ * Store a file which is not a data file in chunks of DATA_CHUNK_SIZE by
+ * --dedup, each compressed with compress unless it's COMPRESS_NONE, and
+ * write the list of them into the backup, see dedup.c.  An empty file is
+ * backed up as an empty file.  Returns false if file is missing.
+ */
+bool
+backup_dedup_file(const char *from_root, const char *to_root, pgFile *file,
+				  CompressAlgorithm compress)
+{
+	char				to_path[MAXPGPATH];
+	int					in;
+	FILE			   *out;
+	char			   *buf;
+	struct stat			st;
+	pg_crc32c			crc;
+	BackupChunkWriter	writer;
+	int					tablespace;
+	int					errno_tmp;
+
+	PGRMAN_INIT_CRC32(crc);
+
+	/* reset size summary */
+	file->read_size = 0;
+	file->write_size = 0;
+
+	in = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (in == -1)
+	{
+		PGRMAN_FIN_CRC32(crc);
+		file->crc = crc;
+
+		/* maybe deleted, it's not error */
+		if (errno == ENOENT)
+			return false;
+
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open source file \"%s\": %s", file->path,
+				strerror(errno))));
+	}
+	if (fstat(in, &st) == -1)
 	{
 		errno_tmp = errno;
-		fclose(in);
-		fclose(out);
+		close(in);
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
-			 errmsg("could not change mode of \"%s\": %s", to_path,
+			 errmsg("could not execute stat \"%s\": %s", file->path,
 				strerror(errno_tmp))));
 	}
 
-	fclose(in);
-	fclose(out);
+	join_path_components(to_path, to_root, file->path + strlen(from_root) + 1);
+	out = sink_open(to_path);
+	if (out == NULL)
+	{
+		errno_tmp = errno;
+		close(in);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open destination file \"%s\": %s",
+				to_path, strerror(errno_tmp))));
+	}
 
-	if (check)
-		remove(to_path);
+	chunk_writer_init(&writer, out, to_path, compress, &crc, &file->write_size);
+	tablespace = throttle_tablespace(file->path + strlen(from_root) + 1);
+	buf = pgut_malloc(DATA_CHUNK_SIZE);
+	for (;;)
+	{
+		size_t	len = 0;
+		ssize_t	ret = 0;
+
+		/* fill the buffer, read() may return a part for a large request */
+		while (len < DATA_CHUNK_SIZE)
+		{
+			throttle_read(tablespace, DATA_CHUNK_SIZE - len);
+			if ((ret = read(in, buf + len, DATA_CHUNK_SIZE - len)) <= 0)
+				break;
+			len += ret;
+		}
+		if (ret == -1)
+		{
+			errno_tmp = errno;
+			free(buf);
+			chunk_writer_free(&writer);
+			close(in);
+			fclose(out);
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read backup mode file \"%s\": %s",
+					file->path, strerror(errno_tmp))));
+		}
+		if (len == 0)
+			break;
+
+		chunk_writer_append_page(&writer, NULL, buf, len, NULL, 0);
+		chunk_writer_flush(&writer);
+		file->read_size += len;
+
+		if (len < DATA_CHUNK_SIZE)
+			break;
+	}
+	free(buf);
+	chunk_writer_free(&writer);
+
+	PGRMAN_FIN_CRC32(crc);
+	file->crc = crc;
+
+	close(in);
+	if (sink_close(out, to_path, st.st_mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", to_path,
+				strerror(errno))));
 
 	return true;
 }
@@ -1149,10 +2662,7 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 	struct stat		st;
 	pgFile		   *file;
 	pg_crc32c		crc;
-#ifdef HAVE_LIBZ
-	z_stream		z;
-	char			outbuf[zlibOutSize];
-#endif
+	pgCompressor   *comp = NULL;
 	size_t			write_size = 0;
 	int				write_len,
 					written_len = 0;
@@ -1160,7 +2670,7 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 	pgBackupGetPath(backup, dbpath, lengthof(dbpath), DATABASE_DIR);
 	snprintf(path, sizeof(path), "%s/%s", dbpath, file_name);
 
-	fp = fopen(path, "wt");
+	fp = sink_open(path);
 	if (fp == NULL)
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
@@ -1169,26 +2679,10 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 
 	PGRMAN_INIT_CRC32(crc);
 
-#ifdef HAVE_LIBZ
-	if (backup->compress_data)
-	{
-		z.zalloc = Z_NULL;
-		z.zfree = Z_NULL;
-		z.opaque = Z_NULL;
-
-		if (deflateInit(&z, Z_DEFAULT_COMPRESSION) != Z_OK)
-		{
-			fclose(fp);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not initialize compression library: %s", z.msg)));
-		}
-
-		z.avail_in = 0;
-		z.next_out = (void *) outbuf;
-		z.avail_out = zlibOutSize;
-	}
-#endif
+	if (BACKUP_COMPRESSION(backup) != COMPRESS_NONE)
+		comp = compressor_create(backup->compress_algorithm,
+								 backup->compress_level, fp, path, &crc,
+								 &write_size);
 
 	while (written_len < len)
 	{
@@ -1197,12 +2691,9 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 		memcpy(writebuf, buf + written_len, write_len);
 		written_len += write_len;
 
-#ifdef HAVE_LIBZ
-		if (backup->compress_data)
-			doDeflate(&z, write_len, sizeof(outbuf), (void *) writebuf, outbuf, NULL,
-					  fp, &crc, &write_size, Z_FINISH);
+		if (comp)
+			compressor_write(comp, writebuf, write_len);
 		else
-#endif
 		{
 			if (fwrite(writebuf, 1, write_len, fp) != write_len)
 			{
@@ -1218,25 +2709,27 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 		}
 	}
 
-#ifdef HAVE_LIBZ
-	if (backup->compress_data)
+	if (comp)
+		compressor_end(comp);
+
+	if (sink_is_streamed(path))
 	{
-		if (deflateEnd(&z) != Z_OK)
-		{
-			fclose(fp);
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not close compression stream: %s", z.msg)));
-		}
+		/* there is no local file to stat */
+		st.st_mtime = time(NULL);
+		st.st_size = write_size;
+		st.st_mode = S_IFREG | FILE_PERMISSION;
 	}
-#endif
-
-	fclose(fp);
+	if (sink_close(fp, path, FILE_PERMISSION) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write to file \"%s\": %s",
+					path, strerror(errno))));
 	PGRMAN_FIN_CRC32(crc);
 
 	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(file_name) + 1);
 
-	stat(path, &st);
+	if (!sink_is_streamed(path))
+		stat(path, &st);
 	file->mtime = st.st_mtime;
 	file->size = st.st_size;
 	file->read_size = 0;
@@ -1244,7 +2737,9 @@ write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *f
 	file->mode = st.st_mode;
 	file->crc = crc;
 	file->is_datafile = false;
+	file->is_entire = false;
 	file->linked = NULL;
+	file->block = NULL;
 	strcpy(file->path, file_name);		/* enough buffer size guaranteed */
 
 	return file;
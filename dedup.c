@@ -0,0 +1,887 @@
+/*-------------------------------------------------------------------------
+ *
+ * dedup.c: store of the chunks of data file backups shared by the backups,
+ * used with --dedup.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common/cryptohash.h"
+#include "common/sha2.h"
+
+/*
+ * With --dedup, the backup of a file in DATABASE_DIR is stored as chunks in
+ * DEDUP_DIR under BACKUP_PATH, named by the SHA-256 of their contents, and
+ * the backup file lists the chunks instead:
+ *
+ *   DEDUP_MAGIC and the compress algorithm of the chunks as uint32,
+ *   followed by an entry for each chunk in order: the number of page
+ *   headers as uint32, the BackupPageHeaders, and the hash of the chunk.
+ *
+ * A chunk of a data file is the page images which backup_data_file() writes
+ * for each chunk read from the file, without their BackupPageHeaders; the
+ * headers stay in the entry, so that the same pages are stored once however
+ * their block numbers or the pages skipped around them differ.  Putting the
+ * headers back in front of the images, each followed by BLCKSZ minus the
+ * length of its hole, gives the same output as without --dedup.  Other
+ * files are split into chunks of DATA_CHUNK_SIZE without headers.
+ *
+ * Pages are not stored one by one, which would take a file and a hash of
+ * 32 bytes for each page of 8kB in the store; a page modified makes the
+ * whole chunk of the pages read with it stored again instead.  The chunks
+ * are compressed one by one, and the file name has a suffix of the
+ * algorithm, so that the backups compressed in different ways never share a
+ * chunk.
+ *
+ * A chunk is written into a temporary file and renamed, so it is complete
+ * once it's found by the name.  At the end of the backup, the chunks its
+ * files refer to are listed in DEDUP_CHUNK_LIST of the backup, as the sorted
+ * hashes each followed by the algorithm as a byte.  Chunks no backup refers
+ * to any more are removed by dedup_collect_garbage() under the catalog lock,
+ * which reads only those lists of the backups taken with --dedup and not
+ * deleted yet.  The files themselves are read only for a backup which
+ * failed before listing its chunks, whose files may be reused by --resume.
+ */
+
+#define DEDUP_MAGIC			"\377PGRMDD\n"
+#define DEDUP_MAGIC_LEN		8
+#define DEDUP_HEADER_LEN	(DEDUP_MAGIC_LEN + sizeof(uint32))
+#define DEDUP_TMP_PREFIX	"tmp."
+
+typedef enum ChunkStatus
+{
+	CHUNK_OK,
+	CHUNK_MISSING,
+	CHUNK_BROKEN
+} ChunkStatus;
+
+/*
+ * Set of the chunks referred by the backups.  Each entry is the hash and the
+ * compress algorithm as a byte, since the chunks of the same pages stored
+ * with different algorithms are different files.
+ */
+#define CHUNK_KEY_LEN	(DEDUP_HASH_LEN + 1)
+
+typedef struct HashSet
+{
+	uint8	   *hashes;		/* num entries of CHUNK_KEY_LEN bytes */
+	size_t		num;
+	size_t		capacity;
+} HashSet;
+
+/* suffix of the chunk file name by the compress algorithm */
+static const char *chunk_suffixes[] = { "", ".zlib", ".lz4", ".zst" };
+
+static int64			written_bytes = 0;
+static pthread_mutex_t	dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool read_entry(FILE *in, const char *path, BackupPageHeader **headers,
+					   uint32 *nheaders, uint8 *hash, pg_crc32c *crc);
+static void compute_hash(const char *data, size_t len, uint8 *hash);
+static void chunk_path(char *path, size_t size, const uint8 *hash,
+					   CompressAlgorithm compress);
+static size_t store_chunk(const char *data, size_t len, const uint8 *hash,
+						  CompressAlgorithm compress);
+static ChunkStatus load_chunk(const uint8 *hash, CompressAlgorithm compress,
+							  char *buf, size_t size, size_t *len);
+static void make_dir(const char *path);
+static void collect_references(HashSet *set, const char *root);
+static bool read_chunk_list(HashSet *set, const pgBackup *backup);
+static void reserve_key(HashSet *set);
+static int hash_compare(const void *a, const void *b);
+
+/*
+ * Store the chunk of len bytes and write its entry with the nheaders page
+ * headers into the backup out.  The header of the backup is written first
+ * if nothing is written yet, i.e. *write_size is 0.
+ */
+void
+dedup_write_chunk(FILE *out, const char *path, const BackupPageHeader *headers,
+				  uint32 nheaders, const char *data, size_t len,
+				  CompressAlgorithm compress, pg_crc32c *crc, size_t *write_size)
+{
+	uint8	hash[DEDUP_HASH_LEN];
+	size_t	stored;
+	size_t	headers_len = nheaders * sizeof(BackupPageHeader);
+
+	compute_hash(data, len, hash);
+	stored = store_chunk(data, len, hash, compress);
+	if (stored > 0)
+	{
+		pthread_mutex_lock(&dedup_lock);
+		written_bytes += stored;
+		pthread_mutex_unlock(&dedup_lock);
+	}
+
+	if (*write_size == 0)
+	{
+		char	header[DEDUP_HEADER_LEN];
+		uint32	algorithm = (uint32) compress;
+
+		memcpy(header, DEDUP_MAGIC, DEDUP_MAGIC_LEN);
+		memcpy(header + DEDUP_MAGIC_LEN, &algorithm, sizeof(algorithm));
+		if (fwrite(header, 1, sizeof(header), out) != sizeof(header))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write backup file \"%s\": %s",
+					path, strerror(errno))));
+		PGRMAN_COMP_CRC32(*crc, header, sizeof(header));
+		*write_size += sizeof(header);
+	}
+
+	if (fwrite(&nheaders, 1, sizeof(nheaders), out) != sizeof(nheaders) ||
+		fwrite(headers, 1, headers_len, out) != headers_len ||
+		fwrite(hash, 1, sizeof(hash), out) != sizeof(hash))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup file \"%s\": %s",
+				path, strerror(errno))));
+	PGRMAN_COMP_CRC32(*crc, &nheaders, sizeof(nheaders));
+	PGRMAN_COMP_CRC32(*crc, headers, headers_len);
+	PGRMAN_COMP_CRC32(*crc, hash, sizeof(hash));
+	*write_size += sizeof(nheaders) + headers_len + sizeof(hash);
+}
+
+/*
+ * Return the bytes of the chunks newly stored by this process.
+ */
+int64
+dedup_written_bytes(void)
+{
+	int64	bytes;
+
+	pthread_mutex_lock(&dedup_lock);
+	bytes = written_bytes;
+	pthread_mutex_unlock(&dedup_lock);
+
+	return bytes;
+}
+
+/*
+ * Check whether the backup file opened as in is written with --dedup.  If
+ * so, the header is consumed, added to *crc, and the algorithm of the
+ * chunks is returned in *compress.  Otherwise in is rewound.
+ */
+bool
+dedup_open_ref(FILE *in, const char *path, CompressAlgorithm *compress,
+			   pg_crc32c *crc)
+{
+	char	header[DEDUP_HEADER_LEN];
+	uint32	algorithm;
+
+	if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+		memcmp(header, DEDUP_MAGIC, DEDUP_MAGIC_LEN) != 0)
+	{
+		if (ferror(in) || fseek(in, 0, SEEK_SET) == -1)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read backup file \"%s\": %s", path,
+					strerror(errno))));
+		return false;
+	}
+
+	memcpy(&algorithm, header + DEDUP_MAGIC_LEN, sizeof(algorithm));
+	if (algorithm > COMPRESS_ZSTD)
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("backup file \"%s\" has an unknown compress algorithm %u",
+				path, algorithm)));
+	*compress = (CompressAlgorithm) algorithm;
+	PGRMAN_COMP_CRC32(*crc, header, sizeof(header));
+
+	return true;
+}
+
+/*
+ * Read the next chunk of the backup opened by dedup_open_ref() into buf of
+ * size bytes, with its page headers put back, i.e. the bytes the backup
+ * would have without --dedup.  The chunk must exist and have the content of
+ * its hash.  Returns false at the end of the backup.
+ */
+bool
+dedup_read_chunk(FILE *in, const char *path, CompressAlgorithm compress,
+				 char *buf, size_t size, size_t *len, pg_crc32c *crc)
+{
+	BackupPageHeader   *headers;
+	uint32				nheaders;
+	uint8				hash[DEDUP_HASH_LEN];
+	char				chunk[MAXPGPATH];
+	size_t				headers_len;
+	size_t				chunk_len;
+	size_t				pos;
+	uint32				i;
+
+	if (!read_entry(in, path, &headers, &nheaders, hash, crc))
+		return false;
+	headers_len = nheaders * sizeof(BackupPageHeader);
+	if (headers_len > size)
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("backup file \"%s\" is broken", path)));
+
+	/* load the chunk after the room for the headers */
+	switch (load_chunk(hash, compress, buf + headers_len, size - headers_len,
+					   &chunk_len))
+	{
+		case CHUNK_OK:
+			break;
+		case CHUNK_MISSING:
+			chunk_path(chunk, lengthof(chunk), hash, compress);
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("chunk \"%s\" is missing", chunk)));
+			break;
+		case CHUNK_BROKEN:
+			chunk_path(chunk, lengthof(chunk), hash, compress);
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("chunk \"%s\" is broken", chunk)));
+			break;
+	}
+
+	/*
+	 * Move each page image down behind its header.  An image is shorter
+	 * only if it's of the odd size page at the end of the file, and the rest
+	 * of the chunk after all the images is of a file not a data file.
+	 */
+	*len = 0;
+	pos = headers_len;
+	for (i = 0; i < nheaders; i++)
+	{
+		const BackupPageHeader *header = &headers[i];
+		size_t		image_len;
+
+		memcpy(buf + *len, header, sizeof(BackupPageHeader));
+		*len += sizeof(BackupPageHeader);
+
+		if (header->endpoint || IsZeroPagesHeader(header))
+			image_len = 0;
+		else if (header->hole_length > BLCKSZ)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("backup file \"%s\" is broken", path)));
+		else
+			image_len = BLCKSZ - header->hole_length;
+		image_len = Min(image_len, headers_len + chunk_len - pos);
+
+		memmove(buf + *len, buf + pos, image_len);
+		*len += image_len;
+		pos += image_len;
+	}
+	memmove(buf + *len, buf + pos, headers_len + chunk_len - pos);
+	*len += headers_len + chunk_len - pos;
+	free(headers);
+
+	return true;
+}
+
+/*
+ * Return true if the backup file at path is written with --dedup.
+ */
+bool
+dedup_file_is_ref(const char *path)
+{
+	FILE			   *in;
+	CompressAlgorithm	compress;
+	pg_crc32c			crc;
+	bool				ret;
+
+	/* a missing file is reported by the caller reading it */
+	in = fopen(path, "r");
+	if (in == NULL)
+		return false;
+	INIT_CRC32C(crc);
+	ret = dedup_open_ref(in, path, &compress, &crc);
+	fclose(in);
+
+	return ret;
+}
+
+/*
+ * Check the chunks the backup file at path refers to, if it's written with
+ * --dedup.  They must exist, and with !size_only have the content of their
+ * hash.
+ */
+bool
+dedup_validate_file(const char *path, bool size_only)
+{
+	FILE			   *in;
+	CompressAlgorithm	compress;
+	pg_crc32c			crc;
+	BackupPageHeader   *headers;
+	uint32				nheaders;
+	uint8				hash[DEDUP_HASH_LEN];
+	char			   *buf = NULL;
+	bool				valid = true;
+
+	in = fopen(path, "r");
+	if (in == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open backup file \"%s\": %s", path,
+				strerror(errno))));
+
+	INIT_CRC32C(crc);
+	if (!dedup_open_ref(in, path, &compress, &crc))
+	{
+		fclose(in);
+		return true;
+	}
+
+	if (!size_only)
+		buf = pgut_malloc(DATA_CHUNK_SIZE);
+	while (valid && read_entry(in, path, &headers, &nheaders, hash, &crc))
+	{
+		char		chunk[MAXPGPATH];
+		ChunkStatus	status;
+		size_t		len;
+
+		free(headers);
+
+		if (size_only)
+		{
+			chunk_path(chunk, lengthof(chunk), hash, compress);
+			status = (access(chunk, F_OK) == 0 ? CHUNK_OK : CHUNK_MISSING);
+		}
+		else
+			status = load_chunk(hash, compress, buf, DATA_CHUNK_SIZE, &len);
+
+		if (status != CHUNK_OK)
+		{
+			chunk_path(chunk, lengthof(chunk), hash, compress);
+			elog(WARNING, _("chunk \"%s\" of backup file \"%s\" is %s"), chunk,
+				 path, status == CHUNK_MISSING ? "missing" : "broken");
+			valid = false;
+		}
+	}
+	free(buf);
+	fclose(in);
+
+	return valid;
+}
+
+/*
+ * List the chunks which the database files of the backup refer to into
+ * DEDUP_CHUNK_LIST of the backup, for dedup_collect_garbage().  The list is
+ * written into a temporary file and renamed, as the chunks are.
+ */
+void
+dedup_write_chunk_list(const pgBackup *backup)
+{
+	char		root[MAXPGPATH];
+	char		path[MAXPGPATH];
+	char		tmp_path[MAXPGPATH];
+	HashSet		set;
+	size_t		num = 0;
+	size_t		i;
+	FILE	   *out;
+
+	memset(&set, 0, sizeof(set));
+	pgBackupGetPath(backup, root, lengthof(root), DATABASE_DIR);
+	collect_references(&set, root);
+
+	/* the same chunk is referred many times */
+	if (set.num > 0)
+	{
+		qsort(set.hashes, set.num, CHUNK_KEY_LEN, hash_compare);
+		for (i = 1, num = 1; i < set.num; i++)
+		{
+			uint8  *key = set.hashes + i * CHUNK_KEY_LEN;
+
+			if (hash_compare(key, set.hashes + (num - 1) * CHUNK_KEY_LEN) != 0)
+				memmove(set.hashes + num++ * CHUNK_KEY_LEN, key, CHUNK_KEY_LEN);
+		}
+	}
+
+	pgBackupGetPath(backup, path, lengthof(path), DEDUP_CHUNK_LIST);
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", path);
+	out = fopen(tmp_path, "w");
+	if (out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open chunk list \"%s\": %s", tmp_path,
+				strerror(errno))));
+	if (fwrite(set.hashes, CHUNK_KEY_LEN, num, out) != num ||
+		fflush(out) != 0 || fsync(fileno(out)) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write chunk list \"%s\": %s", tmp_path,
+				strerror(errno))));
+	fclose(out);
+	if (rename(tmp_path, path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not rename \"%s\" to \"%s\": %s", tmp_path, path,
+				strerror(errno))));
+	free(set.hashes);
+
+	elog(DEBUG, "listed %lu chunks in \"%s\"", (unsigned long) num, path);
+}
+
+/*
+ * Remove the chunks which no backup refers to.  The catalog lock must be
+ * held so that no backup adds references meanwhile.
+ */
+void
+dedup_collect_garbage(void)
+{
+	char		root[MAXPGPATH];
+	parray	   *backups;
+	HashSet		set;
+	DIR		   *dir;
+	struct dirent *ent;
+	int64		removed = 0;
+	int64		removed_bytes = 0;
+	int			i;
+
+	join_path_components(root, backup_path, DEDUP_DIR);
+	dir = opendir(root);
+	if (dir == NULL)
+	{
+		/* no backup is taken with --dedup */
+		if (errno == ENOENT)
+			return;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open directory \"%s\": %s", root,
+				strerror(errno))));
+	}
+
+	/* mark the chunks referred by the backups, even broken ones */
+	memset(&set, 0, sizeof(set));
+	backups = catalog_get_backup_list(NULL);
+	if (backups == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not get list of backup already taken")));
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		pgBackup   *backup = (pgBackup *) parray_get(backups, i);
+		char		path[MAXPGPATH];
+
+		if (backup->status == BACKUP_STATUS_DELETED || !backup->dedup)
+			continue;
+		if (read_chunk_list(&set, backup))
+			continue;
+
+		/* failed before listing the chunks */
+		pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
+		collect_references(&set, path);
+	}
+	parray_walk(backups, pgBackupFree);
+	parray_free(backups);
+	if (set.num > 0)
+		qsort(set.hashes, set.num, CHUNK_KEY_LEN, hash_compare);
+
+	/* sweep the others */
+	while ((ent = readdir(dir)) != NULL)
+	{
+		char			subdir[MAXPGPATH];
+		DIR			   *chunks;
+		struct dirent  *chunk;
+
+		if (ent->d_name[0] == '.')
+			continue;
+		join_path_components(subdir, root, ent->d_name);
+		chunks = opendir(subdir);
+		if (chunks == NULL)
+			continue;
+
+		while ((chunk = readdir(chunks)) != NULL)
+		{
+			char		path[MAXPGPATH];
+			uint8		key[CHUNK_KEY_LEN];
+			struct stat	st;
+			int			j;
+
+			if (chunk->d_name[0] == '.')
+				continue;
+
+			/* temporary files are left by failed backups */
+			if (strncmp(chunk->d_name, DEDUP_TMP_PREFIX, strlen(DEDUP_TMP_PREFIX)) != 0)
+			{
+				for (j = 0; j < DEDUP_HASH_LEN; j++)
+				{
+					unsigned int	byte;
+
+					if (sscanf(chunk->d_name + j * 2, "%2x", &byte) != 1)
+						break;
+					key[j] = (uint8) byte;
+				}
+				/* not a chunk */
+				if (j < DEDUP_HASH_LEN)
+					continue;
+				for (j = 0; j < lengthof(chunk_suffixes); j++)
+				{
+					if (strcmp(chunk->d_name + DEDUP_HASH_LEN * 2,
+							   chunk_suffixes[j]) == 0)
+						break;
+				}
+				if (j == lengthof(chunk_suffixes))
+					continue;
+				key[DEDUP_HASH_LEN] = (uint8) j;
+
+				/* still referred with the same algorithm */
+				if (set.num > 0 &&
+					bsearch(key, set.hashes, set.num, CHUNK_KEY_LEN,
+							hash_compare) != NULL)
+					continue;
+			}
+
+			join_path_components(path, subdir, chunk->d_name);
+			if (stat(path, &st) == -1)
+				continue;
+			if (check)
+				elog(DEBUG, "chunk \"%s\" will be removed", path);
+			else if (unlink(path) == -1)
+			{
+				elog(WARNING, _("could not remove chunk \"%s\": %s"), path,
+					 strerror(errno));
+				continue;
+			}
+			removed++;
+			removed_bytes += st.st_size;
+		}
+		closedir(chunks);
+	}
+	closedir(dir);
+	free(set.hashes);
+
+	if (removed > 0)
+		elog(INFO, _("%s " INT64_FORMAT " unreferenced chunks (" INT64_FORMAT " bytes)"),
+			 check ? "will remove" : "removed", removed, removed_bytes);
+}
+
+/*
+ * Read the next entry of the backup opened by dedup_open_ref(), and return
+ * its page headers in *headers, which the caller must free, and the hash of
+ * the chunk.  Returns false at the end of the backup.
+ */
+static bool
+read_entry(FILE *in, const char *path, BackupPageHeader **headers,
+		   uint32 *nheaders, uint8 *hash, pg_crc32c *crc)
+{
+	size_t	len;
+	size_t	headers_len;
+
+	len = fread(nheaders, 1, sizeof(*nheaders), in);
+	if (len == 0 && feof(in))
+		return false;
+	if (len != sizeof(*nheaders))
+		goto read_failed;
+	PGRMAN_COMP_CRC32(*crc, nheaders, sizeof(*nheaders));
+
+	/* no more headers than the bytes of the output of a chunk */
+	if (*nheaders > DATA_OUTBUF_SIZE / sizeof(BackupPageHeader))
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("backup file \"%s\" is broken", path)));
+	headers_len = *nheaders * sizeof(BackupPageHeader);
+	*headers = pgut_malloc(Max(headers_len, 1));
+	if (fread(*headers, 1, headers_len, in) != headers_len ||
+		fread(hash, 1, DEDUP_HASH_LEN, in) != DEDUP_HASH_LEN)
+	{
+		free(*headers);
+		goto read_failed;
+	}
+	PGRMAN_COMP_CRC32(*crc, *headers, headers_len);
+	PGRMAN_COMP_CRC32(*crc, hash, DEDUP_HASH_LEN);
+
+	return true;
+
+read_failed:
+	if (feof(in))
+		ereport(ERROR,
+			(errcode(ERROR_CORRUPTED),
+			 errmsg("backup file \"%s\" is truncated", path)));
+	ereport(ERROR,
+		(errcode(ERROR_SYSTEM),
+		 errmsg("could not read backup file \"%s\": %s", path,
+			strerror(errno))));
+	return false;				/* keep compiler quiet */
+}
+
+static void
+compute_hash(const char *data, size_t len, uint8 *hash)
+{
+	pg_cryptohash_ctx  *ctx;
+
+	ctx = pg_cryptohash_create(PG_SHA256);
+	if (ctx == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_NOMEM),
+			 errmsg("could not allocate SHA-256 context")));
+	if (pg_cryptohash_init(ctx) < 0 ||
+		pg_cryptohash_update(ctx, (const uint8 *) data, len) < 0 ||
+		pg_cryptohash_final(ctx, hash, DEDUP_HASH_LEN) < 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not compute SHA-256: %s", pg_cryptohash_error(ctx))));
+	pg_cryptohash_free(ctx);
+}
+
+/*
+ * Path of the chunk, DEDUP_DIR/<first byte>/<hash>[.<algorithm>].
+ */
+static void
+chunk_path(char *path, size_t size, const uint8 *hash,
+		   CompressAlgorithm compress)
+{
+	char	hex[DEDUP_HASH_LEN * 2 + 1];
+	int		i;
+
+	for (i = 0; i < DEDUP_HASH_LEN; i++)
+		sprintf(hex + i * 2, "%02x", hash[i]);
+	snprintf(path, size, "%s/%s/%.2s/%s%s", backup_path, DEDUP_DIR, hex, hex,
+			 chunk_suffixes[compress]);
+}
+
+/*
+ * Store the chunk unless it's stored already.  Returns the size of the chunk
+ * file written.
+ */
+static size_t
+store_chunk(const char *data, size_t len, const uint8 *hash,
+			CompressAlgorithm compress)
+{
+	char	path[MAXPGPATH];
+	char	dir[MAXPGPATH];
+	char	tmp_path[MAXPGPATH];
+	FILE   *out;
+	int		fd;
+	size_t	size = 0;
+
+	chunk_path(path, lengthof(path), hash, compress);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	/* DEDUP_DIR and its subdirectory are created on demand */
+	join_path_components(dir, backup_path, DEDUP_DIR);
+	make_dir(dir);
+	strlcpy(dir, path, lengthof(dir));
+	get_parent_directory(dir);
+	make_dir(dir);
+
+	snprintf(tmp_path, lengthof(tmp_path), "%s/" DEDUP_TMP_PREFIX "XXXXXX", dir);
+	fd = mkstemp(tmp_path);
+	if (fd == -1 || (out = fdopen(fd, "w")) == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not create chunk \"%s\": %s", tmp_path,
+				strerror(errno))));
+
+	if (compress != COMPRESS_NONE)
+	{
+		pgCompressor   *comp;
+		pg_crc32c		crc;
+
+		INIT_CRC32C(crc);
+		comp = compressor_create(compress, current.compress_level, out,
+								 tmp_path, &crc, &size);
+		compressor_write(comp, data, len);
+		compressor_end(comp);
+	}
+	else
+	{
+		if (fwrite(data, 1, len, out) != len)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write chunk \"%s\": %s", tmp_path,
+					strerror(errno))));
+		size = len;
+	}
+
+	if (fclose(out) != 0 ||
+		chmod(tmp_path, FILE_PERMISSION) == -1 ||
+		rename(tmp_path, path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write chunk \"%s\": %s", path,
+				strerror(errno))));
+
+	return size;
+}
+
+static ChunkStatus
+load_chunk(const uint8 *hash, CompressAlgorithm compress, char *buf,
+		   size_t size, size_t *len)
+{
+	char	path[MAXPGPATH];
+	uint8	actual[DEDUP_HASH_LEN];
+	FILE   *in;
+	char	extra;
+
+	chunk_path(path, lengthof(path), hash, compress);
+	in = fopen(path, "r");
+	if (in == NULL)
+	{
+		if (errno == ENOENT)
+			return CHUNK_MISSING;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open chunk \"%s\": %s", path, strerror(errno))));
+	}
+
+	if (compress != COMPRESS_NONE)
+	{
+		pgDecompressor *decomp;
+		size_t			read_size = 0;
+
+		decomp = decompressor_create(compress, in, path, &read_size, NULL);
+		*len = decompressor_read(decomp, buf, size);
+		if (*len == size && decompressor_read(decomp, &extra, 1) > 0)
+			*len = size + 1;
+		decompressor_free(decomp);
+	}
+	else
+	{
+		*len = fread(buf, 1, size, in);
+		if (ferror(in))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read chunk \"%s\": %s", path,
+					strerror(errno))));
+		if (*len == size && fread(&extra, 1, 1, in) > 0)
+			*len = size + 1;
+	}
+	fclose(in);
+
+	/* larger than any chunk */
+	if (*len > size)
+		return CHUNK_BROKEN;
+
+	compute_hash(buf, *len, actual);
+	if (memcmp(actual, hash, DEDUP_HASH_LEN) != 0)
+		return CHUNK_BROKEN;
+
+	return CHUNK_OK;
+}
+
+static void
+make_dir(const char *path)
+{
+	if (mkdir(path, DIR_PERMISSION) == -1 && errno != EEXIST)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not create directory \"%s\": %s", path,
+				strerror(errno))));
+}
+
+/*
+ * Add the chunks which the backup files under root refer to into set.
+ */
+static void
+collect_references(HashSet *set, const char *root)
+{
+	parray *files = parray_new();
+	int		i;
+
+	dir_list_file(files, root, NULL, true, false);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile			   *file = (pgFile *) parray_get(files, i);
+		FILE			   *in;
+		CompressAlgorithm	compress;
+		pg_crc32c			crc;
+
+		if (!S_ISREG(file->mode) || file->size < DEDUP_HEADER_LEN)
+			continue;
+
+		in = fopen(file->path, "r");
+		if (in == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open backup file \"%s\": %s", file->path,
+					strerror(errno))));
+
+		INIT_CRC32C(crc);
+		if (dedup_open_ref(in, file->path, &compress, &crc))
+		{
+			for (;;)
+			{
+				BackupPageHeader   *headers;
+				uint32				nheaders;
+				uint8			   *key;
+
+				reserve_key(set);
+				key = set->hashes + set->num * CHUNK_KEY_LEN;
+				if (!read_entry(in, file->path, &headers, &nheaders, key, &crc))
+					break;
+				free(headers);
+				key[DEDUP_HASH_LEN] = (uint8) compress;
+				set->num++;
+			}
+		}
+		fclose(in);
+	}
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
+
+/*
+ * Add the chunks listed by dedup_write_chunk_list() for the backup into set.
+ * Returns false if the backup has no list.
+ */
+static bool
+read_chunk_list(HashSet *set, const pgBackup *backup)
+{
+	char	path[MAXPGPATH];
+	FILE   *in;
+
+	pgBackupGetPath(backup, path, lengthof(path), DEDUP_CHUNK_LIST);
+	in = fopen(path, "r");
+	if (in == NULL)
+	{
+		if (errno == ENOENT)
+			return false;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open chunk list \"%s\": %s", path,
+				strerror(errno))));
+	}
+
+	for (;;)
+	{
+		reserve_key(set);
+		if (fread(set->hashes + set->num * CHUNK_KEY_LEN, 1, CHUNK_KEY_LEN,
+				  in) != CHUNK_KEY_LEN)
+			break;
+		set->num++;
+	}
+	if (ferror(in))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read chunk list \"%s\": %s", path,
+				strerror(errno))));
+	fclose(in);
+
+	return true;
+}
+
+/*
+ * Make room for another key in set.
+ */
+static void
+reserve_key(HashSet *set)
+{
+	if (set->num == set->capacity)
+	{
+		set->capacity = Max(set->capacity * 2, 1024);
+		set->hashes = pgut_realloc(set->hashes, set->capacity * CHUNK_KEY_LEN);
+	}
+}
+
+static int
+hash_compare(const void *a, const void *b)
+{
+	return memcmp(a, b, CHUNK_KEY_LEN);
+}
@@ -10,7 +10,19 @@
 #include "pg_rman.h"
 #include <time.h>
 
+static bool pgBackupMarkDeleting(pgBackup *backup);
 static int pgBackupDeleteFiles(pgBackup *backup);
+static parray *pgBackupDeleteMarked(parray *delete_list);
+static void pgBackupMarkDeleted(pgBackup *backup);
+static bool catalog_relock(void);
+
+/*
+ * The status of a backup, that is backup.ini and the catalog index, is
+ * changed only with the catalog lock held.  The files of a backup already
+ * marked DELETING, or DELETED, may be removed without it, since no other
+ * command uses such backups.  So delete and purge release the lock while
+ * they remove files, and take it again to mark the backups DELETED.
+ */
 
 /*
  *  Check backup lists and decide which to delete.
@@ -24,6 +36,9 @@ do_delete(pgBackupRange *range, bool force)
 	int		i;
 	int		ret;
 	parray *backup_list;
+	parray *delete_list;
+	parray *deleted_list;
+	int		num_left;
 	bool	found_boundary_to_keep;
 	char 	backup_timestamp[20];
 	char 	given_timestamp[20];
@@ -63,7 +78,8 @@ do_delete(pgBackupRange *range, bool force)
 			(errcode(ERROR_SYSTEM),
 			 errmsg("could not get list of backup already taken")));
 
-	/* check each backups and delete if possible */
+	/* check each backups and mark it DELETING if possible */
+	delete_list = parray_new();
 	for (i = 0; i < parray_num(backup_list); i++)
 	{
 		pgBackup *backup = (pgBackup *)parray_get(backup_list, i);
@@ -103,18 +119,54 @@ do_delete(pgBackupRange *range, bool force)
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during delete backup")));
 
-		/* Do actual deletion */
-		pgBackupDeleteFiles(backup);
+		if (pgBackupMarkDeleting(backup))
+			parray_append(delete_list, backup);
 	}
 
-	/* release catalog lock */
+	/*
+	 * The DELETING status is on disk now, so release the lock and do actual
+	 * deletion without it.
+	 */
 	catalog_unlock();
+	deleted_list = pgBackupDeleteMarked(delete_list);
+	num_left = parray_num(delete_list) - parray_num(deleted_list);
+
+	/*
+	 * Take the lock again to mark the backups DELETED, which updates the
+	 * catalog index too, and to remove the chunks of --dedup only the
+	 * deleted backups referred to.
+	 */
+	if (parray_num(deleted_list) > 0)
+	{
+		if (catalog_relock())
+		{
+			for (i = 0; i < parray_num(deleted_list); i++)
+				pgBackupMarkDeleted((pgBackup *) parray_get(deleted_list, i));
+			dedup_collect_garbage();
+			catalog_unlock();
+			ret = (num_left > 0 ? ERROR_SYSTEM : 0);
+		}
+		else
+		{
+			num_left = parray_num(delete_list);
+			ret = ERROR_ALREADY_RUNNING;
+		}
+	}
+	else
+		ret = (num_left > 0 ? ERROR_SYSTEM : 0);
+
+	if (num_left > 0)
+		ereport(WARNING,
+			(errmsg("%d backups are left DELETING", num_left),
+			 errhint("Please run 'pg_rman purge' to finish deleting them.")));
 
 	/* cleanup */
+	parray_free(deleted_list);
+	parray_free(delete_list);
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
 
-	return 0;
+	return ret;
 }
 
 /*
@@ -126,6 +178,8 @@ pgBackupDelete(int keep_generations, int keep_days)
 {
 	int		i;
 	parray *backup_list;
+	parray *delete_list;
+	parray *deleted_list;
 	int     existed_generations;
 	bool    check_generations;
 	bool    check_days;
@@ -198,6 +252,7 @@ pgBackupDelete(int keep_generations, int keep_days)
 	backup_list = catalog_get_backup_list(NULL);
 
 	/* find delete target backup. */
+	delete_list = parray_new();
 	existed_generations = 0;
 	last_checked_is_valid_full_backup = false;
 	for (i = 0; i < parray_num(backup_list); i++)
@@ -309,26 +364,57 @@ pgBackupDelete(int keep_generations, int keep_days)
 			}
 		}
 
-		/* delete backup and update status to DELETED */
-		pgBackupDeleteFiles(backup);
+		/* mark backup DELETING */
+		if (pgBackupMarkDeleting(backup))
+			parray_append(delete_list, backup);
+	}
+
+	/*
+	 * Delete the backups without the lock as delete does, and take it again
+	 * for the rest of the backup to update the status to DELETED.
+	 */
+	if (parray_num(delete_list) > 0)
+	{
+		catalog_unlock();
+		deleted_list = pgBackupDeleteMarked(delete_list);
+		if (!catalog_relock())
+			ereport(WARNING,
+				(errcode(ERROR_ALREADY_RUNNING),
+				 errmsg("could not lock backup catalog, the old backups are left DELETING"),
+				 errhint("Please run 'pg_rman purge' to finish deleting them.")));
+		else
+		{
+			for (i = 0; i < parray_num(deleted_list); i++)
+				pgBackupMarkDeleted((pgBackup *) parray_get(deleted_list, i));
+
+			/* remove the chunks of --dedup only the deleted backups referred to */
+			if (parray_num(deleted_list) > 0)
+				dedup_collect_garbage();
+
+			if (parray_num(deleted_list) < parray_num(delete_list))
+				ereport(WARNING,
+					(errmsg("%d old backups are left DELETING",
+						(int) (parray_num(delete_list) - parray_num(deleted_list))),
+					 errhint("Please run 'pg_rman purge' to finish deleting them.")));
+		}
+		parray_free(deleted_list);
 	}
 
 	/* cleanup */
+	parray_free(delete_list);
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
 }
 
 /*
- * Delete backup files of the backup and update the status of the backup to
- * BACKUP_STATUS_DELETED.
+ * Update the status of the backup to BACKUP_STATUS_DELETING in preparation
+ * for the case which the error occurs before deleting all backup files.
+ * Returns false if the backup was deleted already, or in check mode.
  */
-static int
-pgBackupDeleteFiles(pgBackup *backup)
+static bool
+pgBackupMarkDeleting(pgBackup *backup)
 {
-	int		i;
-	char	path[MAXPGPATH];
 	char	timestamp[20];
-	parray *files;
 
 	time2iso(timestamp, lengthof(timestamp), backup->start_time);
 	/*
@@ -338,85 +424,130 @@ pgBackupDeleteFiles(pgBackup *backup)
 	if (backup->status == BACKUP_STATUS_DELETED)
 	{
 		elog(DEBUG, "backup \"%s\" has been already deleted", timestamp);
-		return 0;
+		return false;
 	}
 
-
 	if (check)
+	{
 		elog(INFO, _("will delete the backup with start time: \"%s\""), timestamp);
-	else
-		elog(INFO, _("delete the backup with start time: \"%s\""), timestamp);
+		return false;
+	}
 
-	/*
-	 * update STATUS to BACKUP_STATUS_DELETING in preparation for the case which
-	 * the error occurs before deleting all backup files.
-	 */
-	if (!check)
+	elog(INFO, _("delete the backup with start time: \"%s\""), timestamp);
+	backup->status = BACKUP_STATUS_DELETING;
+	pgBackupWriteIni(backup);
+
+	return true;
+}
+
+/*
+ * Delete backup files of the backup marked by pgBackupMarkDeleting().
+ * Returns non-zero if some of them could not be deleted.
+ */
+static int
+pgBackupDeleteFiles(pgBackup *backup)
+{
+	const char *subdirs[] = { DATABASE_DIR, ARCLOG_DIR, SRVLOG_DIR, NULL };
+	char		path[MAXPGPATH];
+	int			errors = 0;
+	int			i;
+
+	for (i = 0; subdirs[i]; i++)
 	{
-		backup->status = BACKUP_STATUS_DELETING;
-		pgBackupWriteIni(backup);
+		pgBackupGetPath(backup, path, lengthof(path), subdirs[i]);
+		errors += dir_remove_tree(path, true);
 	}
 
-	/* list files to be deleted */
-	files = parray_new();
-	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
-	dir_list_file(files, path, NULL, true, true);
-	pgBackupGetPath(backup, path, lengthof(path), ARCLOG_DIR);
-	dir_list_file(files, path, NULL, true, true);
-	pgBackupGetPath(backup, path, lengthof(path), SRVLOG_DIR);
-	dir_list_file(files, path, NULL, true, true);
-
-	/* delete leaf node first */
-	parray_qsort(files, pgFileComparePathDesc);
-	for (i = 0; i < parray_num(files); i++)
+	return errors > 0 ? 1 : 0;
+}
+
+/*
+ * Delete backup files of the backups in delete_list, marked DELETING, without
+ * the catalog lock.  Returns the list of the backups whose files are all
+ * deleted; the others are left DELETING.
+ */
+static parray *
+pgBackupDeleteMarked(parray *delete_list)
+{
+	parray *deleted_list = parray_new();
+	int		i;
+
+	for (i = 0; i < parray_num(delete_list); i++)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
+		pgBackup *backup = (pgBackup *) parray_get(delete_list, i);
 
-		/* print progress */
-		if (verbose)
-			elog(DEBUG, _("delete file(%d/%lu) \"%s\"\n"), i + 1,
-				(unsigned long) parray_num(files), file->path);
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during delete backup")));
 
-		/* skip actual deletion in check mode */
-		if (!check)
-		{
-			if (remove(file->path))
-			{
-				elog(WARNING, _("could not remove \"%s\": %s"), file->path,
-					strerror(errno));
-				parray_walk(files, pgFileFree);
-				parray_free(files);
-				return 1;
-			}
-		}
+		if (pgBackupDeleteFiles(backup) == 0)
+			parray_append(deleted_list, backup);
 	}
 
-	/*
-	 * After deleting all of the backup files, update STATUS to
-	 * BACKUP_STATUS_DELETED.
-	 */
-	if (!check)
+	return deleted_list;
+}
+
+/*
+ * After deleting all of the backup files, update STATUS to
+ * BACKUP_STATUS_DELETED.  The caller must hold the catalog lock so that
+ * the catalog index is updated as well.  While the lock was released, a
+ * purge may have finished the backup already, so it is marked only if it is
+ * still DELETING on disk.
+ */
+static void
+pgBackupMarkDeleted(pgBackup *backup)
+{
+	pgBackup   *on_disk;
+
+	on_disk = catalog_get_backup(backup->start_time);
+	if (on_disk == NULL || on_disk->status != BACKUP_STATUS_DELETING)
 	{
-		backup->status = BACKUP_STATUS_DELETED;
-		pgBackupWriteIni(backup);
+		if (on_disk)
+			pgBackupFree(on_disk);
+		return;
 	}
+	pgBackupFree(on_disk);
 
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+	backup->status = BACKUP_STATUS_DELETED;
+	pgBackupWriteIni(backup);
+}
 
-	return 0;
+/*
+ * Take the catalog lock again after deleting backup files without it,
+ * waiting CATALOG_LOCK_TIMEOUT seconds at most for another pg_rman to release
+ * it.  Returns false if the lock could not be taken.
+ */
+static bool
+catalog_relock(void)
+{
+	int		ret;
+
+	ret = catalog_lock_wait(CATALOG_LOCK_TIMEOUT);
+	if (ret == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not lock backup catalog")));
+
+	return ret == 0;
 }
 
 /*
- * Remove DELETED backups from BACKUP_PATH directory.
+ * Remove DELETED backups from BACKUP_PATH directory.  The files of DELETING
+ * backups, left by a delete which failed, are deleted and the backups are
+ * marked DELETED first, and then removed as well.
  */
 int do_purge(void)
 {
-	int		i, j;
+	int		i;
 	int		ret;
 	int		any_errors;
+	int		num_left;
 	parray *backup_list;
-	parray *files;
+	parray *delete_list;
+	parray *deleted_list;
+	parray *purge_list;
 	pgBackup *backup;
 	char 	timestamp[20];
 	char	path[MAXPGPATH];
@@ -440,58 +571,52 @@ int do_purge(void)
 			(errcode(ERROR_SYSTEM),
 			 errmsg("could not get list of backup already taken")));
 
+	delete_list = parray_new();
+	purge_list = parray_new();
 	for (i=0; i < parray_num(backup_list); i++)
 	{
 		backup = parray_get(backup_list, i);
 
 		/* skip living backups */
-		if(backup->status != BACKUP_STATUS_DELETED)
+		if (backup->status == BACKUP_STATUS_DELETING)
+			parray_append(delete_list, backup);
+		else if (backup->status == BACKUP_STATUS_DELETED)
+			parray_append(purge_list, backup);
+		else
 			continue;
 
-		time2iso(timestamp, lengthof(timestamp), backup->start_time);
-		pgBackupGetPath(backup, path, lengthof(path), NULL);
-		
 		if (check)
+		{
+			time2iso(timestamp, lengthof(timestamp), backup->start_time);
+			pgBackupGetPath(backup, path, lengthof(path), NULL);
 			ereport(INFO,
-				(errmsg("DELETED backup \"%s\" will be purged", timestamp),
+				(errmsg("%s backup \"%s\" will be purged",
+					status2str(backup->status), timestamp),
 				 errdetail("The path is %s", path)));
+		}
+	}
 
-		files = parray_new();
-		dir_list_file(files, path, NULL, false, true);
-		parray_qsort(files, pgFileComparePathDesc);
-		any_errors = 0;
-		for (j = 0; j < parray_num(files); j++)
+	num_left = 0;
+	ret = 0;
+	if (!check)
+	{
+		/* the files of the backups are removed without the lock */
+		catalog_unlock();
+
+		for (i = 0; i < parray_num(purge_list); i++)
 		{
-			pgFile *file = (pgFile *) parray_get(files, j);
+			backup = parray_get(purge_list, i);
+			time2iso(timestamp, lengthof(timestamp), backup->start_time);
+			pgBackupGetPath(backup, path, lengthof(path), NULL);
 
-			/* print progress */
-			if (check)
-			{
-				if (verbose)
-				{
-					/* skip actual deletion in check mode */
-					elog(DEBUG, _("will delete file(%d/%lu) \"%s\"\n"), j + 1,
-						(unsigned long) parray_num(files), file->path);
-					continue;
-				}
-			}
-			else
-			{
-				if(verbose)
-					elog(DEBUG, _("delete file(%d/%lu) \"%s\"\n"), j + 1,
-						(unsigned long) parray_num(files), file->path);
+			/* check for interrupt */
+			if (interrupted)
+				ereport(FATAL,
+					(errcode(ERROR_INTERRUPTED),
+					 errmsg("interrupted during purge backup")));
 
-				if (remove(file->path))
-				{
-					elog(WARNING, _("could not remove \"%s\": %s"), file->path,
-						strerror(errno));
-					any_errors++;
-				}
-			}
-		}
+			any_errors = dir_remove_tree(path, true);
 
-		if (!check)
-		{
 			/* check the parent directory where deleted backup belongs to can be deleted. */
 			delete_parent_dir(path);
 
@@ -501,8 +626,57 @@ int do_purge(void)
 			else
 				elog(INFO, _("DELETED backup \"%s\" is purged"), timestamp);
 		}
+
+		deleted_list = pgBackupDeleteMarked(delete_list);
+		num_left = parray_num(delete_list) - parray_num(deleted_list);
+
+		/*
+		 * Take the lock again to mark the DELETING backups whose files are
+		 * deleted DELETED, and to remove the chunks of --dedup no backup
+		 * refers to.  What remains of those backups is only backup.ini and
+		 * the file lists, so they are purged with the lock.
+		 */
+		if (!catalog_relock())
+		{
+			num_left = parray_num(delete_list);
+			ret = ERROR_ALREADY_RUNNING;
+		}
+		else
+		{
+			for (i = 0; i < parray_num(deleted_list); i++)
+			{
+				backup = parray_get(deleted_list, i);
+				time2iso(timestamp, lengthof(timestamp), backup->start_time);
+				pgBackupGetPath(backup, path, lengthof(path), NULL);
+
+				pgBackupMarkDeleted(backup);
+				if (dir_remove_tree(path, true) > 0)
+					elog(WARNING, _("some errors are occurred in purging backup \"%s\""), timestamp);
+				else
+					elog(INFO, _("DELETING backup \"%s\" is purged"), timestamp);
+				delete_parent_dir(path);
+			}
+
+			/* remove the chunks of --dedup no backup refers to */
+			dedup_collect_garbage();
+			if (num_left > 0)
+				ret = ERROR_SYSTEM;
+		}
+		parray_free(deleted_list);
+
+		if (num_left > 0)
+			ereport(WARNING,
+				(errmsg("%d backups are left DELETING", num_left)));
 	}
-	return 0;
+
+	/* cleanup */
+	catalog_unlock();
+	parray_free(delete_list);
+	parray_free(purge_list);
+	parray_walk(backup_list, pgBackupFree);
+	parray_free(backup_list);
+
+	return ret;
 }
 
 /*
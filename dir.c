@@ -9,8 +9,11 @@
 
 #include "pg_rman.h"
 
+#include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
@@ -30,7 +33,41 @@ const char *pgdata_exclude[] =
 	NULL,			/* sentinel */
 };
 
-static pgFile *pgFileNew(const char *path, bool omit_symlink);
+/* size of the buffer to calculate CRC of files */
+#define CRC_BUFFER_SIZE		(1024 * 1024)
+
+/*
+ * The pgFiles listed or read from a file list are carved out of large blocks
+ * instead of being malloc'd one by one, as a cluster can have millions of
+ * files.  A block counts the files in it not freed yet and is freed with the
+ * last of them, so pgFileFree() works for any pgFile and the files can be
+ * moved between lists as before.  The arena carving files out of a block
+ * also holds a count on it until it moves to the next block.
+ *
+ * A block is used by one thread at a time: a worker listing files has an
+ * arena of its own, and the files are freed after the workers finished.
+ */
+struct pgFileBlock
+{
+	int		nrefs;			/* files not freed yet, and the arena */
+	size_t	used;			/* bytes of data carved out */
+	char	data[FLEXIBLE_ARRAY_MEMBER];
+};
+
+typedef struct pgFileArena
+{
+	pgFileBlock *block;		/* block to carve the next file out of */
+} pgFileArena;
+
+#define PGFILE_BLOCK_SIZE		(256 * 1024)
+#define PGFILE_BLOCK_DATA_SIZE	(PGFILE_BLOCK_SIZE - offsetof(pgFileBlock, data))
+
+static pgFile *pgFileAlloc(pgFileArena *arena, size_t pathlen);
+static void pgFileArenaRelease(pgFileArena *arena);
+static void pgFileBlockRelease(pgFileBlock *block);
+static pgFile *pgFileNew(pgFileArena *arena, const char *path, bool omit_symlink);
+static pgFile *pgFileNewStat(pgFileArena *arena, const char *path,
+							 const struct stat *st);
 static int BlackListCompare(const void *str1, const void *str2);
 
 /* create directory, also create parent directories if necessary */
@@ -90,11 +127,54 @@ delete_parent_dir(const char *path)
 }
 
 
+/*
+ * Allocate a pgFile whose path is pathlen bytes long, excluding the
+ * terminator, in the arena.
+ */
 static pgFile *
-pgFileNew(const char *path, bool omit_symlink)
+pgFileAlloc(pgFileArena *arena, size_t pathlen)
+{
+	size_t		size = MAXALIGN(offsetof(pgFile, path) + pathlen + 1);
+	pgFileBlock *block = arena->block;
+	pgFile	   *file;
+
+	if (block == NULL || block->used + size > PGFILE_BLOCK_DATA_SIZE)
+	{
+		pgFileArenaRelease(arena);
+		block = (pgFileBlock *) pgut_malloc(PGFILE_BLOCK_SIZE);
+		block->nrefs = 1;
+		block->used = 0;
+		arena->block = block;
+	}
+
+	file = (pgFile *) (block->data + block->used);
+	block->used += size;
+	block->nrefs++;
+	file->block = block;
+
+	return file;
+}
+
+/* stop carving files out of the block of the arena */
+static void
+pgFileArenaRelease(pgFileArena *arena)
+{
+	if (arena->block != NULL)
+		pgFileBlockRelease(arena->block);
+	arena->block = NULL;
+}
+
+static void
+pgFileBlockRelease(pgFileBlock *block)
+{
+	if (--block->nrefs == 0)
+		free(block);
+}
+
+static pgFile *
+pgFileNew(pgFileArena *arena, const char *path, bool omit_symlink)
 {
 	struct stat		st;
-	pgFile		   *file;
 
 	/* stat the file */
 	if ((omit_symlink ? stat(path, &st) : lstat(path, &st)) == -1)
@@ -107,15 +187,25 @@ pgFileNew(const char *path, bool omit_symlink)
 			 errmsg("could not stat file \"%s\": %s", path, strerror(errno))));
 	}
 
-	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + strlen(path) + 1);
+	return pgFileNewStat(arena, path, &st);
+}
+
+/* make a pgFile of path from the result of stat */
+static pgFile *
+pgFileNewStat(pgFileArena *arena, const char *path, const struct stat *st)
+{
+	pgFile		   *file;
+
+	file = pgFileAlloc(arena, strlen(path));
 
-	file->mtime = st.st_mtime;
-	file->size = st.st_size;
+	file->mtime = st->st_mtime;
+	file->size = st->st_size;
 	file->read_size = 0;
 	file->write_size = 0;
-	file->mode = st.st_mode;
+	file->mode = st->st_mode;
 	file->crc = 0;
 	file->is_datafile = false;
+	file->is_entire = false;
 	file->linked = NULL;
 	strcpy(file->path, path);		/* enough buffer size guaranteed */
 
@@ -157,41 +247,65 @@ delete_file:
 	}
 }
 
+/*
+ * Calculate CRC of the file.  The file is read in large chunks so that the
+ * CRC32C implementation, hardware-accelerated if available, runs at full
+ * speed instead of being called for every 1KB.
+ */
 pg_crc32c
 pgFileGetCRC(pgFile *file)
 {
-	FILE	   *fp;
+	int			fd;
+	struct stat	st;
 	pg_crc32c	crc = 0;
-	char		buf[1024];
-	size_t		len;
-	int			errno_tmp;
+	char	   *buf;
+	size_t		bufsize = CRC_BUFFER_SIZE;
+	ssize_t		len;
 
 	/* open file in binary read mode */
-	fp = fopen(file->path, "r");
-	if (fp == NULL)
+	fd = open(file->path, O_RDONLY | PG_BINARY, 0);
+	if (fd == -1)
 		ereport(ERROR,
 			(errcode(ERROR_SYSTEM),
 			 errmsg("could not open file \"%s\": %s", file->path, strerror(errno))));
 
+	/* don't allocate the whole chunk for small files */
+	if (fstat(fd, &st) == 0 && st.st_size < bufsize)
+		bufsize = Max(st.st_size, BLCKSZ);
+	buf = pgut_malloc(bufsize);
+
 	/* calc CRC of backup file */
 	PGRMAN_INIT_CRC32(crc);
-	while ((len = fread(buf, 1, sizeof(buf), fp)) == sizeof(buf))
+	for (;;)
 	{
 		if (interrupted)
 			ereport(FATAL,
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during CRC calculation")));
-		PGRMAN_COMP_CRC32(crc, buf, len);
+
+		len = read(fd, buf, bufsize);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len <= 0)
+			break;
+		if (stats_enabled)
+		{
+			struct timespec	start;
+
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			PGRMAN_COMP_CRC32(crc, buf, len);
+			stats_add_time(STATS_CRC_USEC, &start);
+		}
+		else
+			PGRMAN_COMP_CRC32(crc, buf, len);
 	}
-	errno_tmp = errno;
-	if (!feof(fp))
+	if (len == -1)
 		elog(WARNING, _("could not read \"%s\": %s"), file->path,
-			strerror(errno_tmp));
-	if (len > 0)
-		PGRMAN_COMP_CRC32(crc, buf, len);
+			strerror(errno));
 	PGRMAN_FIN_CRC32(crc);
 
-	fclose(fp);
+	free(buf);
+	close(fd);
 
 	return crc;
 }
@@ -202,7 +316,10 @@ pgFileFree(void *file)
 	if (file == NULL)
 		return;
 	free(((pgFile *)file)->linked);
-	free(file);
+	if (((pgFile *)file)->block != NULL)
+		pgFileBlockRelease(((pgFile *)file)->block);
+	else
+		free(file);
 }
 
 /* Compare two pgFile with their path in ascending order of ASCII code. */
@@ -298,27 +415,123 @@ dir_list_file(parray *files, const char *root, const char *exclude[], bool omit_
 		dir_list_file_internal(files, root, exclude, omit_symlink, add_root, NULL);
 }
 
+/*
+ * Directories are listed by num_threads workers, each taking one from the
+ * queue, adding its entries into its own list and putting the subdirectories
+ * back into the queue.  The lists are merged and sorted once at the end,
+ * instead of sorting all the files listed so far at each directory.
+ */
+typedef struct list_tree_arg
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	parray		   *queue;			/* paths of directories to be listed */
+	int				busy;			/* number of workers listing a directory */
+	parray		  **lists;			/* files listed by each worker */
+	int				next_list;
+	const char	  **exclude;
+	bool			omit_symlink;
+	parray		   *black_list;
+} list_tree_arg;
+
+/* how long an idle worker waits for a directory before checking failure */
+#define LIST_TREE_WAIT_MSEC		100
+
+static pgFile *list_tree_link(pgFileArena *arena, parray *files, pgFile *file,
+							  bool omit_symlink);
+static bool list_tree_excluded(const pgFile *file, const char *exclude[]);
+static void list_tree_dir(list_tree_arg *args, pgFileArena *arena,
+						  const char *path, parray *files, parray *subdirs);
+static void list_tree_worker(void *arg);
+
 void
 dir_list_file_internal(parray *files, const char *root, const char *exclude[],
 			bool omit_symlink, bool add_root, parray *black_list)
 {
-	pgFile *file;
-
-	file = pgFileNew(root, omit_symlink);
-	if (file == NULL)
-		return;
+	pgFile		   *root_file;
+	pgFile		   *file;
+	pgFileArena		arena = { NULL };
+	list_tree_arg	args;
+	int				nworkers;
+	size_t			nfiles;
+	int				i;
 
 	/* skip if the file is in black_list defined by user */
 	if (black_list && parray_bsearch(black_list, root, BlackListCompare))
+		return;
+
+	root_file = pgFileNew(&arena, root, omit_symlink);
+	if (root_file == NULL)
 	{
-		/* found in black_list. skip this item */
+		pgFileArenaRelease(&arena);
 		return;
 	}
 
 	if (add_root)
-		parray_append(files, file);
+		parray_append(files, root_file);
+
+	/*
+	 * If the root is a directory, list the contents unless the directory
+	 * name is in the exclude list.
+	 */
+	file = list_tree_link(&arena, files, root_file, omit_symlink);
+	if (file == NULL || !S_ISDIR(file->mode) ||
+		list_tree_excluded(file, exclude))
+	{
+		if (!add_root)
+			pgFileFree(root_file);
+		pgFileArenaRelease(&arena);
+		parray_qsort(files, pgFileComparePath);
+		return;
+	}
+
+	nworkers = Max(num_threads, 1);
+	args.queue = parray_new();
+	parray_append(args.queue, pgut_strdup(file->path));
+	args.busy = 0;
+	args.lists = pgut_newarray(parray *, nworkers);
+	for (i = 0; i < nworkers; i++)
+		args.lists[i] = parray_new();
+	args.next_list = 0;
+	args.exclude = exclude;
+	args.omit_symlink = omit_symlink;
+	args.black_list = black_list;
+	pthread_mutex_init(&args.lock, NULL);
+	pthread_cond_init(&args.cond, NULL);
+
+	pgut_run_threads(nworkers, list_tree_worker, &args);
+
+	/* grow the list to the number of files at once */
+	nfiles = parray_num(files);
+	for (i = 0; i < nworkers; i++)
+		nfiles += parray_num(args.lists[i]);
+	parray_expand(files, nfiles);
+	for (i = 0; i < nworkers; i++)
+	{
+		parray_concat(files, args.lists[i]);
+		parray_free(args.lists[i]);
+	}
+	free(args.lists);
+	parray_walk(args.queue, free);
+	parray_free(args.queue);
+	pthread_cond_destroy(&args.cond);
+	pthread_mutex_destroy(&args.lock);
+	if (!add_root)
+		pgFileFree(root_file);
+	pgFileArenaRelease(&arena);
+
+	parray_qsort(files, pgFileComparePath);
+}
 
-	/* chase symbolic link chain and find regular file or directory */
+/*
+ * Chase the chain of symbolic links from file, adding the files linked to
+ * into files, and return the regular file or directory found at the end, or
+ * NULL if not found.
+ */
+static pgFile *
+list_tree_link(pgFileArena *arena, parray *files, pgFile *file,
+			   bool omit_symlink)
+{
 	while (S_ISLNK(file->mode))
 	{
 		ssize_t	len;
@@ -342,108 +555,197 @@ dir_list_file_internal(parray *files, const char *root, const char *exclude[],
 
 			strncpy(dname, file->path, lengthof(dname));
 			join_path_components(absolute, dirname(dname), linked);
-			file = pgFileNew(absolute, omit_symlink);
+			file = pgFileNew(arena, absolute, omit_symlink);
 		}
 		else
-			file = pgFileNew(file->linked, omit_symlink);
+			file = pgFileNew(arena, file->linked, omit_symlink);
 
 		/* linked file is not found, stop following link chain */
 		if (file == NULL)
-			return;
+			return NULL;
 
 		parray_append(files, file);
 	}
 
-	/*
-	 * If the entry was a directory, add it to the list and add call this
-	 * function recursively.
-	 * If the directory name is in the exclude list, do not list the contents.
-	 */
-	while (S_ISDIR(file->mode))
+	return file;
+}
+
+/*
+ * If the item in the exclude list starts with '/', compare to the absolute
+ * path of the directory. Otherwise compare to the directory name portion.
+ */
+static bool
+list_tree_excluded(const pgFile *file, const char *exclude[])
+{
+	const char *dirname;
+	int			i;
+
+	dirname = strrchr(file->path, '/');
+	if (dirname == NULL)
+		dirname = file->path;
+	else
+		dirname++;
+
+	for (i = 0; exclude && exclude[i]; i++)
 	{
-		int				i;
-		bool			skip = false;
-		DIR			    *dir;
-		struct dirent   *dent;
-		char		    *dirname;
-
-		/* skip entry which matches exclude list */
-	   	dirname = strrchr(file->path, '/');
-		if (dirname == NULL)
-			dirname = file->path;
-		else
-			dirname++;
+		if (strcmp(exclude[i][0] == '/' ? file->path : dirname, exclude[i]) == 0)
+			return true;
+	}
+	return false;
+}
 
-		/*
-		 * If the item in the exclude list starts with '/', compare to the
-		 * absolute path of the directory. Otherwise compare to the directory
-		 * name portion.
-		 */
-		for (i = 0; exclude && exclude[i]; i++)
-		{
-			if (exclude[i][0] == '/')
-			{
-				if (strcmp(file->path, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-			else
-			{
-				if (strcmp(dirname, exclude[i]) == 0)
-				{
-					skip = true;
-					break;
-				}
-			}
-		}
-		if (skip)
-			break;
+/*
+ * Add the entries of the directory at path into files, and the paths of the
+ * subdirectories to be listed into subdirs.  The entries are stat'ed relative
+ * to the fd of the directory, and those in the black list are skipped without
+ * stat.
+ */
+static void
+list_tree_dir(list_tree_arg *args, pgFileArena *arena, const char *path,
+			  parray *files, parray *subdirs)
+{
+	DIR			   *dir;
+	struct dirent  *dent;
+	int				fd;
 
-		/* open directory and list contents */
-		dir = opendir(file->path);
-		if (dir == NULL)
-		{
-			if (errno == ENOENT)
-			{
-				/* maybe the directory was removed */
-				return;
-			}
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not open directory \"%s\": %s",
-					file->path, strerror(errno))));
-		}
+	/* open directory and list contents */
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd == -1 || (dir = fdopendir(fd)) == NULL)
+	{
+		int errno_tmp = errno;
 
-		errno = 0;
-		while ((dent = readdir(dir)))
-		{
-			char child[MAXPGPATH];
+		if (fd != -1)
+			close(fd);
+		/* maybe the directory was removed */
+		if (errno_tmp == ENOENT)
+			return;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open directory \"%s\": %s",
+				path, strerror(errno_tmp))));
+	}
 
-			/* skip entries point current dir or parent dir */
-			if (strcmp(dent->d_name, ".") == 0 ||
-				strcmp(dent->d_name, "..") == 0)
-				continue;
+	for (errno = 0; (dent = readdir(dir)) != NULL; errno = 0)
+	{
+		char		child[MAXPGPATH];
+		struct stat	st;
+		pgFile	   *file;
 
-			join_path_components(child, file->path, dent->d_name);
-			dir_list_file_internal(files, child, exclude, omit_symlink, true, black_list);
-		}
-		if (errno && errno != ENOENT)
+		/* skip entries point current dir or parent dir */
+		if (strcmp(dent->d_name, ".") == 0 ||
+			strcmp(dent->d_name, "..") == 0)
+			continue;
+
+		join_path_components(child, path, dent->d_name);
+
+		/* skip if the file is in black_list defined by user */
+		if (args->black_list &&
+			parray_bsearch(args->black_list, child, BlackListCompare))
+			continue;
+
+		if (fstatat(fd, dent->d_name, &st,
+					args->omit_symlink ? 0 : AT_SYMLINK_NOFOLLOW) == -1)
 		{
 			int errno_tmp = errno;
+
+			/* file not found is not an error case */
+			if (errno_tmp == ENOENT)
+				continue;
 			closedir(dir);
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
-				 errmsg("could not read directory \"%s\": %s",
-					file->path, strerror(errno_tmp))));
+				 errmsg("could not stat file \"%s\": %s", child,
+					strerror(errno_tmp))));
 		}
+
+		file = pgFileNewStat(arena, child, &st);
+		parray_append(files, file);
+
+		/* the chain of links is chased by path, as it may lead anywhere */
+		if (S_ISLNK(file->mode) &&
+			(file = list_tree_link(arena, files, file, args->omit_symlink)) == NULL)
+			continue;
+
+		if (S_ISDIR(file->mode) && !list_tree_excluded(file, args->exclude))
+			parray_append(subdirs, pgut_strdup(file->path));
+	}
+	if (errno && errno != ENOENT)
+	{
+		int errno_tmp = errno;
 		closedir(dir);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read directory \"%s\": %s",
+				path, strerror(errno_tmp))));
+	}
+	closedir(dir);
+}
+
+static void
+list_tree_worker(void *arg)
+{
+	list_tree_arg  *args = (list_tree_arg *) arg;
+	pgFileArena		arena = { NULL };
+	parray		   *files;
+	parray		   *subdirs = parray_new();
 
-		break;	/* pseudo loop */
+	pthread_mutex_lock(&args->lock);
+	files = args->lists[args->next_list++];
+	pthread_mutex_unlock(&args->lock);
+
+	for (;;)
+	{
+		char	   *path;
+
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during listing files")));
+
+		/*
+		 * Wait for a directory while others are listing, since they might
+		 * find subdirectories.  The wait is bounded so that a worker which
+		 * failed, and never puts back what it was listing, is noticed.
+		 */
+		pthread_mutex_lock(&args->lock);
+		while (parray_num(args->queue) == 0 && args->busy > 0 && !thread_failed)
+		{
+			struct timespec	abstime;
+
+			clock_gettime(CLOCK_REALTIME, &abstime);
+			abstime.tv_nsec += LIST_TREE_WAIT_MSEC * 1000000L;
+			if (abstime.tv_nsec >= 1000000000L)
+			{
+				abstime.tv_sec++;
+				abstime.tv_nsec -= 1000000000L;
+			}
+			pthread_cond_timedwait(&args->cond, &args->lock, &abstime);
+		}
+		if (parray_num(args->queue) == 0 || thread_failed)
+		{
+			pthread_cond_broadcast(&args->cond);
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		path = (char *) parray_remove(args->queue, parray_num(args->queue) - 1);
+		args->busy++;
+		pthread_mutex_unlock(&args->lock);
+
+		list_tree_dir(args, &arena, path, files, subdirs);
+		free(path);
+
+		pthread_mutex_lock(&args->lock);
+		while (parray_num(subdirs) > 0)
+			parray_append(args->queue,
+						  parray_remove(subdirs, parray_num(subdirs) - 1));
+		args->busy--;
+		pthread_cond_broadcast(&args->cond);
+		pthread_mutex_unlock(&args->lock);
 	}
 
-	parray_qsort(files, pgFileComparePath);
+	parray_free(subdirs);
+	pgFileArenaRelease(&arena);
 }
 
 /* print mkdirs.sh */
@@ -477,40 +779,102 @@ dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root)
 	}
 }
 
+/*
+ * Binary version of a file list, written along with the text one.  It
+ * consists of a header, fixed-width records sorted by path and a pool of
+ * NUL-terminated paths, so that it can be loaded without parsing nor sorting.
+ */
+#define FILE_INDEX_MAGIC		"PGRMFIL"
+#define FILE_INDEX_VERSION		1
+#define FILE_INDEX_SUFFIX		".bin"
+
+typedef struct FileIndexHeader
+{
+	char		magic[8];
+	uint32		version;
+	uint32		nfiles;
+	uint64		pool_size;
+	pg_crc32c	crc;			/* CRC of the records and the pool */
+	uint32		padding;
+} FileIndexHeader;
+
+typedef struct FileIndexRecord
+{
+	int64		mtime;
+	uint64		write_size;
+	uint32		mode;
+	pg_crc32c	crc;
+	uint32		path;			/* offset of the path in the pool */
+	uint8		is_datafile;
+	uint8		is_entire;
+	uint8		padding[2];
+} FileIndexRecord;
+
+/* path and entry of a file to be written into the binary file list */
+typedef struct FileIndexEntry
+{
+	char	   *path;
+	pgFile	   *file;
+} FileIndexEntry;
+
+/*
+ * Get the path of the binary file list from the path of the text one, e.g.
+ * file_database.bin for file_database.txt.  Returns false if the name of
+ * the text one doesn't end with ".txt".
+ */
+static bool
+get_file_index_path(char *path, size_t len, const char *file_txt)
+{
+	size_t	txt_len = strlen(file_txt);
+
+	if (txt_len < 4 || strcmp(file_txt + txt_len - 4, ".txt") != 0 ||
+		txt_len - 4 + strlen(FILE_INDEX_SUFFIX) >= len)
+		return false;
+
+	memcpy(path, file_txt, txt_len - 4);
+	strcpy(path + txt_len - 4, FILE_INDEX_SUFFIX);
+	return true;
+}
+
+/*
+ * Get the path of the file to be written into the file list; root directory
+ * portion is omitted, and prefix is prepended if not NULL.
+ */
+static void
+get_file_list_path(char *path, const pgFile *file, const char *root,
+				   const char *prefix)
+{
+	const char *ptr = file->path;
+
+	/* omit root directory portion */
+	if (root && strstr(ptr, root) == ptr)
+		ptr = JoinPathEnd(ptr, root);
+
+	/* append prefix if not NULL */
+	if (prefix)
+		join_path_components(path, prefix, ptr);
+	else
+		strcpy(path, ptr);
+}
+
 /* print file list */
 void
 dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix)
 {
 	int i;
-	int root_len = 0;
-
-	/* calculate length of root directory portion */
-	if (root)
-	{
-		root_len = strlen(root);
-		if (root[root_len - 1] != '/')
-			root_len++;
-	}
 
 	/* print each file in the list */
 	for (i = 0; i < parray_num(files); i++)
 	{
 		pgFile *file = (pgFile *)parray_get(files, i);
 		char path[MAXPGPATH];
-		char *ptr = file->path;
 		char type;
 
-		/* omit root directory portion */
-		if (root && strstr(ptr, root) == ptr)
-			ptr = JoinPathEnd(ptr, root);
-
-		/* append prefix if not NULL */
-		if (prefix)
-			join_path_components(path, prefix, ptr);
-		else
-			strcpy(path, ptr);
+		get_file_list_path(path, file, root, prefix);
 
-		if (S_ISREG(file->mode) && file->is_datafile)
+		if (S_ISREG(file->mode) && file->is_datafile && file->is_entire)
+			type = 'E';
+		else if (S_ISREG(file->mode) && file->is_datafile)
 			type = 'F';
 		else if (S_ISREG(file->mode) && !file->is_datafile)
 			type = 'f';
@@ -538,6 +902,263 @@ dir_print_file_list(FILE *out, const parray *files, const char *root, const char
 	}
 }
 
+static int
+FileIndexEntryCompare(const void *e1, const void *e2)
+{
+	return strcmp(((const FileIndexEntry *) e1)->path,
+				  ((const FileIndexEntry *) e2)->path);
+}
+
+/*
+ * Write the binary version of the file list next to file_txt, which has
+ * been written by dir_print_file_list() with the same arguments.
+ */
+void
+dir_print_file_index(const char *file_txt, const parray *files,
+					 const char *root, const char *prefix)
+{
+	char			path[MAXPGPATH];
+	FILE		   *out;
+	FileIndexHeader	header;
+	FileIndexEntry *entries;
+	FileIndexRecord	*records;
+	size_t			nfiles = parray_num(files);
+	size_t			pool_size = 0;
+	size_t			i;
+
+	if (!get_file_index_path(path, lengthof(path), file_txt))
+		return;
+
+	/* sort the entries by the path written */
+	entries = pgut_newarray(FileIndexEntry, Max(nfiles, 1));
+	for (i = 0; i < nfiles; i++)
+	{
+		char	file_path[MAXPGPATH];
+
+		entries[i].file = (pgFile *) parray_get(files, i);
+		get_file_list_path(file_path, entries[i].file, root, prefix);
+		entries[i].path = pgut_strdup(file_path);
+	}
+	qsort(entries, nfiles, sizeof(FileIndexEntry), FileIndexEntryCompare);
+
+	records = pgut_newarray(FileIndexRecord, Max(nfiles, 1));
+	memset(records, 0, sizeof(FileIndexRecord) * nfiles);
+	for (i = 0; i < nfiles; i++)
+	{
+		pgFile *file = entries[i].file;
+
+		records[i].mtime = (int64) file->mtime;
+		records[i].write_size = (uint64) file->write_size;
+		records[i].mode = (file->mode & S_IFMT) |
+			(file->mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+		records[i].crc = file->crc;
+		records[i].path = (uint32) pool_size;
+		records[i].is_datafile = (S_ISREG(file->mode) && file->is_datafile);
+		records[i].is_entire = (records[i].is_datafile && file->is_entire);
+		pool_size += strlen(entries[i].path) + 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	strcpy(header.magic, FILE_INDEX_MAGIC);
+	header.version = FILE_INDEX_VERSION;
+	header.nfiles = (uint32) nfiles;
+	header.pool_size = pool_size;
+
+	PGRMAN_INIT_CRC32(header.crc);
+	PGRMAN_COMP_CRC32(header.crc, records, sizeof(FileIndexRecord) * nfiles);
+	for (i = 0; i < nfiles; i++)
+		PGRMAN_COMP_CRC32(header.crc, entries[i].path, strlen(entries[i].path) + 1);
+	PGRMAN_FIN_CRC32(header.crc);
+
+	out = fopen(path, "w");
+	if (out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open file list \"%s\": %s", path,
+				strerror(errno))));
+
+	if (fwrite(&header, 1, sizeof(header), out) != sizeof(header) ||
+		fwrite(records, sizeof(FileIndexRecord), nfiles, out) != nfiles)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write file list \"%s\": %s", path,
+				strerror(errno))));
+	for (i = 0; i < nfiles; i++)
+	{
+		if (fputs(entries[i].path, out) == EOF || fputc('\0', out) == EOF)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write file list \"%s\": %s", path,
+					strerror(errno))));
+		free(entries[i].path);
+	}
+
+	if (fclose(out) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write file list \"%s\": %s", path,
+				strerror(errno))));
+
+	free(entries);
+	free(records);
+}
+
+/*
+ * Remove the binary version of the file list file_txt, if any.
+ */
+void
+dir_remove_file_index(const char *file_txt)
+{
+	char	path[MAXPGPATH];
+
+	if (get_file_index_path(path, lengthof(path), file_txt) &&
+		remove(path) == -1 && errno != ENOENT)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not remove file \"%s\": %s", path, strerror(errno))));
+}
+
+/*
+ * Rename the binary version of the file list from_txt to that of to_txt.
+ * Returns 0 on success, or -1 with errno set, as rename().
+ */
+int
+dir_rename_file_index(const char *from_txt, const char *to_txt)
+{
+	char	from[MAXPGPATH];
+	char	to[MAXPGPATH];
+
+	if (!get_file_index_path(from, lengthof(from), from_txt) ||
+		!get_file_index_path(to, lengthof(to), to_txt))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	return rename(from, to);
+}
+
+/*
+ * Construct parray of pgFile from the binary version of the file list
+ * file_txt.  Returns NULL if there is no binary one, e.g. for the backups
+ * taken by older versions, or it is broken, to read the text one instead.
+ */
+static parray *
+dir_read_file_index(const char *root, const char *file_txt)
+{
+	char			path[MAXPGPATH];
+	int				fd;
+	struct stat		st;
+	char		   *map;
+	FileIndexHeader	header;
+	const FileIndexRecord *records;
+	const char	   *pool;
+	pg_crc32c		crc;
+	parray		   *files;
+	pgFileArena		arena = { NULL };
+	uint32			i;
+
+	if (!get_file_index_path(path, lengthof(path), file_txt))
+		return NULL;
+
+	fd = open(path, O_RDONLY | PG_BINARY, 0);
+	if (fd == -1)
+	{
+		if (errno != ENOENT)
+			elog(WARNING, "could not open \"%s\": %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size < sizeof(FileIndexHeader))
+	{
+		close(fd);
+		elog(WARNING, "invalid file list \"%s\", read \"%s\" instead",
+			 path, file_txt);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		elog(WARNING, "could not map \"%s\": %s", path, strerror(errno));
+		return NULL;
+	}
+
+	memcpy(&header, map, sizeof(header));
+	records = (const FileIndexRecord *) (map + sizeof(header));
+	pool = (const char *) (records + header.nfiles);
+
+	/* check the header and the CRC of the contents */
+	if (memcmp(header.magic, FILE_INDEX_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != FILE_INDEX_VERSION ||
+		st.st_size != sizeof(header) +
+			(off_t) sizeof(FileIndexRecord) * header.nfiles + header.pool_size ||
+		(header.pool_size > 0 && pool[header.pool_size - 1] != '\0'))
+	{
+		munmap(map, st.st_size);
+		elog(WARNING, "invalid file list \"%s\", read \"%s\" instead",
+			 path, file_txt);
+		return NULL;
+	}
+	PGRMAN_INIT_CRC32(crc);
+	PGRMAN_COMP_CRC32(crc, records, st.st_size - sizeof(header));
+	PGRMAN_FIN_CRC32(crc);
+	if (!PGRMAN_EQ_CRC32(crc, header.crc))
+	{
+		munmap(map, st.st_size);
+		elog(WARNING, "file list \"%s\" is corrupted, read \"%s\" instead",
+			 path, file_txt);
+		return NULL;
+	}
+
+	files = parray_new();
+	parray_expand(files, header.nfiles);
+
+	for (i = 0; i < header.nfiles; i++)
+	{
+		const FileIndexRecord *rec = &records[i];
+		const char *rel_path;
+		pgFile	   *file;
+
+		if (rec->path >= header.pool_size)
+		{
+			munmap(map, st.st_size);
+			parray_walk(files, pgFileFree);
+			parray_free(files);
+			pgFileArenaRelease(&arena);
+			elog(WARNING, "invalid file list \"%s\", read \"%s\" instead",
+				 path, file_txt);
+			return NULL;
+		}
+		rel_path = pool + rec->path;
+
+		file = pgFileAlloc(&arena,
+					(root ? strlen(root) + 1 : 0) + strlen(rel_path));
+		file->mtime = (time_t) rec->mtime;
+		file->mode = rec->mode;
+		file->size = 0;
+		file->read_size = 0;
+		file->write_size = (size_t) rec->write_size;
+		file->crc = rec->crc;
+		file->is_datafile = rec->is_datafile != 0;
+		file->is_entire = rec->is_entire != 0;
+		file->linked = NULL;
+		if (root)
+			sprintf(file->path, "%s/%s", root, rel_path);
+		else
+			strcpy(file->path, rel_path);
+
+		parray_append(files, file);
+	}
+
+	munmap(map, st.st_size);
+	pgFileArenaRelease(&arena);
+
+	/* the records are sorted by path, so no need to sort them here */
+	return files;
+}
+
 /*
  * Construct parray of pgFile from the file list.
  * If root is not NULL, path will be absolute path.
@@ -547,8 +1168,14 @@ dir_read_file_list(const char *root, const char *file_txt)
 {
 	FILE   *fp;
 	parray *files;
+	pgFileArena arena = { NULL };
 	char	buf[MAXPGPATH * 2];
 
+	/* use the binary version if available */
+	files = dir_read_file_index(root, file_txt);
+	if (files != NULL)
+		return files;
+
 	fp = fopen(file_txt, "rt");
 	if (fp == NULL)
 		ereport(ERROR,
@@ -576,28 +1203,29 @@ dir_read_file_list(const char *root, const char *file_txt)
 				(errcode(ERROR_CORRUPTED),
 				 errmsg("invalid format found in \"%s\"", file_txt)));
 
-		if (type != 'f' && type != 'F' && type != 'd' && type != 'l' && type != 's')
+		if (type != 'f' && type != 'F' && type != 'E' && type != 'd' &&
+			type != 'l' && type != 's')
 			ereport(ERROR,
 				(errcode(ERROR_CORRUPTED),
 				 errmsg("invalid type '%c' found in \"%s\"", type, file_txt)));
 
 		tm.tm_isdst = -1;
 
-		file = (pgFile *) pgut_malloc(offsetof(pgFile, path) +
-					(root ? strlen(root) + 1 : 0) + strlen(path) + 1);
+		file = pgFileAlloc(&arena, (root ? strlen(root) + 1 : 0) + strlen(path));
 
 		tm.tm_year -= 1900;
 		tm.tm_mon -= 1;
 		file->mtime = mktime(&tm);
 		file->mode = mode |
-			((type == 'f' || type == 'F') ? S_IFREG :
+			((type == 'f' || type == 'F' || type == 'E') ? S_IFREG :
 			 type == 'd' ? S_IFDIR : type == 'l' ? S_IFLNK :
 			 type == 's' ? S_IFSOCK : 0);
 		file->size = 0;
 		file->read_size = 0;
 		file->write_size = write_size;
 		file->crc = crc;
-		file->is_datafile = (type == 'F' ? true : false);
+		file->is_datafile = (type == 'F' || type == 'E');
+		file->is_entire = (type == 'E');
 		file->linked = NULL;
 		if (root)
 			sprintf(file->path, "%s/%s", root, path);
@@ -608,6 +1236,7 @@ dir_read_file_list(const char *root, const char *file_txt)
 	}
 
 	fclose(fp);
+	pgFileArenaRelease(&arena);
 
 	/* file.txt is sorted, so this qsort is redundant */
 	parray_qsort(files, pgFileComparePath);
@@ -646,7 +1275,7 @@ dir_copy_files(const char *from_root, const char *to_root)
 				printf(_("copy \"%s\"\n"),
 					file->path + strlen(from_root) + 1);
 			if (!check)
-				copy_file(from_root, to_root, file, NO_COMPRESSION);
+				copy_file(from_root, to_root, file, NO_COMPRESSION, COMPRESS_NONE);
 		}
 	}
 
@@ -655,6 +1284,258 @@ dir_copy_files(const char *from_root, const char *to_root)
 	parray_free(files);
 }
 
+/*
+ * Entries of a directory to be removed by dir_remove_tree().  Directories
+ * are removed by the caller after the other entries, so they are not in names.
+ */
+typedef struct remove_dir
+{
+	char	   *path;
+	parray	   *names;
+} remove_dir;
+
+/* a range of names of a directory removed by a worker at once */
+typedef struct remove_batch
+{
+	remove_dir *dir;
+	int			begin;
+	int			end;
+} remove_batch;
+
+typedef struct remove_tree_arg
+{
+	pthread_mutex_t	lock;
+	parray		   *batches;
+	int				next_batch;
+	int				errors;
+} remove_tree_arg;
+
+/* number of entries unlinked relative to one directory fd in a batch */
+#define REMOVE_BATCH_SIZE	256
+
+static bool remove_tree_walk(parray *dirs, int parent_fd, const char *name,
+							 const char *path);
+static void remove_tree_worker(void *arg);
+
+/*
+ * Remove the directory tree at root.  Unlike the file lists built by
+ * dir_list_file(), only the names of entries are collected, and they are
+ * unlinked relative to the fd of their directory by num_threads workers in
+ * batches, so that the round trip of each unlink, which is long on a network
+ * file system, overlaps with the others.  Symbolic links are removed, not
+ * followed.  The root itself is removed too if remove_root is true.
+ *
+ * Errors are reported as WARNING, and the number of entries which could not
+ * be removed is returned.
+ */
+int
+dir_remove_tree(const char *root, bool remove_root)
+{
+	parray		   *dirs = parray_new();
+	remove_tree_arg	args;
+	int				i;
+	int				j;
+
+	args.batches = parray_new();
+	args.next_batch = 0;
+	args.errors = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	if (!remove_tree_walk(dirs, AT_FDCWD, root, root))
+		args.errors++;
+
+	for (i = 0; i < parray_num(dirs); i++)
+	{
+		remove_dir *dir = (remove_dir *) parray_get(dirs, i);
+
+		for (j = 0; j < parray_num(dir->names); j += REMOVE_BATCH_SIZE)
+		{
+			remove_batch *batch = pgut_new(remove_batch);
+
+			batch->dir = dir;
+			batch->begin = j;
+			batch->end = Min(j + REMOVE_BATCH_SIZE, parray_num(dir->names));
+			parray_append(args.batches, batch);
+		}
+	}
+
+	if (parray_num(args.batches) > 0)
+		pgut_run_threads(Min(num_threads, parray_num(args.batches)),
+						 remove_tree_worker, &args);
+
+	/* directories were listed parents first, so remove them backward */
+	for (i = parray_num(dirs) - 1; i >= 0; i--)
+	{
+		remove_dir *dir = (remove_dir *) parray_get(dirs, i);
+
+		if ((i > 0 || remove_root) && rmdir(dir->path) == -1 &&
+			errno != ENOENT)
+		{
+			elog(WARNING, _("could not remove \"%s\": %s"), dir->path,
+				strerror(errno));
+			args.errors++;
+		}
+
+		parray_walk(dir->names, free);
+		parray_free(dir->names);
+		free(dir->path);
+		free(dir);
+	}
+	parray_free(dirs);
+
+	parray_walk(args.batches, free);
+	parray_free(args.batches);
+	pthread_mutex_destroy(&args.lock);
+
+	return args.errors;
+}
+
+/*
+ * Collect the entries of the directory name relative to parent_fd, whose
+ * full path is path, and its subdirectories into dirs.  Returns false if the
+ * directory could not be read.
+ */
+static bool
+remove_tree_walk(parray *dirs, int parent_fd, const char *name,
+				 const char *path)
+{
+	remove_dir	   *dir;
+	DIR			   *dp;
+	struct dirent  *ent;
+	int				fd;
+	bool			ok = true;
+
+	fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd == -1 || (dp = fdopendir(fd)) == NULL)
+	{
+		if (fd != -1)
+			close(fd);
+		if (errno == ENOENT)
+			return true;
+		elog(WARNING, _("could not open directory \"%s\": %s"), path,
+			strerror(errno));
+		return false;
+	}
+
+	dir = pgut_new(remove_dir);
+	dir->path = pgut_strdup(path);
+	dir->names = parray_new();
+	parray_append(dirs, dir);
+
+	for (errno = 0; (ent = readdir(dp)) != NULL; errno = 0)
+	{
+		bool	is_dir;
+
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+
+		if (ent->d_type != DT_UNKNOWN)
+			is_dir = (ent->d_type == DT_DIR);
+		else
+		{
+			struct stat	st;
+
+			if (fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+			{
+				if (errno == ENOENT)
+					continue;
+				elog(WARNING, _("could not stat \"%s/%s\": %s"), path,
+					ent->d_name, strerror(errno));
+				ok = false;
+				continue;
+			}
+			is_dir = S_ISDIR(st.st_mode);
+		}
+
+		if (is_dir)
+		{
+			char	child[MAXPGPATH];
+
+			join_path_components(child, path, ent->d_name);
+			if (!remove_tree_walk(dirs, fd, ent->d_name, child))
+				ok = false;
+		}
+		else
+			parray_append(dir->names, pgut_strdup(ent->d_name));
+	}
+	if (errno)
+	{
+		elog(WARNING, _("could not read directory \"%s\": %s"), path,
+			strerror(errno));
+		ok = false;
+	}
+	closedir(dp);
+
+	return ok;
+}
+
+static void
+remove_tree_worker(void *arg)
+{
+	remove_tree_arg *args = (remove_tree_arg *) arg;
+
+	for (;;)
+	{
+		remove_batch   *batch;
+		int				fd;
+		int				errors = 0;
+		int				i;
+
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during delete backup")));
+
+		/* another worker failed */
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_batch >= parray_num(args->batches))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		batch = (remove_batch *) parray_get(args->batches, args->next_batch++);
+		pthread_mutex_unlock(&args->lock);
+
+		fd = open(batch->dir->path, O_RDONLY | O_DIRECTORY);
+		if (fd == -1)
+		{
+			elog(WARNING, _("could not open directory \"%s\": %s"),
+				batch->dir->path, strerror(errno));
+			errors = batch->end - batch->begin;
+		}
+		else
+		{
+			for (i = batch->begin; i < batch->end; i++)
+			{
+				const char *name = parray_get(batch->dir->names, i);
+
+				if (verbose)
+					elog(DEBUG, _("delete file \"%s/%s\""), batch->dir->path,
+						name);
+
+				if (unlinkat(fd, name, 0) == -1 && errno != ENOENT)
+				{
+					elog(WARNING, _("could not remove \"%s/%s\": %s"),
+						batch->dir->path, name, strerror(errno));
+					errors++;
+				}
+			}
+			close(fd);
+		}
+
+		if (errors > 0)
+		{
+			pthread_mutex_lock(&args->lock);
+			args->errors += errors;
+			pthread_mutex_unlock(&args->lock);
+		}
+	}
+}
+
 #ifdef NOT_USED
 void
 pgFileDump(pgFile *file, FILE *out)
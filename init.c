@@ -53,7 +53,7 @@ do_init(void)
 				 errmsg("backup catalog already exist and it's not empty")));
 	}
 
-	if (pgdata == NULL)
+	if (pgdata == NULL && !use_replication)
 		ereport(ERROR,
 			(errcode(ERROR_ARGS),
 			 errmsg("required parameter not specified: PGDATA (-D, --pgdata)")));
@@ -83,14 +83,19 @@ do_init(void)
 	}
 
 	/* get system identifier of the current database.*/
-	controlFile = get_controlfile(pgdata, &crc_ok);
-
-	if (!crc_ok)
-		ereport(WARNING,
-				(errmsg("control file appears to be corrupt"),
-				 errdetail("Calculated CRC checksum does not match value stored in file.")));
-	sysid = controlFile->system_identifier;
-	pg_free(controlFile);
+	if (use_replication)
+		base_backup_identify_system(&sysid, NULL);
+	else
+	{
+		controlFile = get_controlfile(pgdata, &crc_ok);
+
+		if (!crc_ok)
+			ereport(WARNING,
+					(errmsg("control file appears to be corrupt"),
+					 errdetail("Calculated CRC checksum does not match value stored in file.")));
+		sysid = controlFile->system_identifier;
+		pg_free(controlFile);
+	}
 
 	/* register system identifier of target database. */
 	join_path_components(path, backup_path, SYSTEM_IDENTIFIER_FILE);
@@ -0,0 +1,547 @@
+/*-------------------------------------------------------------------------
+ *
+ * merge.c: merge an incremental backup and the backups it depends on into
+ * a full backup, inside the backup catalog.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * The merged files are written into MERGE_DATABASE_DIR next to the database
+ * directory of the target backup, with their file list in MERGE_FILE_LIST
+ * and its binary version, which replace the current ones at the end.  A
+ * failed merge leaves the backup as it was, except the directory.
+ */
+#define MERGE_DATABASE_DIR		DATABASE_DIR ".merge"
+#define MERGE_OLD_DATABASE_DIR	DATABASE_DIR ".old"
+#define MERGE_FILE_LIST			"file_database.merge.txt"
+
+/* a file to be merged and its images to merge */
+typedef struct merge_file
+{
+	pgFile			   *file;			/* entry in the target file list */
+	int					num_sources;
+	pgRestoreSource		sources[1];		/* ordered from the newest */
+} merge_file;
+
+/* arguments and shared state of merge_backup() workers */
+typedef struct merge_files_arg
+{
+	const char		   *from_root;		/* database directory of the target */
+	const char		   *to_root;		/* MERGE_DATABASE_DIR of the target */
+	parray			   *files;			/* list of merge_file */
+	CompressAlgorithm	compress;		/* compression of the target */
+
+	/* protected by lock */
+	pthread_mutex_t		lock;
+	int					next_file;		/* index of next file in files */
+	int					num_processed;
+} merge_files_arg;
+
+static parray *get_merge_chain(parray *backups, pgBackup *target);
+static void merge_backup(parray *chain);
+static void merge_files_worker(void *arg);
+static const char *merge_one_file(merge_files_arg *args, merge_file *mfile);
+static void remove_merge_dir(const pgBackup *backup, const char *subdir);
+
+/*
+ * Merge the newest incremental backup in the range and the backups it
+ * depends on, i.e. the preceding full backup and the incremental backups
+ * between them, into a full backup which replaces the incremental one.
+ * The database server is never accessed, and the other backups are kept
+ * as they are.
+ */
+int
+do_merge(pgBackupRange *range)
+{
+	int			i;
+	int			ret;
+	parray	   *backup_list;
+	parray	   *chain;
+	pgBackup   *target = NULL;
+	char		timestamp[20];
+
+	/* DATE are always required */
+	if (!pgBackupRangeIsValid(range))
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("merge range option not specified"),
+			 errhint("Please run with 'pg_rman merge DATE'.")));
+
+	/* get exclusive lock of backup catalog */
+	ret = catalog_lock();
+	if (ret == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not lock backup catalog")));
+	else if (ret == 1)
+		ereport(ERROR,
+			(errcode(ERROR_ALREADY_RUNNING),
+			 errmsg("could not lock backup catalog"),
+			 errdetail("Another pg_rman is just running.")));
+
+	/* get list of backups. */
+	backup_list = catalog_get_backup_list(NULL);
+	if (!backup_list)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not get list of backup already taken")));
+
+	/* the newest database backup in the range, which is sorted DESC */
+	for (i = 0; i < parray_num(backup_list); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backup_list, i);
+
+		if (backup->start_time < range->begin ||
+			backup->start_time > range->end)
+			continue;
+		if (HAVE_DATABASE(backup) && backup->status == BACKUP_STATUS_OK)
+		{
+			target = backup;
+			break;
+		}
+	}
+	if (target == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_NO_BACKUP),
+			 errmsg("cannot merge backup"),
+			 errdetail("There is no valid database backup in the given range.")));
+
+	time2iso(timestamp, lengthof(timestamp), target->start_time);
+	if (target->backup_mode == BACKUP_MODE_FULL)
+	{
+		elog(INFO, "backup \"%s\" is a full backup already", timestamp);
+		parray_walk(backup_list, pgBackupFree);
+		parray_free(backup_list);
+		catalog_unlock();
+		return 0;
+	}
+
+	chain = get_merge_chain(backup_list, target);
+	merge_backup(chain);
+	parray_free(chain);
+
+	/* the chunks of --dedup only the replaced images referred to */
+	if (target->dedup && !check)
+		dedup_collect_garbage();
+
+	/* statistics of --stats=json */
+	if (stats_enabled)
+	{
+		char	path[MAXPGPATH];
+
+		join_path_components(path, backup_path, "merge_" STATS_FILE);
+		stats_write_json("merge", path);
+	}
+
+	/* cleanup */
+	parray_walk(backup_list, pgBackupFree);
+	parray_free(backup_list);
+
+	catalog_unlock();
+
+	return 0;
+}
+
+/*
+ * Return the backups to restore target from, ordered from the full backup,
+ * as do_restore() selects them: the latest full backup before target and
+ * the incremental backups after it, of the same timeline.
+ */
+static parray *
+get_merge_chain(parray *backups, pgBackup *target)
+{
+	parray	   *chain = parray_new();
+	int			i;
+
+	for (i = 0; i < parray_num(backups); i++)
+	{
+		if (parray_get(backups, i) == target)
+			break;
+	}
+
+	parray_append(chain, target);
+	for (i++; i < parray_num(backups); i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		/* don't use incomplete nor different timeline backup */
+		if (backup->status != BACKUP_STATUS_OK || backup->tli != target->tli ||
+			!HAVE_DATABASE(backup))
+			continue;
+
+		parray_insert(chain, 0, backup);
+		if (backup->backup_mode == BACKUP_MODE_FULL)
+			return chain;
+	}
+
+	ereport(ERROR,
+		(errcode(ERROR_NO_BACKUP),
+		 errmsg("cannot merge backup"),
+		 errdetail("There is no valid full backup which the incremental backup depends on.")));
+	return NULL;				/* keep compiler quiet */
+}
+
+/*
+ * Write the merged images of the files in the newest backup of chain, and
+ * replace its database directory and file list with them.
+ */
+static void
+merge_backup(parray *chain)
+{
+	int			num_backups = parray_num(chain);
+	pgBackup   *target = (pgBackup *) parray_get(chain, num_backups - 1);
+	char		timestamp[20];
+	char		list_path[MAXPGPATH];
+	char		merge_root[MAXPGPATH];
+	char		merge_list_path[MAXPGPATH];
+	char		old_root[MAXPGPATH];
+	char	  **roots;			/* database directory of each backup */
+	parray	  **lists;			/* file list of each backup */
+	parray	   *target_files;
+	parray	   *files;
+	pgFile	   *key;
+	int64		old_bytes = 0;
+	int64		new_bytes = 0;
+	FILE	   *fp;
+	int			swapped = 0;	/* renames done to replace the files */
+	int			i;
+	int			j;
+	merge_files_arg	args;
+
+	roots = pgut_newarray(char *, num_backups);
+	lists = pgut_newarray(parray *, num_backups);
+
+	for (j = 0; j < num_backups; j++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(chain, j);
+
+		time2iso(timestamp, lengthof(timestamp), backup->start_time);
+		if (!compress_algorithm_supported(BACKUP_COMPRESSION(backup)))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not merge compressed backup \"%s\"", timestamp),
+				 errdetail("%s compression is not supported in this installation.",
+					compress_algorithm_name(backup->compress_algorithm))));
+
+		/* CRC of each file is checked while merging it */
+		pgBackupValidate(backup, true, false, true);
+		if (backup->status != BACKUP_STATUS_OK)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("cannot merge backup"),
+				 errdetail("Backup \"%s\" is corrupted.", timestamp)));
+
+		if (backup->backup_mode == BACKUP_MODE_FULL)
+			elog(INFO, "merging database files from the full mode backup \"%s\"",
+				timestamp);
+		else
+			elog(INFO, "merging database files from the incremental mode backup \"%s\"",
+				timestamp);
+
+		/* get list of files in the backup, which is sorted by path */
+		roots[j] = pgut_malloc(MAXPGPATH);
+		pgBackupGetPath(backup, roots[j], MAXPGPATH, DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+		lists[j] = dir_read_file_list(roots[j], list_path);
+	}
+
+	/* find the images to merge each file in the target backup from */
+	target_files = lists[num_backups - 1];
+	key = (pgFile *) pgut_malloc(offsetof(pgFile, path) + MAXPGPATH);
+	files = parray_new();
+	for (i = 0; i < parray_num(target_files); i++)
+	{
+		pgFile		   *file = (pgFile *) parray_get(target_files, i);
+		merge_file	   *mfile;
+
+		if (S_ISREG(file->mode) && file->write_size != BYTES_INVALID)
+			old_bytes += file->write_size;
+
+		mfile = pgut_malloc(offsetof(merge_file, sources) +
+							sizeof(pgRestoreSource) * num_backups);
+		mfile->file = file;
+		mfile->num_sources = find_file_images(chain, roots, lists, file, key,
+											  mfile->sources);
+		parray_append(files, mfile);
+	}
+	free(key);
+
+	time2iso(timestamp, lengthof(timestamp), target->start_time);
+	if (check)
+	{
+		elog(INFO, "will merge %d backups into the full backup \"%s\"",
+			 num_backups, timestamp);
+		goto cleanup;
+	}
+
+	/* files are written in the format of a full backup of the target */
+	current = *target;
+	current.backup_mode = BACKUP_MODE_FULL;
+
+	/* leftovers of a merge failed before */
+	remove_merge_dir(target, MERGE_DATABASE_DIR);
+	remove_merge_dir(target, MERGE_OLD_DATABASE_DIR);
+	pgBackupGetPath(target, merge_root, lengthof(merge_root), MERGE_DATABASE_DIR);
+	dir_create_dir(merge_root, DIR_PERMISSION);
+
+	args.from_root = roots[num_backups - 1];
+	args.to_root = merge_root;
+	args.files = files;
+	args.compress = BACKUP_COMPRESSION(target);
+	args.next_file = 0;
+	args.num_processed = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	pgut_run_threads(num_threads, merge_files_worker, &args);
+	pthread_mutex_destroy(&args.lock);
+
+	for (i = 0; i < parray_num(target_files); i++)
+	{
+		pgFile *file = (pgFile *) parray_get(target_files, i);
+
+		if (S_ISREG(file->mode) && file->write_size != BYTES_INVALID)
+			new_bytes += file->write_size;
+	}
+
+	/* write the new file list next to the current one */
+	pgBackupGetPath(target, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+	pgBackupGetPath(target, merge_list_path, lengthof(merge_list_path),
+					MERGE_FILE_LIST);
+	fp = fopen(merge_list_path, "wt");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open file list \"%s\": %s", merge_list_path,
+				strerror(errno))));
+	dir_print_file_list(fp, target_files, roots[num_backups - 1], NULL);
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write file list \"%s\": %s", merge_list_path,
+				strerror(errno))));
+	fclose(fp);
+	dir_print_file_index(merge_list_path, target_files,
+						 roots[num_backups - 1], NULL);
+
+	/*
+	 * Replace the database directory and the file lists.  The backup is
+	 * RUNNING meanwhile, so it turns into ERROR and is never used if we
+	 * crash halfway.  The current binary file list goes first, as the text
+	 * one is read without it, and the current directory is put back if the
+	 * new one or the text file list can't be moved into place.
+	 */
+	target->status = BACKUP_STATUS_RUNNING;
+	pgBackupWriteIni(target);
+
+	dir_remove_file_index(list_path);
+	pgBackupGetPath(target, old_root, lengthof(old_root), MERGE_OLD_DATABASE_DIR);
+	if (rename(roots[num_backups - 1], old_root) == 0)
+	{
+		swapped++;
+		if (rename(merge_root, roots[num_backups - 1]) == 0)
+		{
+			swapped++;
+			if (rename(merge_list_path, list_path) == 0)
+				swapped++;
+		}
+	}
+	if (swapped < 3)
+	{
+		int		errno_tmp = errno;
+
+		if ((swapped < 2 || rename(roots[num_backups - 1], merge_root) == 0) &&
+			(swapped < 1 || rename(old_root, roots[num_backups - 1]) == 0))
+		{
+			target->status = BACKUP_STATUS_OK;
+			pgBackupWriteIni(target);
+		}
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not replace the database files of backup \"%s\": %s",
+				timestamp, strerror(errno_tmp))));
+	}
+	if (dir_rename_file_index(merge_list_path, list_path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not replace the file list of backup \"%s\": %s",
+				timestamp, strerror(errno))));
+
+	/* the images by --dedup taken from the older backups refer to chunks */
+	for (j = 0; j < num_backups; j++)
+	{
+		if (((pgBackup *) parray_get(chain, j))->dedup)
+			target->dedup = true;
+	}
+	if (target->dedup)
+		dedup_write_chunk_list(target);
+
+	target->backup_mode = BACKUP_MODE_FULL;
+	target->write_bytes += new_bytes - old_bytes;
+	target->status = BACKUP_STATUS_OK;
+	pgBackupWriteIni(target);
+
+	remove_merge_dir(target, MERGE_OLD_DATABASE_DIR);
+
+	elog(INFO, "merged %d backups into the full backup \"%s\"", num_backups,
+		 timestamp);
+
+cleanup:
+	for (i = 0; i < parray_num(files); i++)
+		free(parray_get(files, i));
+	parray_free(files);
+	for (j = 0; j < num_backups; j++)
+	{
+		parray_walk(lists[j], pgFileFree);
+		parray_free(lists[j]);
+		free(roots[j]);
+	}
+	free(lists);
+	free(roots);
+}
+
+/*
+ * Merge the files listed in args->files until there is no file left.  This
+ * is run by each of the merge_backup() workers.
+ */
+static void
+merge_files_worker(void *arg)
+{
+	merge_files_arg	   *args = (merge_files_arg *) arg;
+	unsigned long		num_files = (unsigned long) parray_num(args->files);
+
+	for (;;)
+	{
+		merge_file	   *mfile;
+		const char	   *status;
+
+		/* check for interrupt */
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during merge backup")));
+
+		/* another worker failed, the merge is going to be aborted */
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_file >= parray_num(args->files))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		mfile = (merge_file *) parray_get(args->files, args->next_file++);
+		pthread_mutex_unlock(&args->lock);
+
+		status = merge_one_file(args, mfile);
+
+		pthread_mutex_lock(&args->lock);
+		args->num_processed++;
+		if (verbose)
+			printf(_("(%d/%lu) %s %s\n"), args->num_processed, num_files,
+				mfile->file->path + strlen(args->from_root) + 1, status);
+		else if (progress)
+		{
+			fprintf(stderr, _("Processed %d of %lu files"),
+					args->num_processed, num_files);
+			if (args->num_processed < num_files)
+				fprintf(stderr, "\r");
+			else
+				fprintf(stderr, "\n");
+		}
+		pthread_mutex_unlock(&args->lock);
+	}
+}
+
+/*
+ * Write the merged image of a file into args->to_root and update the entry
+ * in the target file list with it.  Returns the status to show.
+ *
+ * The pages of a data file are merged from all of the images.  An entire
+ * image stored in the same format as the target is linked, and the others
+ * are converted into the format, since a backup has one compression.
+ */
+static const char *
+merge_one_file(merge_files_arg *args, merge_file *mfile)
+{
+	pgFile		   *file = mfile->file;
+	pgFile		   *image;
+	const pgRestoreSource *source = &mfile->sources[0];
+	char			to_path[MAXPGPATH];
+	char			parent[MAXPGPATH];
+
+	if (S_ISDIR(file->mode))
+	{
+		join_path_components(to_path, args->to_root,
+							 file->path + strlen(args->from_root) + 1);
+		dir_create_dir(to_path, DIR_PERMISSION);
+		return _("directory");
+	}
+
+	/* symbolic links are made by mkdirs.sh */
+	if (!S_ISREG(file->mode))
+		return _("skip");
+	if (mfile->num_sources == 0)
+		return _("not backed up, skip");
+
+	image = source->file;
+	join_path_components(to_path, args->to_root,
+						 image->path + strlen(source->from_root) + 1);
+	strlcpy(parent, to_path, lengthof(parent));
+	get_parent_directory(parent);
+	dir_create_dir(parent, DIR_PERMISSION);
+
+	if (mfile->num_sources > 1 ||
+		(image->is_datafile && source->compress != args->compress))
+	{
+		merge_data_file(to_path, file, mfile->sources, mfile->num_sources,
+						args->compress);
+		return mfile->num_sources > 1 ? _("merged") : _("converted");
+	}
+
+	file->is_datafile = image->is_datafile;
+	file->is_entire = image->is_entire;
+	file->crc = image->crc;
+
+	/* a backup by --dedup records the algorithm of its chunks itself */
+	if (source->compress == args->compress || dedup_file_is_ref(image->path))
+	{
+		file->write_size = image->write_size;
+		if (clone_file(image->path, to_path) || link(image->path, to_path) == 0)
+			return _("linked");
+
+		elog(DEBUG, "could not link \"%s\" to \"%s\": %s", image->path,
+			 to_path, strerror(errno));
+		convert_backup_file(image->path, to_path, file, COMPRESS_NONE,
+							COMPRESS_NONE);
+		return _("copied");
+	}
+
+	convert_backup_file(image->path, to_path, file, source->compress,
+						args->compress);
+	return _("converted");
+}
+
+/*
+ * Remove the directory subdir of the backup if exists.
+ */
+static void
+remove_merge_dir(const pgBackup *backup, const char *subdir)
+{
+	char	path[MAXPGPATH];
+
+	pgBackupGetPath(backup, path, lengthof(path), subdir);
+	if (access(path, F_OK) == 0 && dir_remove_tree(path, true) > 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not remove directory \"%s\"", path)));
+}
@@ -14,25 +14,6 @@
 #include <time.h>
 #include <sys/stat.h>
 
-const char *PROGRAM_VERSION	= "1.3.16";
-const char *PROGRAM_URL		= "http://github.com/ossc-db/pg_rman";
-const char *PROGRAM_ISSUES	= "http://github.com/ossc-db/pg_rman/issues";
-
-/* path configuration */
-char *backup_path;
-char *pgdata;
-char *arclog_path;
-char *srvlog_path;
-char *pgconf_path;
-
-/* common configuration */
-bool verbose = false;
-bool progress = false;
-bool check = false;
-
-/* directory configuration */
-pgBackup	current;
-
 /* backup configuration */
 static bool		smooth_checkpoint;
 static int		keep_arclog_files = KEEP_INFINITE;
@@ -51,6 +32,8 @@ static char		   *target_inclusive;
 static char		   *target_tli_string;
 static char		   *target_action;
 static bool		is_hard_copy = false;
+static bool		wal_on_demand = false;
+static bool		delta = false;
 
 /* delete configuration */
 static bool		force;
@@ -59,6 +42,8 @@ static bool		force;
 static bool			show_all = false;
 
 static void opt_backup_mode(pgut_option *opt, const char *arg);
+static void opt_compress_algorithm(pgut_option *opt, const char *arg);
+static void opt_stats(pgut_option *opt, const char *arg);
 static void parse_range(pgBackupRange *range, const char *arg1, const char *arg2);
 
 static pgut_option options[] =
@@ -73,6 +58,8 @@ static pgut_option options[] =
 	{ 'b', 'v', "verbose"		, &verbose },
 	{ 'b', 'P', "progress"		, &progress },
 	{ 'b', 'c', "check"			, &check },
+	{ 'i', 'j', "jobs"			, &num_threads	, SOURCE_ENV },
+	{ 'f', 22, "stats"			, opt_stats		, SOURCE_ENV },
 	/* backup options */
 	{ 'f', 'b', "backup-mode"		    , opt_backup_mode			, SOURCE_ENV },
 	{ 'b', 's', "with-serverlog"	    , &current.with_serverlog	, SOURCE_ENV },
@@ -81,6 +68,19 @@ static pgut_option options[] =
 	{ 'b', 'F', "full-backup-on-error"	, &current.full_backup_on_error		, SOURCE_ENV },
 	{ 's', 13, "standby-host"	, &standby_host		, SOURCE_ENV },
 	{ 's', 14, "standby-port"	, &standby_port		, SOURCE_ENV },
+	{ 'f', 15, "compress-algorithm"	, opt_compress_algorithm	, SOURCE_ENV },
+	{ 'i', 16, "compress-level"		, &current.compress_level	, SOURCE_ENV },
+	{ 'b', 17, "direct-io"			, &direct_io				, SOURCE_ENV },
+	{ 's', 18, "output"				, &backup_output },
+	{ 'b', 19, "replication"		, &use_replication			, SOURCE_ENV },
+	{ 'b', 21, "link-unchanged"		, &link_unchanged			, SOURCE_ENV },
+	{ 'i', 23, "max-rate"			, &max_rate					, SOURCE_ENV },
+	{ 'i', 24, "max-iops"			, &max_iops					, SOURCE_ENV },
+	{ 's', 25, "tablespace-max-rate", &tablespace_max_rate		, SOURCE_ENV },
+	{ 'b', 26, "dedup"				, &current.dedup			, SOURCE_ENV },
+	{ 'b', 27, "verify-checksums"	, &verify_checksums			, SOURCE_ENV },
+	{ 'b', 28, "fail-on-checksum-error", &fail_on_checksum_error, SOURCE_ENV },
+	{ 'b', 30, "resume"				, &resume_backup			, SOURCE_ENV },
 	/* delete options */
 	{ 'b', 'f', "force"	, &force		, SOURCE_ENV },
 	/* options with only long name (keep-xxx) */
@@ -97,6 +97,8 @@ static pgut_option options[] =
 	{ 's', 10, "recovery-target-timeline"	, &target_tli_string, SOURCE_ENV },
 	{ 's', 11, "recovery-target-action"		, &target_action	, SOURCE_ENV },
 	{ 'b', 12, "hard-copy"	, &is_hard_copy		, SOURCE_ENV },
+	{ 'b', 20, "wal-on-demand"	, &wal_on_demand	, SOURCE_ENV },
+	{ 'b', 29, "delta"			, &delta			, SOURCE_ENV },
 	/* catalog options */
 	{ 'b', 'a', "show-all"		, &show_all },
 	{ 0 }
@@ -154,8 +156,11 @@ main(int argc, char *argv[])
 		return HELP;
 	}
 
+	/* restore-wal takes the WAL file name and the path to restore it into */
+	if (pg_strcasecmp(cmd, "restore-wal") == 0)
+		range.begin = range.end = 0;
 	/* get object range argument if any */
-	if (range1 && range2)
+	else if (range1 && range2)
 		parse_range(&range, range1, range2);
 	else if (range1)
 		parse_range(&range, range1, "");
@@ -202,6 +207,11 @@ main(int argc, char *argv[])
 			(errcode(ERROR_ARGS),
 			 errmsg("-G, --pgconf-path must be an absolute path")));
 
+	if (num_threads < 1)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("-j, --jobs must be a positive number: %d", num_threads)));
+
 	/* setup exclusion list for file search */
 	for (i = 0; pgdata_exclude[i]; i++)		/* find first empty slot */
 		;
@@ -210,6 +220,9 @@ main(int argc, char *argv[])
 	if (srvlog_path)
 		pgdata_exclude[i++] = srvlog_path;
 
+	/* start collecting statistics of --stats */
+	stats_init();
+
 	/* do actual operation */
 	if (pg_strcasecmp(cmd, "init") == 0)
 		return do_init();
@@ -228,14 +241,23 @@ main(int argc, char *argv[])
 		return do_backup(bkupopt);
 	}
 	else if (pg_strcasecmp(cmd, "restore") == 0)
-		return do_restore(target_time, target_xid,
-					target_inclusive, target_tli_string, target_action, is_hard_copy);
+	{
+		if (wal_on_demand && find_my_exec(argv[0], my_exec_path) != 0)
+			strlcpy(my_exec_path, PROGRAM_NAME, lengthof(my_exec_path));
+		return do_restore(target_time, target_xid, target_inclusive,
+					target_tli_string, target_action, is_hard_copy, wal_on_demand,
+					delta);
+	}
+	else if (pg_strcasecmp(cmd, "restore-wal") == 0)
+		return do_restore_wal(range1, range2);
 	else if (pg_strcasecmp(cmd, "show") == 0)
 		return do_show(&range, show_detail, show_all);
 	else if (pg_strcasecmp(cmd, "validate") == 0)
 		return do_validate(&range);
 	else if (pg_strcasecmp(cmd, "delete") == 0)
 		return do_delete(&range, force);
+	else if (pg_strcasecmp(cmd, "merge") == 0)
+		return do_merge(&range);
 	else if (pg_strcasecmp(cmd, "purge") == 0)
 		return do_purge();
 	else
@@ -254,10 +276,12 @@ pgut_help(bool details)
 	printf(_("  %s OPTION init\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION backup\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION restore\n"), PROGRAM_NAME);
+	printf(_("  %s OPTION restore-wal WALFILE PATH\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION show [DATE]\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION show detail [DATE]\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION validate [DATE]\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION delete DATE\n"), PROGRAM_NAME);
+	printf(_("  %s OPTION merge DATE\n"), PROGRAM_NAME);
 	printf(_("  %s OPTION purge\n"), PROGRAM_NAME);
 
 	if (!details)
@@ -272,11 +296,28 @@ pgut_help(bool details)
 	printf(_("  -c, --check               show what would have been done\n"));
 	printf(_("  -v, --verbose             show what detail messages\n"));
 	printf(_("  -P, --progress            show progress of processed files\n"));
+	printf(_("  -j, --jobs=NUM            use NUM parallel jobs in backup, restore and validate\n"));
+	printf(_("  --stats=json              write timing and throughput of each phase as JSON\n"));
 	printf(_("\nBackup options:\n"));
 	printf(_("  -b, --backup-mode=MODE    full, incremental, or archive\n"));
 	printf(_("  -s, --with-serverlog      also backup server log files\n"));
-	printf(_("  -Z, --compress-data       compress data backup with zlib\n"));
+	printf(_("  -Z, --compress-data       compress data backup\n"));
+	printf(_("  --compress-algorithm=ALGORITHM\n"));
+	printf(_("                            zlib (default), lz4, or zstd\n"));
+	printf(_("  --compress-level=LEVEL    compression level, 0 means the default\n"));
 	printf(_("  -C, --smooth-checkpoint   do smooth checkpoint before backup\n"));
+	printf(_("  --direct-io               read data files bypassing the OS page cache\n"));
+	printf(_("  --output=PATH             write backup files into PATH as tar, - for stdout\n"));
+	printf(_("  --replication             take database files through the replication protocol\n"));
+	printf(_("  --link-unchanged          link unchanged files from the previous backup\n"));
+	printf(_("  --max-rate=RATE           read files at most RATE MB/s in total\n"));
+	printf(_("  --max-iops=NUM            read files by at most NUM read calls per second\n"));
+	printf(_("  --tablespace-max-rate=NAME:RATE[,...]\n"));
+	printf(_("                            read files in tablespace NAME at most RATE MB/s\n"));
+	printf(_("  --dedup                   store database files once in the chunk store\n"));
+	printf(_("  --verify-checksums        verify checksums of data pages while reading them\n"));
+	printf(_("  --fail-on-checksum-error  verify checksums and fail the backup on an error\n"));
+	printf(_("  --resume                  reuse the files completed by the failed backup\n"));
 	printf(_("  -F, --full-backup-on-error   switch to full backup mode\n"));
 	printf(_("                               if pg_rman cannot find validate full backup\n"));
 	printf(_("                               on current timeline\n"));
@@ -296,6 +337,8 @@ pgut_help(bool details)
 	printf(_("  --recovery-target-timeline  recovering into a particular timeline\n"));
 	printf(_("  --recovery-target-action    action the server should take once the recovery target is reached\n"));
 	printf(_("  --hard-copy                 copying archivelog not symbolic link\n"));
+	printf(_("  --wal-on-demand             restore archived WAL by restore_command during recovery\n"));
+	printf(_("  --delta                     rewrite only files and pages differing in PGDATA\n"));
 	printf(_("\nCatalog options:\n"));
 	printf(_("  -a, --show-all            show deleted backup too\n"));
 	printf(_("\nDelete options:\n"));
@@ -390,3 +433,19 @@ opt_backup_mode(pgut_option *opt, const char *arg)
 {
 	current.backup_mode = parse_backup_mode(arg, ERROR);
 }
+
+static void
+opt_compress_algorithm(pgut_option *opt, const char *arg)
+{
+	current.compress_algorithm = parse_compress_algorithm(arg, ERROR);
+}
+
+static void
+opt_stats(pgut_option *opt, const char *arg)
+{
+	if (pg_strcasecmp(arg, "json") != 0)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("invalid stats format \"%s\", only \"json\" is supported", arg)));
+	stats_enabled = true;
+}
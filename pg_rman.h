@@ -13,6 +13,7 @@
 #include "postgres_fe.h"
 
 #include <limits.h>
+#include <time.h>
 #include "libpq-fe.h"
 
 #include "access/xlog_internal.h"
@@ -32,13 +33,22 @@
 #define PG_XLOG_DIR				"pg_wal"
 #define PG_TBLSPC_DIR			"pg_tblspc"
 #define TIMELINE_HISTORY_DIR	"timeline_history"
+#define BASE_BACKUP_DIR			"base_backup"
+#define DEDUP_DIR				"chunks"
 #define BACKUP_INI_FILE			"backup.ini"
 #define PG_RMAN_INI_FILE		"pg_rman.ini"
+#define CATALOG_INDEX_FILE		"catalog.idx"
 #define SYSTEM_IDENTIFIER_FILE	"system_identifier"
 #define MKDIRS_SH_FILE			"mkdirs.sh"
+#define BACKUP_MANIFEST_FILE	"backup_manifest"
+#define STATS_FILE				"stats.json"
+
+/* maximum length of the summary of --stats in backup.ini */
+#define STATS_SUMMARY_LEN		512
 #define DATABASE_FILE_LIST		"file_database.txt"
 #define ARCLOG_FILE_LIST		"file_arclog.txt"
 #define SRVLOG_FILE_LIST		"file_srvlog.txt"
+#define DEDUP_CHUNK_LIST		"chunk_list.bin"
 #define SNAPSHOT_SCRIPT_FILE	"snapshot_script"
 #define PG_BACKUP_LABEL_FILE	"backup_label"
 #define PG_TBLSPC_MAP_FILE		"tablespace_map"
@@ -65,23 +75,41 @@
 #define ERROR_PG_RUNNING		25	/* PostgreSQL server is running */
 #define ERROR_PID_BROKEN		26	/* postmaster.pid file is broken */
 
-/* backup mode file */
+/*
+ * seconds to wait for the catalog lock held by another pg_rman, when taking
+ * it again after removing the files of DELETING backups without it
+ */
+#define CATALOG_LOCK_TIMEOUT	60
+
+/* block of memory pgFiles are allocated in, see dir.c */
+typedef struct pgFileBlock pgFileBlock;
+
+/*
+ * backup mode file.  The fields are ordered by their size so that no padding
+ * is wasted, as catalogs can list millions of files.
+ */
 typedef struct pgFile
 {
 	time_t	mtime;			/* time of last modification */
-	mode_t	mode;			/* protection (file type and permission) */
 	size_t	size;			/* size of the file */
 	size_t	read_size;		/* size of the portion read (if only some pages are
 							   backed up partially, it's different from size) */
 	size_t	write_size;		/* size of the backed-up file. BYTES_INVALID means
 							   that the file existed but was not backed up
 							   because not modified since last backup. */
-	pg_crc32c crc;			/* CRC value of the file, regular file only */
 	char   *linked;			/* path of the linked file */
+	pgFileBlock *block;		/* block allocated in, or NULL if malloc'd alone */
+	mode_t	mode;			/* protection (file type and permission) */
+	pg_crc32c crc;			/* CRC value of the file, regular file only */
 	bool	is_datafile;	/* true if the file is PostgreSQL data file */
+	bool	is_entire;		/* true if the data file image has all blocks
+							   even in an incremental backup */
 	char	path[1]; 		/* path of the file */
 } pgFile;
 
+/* map of blocks modified in WAL, see xlog.c */
+typedef struct pgBlockMap pgBlockMap;
+
 typedef struct pgBackupRange
 {
 	time_t	begin;
@@ -91,6 +119,11 @@ typedef struct pgBackupRange
 /*
  * Along with each data page, the following information is written to the
  * backup.
+ *
+ * A run of all-zero pages, e.g. of a relation just extended, is written as
+ * one header whose hole is the whole page, followed by no data.  A hole of a
+ * valid page never covers the page header, so such a header is not found in
+ * the backups taken before, where zero_pages may be garbage of the padding.
  */
 typedef struct BackupPageHeader
 {
@@ -100,8 +133,32 @@ typedef struct BackupPageHeader
     bool        endpoint;       /* If set to true, this page marks the end
                                    of relation, which means any subsequent
                                    pages are truncated. */
+    uint16      zero_pages;     /* number of all-zero pages from block if
+                                   hole_length is BLCKSZ */
 } BackupPageHeader;
 
+#define IsZeroPagesHeader(header)	((header)->hole_length == BLCKSZ)
+
+/*
+ * Data files are read, and restored pages are written, in chunks of this
+ * size so that the pages are processed in memory with one system call per
+ * chunk instead of per page.
+ */
+#define DATA_CHUNK_SIZE		(1024 * 1024)
+
+/* pages in a chunk of DATA_CHUNK_SIZE */
+#define DATA_CHUNK_PAGES	(DATA_CHUNK_SIZE / BLCKSZ)
+
+/* output of a chunk, pages without hole and their headers */
+#define DATA_OUTBUF_SIZE	(DATA_CHUNK_PAGES * (sizeof(BackupPageHeader) + BLCKSZ))
+
+/*
+ * With --dedup, the page images of the output of backup_data_file() for each
+ * chunk read from a data file, and the other files in chunks of
+ * DATA_CHUNK_SIZE, are stored once by their SHA-256, see dedup.c.
+ */
+#define DEDUP_HASH_LEN		32
+
 
 #define pgBackupRangeIsValid(range)	\
 	(((range)->begin != (time_t) 0) || ((range)->end != (time_t) 0))
@@ -130,6 +187,14 @@ typedef enum BackupStatus
 	BACKUP_STATUS_CORRUPT		/* files are corrupted, not available */
 } BackupStatus;
 
+typedef enum CompressAlgorithm
+{
+	COMPRESS_NONE,
+	COMPRESS_ZLIB,
+	COMPRESS_LZ4,
+	COMPRESS_ZSTD
+} CompressAlgorithm;
+
 typedef enum BackupMode
 {
 	BACKUP_MODE_INVALID,
@@ -149,6 +214,8 @@ typedef struct pgBackup
 	BackupMode	backup_mode;
 	bool		with_serverlog;
 	bool		compress_data;
+	CompressAlgorithm	compress_algorithm;	/* used if compress_data */
+	int			compress_level;	/* 0 means the default of the algorithm */
 	bool		full_backup_on_error;
 
 	/* Status - one of BACKUP_STATUS_xxx */
@@ -179,6 +246,12 @@ typedef struct pgBackup
 	/* if backup from standby or not */
 	bool		is_from_standby;
 
+	/* files were written into the stream given by --output */
+	bool		streamed;
+
+	/* data files were written into the chunk store by --dedup */
+	bool		dedup;
+
 } pgBackup;
 
 typedef struct pgBackupOption
@@ -205,6 +278,8 @@ typedef struct pgBackupOption
 	((HAVE_DATABASE((backup)) ? (backup)->read_data_bytes : 0) + \
 	 (HAVE_ARCLOG((backup)) ? (backup)->read_arclog_bytes : 0) + \
 	 ((backup)->with_serverlog ? (backup)->read_srvlog_bytes : 0))
+#define BACKUP_COMPRESSION(backup)	\
+	((backup)->compress_data ? (backup)->compress_algorithm : COMPRESS_NONE)
 
 typedef struct pgTimeLine
 {
@@ -222,6 +297,16 @@ typedef struct pgRecoveryTarget
 	const char	*recovery_target_action;
 } pgRecoveryTarget;
 
+/*
+ * Backed-up image of a file in one of the backups to be restored.
+ */
+typedef struct pgRestoreSource
+{
+	const char *from_root;		/* database directory of the backup */
+	pgFile	   *file;			/* entry in the file list of the backup */
+	CompressAlgorithm	compress;	/* compression of the backup */
+} pgRestoreSource;
+
 typedef enum CompressionMode
 {
 	NO_COMPRESSION,
@@ -236,6 +321,7 @@ typedef enum CompressionMode
 #define JoinPathEnd(str, prefix) \
 	((strlen(str) <= strlen(prefix)) ? "" : str + strlen(prefix) + 1)
 
+/* in config.c */
 /* path configuration */
 extern char *backup_path;
 extern char *pgdata;
@@ -247,6 +333,18 @@ extern char *pgconf_path;
 extern bool verbose;
 extern bool progress;
 extern bool check;
+extern int num_threads;
+extern bool direct_io;
+extern char *backup_output;
+extern bool use_replication;
+extern char my_exec_path[MAXPGPATH];
+extern bool link_unchanged;
+extern int max_rate;
+extern int max_iops;
+extern char *tablespace_max_rate;
+extern bool verify_checksums;
+extern bool fail_on_checksum_error;
+extern bool resume_backup;
 
 /* current settings */
 extern pgBackup current;
@@ -260,6 +358,8 @@ extern bool data_checksum_enabled;
 /* in backup.c */
 extern int do_backup(pgBackupOption bkupopt);
 extern BackupMode parse_backup_mode(const char *value, int elevel);
+extern bool clone_file(const char *from_path, const char *to_path);
+extern bool is_datafile_path(const char *relative, bool is_pgdata);
 
 /* in restore.c */
 extern int do_restore(const char *target_time,
@@ -267,7 +367,13 @@ extern int do_restore(const char *target_time,
 					  const char *target_inclusive,
 					  const char *target_tli_string,
 					  const char *target_action,
-					  bool is_hard_copy);
+					  bool is_hard_copy,
+					  bool wal_on_demand,
+					  bool delta);
+extern int do_restore_wal(const char *walname, const char *to_path);
+extern int find_file_images(parray *chain, char **roots, parray **lists,
+							pgFile *file, pgFile *key,
+							pgRestoreSource *sources);
 
 /* in init.c */
 extern int do_init(void);
@@ -281,6 +387,9 @@ extern void pgBackupDelete(int keep_generations, int keep_days);
 extern int do_purge(void);
 extern char * getCountSuffix(int number);
 
+/* in merge.c */
+extern int do_merge(pgBackupRange *range);
+
 /* in validate.c */
 extern int do_validate(pgBackupRange *range);
 extern void pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool with_database);
@@ -293,6 +402,7 @@ extern pgBackup *catalog_get_last_arclog_backup(parray *backup_list);
 extern pgBackup *catalog_get_last_srvlog_backup(parray *backup_list);
 
 extern int catalog_lock(void);
+extern int catalog_lock_wait(int timeout);
 extern void catalog_unlock(void);
 
 extern void catalog_init_config(pgBackup *backup);
@@ -300,8 +410,11 @@ extern void check_system_identifier(void);
 extern TimeLineID get_current_timeline(void);
 
 extern void pgBackupWriteConfigSection(FILE *out, pgBackup *backup);
-extern void pgBackupWriteResultSection(FILE *out, pgBackup *backup);
+extern void pgBackupWriteResultSection(FILE *out, pgBackup *backup,
+									   const char *stats);
 extern void pgBackupWriteIni(pgBackup *backup);
+extern void pgBackupWriteIniWithStats(pgBackup *backup, const char *stats);
+extern void catalog_read_stats(const pgBackup *backup, char *buf, size_t size);
 extern void pgBackupGetPath(const pgBackup *backup, char *path, size_t len, const char *subdir);
 extern int pgBackupCreateDir(pgBackup *backup);
 extern void pgBackupFree(void *backup);
@@ -314,11 +427,16 @@ extern void dir_list_file_internal(parray *files, const char *root, const char *
 					bool omit_symlink, bool add_root, parray *black_list);
 extern void dir_print_mkdirs_sh(FILE *out, const parray *files, const char *root);
 extern void dir_print_file_list(FILE *out, const parray *files, const char *root, const char *prefix);
+extern void dir_print_file_index(const char *file_txt, const parray *files,
+								 const char *root, const char *prefix);
+extern void dir_remove_file_index(const char *file_txt);
+extern int dir_rename_file_index(const char *from_txt, const char *to_txt);
 extern parray *dir_read_file_list(const char *root, const char *file_txt);
 
 extern int dir_create_dir(const char *path, mode_t mode);
 extern void dir_copy_files(const char *from_root, const char *to_root);
 extern void delete_parent_dir(const char *path);
+extern int dir_remove_tree(const char *root, bool remove_root);
 
 extern void pgFileDelete(pgFile *file);
 extern void pgFileFree(void *file);
@@ -333,18 +451,179 @@ extern bool xlog_is_complete_wal(const pgFile *file, int wal_segment_size);
 extern bool xlog_logfname2lsn(const char *logfname, XLogRecPtr *lsn);
 extern void xlog_fname(char *fname, size_t len, TimeLineID tli, XLogRecPtr *lsn,
 					   int wal_segment_size);
+extern pgBlockMap *xlog_build_block_map(TimeLineID tli, XLogRecPtr start_lsn,
+										XLogRecPtr end_lsn, int wal_segment_size);
+extern bool xlog_block_map_get(const pgBlockMap *map, const char *rel_path,
+							   BlockNumber **blocks, int *num_blocks);
+extern void xlog_free_block_map(pgBlockMap *map);
 
 /* in data.c */
 extern bool backup_data_file(const char *from_root, const char *to_root,
-							 pgFile *file, const XLogRecPtr *lsn, bool compress, bool prev_file_not_found);
+							 pgFile *file, const XLogRecPtr *lsn, CompressAlgorithm compress, bool prev_file_not_found,
+							 const BlockNumber *blocks, int num_blocks);
 extern void restore_data_file(const char *from_root, const char *to_root,
-							  pgFile *file, bool compress);
+							  pgFile *file, CompressAlgorithm compress,
+							  bool delta);
+extern void restore_data_file_merged(const char *to_root,
+							  pgRestoreSource *sources, int num_sources,
+							  bool delta);
+extern void merge_data_file(const char *to_path, pgFile *file,
+							pgRestoreSource *sources, int num_sources,
+							CompressAlgorithm compress);
+extern void convert_backup_file(const char *from_path, const char *to_path,
+								pgFile *file, CompressAlgorithm from,
+								CompressAlgorithm to);
 extern bool copy_file(const char *from_root, const char *to_root,
-					  pgFile *file, CompressionMode compress);
+					  pgFile *file, CompressionMode mode,
+					  CompressAlgorithm algorithm);
+extern bool backup_wal_file(const char *from_root, const char *to_root,
+							pgFile *file, CompressAlgorithm compress);
+extern bool backup_dedup_file(const char *from_root, const char *to_root,
+							  pgFile *file, CompressAlgorithm compress);
+extern void check_backup_file_crc(const char *path, pg_crc32c expected,
+								  pg_crc32c crc);
+typedef struct pgPageWriter pgPageWriter;
+
+extern pgPageWriter *page_writer_open(const char *to_path, pgFile *file,
+									  CompressAlgorithm compress,
+									  const XLogRecPtr *lsn);
+extern void page_writer_write(pgPageWriter *w, BlockNumber blknum, char *data);
+extern void page_writer_close(pgPageWriter *w, BlockNumber nblocks);
+typedef struct pgCopyWriter pgCopyWriter;
+
+extern pgCopyWriter *copy_writer_open(const char *to_path, pgFile *file,
+									  CompressAlgorithm compress);
+extern void copy_writer_write(pgCopyWriter *w, const char *data, size_t len);
+extern void copy_writer_close(pgCopyWriter *w);
 extern pgFile *write_stop_backup_file(pgBackup *backup, const char *buf, int len, const char *file_name);
 extern bool fileExists(const char *path);
 extern bool get_standby_signal_filepath(char *path, size_t size);
 
+/* in compress.c */
+typedef struct pgCompressor pgCompressor;
+typedef struct pgDecompressor pgDecompressor;
+
+extern CompressAlgorithm parse_compress_algorithm(const char *value, int elevel);
+extern const char *compress_algorithm_name(CompressAlgorithm algorithm);
+extern bool compress_algorithm_supported(CompressAlgorithm algorithm);
+extern int compress_level_max(CompressAlgorithm algorithm);
+extern pgCompressor *compressor_create(CompressAlgorithm algorithm, int level,
+									   FILE *out, const char *path,
+									   pg_crc32c *crc, size_t *write_size);
+extern void compressor_write(pgCompressor *c, const void *data, size_t len);
+extern void compressor_end(pgCompressor *c);
+extern pgDecompressor *decompressor_create(CompressAlgorithm algorithm,
+										   FILE *in, const char *path,
+										   size_t *read_size, pg_crc32c *crc);
+extern size_t decompressor_read(pgDecompressor *d, void *buf, size_t len);
+extern void decompressor_free(pgDecompressor *d);
+
+/* in basebackup.c */
+extern void base_backup_identify_system(uint64 *sysid, TimeLineID *tli);
+extern void base_backup_receive(const char *label, bool smooth,
+								const char *prev_manifest, parray *prev_files,
+								const XLogRecPtr *lsn, const char *root,
+								const char *to_root, const char *manifest_path,
+								parray *received, parray *unchanged,
+								parray *links, pgBackup *backup);
+
+/* in sink.c */
+extern void sink_init(void);
+extern void sink_begin(const pgBackup *backup);
+extern void sink_end(const pgBackup *backup);
+extern bool sink_is_streamed(const char *path);
+extern FILE *sink_open(const char *path);
+extern FILE *sink_open_sized(const char *path, off_t size, mode_t mode);
+extern int sink_close(FILE *fp, const char *path, mode_t mode);
+extern void sink_discard(FILE *fp, const char *path);
+extern void sink_create_dir(const char *path);
+extern bool sink_join_parts(const char *path);
+
+/* in stats.c */
+typedef enum StatsPhase
+{
+	STATS_START_BACKUP,			/* pg_backup_start() with the checkpoint */
+	STATS_LIST_FILES,
+	STATS_COPY_FILES,
+	STATS_STOP_BACKUP,
+	STATS_WAIT_FOR_ARCHIVE,
+	STATS_BASE_BACKUP,			/* BASE_BACKUP with --replication */
+	STATS_BACKUP_ARCLOG,
+	STATS_BACKUP_SRVLOG,
+	STATS_VALIDATE,
+	STATS_RESTORE_FILES,
+	STATS_RESTORE_ARCLOG,
+	STATS_RESTORE_ONLINE_FILES,
+	STATS_NUM_PHASES
+} StatsPhase;
+
+typedef enum StatsCounter
+{
+	STATS_BYTES_READ,
+	STATS_BYTES_WRITTEN,
+	STATS_PAGES_READ,
+	STATS_DATA_READS,			/* reads of data files, of DATA_CHUNK_SIZE at
+								 * most each */
+	STATS_PAGES_SKIPPED,		/* not modified since the LSN, or unchanged
+								 * in $PGDATA by restore --delta */
+	STATS_PAGES_WITH_HOLE,
+	STATS_PAGES_ZERO,			/* all-zero pages written as a run */
+	STATS_PAGES_CORRUPT,		/* failed --verify-checksums */
+	STATS_COMPRESS_USEC,		/* in compression or decompression */
+	STATS_CRC_USEC,				/* in CRC of backup files to validate them */
+	STATS_NUM_COUNTERS
+} StatsCounter;
+
+extern bool stats_enabled;
+
+extern void stats_init(void);
+extern void stats_begin(StatsPhase phase);
+extern void stats_end(StatsPhase phase);
+extern void stats_add(StatsCounter counter, int64 value);
+extern void stats_add_time(StatsCounter counter, const struct timespec *start);
+extern double stats_elapsed(const struct timespec *start);
+extern long stats_count_syscalls(void);
+extern void stats_write_json(const char *command, const char *path);
+extern void stats_summary(char *buf, size_t size);
+extern void stats_add_corrupt_page(const char *path, BlockNumber blkno);
+
+/* in dedup.c */
+extern void dedup_write_chunk(FILE *out, const char *path,
+							  const BackupPageHeader *headers, uint32 nheaders,
+							  const char *data, size_t len,
+							  CompressAlgorithm compress, pg_crc32c *crc,
+							  size_t *write_size);
+extern int64 dedup_written_bytes(void);
+extern bool dedup_open_ref(FILE *in, const char *path,
+						   CompressAlgorithm *compress, pg_crc32c *crc);
+extern bool dedup_read_chunk(FILE *in, const char *path,
+							 CompressAlgorithm compress, char *buf, size_t size,
+							 size_t *len, pg_crc32c *crc);
+extern bool dedup_file_is_ref(const char *path);
+extern bool dedup_validate_file(const char *path, bool size_only);
+extern void dedup_write_chunk_list(const pgBackup *backup);
+extern void dedup_collect_garbage(void);
+
+/* in throttle.c */
+extern void throttle_init(int max_rate, int max_iops);
+extern void throttle_add_tablespace(Oid spcoid, int max_rate);
+extern int throttle_tablespace(const char *path);
+extern void throttle_read(int tablespace, size_t bytes);
+
+/* in checksum.c */
+typedef enum PageChecksumResult
+{
+	CHECKSUM_OK,
+	CHECKSUM_SKIPPED,			/* new, or written after the backup started */
+	CHECKSUM_FAILED
+} PageChecksumResult;
+
+extern void checksum_verify_pages(char *buf, int npages, BlockNumber blkno,
+								  XLogRecPtr start_lsn,
+								  PageChecksumResult *results);
+extern void checksum_report_failure(const char *path, BlockNumber blkno);
+extern int64 checksum_failures(void);
+
 /* in util.c */
 extern void time2iso(char *buf, size_t len, time_t time);
 extern const char *status2str(BackupStatus status);
@@ -17,6 +17,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <pwd.h>
+#include <pthread.h>
 
 #include "pgut.h"
 
@@ -52,6 +53,18 @@ static PGcancel *volatile cancel_conn = NULL;
 bool			interrupted = false;
 static bool		in_cleanup = false;
 
+/* worker threads started by pgut_run_threads() */
+bool			thread_failed = false;
+static bool		threads_running = false;
+static pthread_t main_thread;
+static int		thread_exitcode = 0;
+static pgut_thread_fn thread_fn = NULL;
+static void	   *thread_arg = NULL;
+
+/* serializes error reporting among threads */
+static pthread_once_t	elog_lock_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t	elog_lock;
+
 /* log min messages */
 int		pgut_log_level = INFO;
 int		pgut_abort_level = ERROR;
@@ -60,6 +73,7 @@ int		pgut_abort_level = ERROR;
 /* Connection routines */
 static void init_cancel_handler(void);
 static void on_before_exec(PGconn *conn);
+static PGconn *pgut_connect_internal(bool replication);
 static void on_after_exec(void);
 static void on_interrupt(void);
 static void on_cleanup(void);
@@ -907,6 +921,22 @@ prompt_for_password(const char *username)
 
 PGconn *
 pgut_connect(void)
+{
+	return pgut_connect_internal(false);
+}
+
+/*
+ * Connect to the server as a physical replication client, which accepts
+ * the replication commands like BASE_BACKUP instead of SQL.
+ */
+PGconn *
+pgut_connect_replication(void)
+{
+	return pgut_connect_internal(true);
+}
+
+static PGconn *
+pgut_connect_internal(bool replication)
 {
 	PGconn	   *conn;
 
@@ -923,7 +953,7 @@ pgut_connect(void)
 	/* Start the connection. Loop until we have a password if requested by backend. */
 	for (;;)
 	{
-#define PARAMS_ARRAY_SIZE	7
+#define PARAMS_ARRAY_SIZE	8
 
 		const char *keywords[PARAMS_ARRAY_SIZE];
 		const char *values[PARAMS_ARRAY_SIZE];
@@ -940,8 +970,10 @@ pgut_connect(void)
 		values[4] = password;
 		keywords[5] = "fallback_application_name";
 		values[5] = PROGRAM_NAME;
-		keywords[6] = NULL;
-		values[6] = NULL;
+		keywords[6] = replication ? "replication" : NULL;
+		values[6] = replication ? "true" : NULL;
+		keywords[7] = NULL;
+		values[7] = NULL;
 
 		conn = PQconnectdbParams(keywords, values, true);
 
@@ -949,6 +981,10 @@ pgut_connect(void)
 		{
 			PGresult   *res;
 
+			/* a replication connection doesn't run SQL */
+			if (replication)
+				return conn;
+
 			res = PQexec(conn, ALWAYS_SECURE_SEARCH_PATH_SQL);
 			if (PQresultStatus(res) != PGRES_TUPLES_OK)
 			{
@@ -1280,6 +1316,35 @@ pgut_errinit(int elevel)
 	return edata;
 }
 
+/*
+ * The error data is shared by all threads, so it's locked from
+ * pgut_errstart() (or elog()) until pgut_errfinish().  The lock is
+ * recursive because cleanup callbacks run on exit may report errors too.
+ */
+static void
+elog_lock_init(void)
+{
+	pthread_mutexattr_t	attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&elog_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void
+elog_acquire(void)
+{
+	pthread_once(&elog_lock_once, elog_lock_init);
+	pthread_mutex_lock(&elog_lock);
+}
+
+static void
+elog_release(void)
+{
+	pthread_mutex_unlock(&elog_lock);
+}
+
 bool
 pgut_errstart(int elevel)
 {
@@ -1288,6 +1353,7 @@ pgut_errstart(int elevel)
 	if (elevel < pgut_abort_level && elevel < pgut_log_level && !debug)
 		return false;
 	
+	elog_acquire();
 	pgut_errinit(elevel);
 	return true;
 }
@@ -1296,6 +1362,8 @@ void
 pgut_errfinish(int dummy, ...)
 {
 	pgutErrorData	*edata = getErrorData();
+	int				elevel = edata->elevel;
+	int				ecode = edata->ecode;
 
 	if (edata->elevel >= pgut_log_level || debug)
 		pgut_error(edata->elevel,
@@ -1303,8 +1371,10 @@ pgut_errfinish(int dummy, ...)
 				edata->detail.data,
 				edata->hint.data);
 
-	if (pgut_abort_level <= edata->elevel && edata->elevel <= PANIC)
-		exit_or_abort(edata->ecode);
+	elog_release();
+
+	if (pgut_abort_level <= elevel && elevel <= PANIC)
+		exit_or_abort(ecode);
 }
 
 void
@@ -1437,6 +1507,7 @@ elog(int elevel, const char *fmt, ...)
 	if (elevel < pgut_abort_level && elevel < pgut_log_level && !debug)
 		return;
 
+	elog_acquire();
 	edata = pgut_errinit(elevel);
 
 	do
@@ -1650,10 +1721,87 @@ exit_or_abort(int exitcode)
 		call_atexit_callbacks(true);
 		abort();
 	}
+	else if (threads_running && !pthread_equal(pthread_self(), main_thread))
+	{
+		/*
+		 * Error in a worker thread.  Only this thread is terminated here,
+		 * pgut_run_threads() exits with the code once all workers are done.
+		 */
+		elog_acquire();
+		if (!thread_failed)
+		{
+			thread_failed = true;
+			thread_exitcode = exitcode;
+		}
+		elog_release();
+		pthread_exit(NULL);
+	}
 	else	
 		exit(exitcode);		/* normal exit */
 }
 
+static void *
+thread_start(void *arg)
+{
+	thread_fn(thread_arg);
+	return NULL;
+}
+
+/*
+ * Call fn(arg) in num_threads threads and wait for all of them to finish.
+ * fn must check thread_failed to stop early when another worker failed.
+ * If any worker ends with an error, exit with its exit code as if the
+ * error was raised in the calling thread.  With num_threads <= 1, fn is
+ * just called in the current thread.
+ */
+void
+pgut_run_threads(int num_threads, pgut_thread_fn fn, void *arg)
+{
+	pthread_t  *threads;
+	int			num_started;
+	int			ret = 0;
+	int			i;
+
+	if (num_threads <= 1)
+	{
+		fn(arg);
+		return;
+	}
+
+	threads = pgut_newarray(pthread_t, num_threads);
+	thread_fn = fn;
+	thread_arg = arg;
+	thread_failed = false;
+	thread_exitcode = 0;
+	main_thread = pthread_self();
+	threads_running = true;
+
+	for (num_started = 0; num_started < num_threads; num_started++)
+	{
+		ret = pthread_create(&threads[num_started], NULL, thread_start, NULL);
+		if (ret != 0)
+		{
+			/* stop the workers already started */
+			thread_failed = true;
+			break;
+		}
+	}
+
+	for (i = 0; i < num_started; i++)
+		pthread_join(threads[i], NULL);
+
+	threads_running = false;
+	free(threads);
+
+	if (ret != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not create worker thread: %s", strerror(ret))));
+
+	if (thread_failed)
+		exit_or_abort(thread_exitcode);
+}
+
 void
 help(bool details)
 {
@@ -74,6 +74,7 @@ typedef struct pgut_option
 
 typedef void (*pgut_optfn) (pgut_option *opt, const char *arg);
 typedef void (*pgut_atexit_callback)(bool fatal, void *userdata);
+typedef void (*pgut_thread_fn)(void *arg);
 
 /*
  * pgut client variables and functions
@@ -100,17 +101,20 @@ extern YesNo	prompt_password;
 
 extern PGconn	   *connection;
 extern bool			interrupted;
+extern bool			thread_failed;
 
 extern void help(bool details);
 extern int pgut_getopt(int argc, char **argv, pgut_option options[]);
 extern void pgut_readopt(const char *path, pgut_option options[], int elevel);
 extern void pgut_atexit_push(pgut_atexit_callback callback, void *userdata);
 extern void pgut_atexit_pop(pgut_atexit_callback callback, void *userdata);
+extern void pgut_run_threads(int num_threads, pgut_thread_fn fn, void *arg);
 
 /*
  * Database connections
  */
 extern PGconn *pgut_connect(void);
+extern PGconn *pgut_connect_replication(void);
 extern void pgut_disconnect(PGconn *conn);
 extern PGresult *pgut_execute(PGconn* conn, const char *query, int nParams, const char **params);
 extern void pgut_command(PGconn* conn, const char *query, int nParams, const char **params);
@@ -10,6 +10,7 @@
 #include "pg_rman.h"
 
 #include <fcntl.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -22,10 +23,12 @@
 #define POSTGRES_CONF_TMP "postgresql.conf.pg_rman.tmp"
 #define PG_RMAN_RECOVERY_CONF "pg_rman_recovery.conf"
 #define PG_RMAN_COMMENT "# added by pg_rman"
+#define RESTORE_WAL_TMP_DIR ".pg_rman_restore_wal"
+#define WAL_READ_AHEAD 8		/* segments restored ahead by restore-wal */
 
 static void backup_online_files(bool re_recovery);
 static void restore_online_files(void);
-static void restore_database(pgBackup *backup);
+static void restore_database(parray *chain);
 static void restore_archive_logs(pgBackup *backup, bool is_hard_copy);
 
 static void append_include_directive_for_pg_rman(void);
@@ -62,6 +65,64 @@ static void print_backup_id(const pgBackup *backup);
 static void search_next_wal(const char *path, uint32 *needId, uint32 *needSeg, parray *timelines);
 
 static int wal_segment_size = 0;
+static bool wal_on_demand = false;	/* restore archived WAL by restore-wal */
+static bool delta_restore = false;	/* keep files and pages in PGDATA */
+
+/* a file to be restored and its images to restore from */
+typedef struct restore_file
+{
+	pgFile			   *file;			/* entry in the newest file list */
+	int					num_sources;
+	pgRestoreSource		sources[1];		/* ordered from the newest */
+} restore_file;
+
+/* arguments and shared state of restore_database() workers */
+typedef struct restore_files_arg
+{
+	const char		   *from_root;		/* database directory of the newest
+										 * backup */
+	parray			   *files;			/* list of restore_file */
+
+	/* protected by lock */
+	pthread_mutex_t		lock;
+	int					next_file;		/* index of next file in files */
+	int					num_processed;
+	int					num_skipped;
+} restore_files_arg;
+
+/* arguments and shared state of restore_archive_logs() workers */
+typedef struct restore_arclog_arg
+{
+	const pgBackup	   *backup;
+	const char		   *base_path;		/* arclog directory of the backup */
+	parray			   *files;			/* list of pgFile */
+	bool				is_hard_copy;
+
+	/* protected by lock */
+	pthread_mutex_t		lock;
+	int					next_file;		/* index of next file in files */
+	int					num_processed;
+	int					num_skipped;
+} restore_arclog_arg;
+
+/* an archived WAL segment found in a backup by restore-wal */
+typedef struct archived_wal
+{
+	const char		   *name;			/* points into file->path */
+	const pgBackup	   *backup;
+	const char		   *base_path;		/* arclog directory of the backup */
+	pgFile			   *file;
+} archived_wal;
+
+/* arguments and shared state of the workers reading ahead archived WAL */
+typedef struct read_ahead_wal_arg
+{
+	parray			   *wals;			/* list of archived_wal */
+
+	/* protected by lock */
+	pthread_mutex_t		lock;
+	int					next_wal;		/* index of next WAL in wals */
+} read_ahead_wal_arg;
 
 int
 do_restore(const char *target_time,
@@ -69,7 +130,9 @@ do_restore(const char *target_time,
 		   const char *target_inclusive,
 		   const char *target_tli_string,
 		   const char *target_action,
-		   bool is_hard_copy)
+		   bool is_hard_copy,
+		   bool on_demand,
+		   bool delta)
 {
 	int i;
 	int base_index;				/* index of base (full) backup */
@@ -80,6 +143,7 @@ do_restore(const char *target_time,
 	TimeLineID	cur_tli;
 	TimeLineID	backup_tli;
 	parray *backups;
+	parray *chain;				/* base backup and following incrementals */
 	pgBackup *base_backup = NULL;
 	parray *files;
 	parray *timelines;
@@ -111,6 +175,9 @@ do_restore(const char *target_time,
 	if (pgconf_path == NULL)
 		pgconf_path = pgdata;
 
+	wal_on_demand = on_demand;
+	delta_restore = delta;
+
 	if (verbose)
 	{
 		printf(_("========================================\n"));
@@ -228,17 +295,16 @@ do_restore(const char *target_time,
 			base_backup->status != BACKUP_STATUS_OK)
 			continue;
 
-#ifndef HAVE_LIBZ
 		/* Make sure we won't need decompression we haven't got */
-		if (base_backup->compress_data &&
+		if (!compress_algorithm_supported(BACKUP_COMPRESSION(base_backup)) &&
 			(HAVE_DATABASE(base_backup) || HAVE_ARCLOG(base_backup)))
 		{
 			ereport(ERROR,
 				(errcode(ERROR_SYSTEM),
 				 errmsg("could not restore from compressed backup"),
-				 errdetail("Compression is not supported in this installation.")));
+				 errdetail("%s compression is not supported in this installation.",
+					compress_algorithm_name(base_backup->compress_algorithm))));
 		}
-#endif
 		if (satisfy_timeline(timelines, base_backup) && satisfy_recovery_target(base_backup, rt))
 		{
 			time2iso(timestamp, lengthof(timestamp), base_backup->start_time);
@@ -267,8 +333,32 @@ base_backup_found:
 	 * but we could not find a valid base backup based on user specified
 	 * restore options (perhaps a mistake on user's part but we should be
 	 * cautious.)
+	 *
+	 * With --delta, the files are kept to be compared with the backup, and
+	 * the files not in the backup are deleted by restore_database().  Only
+	 * WAL is cleared, which is excluded from the backup and put back by
+	 * restore_online_files().
 	 */
-	if (!check)
+	if (!check && delta_restore)
+	{
+		char	pg_wal_path[MAXPGPATH];
+		int		x;
+
+		if (verbose)
+			printf(_("----------------------------------------\n"));
+
+		elog(INFO, "clearing WAL in restore destination");
+		join_path_components(pg_wal_path, pgdata, "pg_wal");
+		files = parray_new();
+		dir_list_file(files, pg_wal_path, NULL, false, false);
+		parray_qsort(files, pgFileComparePathDesc);	/* delete from leaf */
+
+		for (x = 0; x < parray_num(files); x++)
+			pgFileDelete((pgFile *) parray_get(files, x));
+		parray_walk(files, pgFileFree);
+		parray_free(files);
+	}
+	else if (!check)
 	{
 		int x;
 
@@ -295,12 +385,13 @@ base_backup_found:
 	if (verbose)
 		print_backup_id(base_backup);
 
-	/* restore base backup */
-	restore_database(base_backup);
+	/* restore base backup and following incremental backups together */
+	chain = parray_new();
+	parray_append(chain, base_backup);
 
 	last_restored_index = base_index;
 
-	/* restore following incremental backup */
+	/* search following incremental backup */
 	if (verbose)
 		printf(_("----------------------------------------\n"));
 	elog(INFO, "searching incremental backup to be restored");
@@ -328,10 +419,13 @@ base_backup_found:
 		elog(DEBUG, "found the incremental backup can be used in recovery: \"%s\"",
 			timestamp);
 
-		restore_database(backup);
+		parray_append(chain, backup);
 		last_restored_index = i;
 	}
 
+	restore_database(chain);
+	parray_free(chain);
+
 	/*
 	 * Restore archived WAL which backed up with or after last restored backup.
 	 * We don't check the backup->tli because a backup of archived WAL
@@ -362,7 +456,11 @@ base_backup_found:
 		if (!satisfy_timeline(timelines, backup))
 			continue;
 
-		restore_archive_logs(backup, is_hard_copy);
+		/* with --wal-on-demand, they are restored by restore_command */
+		if (on_demand)
+			pgBackupValidate(backup, true, false, false);
+		else
+			restore_archive_logs(backup, is_hard_copy);
 
 		if (check)
 		{
@@ -374,7 +472,9 @@ base_backup_found:
 	}
 
 	/* copy online WAL backup to $PGDATA/pg_wal */
+	stats_begin(STATS_RESTORE_ONLINE_FILES);
 	restore_online_files();
+	stats_end(STATS_RESTORE_ONLINE_FILES);
 
 	if (check)
 	{
@@ -398,6 +498,15 @@ base_backup_found:
 	configure_recovery_options(target_time, target_xid, target_inclusive,
 								 target_action, target_tli, target_tli_latest);
 
+	/* statistics of --stats=json */
+	if (stats_enabled)
+	{
+		char	path[MAXPGPATH];
+
+		join_path_components(path, backup_path, "restore_" STATS_FILE);
+		stats_write_json("restore", path);
+	}
+
 	/* release catalog lock */
 	catalog_unlock();
 
@@ -420,107 +529,149 @@ base_backup_found:
 }	
 
 /*
- * Validate and restore backup.
+ * Print the result of restoring a file in verbose mode and the progress in
+ * non-verbose format.
  */
-void
-restore_database(pgBackup *backup)
+static void
+restore_files_report(restore_files_arg *args, pgFile *file, bool skipped,
+					 const char *status)
 {
-	char	timestamp[100];
-	char	path[MAXPGPATH];
-	char	list_path[MAXPGPATH];
-	int		ret;
-	parray *files;
-	int		i;
-	int		num_skipped = 0;
+	unsigned long	num_files = (unsigned long) parray_num(args->files);
 
-	/* confirm block size compatibility */
-	if (backup->block_size != BLCKSZ)
-		ereport(ERROR,
-			(errcode(ERROR_PG_INCOMPATIBLE),
-			 errmsg("BLCKSZ(%d) is not compatible (%d expected)",
-				backup->block_size, BLCKSZ)));
-	if (backup->wal_block_size != XLOG_BLCKSZ)
-		ereport(ERROR,
-			(errcode(ERROR_PG_INCOMPATIBLE),
-			 errmsg("XLOG_BLCKSZ(%d) is not compatible (%d expected)",
-				backup->wal_block_size, XLOG_BLCKSZ)));
+	pthread_mutex_lock(&args->lock);
 
-	time2iso(timestamp, lengthof(timestamp), backup->start_time);
+	args->num_processed++;
+	if (skipped)
+		args->num_skipped++;
+
+	/* print progress in verbose mode */
 	if (verbose && !check)
+		printf(_("(%d/%lu) %s %s\n"), args->num_processed, num_files,
+			file->path + strlen(args->from_root) + 1, status);
+	/* print progress in non-verbose format */
+	else if (progress)
 	{
-		printf(_("----------------------------------------\n"));
+		fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
+				args->num_processed, num_files, args->num_skipped);
+		if (args->num_processed < num_files)
+			fprintf(stderr, "\r");
+		else
+			fprintf(stderr, "\n");
 	}
 
-	/*
-	 * Validate backup files with its size, because load of CRC calculation is
-	 * not light.
-	 */
-	pgBackupValidate(backup, true, false, true);
+	pthread_mutex_unlock(&args->lock);
+}
 
-	if (backup->backup_mode == BACKUP_MODE_FULL)
-		elog(INFO, "restoring database files from the full mode backup \"%s\"",
-			timestamp);
-	else if (backup->backup_mode == BACKUP_MODE_INCREMENTAL)
-		elog(INFO, "restoring database files from the incremental mode backup \"%s\"",
-			timestamp);
+/*
+ * With --delta, return true if the file in $PGDATA is the same as the image
+ * of a non-data file taken without compression, i.e. it has the size and
+ * CRC in the file list.  The mtime is not compared since restored files get
+ * new ones.
+ */
+static bool
+file_is_unchanged(const pgRestoreSource *source)
+{
+	pgFile	   *file;
+	struct stat	st;
+	bool		unchanged;
 
-	/* make directories and symbolic links */
-	pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
-	if (!check)
-	{
-		char pwd[MAXPGPATH];
+	if (source->file->is_datafile || source->compress != COMPRESS_NONE)
+		return false;
 
-		/* keep original directory */
-		if (getcwd(pwd, sizeof(pwd)) == NULL)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not get current working directory: %s", strerror(errno))));
+	file = (pgFile *) pgut_malloc(offsetof(pgFile, path) + MAXPGPATH);
+	memset(file, 0, offsetof(pgFile, path));
+	join_path_components(file->path, pgdata,
+						 source->file->path + strlen(source->from_root) + 1);
 
-		/* create pgdata directory */
-		dir_create_dir(pgdata, DIR_PERMISSION);
+	unchanged = (lstat(file->path, &st) == 0 && S_ISREG(st.st_mode) &&
+				 st.st_size == source->file->write_size &&
+				 pgFileGetCRC(file) == source->file->crc);
 
-		/* change directory to pgdata */
-		if (chdir(pgdata))
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not change directory: %s", strerror(errno))));
+	/* the mode may differ even if the content is the same */
+	if (unchanged && chmod(file->path, source->file->mode) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not change mode of \"%s\": %s", file->path,
+				strerror(errno))));
 
-		/* Execute mkdirs.sh */
-		ret = system(path);
-		if (ret != 0)
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not execute mkdirs.sh: %s", strerror(errno))));
+	free(file);
 
-		/* go back to original directory */
-		if (chdir(pwd))
-			ereport(ERROR,
-				(errcode(ERROR_SYSTEM),
-				 errmsg("could not change directory: %s", strerror(errno))));
+	return unchanged;
+}
+
+/*
+ * Restore a file from its images.  If all of them are images of a data file,
+ * they are merged so that each block is written only once.  Otherwise,
+ * restore them in turn from the oldest one.  Returns false if the file is
+ * kept as is with --delta.
+ */
+static bool
+restore_file_from_sources(restore_file *rfile)
+{
+	int		i;
+
+	for (i = 0; i < rfile->num_sources; i++)
+	{
+		if (!rfile->sources[i].file->is_datafile)
+			break;
+	}
+
+	if (rfile->num_sources > 1 && i == rfile->num_sources)
+	{
+		restore_data_file_merged(pgdata, rfile->sources, rfile->num_sources,
+								 delta_restore);
+		return true;
 	}
 
+	if (delta_restore && rfile->num_sources == 1 &&
+		file_is_unchanged(&rfile->sources[0]))
+		return false;
+
 	/*
-	 * get list of files which need to be restored.
+	 * Images restored in turn can't be compared with the existing file, so
+	 * restore them from scratch.
 	 */
-	pgBackupGetPath(backup, path, lengthof(path), DATABASE_DIR);
-	pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
-	files = dir_read_file_list(path, list_path);
-	for (i = parray_num(files) - 1; i >= 0; i--)
+	if (delta_restore && rfile->num_sources > 1)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
+		char	path[MAXPGPATH];
 
-		/* remove files which are not backed up */
-		if (file->write_size == BYTES_INVALID)
-			pgFileFree(parray_remove(files, i));
+		join_path_components(path, pgdata, rfile->file->path +
+							 strlen(rfile->sources[0].from_root) + 1);
+		if (unlink(path) == -1 && errno != ENOENT)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not remove file \"%s\": %s", path,
+					strerror(errno))));
 	}
 
-	/* restore files into $PGDATA */
-	for (i = 0; i < parray_num(files); i++)
+	for (i = rfile->num_sources - 1; i >= 0; i--)
 	{
-		char from_root[MAXPGPATH];
-		pgFile *file = (pgFile *) parray_get(files, i);
+		pgRestoreSource *source = &rfile->sources[i];
+
+		restore_data_file(source->from_root, pgdata, source->file,
+						  source->compress,
+						  delta_restore && rfile->num_sources == 1);
+	}
+
+	return true;
+}
+
+/*
+ * Restore the files listed in args->files until there is no file left.
+ * This is run by each of the restore_database() workers.  Files are handed
+ * out one by one under the lock, so two workers never write the same file.
+ */
+static void
+restore_files_worker(void *arg)
+{
+	restore_files_arg  *args = (restore_files_arg *) arg;
 
-		pgBackupGetPath(backup, from_root, lengthof(from_root), DATABASE_DIR);
+	for (;;)
+	{
+		restore_file   *rfile;
+		char			status[100];
+		size_t			write_size = 0;
+		int				i;
 
 		/* check for interrupt */
 		if (interrupted)
@@ -528,61 +679,265 @@ restore_database(pgBackup *backup)
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during restore database")));
 
-		/* print progress in verbose mode */
-		if (verbose && !check)
-			printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
-				file->path + strlen(from_root) + 1);
+		/* another worker failed, the restore is going to be aborted */
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_file >= parray_num(args->files))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		rfile = (restore_file *) parray_get(args->files, args->next_file++);
+		pthread_mutex_unlock(&args->lock);
 
 		/* directories are created with mkdirs.sh */
-		if (S_ISDIR(file->mode))
+		if (S_ISDIR(rfile->file->mode))
 		{
-			num_skipped++;
-			if (verbose && !check)
-				printf(_("directory, skip\n"));
-			goto show_progress;
+			restore_files_report(args, rfile->file, true, _("directory, skip"));
+			continue;
 		}
 
 		/* not backed up */
-		if (file->write_size == BYTES_INVALID)
+		if (rfile->num_sources == 0)
 		{
-			num_skipped++;
-			if (verbose && !check)
-				printf(_("not backed up, skip\n"));
-			goto show_progress;
+			restore_files_report(args, rfile->file, true, _("not backed up, skip"));
+			continue;
 		}
 
 		/* restore file */
-		if (!check)
-			restore_data_file(from_root, pgdata, file, backup->compress_data);
+		if (!check && !restore_file_from_sources(rfile))
+		{
+			restore_files_report(args, rfile->file, true, _("unchanged, skip"));
+			continue;
+		}
 
 		/* print size of restored file */
-		if (verbose && !check)
+		for (i = 0; i < rfile->num_sources; i++)
+			write_size += rfile->sources[i].file->write_size;
+		if (!check)
+			stats_add(STATS_BYTES_READ, write_size);
+		if (rfile->num_sources > 1)
+			snprintf(status, lengthof(status), _("restored %lu from %d backups"),
+					 (unsigned long) write_size, rfile->num_sources);
+		else
+			snprintf(status, lengthof(status), _("restored %lu"),
+					 (unsigned long) write_size);
+		restore_files_report(args, rfile->file, false, status);
+	}
+}
+
+/*
+ * Find the images of file, in the file list of the newest backup of chain,
+ * to restore it from.  chain is ordered from the full backup, and roots and
+ * lists have the database directory and the file list of each backup.  The
+ * images are stored into sources ordered from the newest one, and the number
+ * is returned.  key must have room for a path of MAXPGPATH.
+ *
+ * Look back the backups from the newest one until an entire image of the
+ * file is found.  The files not backed up are not modified since the
+ * previous backup, and a file not in a file list didn't exist at the backup.
+ */
+int
+find_file_images(parray *chain, char **roots, parray **lists, pgFile *file,
+				 pgFile *key, pgRestoreSource *sources)
+{
+	int			num_backups = parray_num(chain);
+	const char *rel_path = file->path + strlen(roots[num_backups - 1]) + 1;
+	int			num_sources = 0;
+	int			j;
+
+	for (j = num_backups - 1; j >= 0 && !S_ISDIR(file->mode); j--)
+	{
+		pgBackup	   *backup = (pgBackup *) parray_get(chain, j);
+		pgFile		   *image = file;
+		pgRestoreSource *source;
+
+		if (j < num_backups - 1)
 		{
-			printf(_("restored %lu\n"), (unsigned long) file->write_size);
+			pgFile	  **p;
+
+			join_path_components(key->path, roots[j], rel_path);
+			p = (pgFile **) parray_bsearch(lists[j], key, pgFileComparePath);
+			if (p == NULL || S_ISDIR((*p)->mode))
+				break;
+			image = *p;
+		}
+
+		if (image->write_size == BYTES_INVALID)
 			continue;
+
+		source = &sources[num_sources++];
+		source->from_root = roots[j];
+		source->file = image;
+		source->compress = BACKUP_COMPRESSION(backup);
+
+		/* older images are overwritten by an entire image */
+		if (!image->is_datafile || image->is_entire ||
+			backup->backup_mode == BACKUP_MODE_FULL)
+			break;
+	}
+
+	return num_sources;
+}
+
+/*
+ * Validate and restore a full backup and following incremental backups.
+ * chain is ordered from the full backup.
+ *
+ * Instead of restoring each backup over the previous one, the images of a
+ * file taken by the backups are merged and written at once.  So a block
+ * modified in several backups is written only once, and the files which
+ * are not in the file list are deleted only once.
+ */
+static void
+restore_database(parray *chain)
+{
+	int			num_backups = parray_num(chain);
+	char		timestamp[100];
+	char		path[MAXPGPATH];
+	char		list_path[MAXPGPATH];
+	int			ret;
+	char	  **roots;			/* database directory of each backup */
+	parray	  **lists;			/* file list of each backup */
+	parray	   *newest_files;
+	parray	   *files;
+	pgFile	   *key;
+	int			i;
+	int			j;
+	restore_files_arg	args;
+
+	roots = pgut_newarray(char *, num_backups);
+	lists = pgut_newarray(parray *, num_backups);
+
+	for (j = 0; j < num_backups; j++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(chain, j);
+
+		/* confirm block size compatibility */
+		if (backup->block_size != BLCKSZ)
+			ereport(ERROR,
+				(errcode(ERROR_PG_INCOMPATIBLE),
+				 errmsg("BLCKSZ(%d) is not compatible (%d expected)",
+					backup->block_size, BLCKSZ)));
+		if (backup->wal_block_size != XLOG_BLCKSZ)
+			ereport(ERROR,
+				(errcode(ERROR_PG_INCOMPATIBLE),
+				 errmsg("XLOG_BLCKSZ(%d) is not compatible (%d expected)",
+					backup->wal_block_size, XLOG_BLCKSZ)));
+
+		time2iso(timestamp, lengthof(timestamp), backup->start_time);
+		if (verbose && !check)
+		{
+			printf(_("----------------------------------------\n"));
 		}
 
-show_progress:
-		/* print progress in non-verbose format */
-		if (progress)
+		/*
+		 * Validate backup files with its size before starting to overwrite
+		 * the cluster.  CRC of each file is checked while restoring it.
+		 */
+		pgBackupValidate(backup, true, false, true);
+
+		if (backup->backup_mode == BACKUP_MODE_FULL)
+			elog(INFO, "restoring database files from the full mode backup \"%s\"",
+				timestamp);
+		else if (backup->backup_mode == BACKUP_MODE_INCREMENTAL)
+			elog(INFO, "restoring database files from the incremental mode backup \"%s\"",
+				timestamp);
+
+		/* make directories and symbolic links */
+		pgBackupGetPath(backup, path, lengthof(path), MKDIRS_SH_FILE);
+		if (!check)
 		{
-			fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
-					i + 1, (unsigned long) parray_num(files), num_skipped);
-			if(i + 1 < (unsigned long) parray_num(files))
-				fprintf(stderr, "\r");
-			else
-				fprintf(stderr, "\n");
+			char pwd[MAXPGPATH];
+
+			/* keep original directory */
+			if (getcwd(pwd, sizeof(pwd)) == NULL)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not get current working directory: %s", strerror(errno))));
+
+			/* create pgdata directory */
+			dir_create_dir(pgdata, DIR_PERMISSION);
+
+			/* change directory to pgdata */
+			if (chdir(pgdata))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not change directory: %s", strerror(errno))));
+
+			/* Execute mkdirs.sh */
+			ret = system(path);
+			if (ret != 0)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not execute mkdirs.sh: %s", strerror(errno))));
+
+			/* go back to original directory */
+			if (chdir(pwd))
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not change directory: %s", strerror(errno))));
 		}
+
+		/* get list of files in the backup, which is sorted by path */
+		roots[j] = pgut_malloc(MAXPGPATH);
+		pgBackupGetPath(backup, roots[j], MAXPGPATH, DATABASE_DIR);
+		pgBackupGetPath(backup, list_path, lengthof(list_path), DATABASE_FILE_LIST);
+		lists[j] = dir_read_file_list(roots[j], list_path);
+	}
+
+	/* find the images to restore each file in the newest backup from */
+	newest_files = lists[num_backups - 1];
+	key = (pgFile *) pgut_malloc(offsetof(pgFile, path) + MAXPGPATH);
+	files = parray_new();
+	for (i = 0; i < parray_num(newest_files); i++)
+	{
+		pgFile		   *file = (pgFile *) parray_get(newest_files, i);
+		restore_file   *rfile;
+
+		rfile = pgut_malloc(offsetof(restore_file, sources) +
+							sizeof(pgRestoreSource) * num_backups);
+		rfile->file = file;
+		rfile->num_sources = find_file_images(chain, roots, lists, file, key,
+											  rfile->sources);
+
+		parray_append(files, rfile);
+	}
+	free(key);
+
+	/* restore files into $PGDATA */
+	args.from_root = roots[num_backups - 1];
+	args.files = files;
+	args.next_file = 0;
+	args.num_processed = 0;
+	args.num_skipped = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	stats_begin(STATS_RESTORE_FILES);
+	pgut_run_threads(Min(num_threads, (int) parray_num(files)),
+					 restore_files_worker, &args);
+	stats_end(STATS_RESTORE_FILES);
+
+	pthread_mutex_destroy(&args.lock);
+
+	parray_walk(files, free);
+	parray_free(files);
+	for (j = 0; j < num_backups; j++)
+	{
+		parray_walk(lists[j], pgFileFree);
+		parray_free(lists[j]);
+		free(roots[j]);
 	}
+	free(lists);
+	free(roots);
 
-	/* Delete files which are not in file list. */
+	/* Delete files which are not in file list of the newest backup. */
 	if (!check)
 	{
 		parray *files_now;
 
-		parray_walk(files, pgFileFree);
-		parray_free(files);
-
 		/* re-read file list to change base path to $PGDATA */
 		files = dir_read_file_list(pgdata, list_path);
 		parray_qsort(files, pgFileComparePathDesc);
@@ -608,6 +963,8 @@ show_progress:
 
 		parray_walk(files_now, pgFileFree);
 		parray_free(files_now);
+		parray_walk(files, pgFileFree);
+		parray_free(files);
 	}
 
 	/* remove postmaster.pid */
@@ -617,48 +974,104 @@ show_progress:
 			(errcode(ERROR_SYSTEM),
 			 errmsg("could not remove postmaster.pid: %s", strerror(errno))));
 
-	/* cleanup */
-	parray_walk(files, pgFileFree);
-	parray_free(files);
-
 	if (verbose && !check)
 		printf(_("restore backup completed\n"));
 }
 
 /*
- * Restore archived WAL by creating symbolic link which linked to backup WAL in
- * archive directory.
+ * Restore an archived WAL file in the backup into to_root, which is
+ * arclog_path or a directory on the same file system to be renamed from.
+ * Returns the status to report.
  */
-void
-restore_archive_logs(pgBackup *backup, bool is_hard_copy)
+static const char *
+restore_wal_file(const pgBackup *backup, const char *base_path, pgFile *file,
+				 const char *to_root, bool is_hard_copy)
 {
-	int i;
-	int num_skipped = 0;
-	char timestamp[100];
-	parray *files;
-	char path[MAXPGPATH];
-	char list_path[MAXPGPATH];
-	char base_path[MAXPGPATH];
+	char		path[MAXPGPATH];
+	pg_crc32c	crc = file->crc;
+
+	join_path_components(path, to_root, file->path + strlen(base_path) + 1);
+
+	/* even same file exist, use backup file */
+	if ((remove(path) == -1) && errno != ENOENT)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not remove file \"%s\": %s", path, strerror(errno))));
+
+	if (backup->compress_data)
+	{
+		if (copy_file(base_path, to_root, file, DECOMPRESSION,
+					  backup->compress_algorithm))
+			check_backup_file_crc(file->path, crc, file->crc);
+		return _("decompressed");
+	}
+
+	if (!is_hard_copy)
+	{
+		/* create symlink */
+		if ((symlink(file->path, path) == -1))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not create link to \"%s\": %s",
+					file->path, strerror(errno))));
+		return _("linked");
+	}
+
+	/* create hard-copy */
+	if (!copy_file(base_path, to_root, file, NO_COMPRESSION, COMPRESS_NONE))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not copy to \"%s\": %s",
+				file->path, strerror(errno))));
+	check_backup_file_crc(file->path, crc, file->crc);
+	return _("copied");
+}
+
+/*
+ * Print the result of restoring an archived WAL in verbose mode and the
+ * progress in non-verbose format.
+ */
+static void
+restore_arclog_report(restore_arclog_arg *args, pgFile *file, bool skipped,
+					  const char *status)
+{
+	unsigned long	num_files = (unsigned long) parray_num(args->files);
+
+	pthread_mutex_lock(&args->lock);
+
+	args->num_processed++;
+	if (skipped)
+		args->num_skipped++;
 
-	time2iso(timestamp, lengthof(timestamp), backup->start_time);
 	if (verbose && !check)
+		printf(_("(%d/%lu) %s %s\n"), args->num_processed, num_files,
+			file->path + strlen(args->base_path) + 1, status);
+	else if (progress)
 	{
-		printf(_("----------------------------------------\n"));
+		fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
+				args->num_processed, num_files, args->num_skipped);
+		if (args->num_processed < num_files)
+			fprintf(stderr, "\r");
+		else
+			fprintf(stderr, "\n");
 	}
 
-	/*
-	 * Validate backup files with its size, because load of CRC calculation is
-	 * not light.
-	 */
-	pgBackupValidate(backup, true, false, false);
+	pthread_mutex_unlock(&args->lock);
+}
 
-	elog(INFO,_("restoring WAL files from backup \"%s\""), timestamp);
-	pgBackupGetPath(backup, list_path, lengthof(list_path), ARCLOG_FILE_LIST);
-	pgBackupGetPath(backup, base_path, lengthof(list_path), ARCLOG_DIR);
-	files = dir_read_file_list(base_path, list_path);
-	for (i = 0; i < parray_num(files); i++)
+/*
+ * Restore the archived WAL listed in args->files until there is no file
+ * left.  This is run by each of the restore_archive_logs() workers.
+ */
+static void
+restore_arclog_worker(void *arg)
+{
+	restore_arclog_arg *args = (restore_arclog_arg *) arg;
+
+	for (;;)
 	{
-		pgFile *file = (pgFile *) parray_get(files, i);
+		pgFile		   *file;
+		const char	   *status;
 
 		/* check for interrupt */
 		if (interrupted)
@@ -666,18 +1079,24 @@ restore_archive_logs(pgBackup *backup, bool is_hard_copy)
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during restore WAL")));
 
-		/* print progress */
-		join_path_components(path, arclog_path, file->path + strlen(base_path) + 1);
-		if (verbose && !check)
-			printf(_("(%d/%lu) %s "), i + 1, (unsigned long) parray_num(files),
-				file->path + strlen(base_path) + 1);
+		/* another worker failed, the restore is going to be aborted */
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_file >= parray_num(args->files))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		file = (pgFile *) parray_get(args->files, args->next_file++);
+		pthread_mutex_unlock(&args->lock);
 
 		/* skip files which are not in backup */
 		if (file->write_size == BYTES_INVALID)
 		{
-			if (verbose && !check)
-				printf(_("skip(not backed up)\n"));
-			goto show_progress;
+			restore_arclog_report(args, file, true, _("skip(not backed up)"));
+			continue;
 		}
 
 		/*
@@ -687,70 +1106,389 @@ restore_archive_logs(pgBackup *backup, bool is_hard_copy)
 		if (strstr(file->path, ".history") ==
 				file->path + strlen(file->path) - strlen(".history"))
 		{
-			if (verbose && !check)
-				printf(_("skip(timeline history)\n"));
-			goto show_progress;
+			restore_arclog_report(args, file, true, _("skip(timeline history)"));
+			continue;
 		}
 
+		status = "";
 		if (!check)
+			status = restore_wal_file(args->backup, args->base_path, file,
+									  arclog_path, args->is_hard_copy);
+		restore_arclog_report(args, file, false, status);
+	}
+}
+
+/*
+ * Restore archived WAL by creating symbolic link which linked to backup WAL in
+ * archive directory, or by copying it.  The files are restored by num_threads
+ * workers in parallel, since a point-in-time recovery may need thousands of
+ * them.
+ */
+void
+restore_archive_logs(pgBackup *backup, bool is_hard_copy)
+{
+	char timestamp[100];
+	parray *files;
+	char list_path[MAXPGPATH];
+	char base_path[MAXPGPATH];
+	restore_arclog_arg	args;
+
+	time2iso(timestamp, lengthof(timestamp), backup->start_time);
+	if (verbose && !check)
+	{
+		printf(_("----------------------------------------\n"));
+	}
+
+	/*
+	 * Validate backup files with its size before starting to overwrite
+	 * the cluster.  CRC of each file is checked while restoring it.
+	 */
+	pgBackupValidate(backup, true, false, false);
+
+	elog(INFO,_("restoring WAL files from backup \"%s\""), timestamp);
+	pgBackupGetPath(backup, list_path, lengthof(list_path), ARCLOG_FILE_LIST);
+	pgBackupGetPath(backup, base_path, lengthof(list_path), ARCLOG_DIR);
+	files = dir_read_file_list(base_path, list_path);
+
+	args.backup = backup;
+	args.base_path = base_path;
+	args.files = files;
+	args.is_hard_copy = is_hard_copy;
+	args.next_file = 0;
+	args.num_processed = 0;
+	args.num_skipped = 0;
+	pthread_mutex_init(&args.lock, NULL);
+
+	stats_begin(STATS_RESTORE_ARCLOG);
+	pgut_run_threads(Min(num_threads, (int) parray_num(files)),
+					 restore_arclog_worker, &args);
+	stats_end(STATS_RESTORE_ARCLOG);
+
+	pthread_mutex_destroy(&args.lock);
+
+	parray_walk(files, pgFileFree);
+	parray_free(files);
+}
+
+static int
+archived_wal_compare(const void *a, const void *b)
+{
+	const archived_wal *wal1 = *(archived_wal * const *) a;
+	const archived_wal *wal2 = *(archived_wal * const *) b;
+	int		ret;
+
+	ret = strcmp(wal1->name, wal2->name);
+	if (ret != 0)
+		return ret;
+
+	/* the newer backup first */
+	if (wal1->backup->start_time > wal2->backup->start_time)
+		return -1;
+	if (wal1->backup->start_time < wal2->backup->start_time)
+		return 1;
+	return 0;
+}
+
+/*
+ * Append the archived WAL in the backup to wals, and return the one named
+ * walname if found.
+ */
+static archived_wal *
+list_archived_wal(parray *wals, const pgBackup *backup, const char *walname)
+{
+	archived_wal   *found = NULL;
+	char			list_path[MAXPGPATH];
+	char		   *base_path;
+	parray		   *files;
+	int				i;
+
+	base_path = pgut_malloc(MAXPGPATH);
+	pgBackupGetPath(backup, list_path, lengthof(list_path), ARCLOG_FILE_LIST);
+	pgBackupGetPath(backup, base_path, MAXPGPATH, ARCLOG_DIR);
+	files = dir_read_file_list(base_path, list_path);
+	for (i = 0; i < parray_num(files); i++)
+	{
+		pgFile		   *file = (pgFile *) parray_get(files, i);
+		archived_wal   *wal;
+
+		if (file->write_size == BYTES_INVALID ||
+			!IsXLogFileName(file->path + strlen(base_path) + 1))
 		{
-			if (backup->compress_data)
-			{
-				copy_file(base_path, arclog_path, file, DECOMPRESSION);
-				if (verbose)
-					printf(_("decompressed\n"));
+			pgFileFree(file);
+			continue;
+		}
 
-				goto show_progress;
-			}
+		wal = pgut_new(archived_wal);
+		wal->name = file->path + strlen(base_path) + 1;
+		wal->backup = backup;
+		wal->base_path = base_path;
+		wal->file = file;
+		parray_append(wals, wal);
 
-			/* even same file exist, use backup file */
-			if ((remove(path) == -1) && errno != ENOENT)
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not remove file \"%s\": %s", path, strerror(errno))));
+		if (strcmp(wal->name, walname) == 0)
+			found = wal;
+	}
+	parray_free(files);
 
-			if (!is_hard_copy)
-			{
-				/* create symlink */
-				if ((symlink(file->path, path) == -1))
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not create link to \"%s\": %s",
-							file->path, strerror(errno))));
+	return found;
+}
 
-				if (verbose)
-					printf(_("linked\n"));
-			}
-			else
-			{
-				/* create hard-copy */
-				if (!copy_file(base_path, arclog_path, file, NO_COMPRESSION))
-					ereport(ERROR,
-						(errcode(ERROR_SYSTEM),
-						 errmsg("could not copy to \"%s\": %s",
-							file->path, strerror(errno))));
+/*
+ * Sort the archived WAL listed by list_archived_wal() by name.  A file
+ * backed up more than once is taken from the newest backup.
+ */
+static parray *
+sort_archived_wal(parray *wals)
+{
+	parray *result;
+	int		i;
 
-				if (verbose)
-					printf(_("copied\n"));
-			}
+	/* keep the first, i.e. the newest, of the same name */
+	parray_qsort(wals, archived_wal_compare);
+	result = parray_new();
+	for (i = 0; i < parray_num(wals); i++)
+	{
+		archived_wal *wal = (archived_wal *) parray_get(wals, i);
 
-show_progress:
-		/* print progress in non-verbose format */
-		if (progress)
+		if (parray_num(result) > 0 &&
+			strcmp(((archived_wal *) parray_get(result,
+						parray_num(result) - 1))->name, wal->name) == 0)
 		{
-			fprintf(stderr, _("Processed %d of %lu files, skipped %d"),
-					i + 1, (unsigned long) parray_num(files), num_skipped);
-			if(i + 1 < (unsigned long) parray_num(files))
-				fprintf(stderr, "\r");
-			else
-				fprintf(stderr, "\n");
+			pgFileFree(wal->file);
+			free(wal);
+			continue;
 		}
+		parray_append(result, wal);
+	}
+	parray_free(wals);
+
+	return result;
+}
+
+/*
+ * Restore the archived WAL in the backup into arclog_path through a
+ * temporary directory, so that the server never reads a half-written file
+ * from arclog_path.
+ */
+static void
+restore_wal_atomic(archived_wal *wal)
+{
+	char	tmp_root[MAXPGPATH];
+	char	tmp_path[MAXPGPATH];
+	char	path[MAXPGPATH];
+
+	snprintf(tmp_root, lengthof(tmp_root), "%s/%s.%d", arclog_path,
+			 RESTORE_WAL_TMP_DIR, (int) getpid());
+	if (mkdir(tmp_root, DIR_PERMISSION) == -1 && errno != EEXIST)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not create directory \"%s\": %s", tmp_root,
+				strerror(errno))));
 
+	/* a symbolic link can't be renamed into place once recovery reads it */
+	restore_wal_file(wal->backup, wal->base_path, wal->file, tmp_root, true);
+
+	join_path_components(tmp_path, tmp_root, wal->name);
+	join_path_components(path, arclog_path, wal->name);
+	if (rename(tmp_path, path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not rename \"%s\" to \"%s\": %s", tmp_path, path,
+				strerror(errno))));
+}
+
+/*
+ * Restore the archived WAL listed in args->wals until there is no file
+ * left.  This is run by the workers reading ahead in do_restore_wal().
+ */
+static void
+read_ahead_wal_worker(void *arg)
+{
+	read_ahead_wal_arg *args = (read_ahead_wal_arg *) arg;
+
+	for (;;)
+	{
+		archived_wal *wal;
+
+		if (interrupted || thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->next_wal >= parray_num(args->wals))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
 		}
+		wal = (archived_wal *) parray_get(args->wals, args->next_wal++);
+		pthread_mutex_unlock(&args->lock);
+
+		restore_wal_atomic(wal);
 	}
+}
 
-	parray_walk(files, pgFileFree);
-	parray_free(files);
+/*
+ * Copy the archived WAL at from_path into to_path given by the server.
+ */
+static void
+copy_wal_file(const char *from_path, const char *to_path)
+{
+	FILE   *in;
+	FILE   *out;
+	char	buf[XLOG_BLCKSZ * 8];
+	size_t	len;
+
+	in = fopen(from_path, "r");
+	if (in == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open source file \"%s\": %s", from_path,
+				strerror(errno))));
+	out = fopen(to_path, "w");
+	if (out == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open destination file \"%s\": %s", to_path,
+				strerror(errno))));
+
+	while ((len = fread(buf, 1, sizeof(buf), in)) > 0)
+	{
+		if (fwrite(buf, 1, len, out) != len)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write to \"%s\": %s", to_path,
+					strerror(errno))));
+	}
+	if (ferror(in))
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read from \"%s\": %s", from_path,
+				strerror(errno))));
+
+	fclose(in);
+	if (fclose(out) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write to \"%s\": %s", to_path,
+				strerror(errno))));
+}
+
+/*
+ * Restore the archived WAL walname into to_path, used as restore_command
+ * in the recovery configured by restore with --wal-on-demand.
+ *
+ * walname is taken from arclog_path if found there, otherwise from the
+ * newest valid backup which has it.  The file lists of the backups are read
+ * from the newest one until walname is found, so usually only a few of
+ * them are read.  In the latter case, the following WAL_READ_AHEAD segments
+ * of the timeline in the lists read are also restored into arclog_path by a
+ * child process in the background, so that recovery finds them there when
+ * it asks, without reading the lists again.  Returns ERROR_NO_BACKUP
+ * without a message if walname is not archived, which is the usual end of
+ * the recovery.
+ */
+int
+do_restore_wal(const char *walname, const char *to_path)
+{
+	char			path[MAXPGPATH];
+	parray		   *backups;
+	parray		   *wals;
+	parray		   *read_ahead;
+	archived_wal   *found = NULL;
+	int				i;
+
+	if (arclog_path == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("required parameter not specified: ARCLOG_PATH (-A, --arclog-path)")));
+	if (walname == NULL || to_path == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("required arguments not specified: WAL file name and destination path")));
+
+	join_path_components(path, arclog_path, walname);
+	if (fileExists(path))
+	{
+		elog(DEBUG, "restoring \"%s\" from the archive", walname);
+		copy_wal_file(path, to_path);
+		return 0;
+	}
+
+	if (!IsXLogFileName(walname))
+		return ERROR_NO_BACKUP;
+
+	/* the backups are sorted from the newest */
+	backups = catalog_get_backup_list(NULL);
+	wals = parray_new();
+	for (i = 0; i < parray_num(backups) && found == NULL; i++)
+	{
+		pgBackup *backup = (pgBackup *) parray_get(backups, i);
+
+		if (backup->status != BACKUP_STATUS_OK || !HAVE_ARCLOG(backup))
+			continue;
+		found = list_archived_wal(wals, backup, walname);
+	}
+	if (found == NULL)
+	{
+		elog(DEBUG, "\"%s\" is not found in the backups", walname);
+		return ERROR_NO_BACKUP;
+	}
+
+	/* found is kept, no newer backup has the same name */
+	wals = sort_archived_wal(wals);
+	for (i = 0; i < parray_num(wals); i++)
+	{
+		if ((archived_wal *) parray_get(wals, i) == found)
+			break;
+	}
+
+	elog(DEBUG, "restoring \"%s\" from backup", walname);
+	restore_wal_atomic(found);
+	copy_wal_file(path, to_path);
+
+	/* read ahead the following segments on the same timeline */
+	read_ahead = parray_new();
+	for (i++; i < parray_num(wals) && parray_num(read_ahead) < WAL_READ_AHEAD; i++)
+	{
+		archived_wal *wal = (archived_wal *) parray_get(wals, i);
+
+		if (strncmp(wal->name, walname, 8) != 0)
+			break;
+		join_path_components(path, arclog_path, wal->name);
+		if (!fileExists(path))
+			parray_append(read_ahead, wal);
+	}
+
+	if (parray_num(read_ahead) > 0)
+	{
+		pid_t	pid;
+
+		fflush(stdout);
+		fflush(stderr);
+		pid = fork();
+		if (pid == 0)
+		{
+			read_ahead_wal_arg	args;
+
+			args.wals = read_ahead;
+			args.next_wal = 0;
+			pthread_mutex_init(&args.lock, NULL);
+			pgut_run_threads(Min(num_threads, (int) parray_num(read_ahead)),
+							 read_ahead_wal_worker, &args);
+			snprintf(path, lengthof(path), "%s/%s.%d", arclog_path,
+					 RESTORE_WAL_TMP_DIR, (int) getpid());
+			rmdir(path);
+			exit(0);
+		}
+		else if (pid == -1)
+			elog(DEBUG, "could not fork to read ahead WAL: %s", strerror(errno));
+	}
+
+	/* the directory of the restored segment is no longer used */
+	snprintf(path, lengthof(path), "%s/%s.%d", arclog_path,
+			 RESTORE_WAL_TMP_DIR, (int) getpid());
+	rmdir(path);
+
+	return 0;
 }
 
 static void
@@ -891,7 +1629,11 @@ create_recovery_configuration_file(const char *target_time,
 					 errmsg("could not create file \"%s\": %s", path, strerror(errno))));
 
 		fprintf(fp, "%s %s\n", PG_RMAN_COMMENT, PROGRAM_VERSION);
-		fprintf(fp, "restore_command = 'cp %s/%%f %%p'\n", arclog_path);
+		if (wal_on_demand)
+			fprintf(fp, "restore_command = '\"%s\" restore-wal -B \"%s\" -A \"%s\" -j %d %%f \"%%p\"'\n",
+					my_exec_path, backup_path, arclog_path, num_threads);
+		else
+			fprintf(fp, "restore_command = 'cp %s/%%f %%p'\n", arclog_path);
 		if (target_time)
 			fprintf(fp, "recovery_target_time = '%s'\n", target_time);
 		if (target_xid)
@@ -1088,7 +1830,7 @@ restore_online_files(void)
 				printf(_("restore \"%s\"\n"),
 					file->path + strlen(root_backup) + 1);
 			if (!check)
-				copy_file(root_backup, to_root, file, NO_COMPRESSION);
+				copy_file(root_backup, to_root, file, NO_COMPRESSION, COMPRESS_NONE);
 		}
 
 show_progress:
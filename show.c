@@ -273,6 +273,9 @@ show_detail_backup_list(FILE *out, parray *backup_list, bool show_all)
 static void
 show_backup_detail(FILE *out, pgBackup *backup)
 {
+	char	stats[STATS_SUMMARY_LEN];
+
+	catalog_read_stats(backup, stats, lengthof(stats));
 	pgBackupWriteConfigSection(out, backup);
-	pgBackupWriteResultSection(out, backup);
+	pgBackupWriteResultSection(out, backup, stats);
 }
@@ -0,0 +1,855 @@
+/*-------------------------------------------------------------------------
+ *
+ * sink.c: output of backup files.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+/* for fopencookie(), given by the Linux template of PostgreSQL anyway */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "pg_rman.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pgtar.h"
+
+/*
+ * Backup files are written into the backup directory under BACKUP_PATH by
+ * default.  With --output, the files under the database, arclog and srvlog
+ * directories of the current backup are written into a tar stream instead,
+ * followed by the file lists and backup.ini at the end, while the catalog
+ * keeps only the latter.  Extracting the stream into BACKUP_PATH gives the
+ * same backup as if it was written into the directory.
+ *
+ * A tar header needs the size of the member, which is not known until the
+ * file has been compressed or its pages have been, so such a file is
+ * gathered in memory and appended to the stream on close.  A file outgrowing
+ * SINK_MEMORY_SIZE is appended as parts of SINK_MEMORY_SIZE each instead,
+ * named by SINK_PART_SUFFIX, which sink_join_parts() joins back into the
+ * file once extracted.  Nothing is spooled outside the stream.  A file
+ * opened by sink_open_sized() has its size known up front.
+ * If the stream is a regular file, its member is reserved in the stream on
+ * open and the contents are written there through another descriptor, so
+ * that the workers copy such files in parallel.  A stream to a pipe cannot
+ * be written out of order, so such a file larger than SINK_MEMORY_SIZE is
+ * written into the stream directly while the other workers wait for it.
+ */
+
+/* size of the stdio buffer of the stream */
+#define SINK_BUFFER_SIZE	(1024 * 1024)
+
+/* streamed file larger than this is not kept in memory */
+#define SINK_MEMORY_SIZE	(16 * DATA_CHUNK_SIZE)
+
+/* appended to the path of each part of a streamed file, numbered from 1 */
+#define SINK_PART_SUFFIX	".part%d"
+
+/* member reserved by sink_open_sized() */
+typedef struct SinkMember
+{
+	FILE	   *fp;			/* written into the stream at start */
+	off_t		start;		/* offset of the contents in the stream */
+	off_t		size;		/* size of the contents */
+} SinkMember;
+
+/* file returned by sink_open() or sink_open_sized() for a pipe */
+typedef struct SinkFile
+{
+	FILE	   *fp;			/* written through sink_file_write() */
+	char		path[MAXPGPATH];
+	char	   *data;		/* contents kept in memory */
+	size_t		len;
+	size_t		alloced;
+	int			nparts;		/* parts appended to the stream */
+	off_t		size;		/* bytes written */
+	off_t		limit;		/* size of the member written into the stream
+							 * directly with stream_lock held, or -1 */
+} SinkFile;
+
+static FILE			   *stream = NULL;	/* NULL unless --output is used */
+static char			   *stream_buf = NULL;
+static bool				stream_seekable = false;	/* regular file? */
+static parray		   *stream_members = NULL;	/* reserved SinkMembers */
+static char				stream_root[MAXPGPATH];	/* directory of the backup */
+static pthread_mutex_t	stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static parray		   *stream_files = NULL;	/* open SinkFiles */
+static pthread_mutex_t	files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FILE *open_file(const char *path, off_t limit);
+static ssize_t sink_file_write(void *cookie, const char *buf, size_t size);
+static int sink_file_close(void *cookie);
+static void append_part(SinkFile *file, mode_t mode);
+static SinkMember *forget_member(FILE *fp);
+static SinkFile *forget_file(FILE *fp);
+static void sink_append(FILE *contents, const char *data, off_t size,
+						const char *path, mode_t mode, time_t mtime);
+
+/*
+ * Open the stream given by --output, or "-" for stdout.  Nothing to do
+ * without --output.
+ */
+void
+sink_init(void)
+{
+	if (backup_output == NULL || check)
+		return;
+
+	if (strcmp(backup_output, "-") == 0)
+	{
+		int		fd;
+
+		/* messages written to stdout go to stderr not to break the stream */
+		fflush(stdout);
+		fd = dup(STDOUT_FILENO);
+		if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1 ||
+			(stream = fdopen(fd, "w")) == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open standard output to write backup: %s",
+					strerror(errno))));
+	}
+	else
+	{
+		struct stat	st;
+
+		stream = fopen(backup_output, "w");
+		if (stream == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\" to write backup: %s",
+					backup_output, strerror(errno))));
+		stream_seekable = fstat(fileno(stream), &st) == 0 &&
+						  S_ISREG(st.st_mode);
+	}
+	stream_buf = pgut_malloc(SINK_BUFFER_SIZE);
+	setvbuf(stream, stream_buf, _IOFBF, SINK_BUFFER_SIZE);
+	stream_members = parray_new();
+	stream_files = parray_new();
+}
+
+/*
+ * Start writing the files of the backup into the stream.
+ */
+void
+sink_begin(const pgBackup *backup)
+{
+	const char *subdirs[] = { DATABASE_DIR, ARCLOG_DIR, SRVLOG_DIR, NULL };
+	char		path[MAXPGPATH];
+	int			i;
+
+	if (stream == NULL)
+		return;
+
+	pgBackupGetPath(backup, stream_root, lengthof(stream_root), NULL);
+	sink_append(NULL, NULL, 0, stream_root, S_IFDIR | DIR_PERMISSION,
+				backup->start_time);
+	for (i = 0; subdirs[i]; i++)
+	{
+		pgBackupGetPath(backup, path, lengthof(path), subdirs[i]);
+		sink_append(NULL, NULL, 0, path, S_IFDIR | DIR_PERMISSION,
+					backup->start_time);
+	}
+}
+
+/*
+ * Finish the stream with the files left in the backup directory, i.e. the
+ * file lists, and backup.ini as it should be when extracted.
+ */
+void
+sink_end(const pgBackup *backup)
+{
+	DIR			   *dir;
+	struct dirent  *ent;
+	char			path[MAXPGPATH];
+	char			trailer[TAR_BLOCK_SIZE * 2];
+	pgBackup		extracted;
+	char			stats[STATS_SUMMARY_LEN];
+	FILE		   *fp;
+	char		   *ini = NULL;
+	size_t			ini_len = 0;
+
+	if (stream == NULL)
+		return;
+
+	dir = opendir(stream_root);
+	if (dir == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open directory \"%s\": %s", stream_root,
+				strerror(errno))));
+	for (errno = 0; (ent = readdir(dir)) != NULL; errno = 0)
+	{
+		struct stat	st;
+
+		join_path_components(path, stream_root, ent->d_name);
+		if (strcmp(ent->d_name, BACKUP_INI_FILE) == 0 ||
+			stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+			continue;
+
+		fp = fopen(path, "r");
+		if (fp == NULL)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\": %s", path, strerror(errno))));
+		sink_append(fp, NULL, st.st_size, path, st.st_mode, st.st_mtime);
+		fclose(fp);
+	}
+	if (errno)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read directory \"%s\": %s", stream_root,
+				strerror(errno))));
+	closedir(dir);
+
+	/* the files are in the same place as the backup.ini after extraction */
+	extracted = *backup;
+	extracted.streamed = false;
+	catalog_read_stats(backup, stats, lengthof(stats));
+	fp = open_memstream(&ini, &ini_len);
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not allocate memory: %s", strerror(errno))));
+	pgBackupWriteConfigSection(fp, &extracted);
+	pgBackupWriteResultSection(fp, &extracted, stats);
+	if (fclose(fp) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not allocate memory: %s", strerror(errno))));
+	join_path_components(path, stream_root, BACKUP_INI_FILE);
+	sink_append(NULL, ini, ini_len, path, S_IFREG | FILE_PERMISSION,
+				time(NULL));
+	free(ini);
+
+	/* end of the archive */
+	memset(trailer, 0, sizeof(trailer));
+	if (fwrite(trailer, 1, sizeof(trailer), stream) != sizeof(trailer) ||
+		fclose(stream) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup stream: %s", strerror(errno))));
+	stream = NULL;
+	free(stream_buf);
+	stream_buf = NULL;
+	parray_walk(stream_members, free);
+	parray_free(stream_members);
+	stream_members = NULL;
+	parray_free(stream_files);
+	stream_files = NULL;
+}
+
+/*
+ * Return true if the file at path in the backup directory is written into
+ * the stream.
+ */
+bool
+sink_is_streamed(const char *path)
+{
+	const char *subdirs[] = { DATABASE_DIR, ARCLOG_DIR, SRVLOG_DIR, NULL };
+	size_t		len;
+	int			i;
+
+	if (stream == NULL)
+		return false;
+
+	len = strlen(stream_root);
+	if (strncmp(path, stream_root, len) != 0 || path[len] != '/')
+		return false;
+	path += len + 1;
+
+	for (i = 0; subdirs[i]; i++)
+	{
+		len = strlen(subdirs[i]);
+		if (strncmp(path, subdirs[i], len) == 0 &&
+			(path[len] == '/' || path[len] == '\0'))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Open the file at path in the backup directory for write.  Returns NULL
+ * with errno set on failure, as fopen().
+ */
+FILE *
+sink_open(const char *path)
+{
+	if (sink_is_streamed(path))
+		return open_file(path, -1);
+
+	return fopen(path, "w");
+}
+
+/*
+ * Open the file at path in the backup directory for write, as sink_open(),
+ * to write exactly size bytes into it.  A streamed file is written straight
+ * into the stream if the stream is a regular file, or if it's too large to
+ * keep in memory.  mode is of the file in the stream, and must be the same
+ * as given to sink_close().
+ */
+FILE *
+sink_open_sized(const char *path, off_t size, mode_t mode)
+{
+	const char *name = path + strlen(backup_path) + 1;
+	char		header[TAR_BLOCK_SIZE];
+	SinkMember *member;
+	off_t		start = -1;
+	int			fd;
+	FILE	   *fp;
+	bool		write_failed = false;
+	int			errno_tmp = 0;
+
+	if (!sink_is_streamed(path) ||
+		(!stream_seekable && size <= SINK_MEMORY_SIZE))
+		return sink_open(path);
+
+	if (tarCreateHeader(header, name, NULL, size,
+						S_IFREG | (mode & (S_IRWXU | S_IRWXG | S_IRWXO)),
+						getuid(), getgid(), time(NULL)) != TAR_OK)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("file name \"%s\" is too long to write into tar", name)));
+
+	/*
+	 * Write the header and then the contents into the pipe, holding the lock
+	 * until sink_close().  Released by fclose() also on errors.
+	 */
+	if (!stream_seekable)
+	{
+		fp = open_file(path, size);
+		if (fp == NULL)
+			return NULL;
+		pthread_mutex_lock(&stream_lock);
+		if (fwrite(header, 1, sizeof(header), stream) != sizeof(header))
+		{
+			errno_tmp = errno;
+			fclose(fp);
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not write backup stream: %s",
+					strerror(errno_tmp))));
+		}
+		return fp;
+	}
+
+	/* another descriptor not to share the offset with the stream */
+	fd = open(backup_output, O_WRONLY | PG_BINARY, 0);
+	if (fd == -1)
+		return NULL;
+	fp = fdopen(fd, "w");
+	if (fp == NULL)
+	{
+		errno_tmp = errno;
+		close(fd);
+		errno = errno_tmp;
+		return NULL;
+	}
+
+	/* reserve the member, with its padding left as a hole of zeros */
+	member = pgut_new(SinkMember);
+	pthread_mutex_lock(&stream_lock);
+	if (fwrite(header, 1, sizeof(header), stream) != sizeof(header) ||
+		fflush(stream) != 0 || (start = ftello(stream)) == -1 ||
+		fseeko(stream, size + tarPaddingBytesRequired(size), SEEK_CUR) != 0)
+		write_failed = true;
+	else
+	{
+		member->fp = fp;
+		member->start = start;
+		member->size = size;
+		parray_append(stream_members, member);
+	}
+	errno_tmp = errno;
+	pthread_mutex_unlock(&stream_lock);
+
+	if (write_failed || fseeko(fp, start, SEEK_SET) != 0)
+	{
+		if (write_failed)
+			free(member);
+		else
+			errno_tmp = errno;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup stream: %s", strerror(errno_tmp))));
+	}
+
+	return fp;
+}
+
+/*
+ * Close the file opened by sink_open() or sink_open_sized() and set its
+ * mode.  The contents of a streamed file left in memory are appended to the
+ * stream, as its last part if it has outgrown SINK_MEMORY_SIZE.  Returns 0
+ * on success, or -1 with errno set.
+ */
+int
+sink_close(FILE *fp, const char *path, mode_t mode)
+{
+	SinkMember *member;
+	SinkFile   *file;
+	off_t		size;
+
+	if (!sink_is_streamed(path))
+	{
+		if (fclose(fp) != 0)
+			return -1;
+		return chmod(path, mode);
+	}
+
+	if ((file = forget_file(fp)) != NULL)
+	{
+		bool	write_failed = false;
+		int		errno_tmp = 0;
+
+		if (fflush(fp) != 0)
+		{
+			errno_tmp = errno;
+			fclose(fp);
+			errno = errno_tmp;
+			return -1;
+		}
+
+		/* written into the pipe, pad it and release the lock by fclose() */
+		if (file->limit >= 0)
+		{
+			char	padding[TAR_BLOCK_SIZE];
+			size_t	len = tarPaddingBytesRequired(file->size);
+
+			size = file->size;
+			memset(padding, 0, sizeof(padding));
+			if (size == file->limit &&
+				fwrite(padding, 1, len, stream) != len)
+			{
+				write_failed = true;
+				errno_tmp = errno;
+			}
+			fclose(fp);
+			if (size != file->limit)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("size of \"%s\" changed while writing it into backup stream",
+						path)));
+			if (write_failed)
+			{
+				errno = errno_tmp;
+				return -1;
+			}
+			return 0;
+		}
+
+		mode = S_IFREG | (mode & (S_IRWXU | S_IRWXG | S_IRWXO));
+		if (file->nparts > 0)
+			append_part(file, mode);
+		else
+			sink_append(NULL, file->data, file->len, path, mode, time(NULL));
+
+		return fclose(fp);
+	}
+
+	if ((member = forget_member(fp)) != NULL)
+	{
+		off_t	end;
+
+		if (fflush(fp) != 0 || (end = ftello(fp)) == -1)
+		{
+			int		errno_tmp = errno;
+
+			fclose(fp);
+			free(member);
+			errno = errno_tmp;
+			return -1;
+		}
+		/* the header says the size, the contents must not differ */
+		if (end - member->start != member->size)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("size of \"%s\" changed while writing it into backup stream",
+					path)));
+		free(member);
+
+		return fclose(fp);
+	}
+
+	if (fflush(fp) != 0 || (size = ftello(fp)) == -1)
+	{
+		int		errno_tmp = errno;
+
+		fclose(fp);
+		errno = errno_tmp;
+		return -1;
+	}
+	sink_append(fp, NULL, size, path,
+		S_IFREG | (mode & (S_IRWXU | S_IRWXG | S_IRWXO)), time(NULL));
+
+	return fclose(fp);
+}
+
+/*
+ * Close and forget the file opened by sink_open().  Not for the files
+ * opened by sink_open_sized(), of which the members are in the stream
+ * already.
+ */
+void
+sink_discard(FILE *fp, const char *path)
+{
+	fclose(fp);
+
+	if (!sink_is_streamed(path) && remove(path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not remove file \"%s\": %s", path, strerror(errno))));
+}
+
+/*
+ * Create the directory at path in the backup directory.
+ */
+void
+sink_create_dir(const char *path)
+{
+	if (sink_is_streamed(path))
+		sink_append(NULL, NULL, 0, path, S_IFDIR | DIR_PERMISSION, time(NULL));
+	else
+		dir_create_dir(path, DIR_PERMISSION);
+}
+
+/*
+ * Join the parts of the file at path, extracted from a stream, back into the
+ * file.  Every part but the last has SINK_MEMORY_SIZE bytes, so the first
+ * part is cut back to it before the others are appended, and joining again
+ * after an interrupted join gives the same file.  The file gets the mode of
+ * the last part.  Returns false if the file has no parts.
+ */
+bool
+sink_join_parts(const char *path)
+{
+	char		part[MAXPGPATH];
+	char	   *buf;
+	FILE	   *out;
+	struct stat	st;
+	int			nparts;
+	int			i;
+
+	snprintf(part, lengthof(part), "%s" SINK_PART_SUFFIX, path, 1);
+	out = fopen(part, "r+");
+	if (out == NULL)
+	{
+		if (errno == ENOENT)
+			return false;
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open \"%s\": %s", part, strerror(errno))));
+	}
+	if (fstat(fileno(out), &st) == -1 ||
+		ftruncate(fileno(out), SINK_MEMORY_SIZE) == -1 ||
+		fseeko(out, 0, SEEK_END) != 0)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write \"%s\": %s", part, strerror(errno))));
+
+	buf = pgut_malloc(TAR_BLOCK_SIZE * 128);
+	for (nparts = 2;; nparts++)
+	{
+		FILE   *in;
+		size_t	len;
+
+		snprintf(part, lengthof(part), "%s" SINK_PART_SUFFIX, path, nparts);
+		in = fopen(part, "r");
+		if (in == NULL)
+		{
+			if (errno == ENOENT)
+				break;
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not open \"%s\": %s", part, strerror(errno))));
+		}
+		if (fstat(fileno(in), &st) == -1)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not stat \"%s\": %s", part, strerror(errno))));
+		while ((len = fread(buf, 1, TAR_BLOCK_SIZE * 128, in)) > 0)
+		{
+			if (fwrite(buf, 1, len, out) != len)
+				ereport(ERROR,
+					(errcode(ERROR_SYSTEM),
+					 errmsg("could not write \"%s\": %s", path,
+						strerror(errno))));
+		}
+		if (ferror(in))
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read \"%s\": %s", part, strerror(errno))));
+		fclose(in);
+	}
+	free(buf);
+
+	snprintf(part, lengthof(part), "%s" SINK_PART_SUFFIX, path, 1);
+	if (fclose(out) != 0 || chmod(part, st.st_mode) == -1 ||
+		rename(part, path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not join parts of \"%s\": %s", path,
+				strerror(errno))));
+
+	/* the file is complete, the other parts are not needed any more */
+	for (i = 2; i < nparts; i++)
+	{
+		snprintf(part, lengthof(part), "%s" SINK_PART_SUFFIX, path, i);
+		if (remove(part) == -1)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not remove file \"%s\": %s", part,
+					strerror(errno))));
+	}
+
+	return true;
+}
+
+/*
+ * Open a streamed file gathered in memory, or written into the pipe directly
+ * if limit is not -1.  See sink_file_write().
+ */
+static FILE *
+open_file(const char *path, off_t limit)
+{
+	cookie_io_functions_t	funcs = { NULL, sink_file_write, NULL,
+									  sink_file_close };
+	SinkFile   *file = pgut_new(SinkFile);
+
+	memset(file, 0, sizeof(SinkFile));
+	strlcpy(file->path, path, lengthof(file->path));
+	file->limit = limit;
+	file->fp = fopencookie(file, "w", funcs);
+	if (file->fp == NULL)
+	{
+		free(file);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&files_lock);
+	parray_append(stream_files, file);
+	pthread_mutex_unlock(&files_lock);
+
+	return file->fp;
+}
+
+/*
+ * Write into the streamed file, in memory up to SINK_MEMORY_SIZE.  When more
+ * follows the full memory, it's appended to the stream as a part to make
+ * room.  Returns 0 with errno set on failure, as fopencookie() wants.
+ */
+static ssize_t
+sink_file_write(void *cookie, const char *buf, size_t size)
+{
+	SinkFile   *file = (SinkFile *) cookie;
+	size_t		done = 0;
+
+	if (file->limit >= 0)
+	{
+		if (fwrite(buf, 1, size, stream) != size)
+			return 0;
+		file->size += size;
+		return size;
+	}
+
+	while (done < size)
+	{
+		size_t	len;
+
+		if (file->len == SINK_MEMORY_SIZE)
+		{
+			append_part(file, S_IFREG | FILE_PERMISSION);
+			file->len = 0;
+		}
+
+		len = Min(size - done, SINK_MEMORY_SIZE - file->len);
+		if (file->len + len > file->alloced)
+		{
+			file->alloced = Max(file->alloced * 2, TAR_BLOCK_SIZE * 128);
+			while (file->alloced < file->len + len)
+				file->alloced *= 2;
+			file->alloced = Min(file->alloced, SINK_MEMORY_SIZE);
+			file->data = pgut_realloc(file->data, file->alloced);
+		}
+		memcpy(file->data + file->len, buf + done, len);
+		file->len += len;
+		done += len;
+	}
+	file->size += size;
+
+	return size;
+}
+
+/*
+ * Release the streamed file, also when closed by fclose() on errors without
+ * sink_close().  The lock of a file written into the pipe is released here,
+ * as it's held since sink_open_sized().
+ */
+static int
+sink_file_close(void *cookie)
+{
+	SinkFile   *file = (SinkFile *) cookie;
+
+	forget_file(file->fp);
+	if (file->limit >= 0)
+		pthread_mutex_unlock(&stream_lock);
+	free(file->data);
+	free(file);
+
+	return 0;
+}
+
+/*
+ * Append the contents of the streamed file in memory to the stream as its
+ * next part.
+ */
+static void
+append_part(SinkFile *file, mode_t mode)
+{
+	char	path[MAXPGPATH];
+
+	snprintf(path, lengthof(path), "%s" SINK_PART_SUFFIX, file->path,
+			 ++file->nparts);
+	sink_append(NULL, file->data, file->len, path, mode, time(NULL));
+}
+
+/*
+ * Remove the member written by fp from the reserved ones and return it, or
+ * NULL if fp is not of sink_open_sized().
+ */
+static SinkMember *
+forget_member(FILE *fp)
+{
+	SinkMember *member = NULL;
+	int			i;
+
+	pthread_mutex_lock(&stream_lock);
+	for (i = 0; i < parray_num(stream_members); i++)
+	{
+		SinkMember *m = (SinkMember *) parray_get(stream_members, i);
+
+		if (m->fp == fp)
+		{
+			member = (SinkMember *) parray_remove(stream_members, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stream_lock);
+
+	return member;
+}
+
+/*
+ * Remove the file opened by open_file() from the open ones and return it,
+ * or NULL if fp is not of open_file().
+ */
+static SinkFile *
+forget_file(FILE *fp)
+{
+	SinkFile   *file = NULL;
+	int			i;
+
+	pthread_mutex_lock(&files_lock);
+	for (i = 0; i < parray_num(stream_files); i++)
+	{
+		SinkFile   *f = (SinkFile *) parray_get(stream_files, i);
+
+		if (f->fp == fp)
+		{
+			file = (SinkFile *) parray_remove(stream_files, i);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+
+	return file;
+}
+
+/*
+ * Append a member for path with size bytes of contents, read from the file
+ * "contents" or from memory at "data", or no contents if both are NULL, to
+ * the stream.  The member is named by the path relative to BACKUP_PATH.
+ * Called by the backup_files() workers concurrently.
+ */
+static void
+sink_append(FILE *contents, const char *data, off_t size, const char *path,
+			mode_t mode, time_t mtime)
+{
+	const char *name = path + strlen(backup_path) + 1;
+	char		header[TAR_BLOCK_SIZE];
+	char		zeros[TAR_BLOCK_SIZE];
+	char	   *buf = NULL;
+	off_t		left = size;
+	bool		read_failed = false;
+	bool		write_failed = false;
+	int			errno_tmp = 0;
+
+	if (tarCreateHeader(header, name, NULL, size, mode, getuid(), getgid(),
+						mtime) != TAR_OK)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("file name \"%s\" is too long to write into tar", name)));
+
+	if (contents)
+	{
+		if (fseeko(contents, 0, SEEK_SET) != 0)
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not read temporary file of \"%s\": %s", name,
+					strerror(errno))));
+		buf = pgut_malloc(TAR_BLOCK_SIZE * 128);
+	}
+
+	/* don't raise errors with the lock held, let the other workers go on */
+	pthread_mutex_lock(&stream_lock);
+	if (fwrite(header, 1, sizeof(header), stream) != sizeof(header))
+		write_failed = true;
+	if (!write_failed && data && fwrite(data, 1, size, stream) != size)
+		write_failed = true;
+	while (!write_failed && contents && left > 0)
+	{
+		size_t	len = fread(buf, 1, Min(left, TAR_BLOCK_SIZE * 128), contents);
+
+		if (len == 0)
+		{
+			read_failed = true;
+			break;
+		}
+		if (fwrite(buf, 1, len, stream) != len)
+			write_failed = true;
+		left -= len;
+	}
+	if (!write_failed && !read_failed && (contents || data))
+	{
+		size_t	padding = tarPaddingBytesRequired(size);
+
+		memset(zeros, 0, padding);
+		if (fwrite(zeros, 1, padding, stream) != padding)
+			write_failed = true;
+	}
+	errno_tmp = errno;
+	pthread_mutex_unlock(&stream_lock);
+
+	free(buf);
+
+	if (read_failed)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not read temporary file of \"%s\": %s", name,
+				strerror(errno_tmp))));
+	if (write_failed)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write backup stream: %s", strerror(errno_tmp))));
+}
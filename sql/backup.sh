@@ -107,6 +107,42 @@ function init_catalog()
     pg_rman init -B ${BACKUP_PATH} --quiet
 }
 
+# Take a full backup and an incremental backup after running pgbench, and
+# count the OK backups.
+#   $1: name of the test, $2: options for the full backup,
+#   $3: options for the incremental backup, $4: options for validate
+function full_and_incremental_backup()
+{
+    pg_rman backup -B ${BACKUP_PATH} -b full $2 -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+    pg_rman validate -B ${BACKUP_PATH} $4 --quiet
+    pgbench -p ${TEST_PGPORT} -T ${DURATION} -c 8 pgbench > /dev/null 2>&1
+    pg_rman backup -B ${BACKUP_PATH} -b incremental $3 -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+    pg_rman validate -B ${BACKUP_PATH} $4 --quiet
+    pg_rman show detail -B ${BACKUP_PATH} > ${TEST_BASE}/$1.log 2>&1
+    grep -c OK ${TEST_BASE}/$1.log
+}
+
+# Restore the latest backup and check that the restored database has the
+# same rows as the one backed up.
+#   $1: name of the test
+function restore_and_compare()
+{
+    psql -tA --no-psqlrc -p ${TEST_PGPORT} -d pgbench \
+        -c "SELECT count(*) FROM pgbench_history;" \
+        -c "SELECT sum(abalance) FROM pgbench_accounts;" > ${TEST_BASE}/$1-before.out
+    pg_ctl stop -m immediate > /dev/null 2>&1
+    pg_rman restore -B ${BACKUP_PATH} --quiet;echo $?
+    pg_ctl start -w -t 300 > /dev/null 2>&1
+    # wait for the end of the archive recovery
+    while [ "`psql -tA --no-psqlrc -p ${TEST_PGPORT} -d postgres -c 'SELECT pg_is_in_recovery();'`" = "t" ]; do
+        sleep 1
+    done
+    psql -tA --no-psqlrc -p ${TEST_PGPORT} -d pgbench \
+        -c "SELECT count(*) FROM pgbench_history;" \
+        -c "SELECT sum(abalance) FROM pgbench_accounts;" > ${TEST_BASE}/$1-after.out
+    diff ${TEST_BASE}/$1-before.out ${TEST_BASE}/$1-after.out;echo $?
+}
+
 cleanup
 init_database
 init_catalog
@@ -207,6 +243,115 @@ init_database
 pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
 
 
+echo '###### BACKUP COMMAND TEST-0011 ######'
+echo '###### full and incremental backup and validation with parallel jobs ######'
+init_catalog
+full_and_incremental_backup TEST-0011 "-s -Z -j 4" "-j 4" "-j 4"
+echo 'the files are copied by 4 workers'
+pg_rman backup -B ${BACKUP_PATH} -b full -j 4 -p ${TEST_PGPORT} -d postgres --debug > ${TEST_BASE}/TEST-0011.out 2>&1;echo $?
+grep -q 'copied by 4 workers$' ${TEST_BASE}/TEST-0011.out;echo $?
+
+echo '###### BACKUP COMMAND TEST-0012 ######'
+echo '###### full and incremental backup with direct I/O ######'
+init_catalog
+full_and_incremental_backup TEST-0012 "--direct-io --stats=json" "-Z --direct-io"
+echo 'the data files are read by chunks of pages'
+STATS=`ls ${BACKUP_PATH}/*/*/stats.json | head -n 1`
+PAGES_READ=`grep '"total"' ${STATS} | sed 's/.*"pages_read": \([0-9]*\).*/\1/'`
+DATA_READS=`grep '"total"' ${STATS} | sed 's/.*"data_reads": \([0-9]*\).*/\1/'`
+test ${DATA_READS} -gt 0 -a ${DATA_READS} -lt ${PAGES_READ};echo $?
+
+echo '###### BACKUP COMMAND TEST-0013 ######'
+echo '###### full backup written into a tar stream ######'
+init_catalog
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "CREATE TABLE stream_large AS SELECT i, repeat('x', 100) AS s FROM generate_series(1, 300000) i;" > /dev/null 2>&1
+# TMPDIR doesn't exist, so the backup fails if anything is spooled there
+TMPDIR=${TEST_BASE}/TEST-0013.tmp pg_rman backup -B ${BACKUP_PATH} -b full -j 4 --output=${TEST_BASE}/TEST-0013.tar -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pg_rman show detail -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0013.log 2>&1
+grep -c OK ${TEST_BASE}/TEST-0013.log
+ls ${BACKUP_PATH}/*/*/database | wc -l
+tar tf ${TEST_BASE}/TEST-0013.tar | grep -c 'database/PG_VERSION$'
+echo 'the table larger than 16MB is streamed as parts'
+tar tf ${TEST_BASE}/TEST-0013.tar | grep -q 'database/.*\.part2$';echo $?
+tar xf ${TEST_BASE}/TEST-0013.tar -C ${BACKUP_PATH};echo $?
+ls ${BACKUP_PATH}/*/*/database/PG_VERSION | wc -l
+restore_and_compare TEST-0013
+find ${BACKUP_PATH} -name '*.part[0-9]*' | wc -l
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "DROP TABLE stream_large;" > /dev/null 2>&1
+
+echo '###### BACKUP COMMAND TEST-0014 ######'
+echo '###### full and incremental backup through the replication protocol ######'
+init_catalog
+full_and_incremental_backup TEST-0014 "-j 4 --replication --stats=json" "-j 4 --replication"
+ls -d ${BACKUP_PATH}/*/*/base_backup 2> /dev/null | wc -l
+echo 'the received files are written into the backup without a local copy'
+STATS=`ls ${BACKUP_PATH}/*/*/stats.json | head -n 1`
+grep '"name": "base_backup"' ${STATS} | grep -vc '"bytes_written": 0,'
+grep '"name": "copy_files"' ${STATS} | grep -c '"bytes_read": 0,'
+restore_and_compare TEST-0014
+
+echo '###### BACKUP COMMAND TEST-0015 ######'
+echo '###### incremental backup linking unchanged files from the previous backup ######'
+init_catalog
+full_and_incremental_backup TEST-0015 "-Z" "-Z --link-unchanged"
+grep -c ' 18446744073709551615 ' `ls ${BACKUP_PATH}/*/*/file_database.txt | tail -n 1`
+echo 'the unchanged files are linked from the previous backup'
+pg_rman backup -B ${BACKUP_PATH} -b incremental -Z --link-unchanged -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0015.out 2>&1;echo $?
+grep -q ' linked$' ${TEST_BASE}/TEST-0015.out;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+restore_and_compare TEST-0015
+
+echo '###### BACKUP COMMAND TEST-0016 ######'
+echo '###### full backups storing pages of data files into the chunk store ######'
+init_catalog
+pg_rman backup -B ${BACKUP_PATH} -b full -Z --dedup -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+NUM_CHUNKS=`find ${BACKUP_PATH}/chunks -type f | wc -l`
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "UPDATE pgbench_accounts SET abalance = abalance + 1 WHERE aid <= 1000;" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b full -Z --dedup -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pg_rman show detail -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0016.log 2>&1
+grep -c OK ${TEST_BASE}/TEST-0016.log
+ls ${BACKUP_PATH}/*/*/chunk_list.bin | wc -l
+echo 'the second backup stores only the chunks of the pages updated'
+test `find ${BACKUP_PATH}/chunks -type f | wc -l` -lt `expr ${NUM_CHUNKS} + ${NUM_CHUNKS} / 10`;echo $?
+echo 'delete the first backup and purge the chunks only it referred to'
+NUM_CHUNKS=`find ${BACKUP_PATH}/chunks -type f | wc -l`
+pg_rman delete `date +"%Y-%m-%d %H:%M:%S"` -B ${BACKUP_PATH} --quiet;echo $?
+pg_rman purge -B ${BACKUP_PATH} --quiet;echo $?
+test `find ${BACKUP_PATH}/chunks -type f | wc -l` -lt ${NUM_CHUNKS};echo $?
+echo 'delete the old backup by --keep-data-generations with the chunks only it referred to'
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "UPDATE pgbench_accounts SET abalance = abalance + 1 WHERE aid <= 1000;" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b full -Z --dedup -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "UPDATE pgbench_accounts SET abalance = abalance + 1 WHERE aid <= 1000;" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b full -Z --dedup --keep-data-generations=1 -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pg_rman show -a -B ${BACKUP_PATH} | grep -c DELETED
+NUM_CHUNKS=`find ${BACKUP_PATH}/chunks -type f | wc -l`
+pg_rman purge -B ${BACKUP_PATH} --quiet;echo $?
+test `find ${BACKUP_PATH}/chunks -type f | wc -l` -eq ${NUM_CHUNKS};echo $?
+restore_and_compare TEST-0016
+
+echo '###### BACKUP COMMAND TEST-0017 ######'
+echo '###### full backup resuming the files completed by the failed backup ######'
+init_catalog
+psql --no-psqlrc -p ${TEST_PGPORT} -d postgres -c "ALTER SYSTEM SET archive_command = 'false'; SELECT pg_reload_conf();" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet > /dev/null 2>&1;echo $?
+echo 'the failed backup has listed the files it completed'
+test `cat ${BACKUP_PATH}/*/*/file_database.txt.partial | wc -l` -gt 0;echo $?
+psql --no-psqlrc -p ${TEST_PGPORT} -d postgres -c "ALTER SYSTEM RESET archive_command; SELECT pg_reload_conf();" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b full -j 4 --resume -p ${TEST_PGPORT} -d postgres --verbose > ${TEST_BASE}/TEST-0017.out 2>&1;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+echo 'most of the files are resumed instead of copied again'
+RESUMED=`grep -c ' resumed$' ${TEST_BASE}/TEST-0017.out`
+test ${RESUMED} -gt `expr \`grep -c '^(' ${TEST_BASE}/TEST-0017.out\` / 2`;echo $?
+pg_rman show detail -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0017.log 2>&1
+grep -c OK ${TEST_BASE}/TEST-0017.log
+ls ${BACKUP_PATH}/*/*/file_database.txt.partial | wc -l
+
+
 # cleanup
 ## clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
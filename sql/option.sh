@@ -199,6 +199,31 @@ echo "BACKUP_MODE=ENV_PATH_A" > ${BACKUP_PATH}/conf_path_a/pg_rman.ini
 pg_rman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -p ${TEST_PGPORT};echo $?
 echo ''
 
+echo '###### COMMAND OPTION TEST-0022 ######'
+echo '###### invalid value in pg_rman.ini ######'
+init_catalog
+echo "JOBS=TRUE" >> ${BACKUP_PATH}/pg_rman.ini
+pg_rman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0023 ######'
+echo '###### invalid number of parallel jobs ######'
+init_catalog
+pg_rman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full -j 0 -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0024 ######'
+echo '###### invalid compression algorithm ######'
+init_catalog
+pg_rman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full -Z --compress-algorithm=bad -p ${TEST_PGPORT};echo $?
+echo ''
+
+echo '###### COMMAND OPTION TEST-0025 ######'
+echo '###### compression level out of range ######'
+init_catalog
+pg_rman backup -B ${BACKUP_PATH} -A ${ARCLOG_PATH} -b full -Z --compress-algorithm=zlib --compress-level=10 -p ${TEST_PGPORT};echo $?
+echo ''
+
 # clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
@@ -115,6 +115,34 @@ pg_rman show -a -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0002.out.4 2>&1
 NUM_OF_PURGED_BACKUPS=`diff ${TEST_BASE}/TEST-0002.out.2 ${TEST_BASE}/TEST-0002.out.4 | grep DELETED | wc -l`
 echo "Number of purged backups: ${NUM_OF_PURGED_BACKUPS}"
 
+init_backup
+echo '###### PURGE COMMAND TEST-0003 ######'
+echo '###### purge DELETING backups left by a failed delete ######'
+
+FIRST_BACKUP_DATE=`date +"%Y-%m-%d %H:%M:%S"`
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet
+pgbench -p ${TEST_PGPORT} >> ${TEST_BASE}/pgbench.log 2>&1
+SECOND_BACKUP_DATE=`date +"%Y-%m-%d %H:%M:%S"`
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet
+pgbench -p ${TEST_PGPORT} >> ${TEST_BASE}/pgbench.log 2>&1
+THRID_BACKUP_DATE=`date +"%Y-%m-%d %H:%M:%S"`
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet
+pg_rman validate -B ${BACKUP_PATH} --quiet
+
+echo "fail to delete the files of the oldest backup"
+OLDEST_DATABASE_DIR=`ls -d ${BACKUP_PATH}/*/*/database | head -n 1`
+chmod 500 ${OLDEST_DATABASE_DIR}
+pg_rman -B ${BACKUP_PATH} delete ${SECOND_BACKUP_DATE} > /dev/null 2>&1;echo $?
+chmod 700 ${OLDEST_DATABASE_DIR}
+pg_rman show -a -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0003.out.1 2>&1
+grep -c DELETING ${TEST_BASE}/TEST-0003.out.1
+
+echo "Now, test purge command"
+pg_rman purge -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0003.out.2 2>&1;echo $?
+pg_rman show -a -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0003.out.3 2>&1
+grep -c 'DELETING\|DELETED' ${TEST_BASE}/TEST-0003.out.3
+ls -d ${OLDEST_DATABASE_DIR} 2> /dev/null | wc -l
+
 # clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
@@ -651,6 +651,155 @@ else
 fi
 echo ''
 
+echo '###### RESTORE COMMAND TEST-0021 ######'
+echo '###### recovery to latest from full + incremental backups with parallel jobs ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -j 4 -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b incremental -Z -j 4 -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0021-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -B ${BACKUP_PATH} -j 4 --quiet;echo $?
+start_postgres
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0021-after.out
+diff ${TEST_BASE}/TEST-0021-before.out ${TEST_BASE}/TEST-0021-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0022 ######'
+echo '###### recovery to latest from full + two incremental backups ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b incremental -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "VACUUM FULL pgbench_history;" > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b incremental -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0022-before.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*) FROM pgbench_history;" >> ${TEST_BASE}/TEST-0022-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -B ${BACKUP_PATH} --quiet;echo $?
+start_postgres
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0022-after.out
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT count(*) FROM pgbench_history;" >> ${TEST_BASE}/TEST-0022-after.out
+diff ${TEST_BASE}/TEST-0022-before.out ${TEST_BASE}/TEST-0022-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0023 ######'
+echo '###### restore fails on a backup file with broken CRC ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pg_ctl stop -m immediate > /dev/null 2>&1
+printf 'X' | dd of=`ls ${BACKUP_PATH}/*/*/database/PG_VERSION` bs=1 count=1 conv=notrunc > /dev/null 2>&1
+pg_rman restore -B ${BACKUP_PATH} --quiet > /dev/null 2>&1;echo $?
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0024 ######'
+echo '###### recovery with archived WAL restored on demand ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pgbench -p ${TEST_PGPORT} -d pgbench > /dev/null 2>&1
+pg_rman backup -B ${BACKUP_PATH} -b archive -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0024-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+rm -f ${ARCLOG_PATH}/0*
+pg_rman restore -B ${BACKUP_PATH} -j 4 --wal-on-demand --quiet;echo $?
+grep -c "restore-wal" ${PGDATA_PATH}/pg_rman_recovery.conf
+start_postgres
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0024-after.out
+diff ${TEST_BASE}/TEST-0024-before.out ${TEST_BASE}/TEST-0024-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0025 ######'
+echo '###### backup and restore of a data file extended by all-zero pages ######'
+init_backup
+RELPATH=`psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -tA -c "SELECT pg_relation_filepath('pgbench_branches');"`
+pg_ctl stop -m fast > /dev/null 2>&1
+dd if=/dev/zero bs=8192 count=64 >> ${PGDATA_PATH}/${RELPATH} 2> /dev/null
+SIZE_BEFORE=`stat -c %s ${PGDATA_PATH}/${RELPATH}`
+start_postgres
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+if [ `stat -c %s ${BACKUP_PATH}/*/*/database/${RELPATH}` -lt 524288 ]; then echo 'zero pages are not copied'; fi
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -B ${BACKUP_PATH} --quiet;echo $?
+if [ `stat -c %s ${PGDATA_PATH}/${RELPATH}` -eq ${SIZE_BEFORE} ]; then echo 'size is restored'; fi
+tail -c 524288 ${PGDATA_PATH}/${RELPATH} | cmp -s -n 524288 - /dev/zero;echo $?
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0026 ######'
+echo '###### verification of data checksums while backing up ######'
+init_backup
+RELPATH=`psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -tA -c "SELECT pg_relation_filepath('pgbench_accounts');"`
+pg_ctl stop -m fast > /dev/null 2>&1
+printf 'XXXXXXXX' | dd of=${PGDATA_PATH}/${RELPATH} bs=1 seek=4000 count=8 conv=notrunc > /dev/null 2>&1
+start_postgres
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --verify-checksums --quiet > ${TEST_BASE}/TEST-0026.log 2>&1;echo $?
+grep -c "checksum verification failed in block 0" ${TEST_BASE}/TEST-0026.log
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --fail-on-checksum-error --quiet > /dev/null 2>&1;echo $?
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0027 ######'
+echo '###### recovery to latest by restoring only differences with --delta ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+load_with_pgbench
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0027-before.out
+pg_ctl stop -m immediate > /dev/null 2>&1
+touch ${PGDATA_PATH}/TEST-0027-stray
+pg_rman restore -B ${BACKUP_PATH} --delta --quiet;echo $?
+if [ ! -e ${PGDATA_PATH}/TEST-0027-stray ]; then echo 'stray file is deleted'; fi
+start_postgres
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0027-after.out
+diff ${TEST_BASE}/TEST-0027-before.out ${TEST_BASE}/TEST-0027-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0028 ######'
+echo '###### recovery to latest from full + two incremental backups merged into full ######'
+init_backup
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+load_with_pgbench
+pg_rman backup -B ${BACKUP_PATH} -b incremental -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+load_with_pgbench
+pg_rman backup -B ${BACKUP_PATH} -b incremental -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0028-before.out
+TARGET=`pg_rman show -B ${BACKUP_PATH} | sed -n 4p | cut -c 1-19`
+pg_rman merge -B ${BACKUP_PATH} "${TARGET}" -j 4 --quiet;echo $?
+pg_rman show -B ${BACKUP_PATH} | grep -c FULL
+pg_ctl stop -m immediate > /dev/null 2>&1
+pg_rman restore -B ${BACKUP_PATH} --quiet;echo $?
+start_postgres
+psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -c "SELECT * FROM pgbench_branches;" > ${TEST_BASE}/TEST-0028-after.out
+diff ${TEST_BASE}/TEST-0028-before.out ${TEST_BASE}/TEST-0028-after.out
+echo ''
+
+echo '###### RESTORE COMMAND TEST-0029 ######'
+echo '###### restoring only differences with --delta leaves unchanged zero pages ######'
+init_backup
+RELPATH=`psql --no-psqlrc -p ${TEST_PGPORT} -d pgbench -tA -c "SELECT pg_relation_filepath('pgbench_branches');"`
+pg_ctl stop -m fast > /dev/null 2>&1
+dd if=/dev/zero bs=8192 count=64 >> ${PGDATA_PATH}/${RELPATH} 2> /dev/null
+start_postgres
+pg_rman backup -B ${BACKUP_PATH} -b full -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet
+pg_ctl stop -m immediate > /dev/null 2>&1
+BLOCKS_BEFORE=`stat -c %b ${PGDATA_PATH}/${RELPATH}`
+pg_rman restore -B ${BACKUP_PATH} --delta --quiet;echo $?
+if [ `stat -c %b ${PGDATA_PATH}/${RELPATH}` -eq ${BLOCKS_BEFORE} ]; then echo 'zero pages are left as they are'; fi
+tail -c 524288 ${PGDATA_PATH}/${RELPATH} | cmp -s -n 524288 - /dev/zero;echo $?
+echo ''
+
 # clean up the temporal test data
 pg_ctl stop -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
@@ -130,6 +130,20 @@ else
 fi
 echo ''
 
+echo '###### SHOW COMMAND TEST-0005 ######'
+echo '###### Status changed in backup.ini by hand ######'
+init_catalog
+pg_rman backup -B ${BACKUP_PATH} -b full -Z -p ${TEST_PGPORT} -d postgres --quiet;echo $?
+pg_rman validate -B ${BACKUP_PATH} --quiet > /dev/null 2>&1;echo $?
+sed -i 's/^STATUS=OK$/STATUS=ERROR/' `find ${BACKUP_PATH} -name backup.ini`
+pg_rman show -B ${BACKUP_PATH} > ${TEST_BASE}/TEST-0005-show.out 2>&1
+if grep "ERROR" ${TEST_BASE}/TEST-0005-show.out > /dev/null ; then
+     echo 'OK: status in backup.ini is shown instead of the catalog index.'
+else
+     echo 'NG: status in the catalog index is shown.'
+fi
+echo ''
+
 # clean up the temporal test data
 pg_ctl stop -D ${PGDATA_PATH} -m immediate > /dev/null 2>&1
 rm -fr ${PGDATA_PATH}
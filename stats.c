@@ -0,0 +1,415 @@
+/*-------------------------------------------------------------------------
+ *
+ * stats.c: timing and throughput of the phases of backup, restore and
+ * validate, reported with --stats=json.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The counters are totals of the command, added by the workers as they go.
+ * A phase records the time, the system calls and the counters it has spent
+ * between stats_begin() and stats_end(), so phases can be nested, e.g.
+ * wait_for_archive is also a part of stop_backup.
+ */
+typedef struct StatsValues
+{
+	double	seconds;
+	long	syscalls;			/* -1 if unknown */
+	int64	counters[STATS_NUM_COUNTERS];
+} StatsValues;
+
+typedef struct StatsPhaseData
+{
+	int				order;		/* 0 if never begun, or 1 origin order */
+	bool			running;
+	struct timespec	start;
+	long			start_syscalls;
+	int64			start_counters[STATS_NUM_COUNTERS];
+	StatsValues		total;
+} StatsPhaseData;
+
+bool stats_enabled = false;
+
+static const char *phase_names[STATS_NUM_PHASES] =
+{
+	"start_backup",
+	"list_files",
+	"copy_files",
+	"stop_backup",
+	"wait_for_archive",
+	"base_backup",
+	"backup_arclog",
+	"backup_srvlog",
+	"validate",
+	"restore_files",
+	"restore_arclog",
+	"restore_online_files"
+};
+
+static const char *counter_names[STATS_NUM_COUNTERS] =
+{
+	"bytes_read",
+	"bytes_written",
+	"pages_read",
+	"data_reads",
+	"pages_skipped",
+	"pages_with_hole",
+	"pages_zero",
+	"pages_corrupt",
+	"compress_seconds",
+	"crc_seconds"
+};
+
+/* a page failed --verify-checksums */
+typedef struct StatsCorruptPage
+{
+	BlockNumber	blkno;
+	char		path[FLEXIBLE_ARRAY_MEMBER];
+} StatsCorruptPage;
+
+static StatsPhaseData	phases[STATS_NUM_PHASES];
+static int64			counters[STATS_NUM_COUNTERS];
+static int				num_begun = 0;
+static struct timespec	command_start;
+static long				command_syscalls;
+static parray		   *corrupt_pages = NULL;
+static pthread_mutex_t	stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stats_print_values(FILE *out, const StatsValues *values);
+static void stats_print_corrupt_pages(FILE *out);
+static int stats_compare_corrupt_page(const void *a, const void *b);
+
+/*
+ * Start collecting the statistics of the command.
+ */
+void
+stats_init(void)
+{
+	if (!stats_enabled)
+		return;
+
+	memset(phases, 0, sizeof(phases));
+	memset(counters, 0, sizeof(counters));
+	num_begun = 0;
+	corrupt_pages = parray_new();
+	clock_gettime(CLOCK_MONOTONIC, &command_start);
+	command_syscalls = stats_count_syscalls();
+}
+
+void
+stats_begin(StatsPhase phase)
+{
+	StatsPhaseData *p = &phases[phase];
+
+	if (!stats_enabled)
+		return;
+
+	if (p->order == 0)
+		p->order = ++num_begun;
+	p->running = true;
+	p->start_syscalls = stats_count_syscalls();
+	pthread_mutex_lock(&stats_lock);
+	memcpy(p->start_counters, counters, sizeof(counters));
+	pthread_mutex_unlock(&stats_lock);
+	clock_gettime(CLOCK_MONOTONIC, &p->start);
+}
+
+/*
+ * End the phase begun by stats_begin().  A phase can be begun again, e.g.
+ * for each backup validated, and then its values are accumulated.
+ */
+void
+stats_end(StatsPhase phase)
+{
+	StatsPhaseData *p = &phases[phase];
+	long			syscalls;
+	int				i;
+
+	if (!stats_enabled || !p->running)
+		return;
+
+	p->total.seconds += stats_elapsed(&p->start);
+	syscalls = stats_count_syscalls();
+	if (syscalls >= 0 && p->start_syscalls >= 0)
+		p->total.syscalls += syscalls - p->start_syscalls;
+	else
+		p->total.syscalls = -1;
+	pthread_mutex_lock(&stats_lock);
+	for (i = 0; i < STATS_NUM_COUNTERS; i++)
+		p->total.counters[i] += counters[i] - p->start_counters[i];
+	pthread_mutex_unlock(&stats_lock);
+	p->running = false;
+}
+
+/*
+ * Add value to the counter.  Called by the workers concurrently.
+ */
+void
+stats_add(StatsCounter counter, int64 value)
+{
+	if (!stats_enabled || value == 0)
+		return;
+
+	pthread_mutex_lock(&stats_lock);
+	counters[counter] += value;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Record the page of block blkno in the file at path whose checksum is
+ * wrong, to be listed by the file.  Called by the workers concurrently.
+ */
+void
+stats_add_corrupt_page(const char *path, BlockNumber blkno)
+{
+	StatsCorruptPage   *page;
+
+	if (!stats_enabled)
+		return;
+
+	page = pgut_malloc(offsetof(StatsCorruptPage, path) + strlen(path) + 1);
+	page->blkno = blkno;
+	strcpy(page->path, path);
+
+	pthread_mutex_lock(&stats_lock);
+	parray_append(corrupt_pages, page);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Add the time elapsed since start to the counter of time, in usec.
+ */
+void
+stats_add_time(StatsCounter counter, const struct timespec *start)
+{
+	if (!stats_enabled)
+		return;
+
+	stats_add(counter, (int64) (stats_elapsed(start) * 1000000));
+}
+
+/*
+ * Seconds elapsed since start, taken by clock_gettime(CLOCK_MONOTONIC).
+ */
+double
+stats_elapsed(const struct timespec *start)
+{
+	struct timespec	now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Return the number of read and write system calls issued by this process
+ * so far, or -1 if not known on this platform.
+ */
+long
+stats_count_syscalls(void)
+{
+	FILE   *fp;
+	char	buf[256];
+	long	count = 0;
+	long	value;
+	int		found = 0;
+
+	fp = fopen("/proc/self/io", "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(buf, lengthof(buf), fp) != NULL)
+	{
+		if (sscanf(buf, "syscr: %ld", &value) == 1 ||
+			sscanf(buf, "syscw: %ld", &value) == 1)
+		{
+			count += value;
+			found++;
+		}
+	}
+	fclose(fp);
+
+	return found == 2 ? count : -1;
+}
+
+/*
+ * Write the statistics of the command as JSON into path.  The file is
+ * replaced at once so that the monitoring never reads a partial one.
+ */
+void
+stats_write_json(const char *command, const char *path)
+{
+	char		tmp_path[MAXPGPATH];
+	char		timestamp[20];
+	StatsValues	total;
+	FILE	   *fp;
+	bool		first = true;
+	long		syscalls;
+	int			i;
+	int			order;
+
+	if (!stats_enabled || check)
+		return;
+
+	total.seconds = stats_elapsed(&command_start);
+	syscalls = stats_count_syscalls();
+	total.syscalls = (syscalls >= 0 && command_syscalls >= 0) ?
+		syscalls - command_syscalls : -1;
+	pthread_mutex_lock(&stats_lock);
+	memcpy(total.counters, counters, sizeof(counters));
+	pthread_mutex_unlock(&stats_lock);
+
+	snprintf(tmp_path, lengthof(tmp_path), "%s.tmp", path);
+	fp = fopen(tmp_path, "w");
+	if (fp == NULL)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not open \"%s\": %s", tmp_path, strerror(errno))));
+
+	time2iso(timestamp, lengthof(timestamp), time(NULL));
+	fprintf(fp, "{\n  \"command\": \"%s\",\n  \"end_time\": \"%s\",\n",
+			command, timestamp);
+	fprintf(fp, "  \"phases\": [");
+	for (order = 1; order <= num_begun; order++)
+	{
+		for (i = 0; i < STATS_NUM_PHASES; i++)
+		{
+			if (phases[i].order != order)
+				continue;
+			fprintf(fp, "%s\n    { \"name\": \"%s\", ", first ? "" : ",",
+					phase_names[i]);
+			stats_print_values(fp, &phases[i].total);
+			fprintf(fp, " }");
+			first = false;
+		}
+	}
+	fprintf(fp, "\n  ],\n  \"corrupt_files\": [");
+	stats_print_corrupt_pages(fp);
+	fprintf(fp, "],\n  \"total\": { ");
+	stats_print_values(fp, &total);
+	fprintf(fp, " }\n}\n");
+
+	if (fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+	{
+		int		errno_tmp = errno;
+
+		fclose(fp);
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not write \"%s\": %s", tmp_path,
+				strerror(errno_tmp))));
+	}
+	fclose(fp);
+
+	if (rename(tmp_path, path) == -1)
+		ereport(ERROR,
+			(errcode(ERROR_SYSTEM),
+			 errmsg("could not rename \"%s\" to \"%s\": %s", tmp_path, path,
+				strerror(errno))));
+}
+
+/*
+ * Write the summary of the statistics kept in backup.ini, i.e. the seconds
+ * of each phase and the pages skipped, into buf.  Empty if not collected.
+ */
+void
+stats_summary(char *buf, size_t size)
+{
+	size_t	len = 0;
+	int		i;
+	int		order;
+
+	buf[0] = '\0';
+	if (!stats_enabled)
+		return;
+
+	for (order = 1; order <= num_begun; order++)
+	{
+		for (i = 0; i < STATS_NUM_PHASES; i++)
+		{
+			if (phases[i].order == order && len < size)
+				len += snprintf(buf + len, size - len, "%s=%.3fs ",
+								phase_names[i], phases[i].total.seconds);
+		}
+	}
+	if (len < size)
+		snprintf(buf + len, size - len,
+				 "pages_skipped=" INT64_FORMAT " pages_with_hole=" INT64_FORMAT,
+				 counters[STATS_PAGES_SKIPPED], counters[STATS_PAGES_WITH_HOLE]);
+}
+
+static void
+stats_print_values(FILE *out, const StatsValues *values)
+{
+	int		i;
+
+	fprintf(out, "\"seconds\": %.3f, \"syscalls\": %ld",
+			values->seconds, values->syscalls);
+	for (i = 0; i < STATS_NUM_COUNTERS; i++)
+	{
+		/* the counters of time are in usec */
+		if (i == STATS_COMPRESS_USEC || i == STATS_CRC_USEC)
+			fprintf(out, ", \"%s\": %.3f", counter_names[i],
+					values->counters[i] / 1000000.0);
+		else
+			fprintf(out, ", \"%s\": " INT64_FORMAT, counter_names[i],
+					values->counters[i]);
+	}
+}
+
+/*
+ * Print the pages failed --verify-checksums as the array of the files, each
+ * with the block numbers in it.
+ */
+static void
+stats_print_corrupt_pages(FILE *out)
+{
+	int		i;
+
+	pthread_mutex_lock(&stats_lock);
+	parray_qsort(corrupt_pages, stats_compare_corrupt_page);
+	for (i = 0; i < parray_num(corrupt_pages); i++)
+	{
+		StatsCorruptPage   *page = parray_get(corrupt_pages, i);
+		StatsCorruptPage   *prev = i > 0 ? parray_get(corrupt_pages, i - 1) : NULL;
+		const char		   *p;
+
+		if (prev && strcmp(prev->path, page->path) == 0)
+		{
+			fprintf(out, ", %u", page->blkno);
+			continue;
+		}
+
+		fprintf(out, "%s\n    { \"file\": \"", prev ? "] }," : "");
+		for (p = page->path; *p; p++)
+		{
+			if (*p == '"' || *p == '\\')
+				fputc('\\', out);
+			fputc(*p, out);
+		}
+		fprintf(out, "\", \"blocks\": [%u", page->blkno);
+	}
+	if (parray_num(corrupt_pages) > 0)
+		fprintf(out, "] }\n  ");
+	pthread_mutex_unlock(&stats_lock);
+}
+
+static int
+stats_compare_corrupt_page(const void *a, const void *b)
+{
+	const StatsCorruptPage *pa = *(StatsCorruptPage **) a;
+	const StatsCorruptPage *pb = *(StatsCorruptPage **) b;
+	int			rc = strcmp(pa->path, pb->path);
+
+	if (rc != 0)
+		return rc;
+	return pa->blkno < pb->blkno ? -1 : pa->blkno > pb->blkno ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+/*-------------------------------------------------------------------------
+ *
+ * throttle.c: limit the rate of reading files during backup, given by
+ * --max-rate, --max-iops and --tablespace-max-rate.
+ *
+ * Copyright (c) 2009-2023, NIPPON TELEGRAPH AND TELEPHONE CORPORATION
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "pg_rman.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#include "catalog/pg_tablespace_d.h"
+
+/*
+ * Each limit is a token bucket filled by its rate per second up to
+ * THROTTLE_BURST seconds worth.  A read takes its cost from the buckets
+ * first, even beyond empty, and then sleeps until the debts would be paid
+ * off, so the workers reading in parallel are kept under the rate in total
+ * however many they are, and a read larger than the burst just sleeps
+ * longer.
+ */
+#define THROTTLE_BURST		0.1
+
+/* maximum number of tablespaces which can have their own --max-rate */
+#define THROTTLE_MAX_TABLESPACES	64
+
+typedef struct TokenBucket
+{
+	double			rate;		/* tokens per second, 0 if not limited */
+	double			tokens;		/* negative while in debt */
+	struct timespec	last;		/* when tokens was filled last */
+} TokenBucket;
+
+typedef struct TablespaceBucket
+{
+	Oid				spcoid;
+	TokenBucket		bytes;
+} TablespaceBucket;
+
+static bool				throttled = false;
+static TokenBucket		total_bytes;
+static TokenBucket		total_ios;
+static TablespaceBucket	tablespaces[THROTTLE_MAX_TABLESPACES];
+static int				num_tablespaces = 0;
+static pthread_mutex_t	throttle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void bucket_init(TokenBucket *bucket, double rate);
+static double bucket_take(TokenBucket *bucket, double cost,
+						  const struct timespec *now);
+
+/*
+ * Limit the reads of all the workers to max_rate MB/s and max_iops read
+ * calls per second in total.  Zero means no limit.
+ */
+void
+throttle_init(int max_rate, int max_iops)
+{
+	bucket_init(&total_bytes, (double) max_rate * 1024 * 1024);
+	bucket_init(&total_ios, max_iops);
+	num_tablespaces = 0;
+	throttled = (max_rate > 0 || max_iops > 0);
+}
+
+/*
+ * Limit the reads of the files in the tablespace spcoid to max_rate MB/s,
+ * in addition to the limit of the total.
+ */
+void
+throttle_add_tablespace(Oid spcoid, int max_rate)
+{
+	TablespaceBucket   *spc;
+
+	if (max_rate <= 0)
+		return;
+	if (num_tablespaces >= THROTTLE_MAX_TABLESPACES)
+		ereport(ERROR,
+			(errcode(ERROR_ARGS),
+			 errmsg("too many tablespaces in --tablespace-max-rate, at most %d",
+				THROTTLE_MAX_TABLESPACES)));
+
+	spc = &tablespaces[num_tablespaces++];
+	spc->spcoid = spcoid;
+	bucket_init(&spc->bytes, (double) max_rate * 1024 * 1024);
+	throttled = true;
+}
+
+/*
+ * Return the number to give throttle_read() for the file at path relative
+ * to $PGDATA, i.e. which tablespace limits the reads of the file, or -1 if
+ * only the total limits them.
+ */
+int
+throttle_tablespace(const char *path)
+{
+	Oid		spcoid;
+	int		i;
+
+	if (num_tablespaces == 0)
+		return -1;
+
+	if (strncmp(path, "global/", 7) == 0)
+		spcoid = GLOBALTABLESPACE_OID;
+	else if (strncmp(path, "base/", 5) == 0)
+		spcoid = DEFAULTTABLESPACE_OID;
+	else if (strncmp(path, PG_TBLSPC_DIR "/", strlen(PG_TBLSPC_DIR) + 1) == 0)
+		spcoid = (Oid) strtoul(path + strlen(PG_TBLSPC_DIR) + 1, NULL, 10);
+	else
+		return -1;
+
+	for (i = 0; i < num_tablespaces; i++)
+	{
+		if (tablespaces[i].spcoid == spcoid)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Account a read of bytes from a file in the tablespace given by
+ * throttle_tablespace(), and sleep as long as needed to keep the limits.
+ * Call this once per read system call.
+ */
+void
+throttle_read(int tablespace, size_t bytes)
+{
+	struct timespec	now;
+	double			wait;
+
+	if (!throttled)
+		return;
+
+	pthread_mutex_lock(&throttle_lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = bucket_take(&total_bytes, bytes, &now);
+	wait = Max(wait, bucket_take(&total_ios, 1, &now));
+	if (tablespace >= 0)
+		wait = Max(wait, bucket_take(&tablespaces[tablespace].bytes, bytes, &now));
+	pthread_mutex_unlock(&throttle_lock);
+
+	if (wait > 0)
+	{
+		struct timespec	delay;
+
+		delay.tv_sec = (time_t) wait;
+		delay.tv_nsec = (long) ((wait - delay.tv_sec) * 1000000000);
+		while (nanosleep(&delay, &delay) == -1 && errno == EINTR && !interrupted)
+			;
+	}
+}
+
+static void
+bucket_init(TokenBucket *bucket, double rate)
+{
+	bucket->rate = Max(rate, 0);
+	bucket->tokens = bucket->rate * THROTTLE_BURST;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
+
+/*
+ * Take cost from the bucket and return the seconds to sleep until it is
+ * out of debt.
+ */
+static double
+bucket_take(TokenBucket *bucket, double cost, const struct timespec *now)
+{
+	double	elapsed;
+
+	if (bucket->rate <= 0)
+		return 0;
+
+	elapsed = (now->tv_sec - bucket->last.tv_sec) +
+		(now->tv_nsec - bucket->last.tv_nsec) / 1e9;
+	bucket->last = *now;
+	bucket->tokens = Min(bucket->tokens + bucket->rate * elapsed,
+						 bucket->rate * THROTTLE_BURST);
+	bucket->tokens -= cost;
+
+	return bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
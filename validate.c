@@ -9,9 +9,27 @@
 
 #include "pg_rman.h"
 
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
-static bool pgBackupValidateFiles(parray *files, const char *root, bool size_only);
+/* arguments and shared state of pgBackupValidateFiles() workers */
+typedef struct validate_files_arg
+{
+	parray		   *files;
+	const char	   *root;
+	bool			size_only;
+
+	pthread_mutex_t	lock;
+	int				next_file;		/* index of next file in files */
+	bool			corrupted;		/* found a broken file */
+	int64			read_bytes;		/* total size of validated files */
+} validate_files_arg;
+
+static bool pgBackupValidateFiles(parray *files, const char *root,
+								  bool size_only, int64 *read_bytes);
+static bool pgBackupHasFiles(pgBackup *backup);
 
 /*
  * Validate files in the backup and update its status to OK.
@@ -41,10 +59,12 @@ do_validate(pgBackupRange *range)
 	{
 		pgBackup *backup = (pgBackup *)parray_get(backup_list, i);
 
-		/* clean extra backups (switch STATUS to ERROR) */
-		if(!another_pg_rman &&
-		   (backup->status == BACKUP_STATUS_RUNNING ||
-			backup->status == BACKUP_STATUS_DELETING))
+		/*
+		 * Clean extra backups (switch STATUS to ERROR).  DELETING backups
+		 * are left as they are, since delete removes their files without
+		 * the catalog lock, and the next delete retries them.
+		 */
+		if(!another_pg_rman && backup->status == BACKUP_STATUS_RUNNING)
 		{
 			backup->status = BACKUP_STATUS_ERROR;
 			pgBackupWriteIni(backup);
@@ -58,6 +78,15 @@ do_validate(pgBackupRange *range)
 		pgBackupValidate(backup, false, false, (HAVE_DATABASE(backup)));
 	}
 
+	/* statistics of --stats=json */
+	if (stats_enabled)
+	{
+		char	path[MAXPGPATH];
+
+		join_path_components(path, backup_path, "validate_" STATS_FILE);
+		stats_write_json("validate", path);
+	}
+
 	/* cleanup */
 	parray_walk(backup_list, pgBackupFree);
 	parray_free(backup_list);
@@ -78,8 +107,35 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 	char	path[MAXPGPATH];
 	parray *files;
 	bool	corrupted = false;
+	int64	read_bytes = 0;
+	struct timeval	start_tv;
+	struct timeval	end_tv;
 
 	time2iso(timestamp, lengthof(timestamp), backup->start_time);
+
+	/*
+	 * The files of a backup written by --output are not in the catalog
+	 * unless the stream has been extracted into it.
+	 */
+	if (backup->streamed && !pgBackupHasFiles(backup))
+	{
+		if (size_only)
+			ereport(ERROR,
+				(errcode(ERROR_CORRUPTED),
+				 errmsg("files of backup \"%s\" are not in the backup catalog", timestamp),
+				 errdetail("The backup was written by --output."),
+				 errhint("Extract the backup into the backup catalog.")));
+		if (!check)
+		{
+			backup->status = BACKUP_STATUS_OK;
+			pgBackupWriteIni(backup);
+			elog(INFO, "backup \"%s\" was written by --output, its files are not validated",
+				 timestamp);
+		}
+		return;
+	}
+	backup->streamed = false;
+
 	if(!for_get_timeline)
 	{
 		if (with_database && backup->with_serverlog)
@@ -122,6 +178,9 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 
 	if(!check)
 	{
+		gettimeofday(&start_tv, NULL);
+		stats_begin(STATS_VALIDATE);
+
 		if (HAVE_DATABASE(backup))
 		{
 			elog(DEBUG, "checking database files");
@@ -129,7 +188,8 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 			pgBackupGetPath(backup, path, lengthof(path),
 				DATABASE_FILE_LIST);
 			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
+			if (!pgBackupValidateFiles(files, base_path, size_only,
+									   &read_bytes))
 				corrupted = true;
 			parray_walk(files, pgFileFree);
 			parray_free(files);
@@ -140,7 +200,8 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 			pgBackupGetPath(backup, base_path, lengthof(base_path), ARCLOG_DIR);
 			pgBackupGetPath(backup, path, lengthof(path), ARCLOG_FILE_LIST);
 			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
+			if (!pgBackupValidateFiles(files, base_path, size_only,
+									   &read_bytes))
 				corrupted = true;
 			parray_walk(files, pgFileFree);
 			parray_free(files);
@@ -151,11 +212,13 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 			pgBackupGetPath(backup, base_path, lengthof(base_path), SRVLOG_DIR);
 			pgBackupGetPath(backup, path, lengthof(path), SRVLOG_FILE_LIST);
 			files = dir_read_file_list(base_path, path);
-			if (!pgBackupValidateFiles(files, base_path, size_only))
+			if (!pgBackupValidateFiles(files, base_path, size_only,
+									   &read_bytes))
 				corrupted = true;
 			parray_walk(files, pgFileFree);
 			parray_free(files);
 		}
+		stats_end(STATS_VALIDATE);
 
 		/* update status to OK */
 		if (corrupted)
@@ -168,9 +231,46 @@ pgBackupValidate(pgBackup *backup, bool size_only, bool for_get_timeline, bool w
 			elog(WARNING, "backup \"%s\" is corrupted", timestamp);
 		else
 			elog(INFO, "backup \"%s\" is valid", timestamp);
+
+		/* print throughput summary */
+		if (!for_get_timeline && !size_only)
+		{
+			double	elapsed;
+
+			gettimeofday(&end_tv, NULL);
+			elapsed = (end_tv.tv_sec - start_tv.tv_sec) +
+				(end_tv.tv_usec - start_tv.tv_usec) / 1000000.0;
+			elog(INFO, "validated " INT64_FORMAT " bytes of backup \"%s\" in %.2f sec (%.2f MB/s)",
+				 read_bytes, timestamp, elapsed,
+				 elapsed > 0 ? read_bytes / elapsed / (1024 * 1024) : 0.0);
+		}
 	}
 }
 
+/*
+ * Return true if the backup directory has any backup file, i.e. the stream
+ * written by --output has been extracted into it.
+ */
+static bool
+pgBackupHasFiles(pgBackup *backup)
+{
+	char			path[MAXPGPATH];
+	DIR			   *dir;
+	struct dirent  *ent;
+	bool			found = false;
+
+	pgBackupGetPath(backup, path, lengthof(path),
+					HAVE_DATABASE(backup) ? DATABASE_DIR : ARCLOG_DIR);
+	dir = opendir(path);
+	if (dir == NULL)
+		return false;
+	while (!found && (ent = readdir(dir)) != NULL)
+		found = (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0);
+	closedir(dir);
+
+	return found;
+}
+
 static const char *
 get_relative_path(const char *path, const char *root)
 {
@@ -182,72 +282,151 @@ get_relative_path(const char *path, const char *root)
 }
 
 /*
- * Validate files in the backup with size or CRC.
+ * Validate a file in the backup with size or CRC.
  */
 static bool
-pgBackupValidateFiles(parray *files, const char *root, bool size_only)
+pgBackupValidateFile(validate_files_arg *args, pgFile *file, int index)
 {
-	int		i;
+	struct stat st;
 
-	for (i = 0; i < parray_num(files); i++)
+	/* print progress */
+	if (verbose)
+		elog(DEBUG, _("(%d/%lu) validating %s"), index + 1,
+			(unsigned long) parray_num(args->files),
+			get_relative_path(file->path, args->root));
+
+	/*
+	 * always validate file size, after joining the parts of a large file
+	 * extracted from a stream of --output
+	 */
+	if (stat(file->path, &st) == -1 &&
+		(errno != ENOENT || !sink_join_parts(file->path) ||
+		 stat(file->path, &st) == -1))
+	{
+		if (errno == ENOENT)
+			elog(WARNING, _("backup file \"%s\" vanished"), file->path);
+		else
+			ereport(ERROR,
+				(errcode(ERROR_SYSTEM),
+				 errmsg("could not stat backup file \"%s\": %s",
+					get_relative_path(file->path, args->root), strerror(errno))));
+		return false;
+	}
+	if (file->write_size != st.st_size)
 	{
-		struct stat st;
+		elog(WARNING, _("size of backup file \"%s\" must be %lu but %lu"),
+			get_relative_path(file->path, args->root),
+			(unsigned long) file->write_size,
+			(unsigned long) st.st_size);
+		return false;
+	}
 
-		pgFile *file = (pgFile *) parray_get(files, i);
+	/* validate CRC too */
+	if (!args->size_only)
+	{
+		pg_crc32c	crc;
+
+		crc = pgFileGetCRC(file);
+		if (crc != file->crc)
+		{
+			elog(WARNING, _("CRC calculation showed incorrect result"));
+			if(verbose)
+			{
+				elog(WARNING, _("CRC of backup file \"%s\" must be %X but %X"),
+					get_relative_path(file->path, args->root), file->crc, crc);
+			}
+			return false;
+		}
+	}
+
+	/* the chunks of the file backed up by --dedup must be there */
+	if (!dedup_validate_file(file->path, args->size_only))
+		return false;
+
+	if (!args->size_only)
+	{
+		pthread_mutex_lock(&args->lock);
+		args->read_bytes += st.st_size;
+		pthread_mutex_unlock(&args->lock);
+		stats_add(STATS_BYTES_READ, st.st_size);
+	}
+
+	return true;
+}
+
+/*
+ * Validate the files listed in args->files until there is no file left or
+ * a broken one is found.  This is run by each of the pgBackupValidateFiles()
+ * workers.
+ */
+static void
+pgBackupValidateFilesWorker(void *arg)
+{
+	validate_files_arg *args = (validate_files_arg *) arg;
+
+	for (;;)
+	{
+		pgFile *file;
+		int		index;
 
 		if (interrupted)
 			ereport(FATAL,
 				(errcode(ERROR_INTERRUPTED),
 				 errmsg("interrupted during validate")));
 
+		if (thread_failed)
+			break;
+
+		pthread_mutex_lock(&args->lock);
+		if (args->corrupted || args->next_file >= parray_num(args->files))
+		{
+			pthread_mutex_unlock(&args->lock);
+			break;
+		}
+		index = args->next_file++;
+		pthread_mutex_unlock(&args->lock);
+
+		file = (pgFile *) parray_get(args->files, index);
+
 		/* skipped backup while incremental backup */
 		if (file->write_size == BYTES_INVALID || !S_ISREG(file->mode))
 			continue;
 
-		/* print progress */
-		if (verbose)
-			elog(DEBUG, _("(%d/%lu) validating %s"), i + 1, (unsigned long) parray_num(files),
-				get_relative_path(file->path, root));
-
-		/* always validate file size */
-		if (stat(file->path, &st) == -1)
+		if (!pgBackupValidateFile(args, file, index))
 		{
-			if (errno == ENOENT)
-				elog(WARNING, _("backup file \"%s\" vanished"), file->path);
-			else
-				ereport(ERROR,
-					(errcode(ERROR_SYSTEM),
-					 errmsg("could not stat backup file \"%s\": %s",
-						get_relative_path(file->path, root), strerror(errno))));
-			return false;
-		}
-		if (file->write_size != st.st_size)
-		{
-			elog(WARNING, _("size of backup file \"%s\" must be %lu but %lu"),
-				get_relative_path(file->path, root),
-				(unsigned long) file->write_size,
-				(unsigned long) st.st_size);
-			return false;
+			pthread_mutex_lock(&args->lock);
+			args->corrupted = true;
+			pthread_mutex_unlock(&args->lock);
+			break;
 		}
+	}
+}
 
-		/* validate CRC too */
-		if (!size_only)
-		{
-			pg_crc32c	crc;
+/*
+ * Validate files in the backup with size or CRC, by num_threads workers.
+ * The total size of the files whose CRC is validated is added to
+ * *read_bytes.
+ */
+static bool
+pgBackupValidateFiles(parray *files, const char *root, bool size_only,
+					  int64 *read_bytes)
+{
+	validate_files_arg	args;
 
-			crc = pgFileGetCRC(file);
-			if (crc != file->crc)
-			{
-				elog(WARNING, _("CRC calculation showed incorrect result"));
-				if(verbose)
-				{
-					elog(WARNING, _("CRC of backup file \"%s\" must be %X but %X"),
-						get_relative_path(file->path, root), file->crc, crc);
-				}
-				return false;
-			}
-		}
-	}
+	args.files = files;
+	args.root = root;
+	args.size_only = size_only;
+	args.next_file = 0;
+	args.corrupted = false;
+	args.read_bytes = 0;
+	pthread_mutex_init(&args.lock, NULL);
 
-	return true;
+	pgut_run_threads(Min(num_threads, (int) Max(parray_num(files), 1)),
+					 pgBackupValidateFilesWorker, &args);
+
+	pthread_mutex_destroy(&args.lock);
+
+	*read_bytes += args.read_bytes;
+
+	return !args.corrupted;
 }
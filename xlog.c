@@ -9,12 +9,17 @@
 
 #include "pg_rman.h"
 
+#include <ctype.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "access/xlog_internal.h"
+#include "access/xlogrecord.h"
+#include "catalog/pg_tablespace_d.h"
+#include "catalog/storage_xlog.h"
+#include "commands/dbcommands_xlog.h"
 
 typedef unsigned long Datum;
 
@@ -86,3 +91,688 @@ xlog_fname(char *fname, size_t len, TimeLineID tli, XLogRecPtr *lsn,
 	snprintf(fname, len, "%08X%08X%08X", tli,
 		xlogid, xrecoff / wal_segment_size);
 }
+
+/*
+ * Blocks of a relation modified in WAL.  An entry whose relNumber is
+ * InvalidOid stands for all the relations in the database.
+ */
+typedef struct BlockMapEntry
+{
+	Oid			spcOid;
+	Oid			dbOid;
+	Oid			relNumber;
+	bool		all_blocks;		/* all blocks should be read */
+	uint64		nbits;			/* number of blocks covered by bitmap */
+	uint8	   *bitmap;			/* a bit is set for each modified block */
+} BlockMapEntry;
+
+struct pgBlockMap
+{
+	parray		   *entries;	/* sorted by block_map_compare_entry() */
+	BlockMapEntry  *last;		/* entry looked up last while building */
+};
+
+/* WAL stream being read by xlog_build_block_map() */
+typedef struct XLogStream
+{
+	TimeLineID	tli;
+	int			wal_segment_size;
+	FILE	   *fp;				/* segment currently opened */
+	XLogSegNo	segno;			/* segment number of fp */
+	XLogRecPtr	page_ptr;		/* location of page, or InvalidXLogRecPtr */
+	XLogPage	page;
+} XLogStream;
+
+static int
+block_map_compare_entry(const BlockMapEntry *entry, Oid spcOid, Oid dbOid,
+						Oid relNumber)
+{
+	if (entry->spcOid != spcOid)
+		return entry->spcOid < spcOid ? -1 : 1;
+	if (entry->dbOid != dbOid)
+		return entry->dbOid < dbOid ? -1 : 1;
+	if (entry->relNumber != relNumber)
+		return entry->relNumber < relNumber ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Binary search for the entry of the relation.  If not found, return NULL
+ * and set the index to insert it into *index.
+ */
+static BlockMapEntry *
+block_map_find(const pgBlockMap *map, Oid spcOid, Oid dbOid, Oid relNumber,
+			   size_t *index)
+{
+	size_t	lo = 0;
+	size_t	hi = parray_num(map->entries);
+
+	while (lo < hi)
+	{
+		size_t			mid = lo + (hi - lo) / 2;
+		BlockMapEntry  *entry = (BlockMapEntry *) parray_get(map->entries, mid);
+		int				cmp;
+
+		cmp = block_map_compare_entry(entry, spcOid, dbOid, relNumber);
+		if (cmp == 0)
+			return entry;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (index)
+		*index = lo;
+	return NULL;
+}
+
+/*
+ * Return the entry of the relation, creating it if not exists.
+ */
+static BlockMapEntry *
+block_map_get_entry(pgBlockMap *map, Oid spcOid, Oid dbOid, Oid relNumber)
+{
+	BlockMapEntry  *entry;
+	size_t			index;
+
+	/* most of consecutive records modify the same relation */
+	if (map->last &&
+		block_map_compare_entry(map->last, spcOid, dbOid, relNumber) == 0)
+		return map->last;
+
+	entry = block_map_find(map, spcOid, dbOid, relNumber, &index);
+	if (entry == NULL)
+	{
+		entry = pgut_new(BlockMapEntry);
+		entry->spcOid = spcOid;
+		entry->dbOid = dbOid;
+		entry->relNumber = relNumber;
+		entry->all_blocks = false;
+		entry->nbits = 0;
+		entry->bitmap = NULL;
+		parray_insert(map->entries, index, entry);
+	}
+
+	map->last = entry;
+	return entry;
+}
+
+/*
+ * Record the block as modified.  Only main fork is tracked, other forks are
+ * always read entirely because they are small and the free space map is not
+ * WAL-logged.
+ */
+static void
+block_map_add_block(pgBlockMap *map, const RelFileLocator *rlocator,
+					ForkNumber forknum, BlockNumber blkno)
+{
+	BlockMapEntry  *entry;
+
+	if (forknum != MAIN_FORKNUM)
+		return;
+
+	entry = block_map_get_entry(map, rlocator->spcOid, rlocator->dbOid,
+								rlocator->relNumber);
+	if (entry->all_blocks)
+		return;
+
+	if (blkno >= entry->nbits)
+	{
+		uint64	nbits = Max((uint64) blkno + 1, entry->nbits * 2);
+
+		nbits = Max(nbits, 1024);
+		nbits = TYPEALIGN64(8, nbits);
+		entry->bitmap = pgut_realloc(entry->bitmap, nbits / 8);
+		memset(entry->bitmap + entry->nbits / 8, 0, (nbits - entry->nbits) / 8);
+		entry->nbits = nbits;
+	}
+	entry->bitmap[blkno / 8] |= (1 << (blkno % 8));
+}
+
+/*
+ * Record all blocks of the relation as modified.  If relNumber is InvalidOid,
+ * all relations in the database are.
+ */
+static void
+block_map_add_all(pgBlockMap *map, Oid spcOid, Oid dbOid, Oid relNumber)
+{
+	BlockMapEntry  *entry;
+
+	entry = block_map_get_entry(map, spcOid, dbOid, relNumber);
+	entry->all_blocks = true;
+	free(entry->bitmap);
+	entry->bitmap = NULL;
+	entry->nbits = 0;
+}
+
+static void
+block_map_free_entry(void *entry)
+{
+	free(((BlockMapEntry *) entry)->bitmap);
+	free(entry);
+}
+
+/*
+ * Add blocks referenced by the WAL record to the map.
+ * based on DecodeXLogRecord() in src/backend/access/transam/xlogreader.c.
+ * Return false if the record is broken.
+ */
+static bool
+xlog_record_add_blocks(pgBlockMap *map, const XLogRecord *record)
+{
+	const char	   *ptr = (const char *) record + SizeOfXLogRecord;
+	uint32			remaining = record->xl_tot_len - SizeOfXLogRecord;
+	uint32			datatotal = 0;
+	uint32			main_data_len = 0;
+	const char	   *main_data;
+	RelFileLocator	rlocator;
+	bool			has_rlocator = false;
+	uint8			info = record->xl_info & ~XLR_INFO_MASK;
+
+#define COPY_HEADER_FIELD(_dst, _size)	\
+	do { \
+		if (remaining < (_size)) \
+			return false; \
+		memcpy((_dst), ptr, (_size)); \
+		ptr += (_size); \
+		remaining -= (_size); \
+	} while (0)
+
+	while (remaining > datatotal)
+	{
+		uint8	block_id;
+
+		COPY_HEADER_FIELD(&block_id, sizeof(uint8));
+
+		if (block_id == XLR_BLOCK_ID_DATA_SHORT)
+		{
+			uint8	len;
+
+			COPY_HEADER_FIELD(&len, sizeof(uint8));
+			main_data_len = len;
+			datatotal += main_data_len;
+			break;
+		}
+		else if (block_id == XLR_BLOCK_ID_DATA_LONG)
+		{
+			COPY_HEADER_FIELD(&main_data_len, sizeof(uint32));
+			datatotal += main_data_len;
+			break;
+		}
+		else if (block_id == XLR_BLOCK_ID_ORIGIN)
+		{
+			RepOriginId	origin;
+
+			COPY_HEADER_FIELD(&origin, sizeof(RepOriginId));
+		}
+		else if (block_id == XLR_BLOCK_ID_TOPLEVEL_XID)
+		{
+			TransactionId	xid;
+
+			COPY_HEADER_FIELD(&xid, sizeof(TransactionId));
+		}
+		else if (block_id <= XLR_MAX_BLOCK_ID)
+		{
+			uint8		fork_flags;
+			uint16		data_length;
+			BlockNumber	blkno;
+
+			COPY_HEADER_FIELD(&fork_flags, sizeof(uint8));
+			COPY_HEADER_FIELD(&data_length, sizeof(uint16));
+			datatotal += data_length;
+
+			if (fork_flags & BKPBLOCK_HAS_IMAGE)
+			{
+				uint16	bimg_len;
+				uint16	hole_offset;
+				uint8	bimg_info;
+
+				COPY_HEADER_FIELD(&bimg_len, sizeof(uint16));
+				COPY_HEADER_FIELD(&hole_offset, sizeof(uint16));
+				COPY_HEADER_FIELD(&bimg_info, sizeof(uint8));
+				datatotal += bimg_len;
+
+				if ((bimg_info & BKPIMAGE_HAS_HOLE) &&
+					BKPIMAGE_COMPRESSED(bimg_info))
+				{
+					uint16	hole_length;
+
+					COPY_HEADER_FIELD(&hole_length, sizeof(uint16));
+				}
+			}
+
+			if (!(fork_flags & BKPBLOCK_SAME_REL))
+			{
+				COPY_HEADER_FIELD(&rlocator, sizeof(RelFileLocator));
+				has_rlocator = true;
+			}
+			else if (!has_rlocator)
+				return false;
+
+			COPY_HEADER_FIELD(&blkno, sizeof(BlockNumber));
+
+			block_map_add_block(map, &rlocator,
+								fork_flags & BKPBLOCK_FORK_MASK, blkno);
+		}
+		else
+			return false;
+	}
+#undef COPY_HEADER_FIELD
+
+	if (remaining != datatotal)
+		return false;
+
+	/*
+	 * Some records create or shrink relation files without block references.
+	 * Read such relations entirely.
+	 */
+	main_data = (const char *) record + record->xl_tot_len - main_data_len;
+	if (record->xl_rmid == RM_SMGR_ID &&
+		(info == XLOG_SMGR_CREATE || info == XLOG_SMGR_TRUNCATE))
+	{
+		size_t	offset = (info == XLOG_SMGR_CREATE ?
+						  offsetof(xl_smgr_create, rlocator) :
+						  offsetof(xl_smgr_truncate, rlocator));
+
+		if (main_data_len < offset + sizeof(RelFileLocator))
+			return false;
+		memcpy(&rlocator, main_data + offset, sizeof(RelFileLocator));
+		block_map_add_all(map, rlocator.spcOid, rlocator.dbOid,
+						  rlocator.relNumber);
+	}
+	else if (record->xl_rmid == RM_DBASE_ID &&
+			 (info == XLOG_DBASE_CREATE_FILE_COPY ||
+			  info == XLOG_DBASE_CREATE_WAL_LOG))
+	{
+		xl_dbase_create_wal_log_rec	xlrec;
+
+		/* both of the records start with db_id and tablespace_id */
+		if (main_data_len < sizeof(xlrec))
+			return false;
+		memcpy(&xlrec, main_data, sizeof(xlrec));
+		block_map_add_all(map, xlrec.tablespace_id, xlrec.db_id, InvalidOid);
+	}
+
+	return true;
+}
+
+/*
+ * Read the WAL page at page_ptr from the archive or $PGDATA/pg_wal.
+ */
+static bool
+xlog_read_page(XLogStream *stream, XLogRecPtr page_ptr)
+{
+	XLogSegNo	segno;
+
+	XLByteToSeg(page_ptr, segno, stream->wal_segment_size);
+	if (stream->fp == NULL || stream->segno != segno)
+	{
+		char		fname[MAXFNAMELEN];
+		char		path[MAXPGPATH];
+		struct stat	st;
+
+		if (stream->fp)
+			fclose(stream->fp);
+		stream->fp = NULL;
+
+		XLogFileName(fname, stream->tli, segno, stream->wal_segment_size);
+		join_path_components(path, arclog_path, fname);
+		if (stat(path, &st) == -1 || st.st_size != stream->wal_segment_size)
+			snprintf(path, lengthof(path), "%s/%s/%s", pgdata, XLOGDIR, fname);
+		stream->fp = fopen(path, "r");
+		if (stream->fp == NULL)
+		{
+			elog(DEBUG, "could not open WAL segment \"%s\": %s", fname,
+				 strerror(errno));
+			return false;
+		}
+		stream->segno = segno;
+		stream->page_ptr = InvalidXLogRecPtr;
+	}
+
+	if (stream->page_ptr == InvalidXLogRecPtr ||
+		stream->page_ptr + XLOG_BLCKSZ != page_ptr)
+	{
+		if (fseeko(stream->fp, XLogSegmentOffset(page_ptr,
+						stream->wal_segment_size), SEEK_SET) != 0)
+			return false;
+	}
+
+	stream->page_ptr = InvalidXLogRecPtr;
+	if (fread(&stream->page, 1, XLOG_BLCKSZ, stream->fp) != XLOG_BLCKSZ)
+	{
+		elog(DEBUG, "could not read WAL page at %X/%08X",
+			 (uint32) (page_ptr >> 32), (uint32) page_ptr);
+		return false;
+	}
+
+	/* the segment might be recycled one */
+	if (stream->page.header.xlp_magic != XLOG_PAGE_MAGIC ||
+		(stream->page.header.xlp_info & ~XLP_ALL_FLAGS) != 0 ||
+		stream->page.header.xlp_pageaddr != page_ptr)
+	{
+		elog(DEBUG, "invalid WAL page header at %X/%08X",
+			 (uint32) (page_ptr >> 32), (uint32) page_ptr);
+		return false;
+	}
+
+	stream->page_ptr = page_ptr;
+	return true;
+}
+
+/*
+ * If *ptr is at the beginning of a page, skip the page header and the rest
+ * of the record continued from the previous page, so that *ptr points to
+ * the beginning of a record.
+ * based on XLogFindNextRecord() in src/backend/access/transam/xlogreader.c.
+ */
+static bool
+xlog_skip_page_header(XLogStream *stream, XLogRecPtr *ptr)
+{
+	while (*ptr % XLOG_BLCKSZ == 0)
+	{
+		uint32	header_size;
+
+		if (!xlog_read_page(stream, *ptr))
+			return false;
+
+		header_size = XLogPageHeaderSize(&stream->page.header);
+		if (!(stream->page.header.xlp_info & XLP_FIRST_IS_CONTRECORD))
+			*ptr += header_size;
+		else if (stream->page.header.xlp_rem_len >= XLOG_BLCKSZ - header_size)
+			*ptr += XLOG_BLCKSZ;
+		else
+			*ptr += header_size + MAXALIGN(stream->page.header.xlp_rem_len);
+	}
+
+	return true;
+}
+
+/*
+ * Read len bytes of the record at *ptr into buf, skipping page headers.
+ */
+static bool
+xlog_read_record_bytes(XLogStream *stream, XLogRecPtr *ptr, char *buf,
+					   uint32 len)
+{
+	while (len > 0)
+	{
+		XLogRecPtr	page_ptr = *ptr - *ptr % XLOG_BLCKSZ;
+		uint32		offset = *ptr % XLOG_BLCKSZ;
+		uint32		n;
+
+		if (stream->page_ptr != page_ptr && !xlog_read_page(stream, page_ptr))
+			return false;
+
+		/* the record continues to this page */
+		if (offset == 0)
+		{
+			if (!(stream->page.header.xlp_info & XLP_FIRST_IS_CONTRECORD))
+				return false;
+			offset = XLogPageHeaderSize(&stream->page.header);
+			*ptr += offset;
+		}
+
+		n = Min(len, XLOG_BLCKSZ - offset);
+		memcpy(buf, stream->page.data + offset, n);
+		buf += n;
+		len -= n;
+		*ptr += n;
+	}
+
+	return true;
+}
+
+/*
+ * Build a map of the blocks modified by WAL records between start_lsn and
+ * end_lsn, reading WAL segments from the archive or $PGDATA/pg_wal.
+ * Returns NULL if the map could not be built, e.g. a segment is missing.
+ */
+pgBlockMap *
+xlog_build_block_map(TimeLineID tli, XLogRecPtr start_lsn,
+					 XLogRecPtr end_lsn, int wal_segment_size)
+{
+	pgBlockMap	   *map;
+	XLogStream		stream;
+	XLogRecPtr		ptr;
+	char		   *buf = NULL;
+	uint32			bufsize = 0;
+	bool			ok = false;
+	int64			num_records = 0;
+
+	map = pgut_new(pgBlockMap);
+	map->entries = parray_new();
+	map->last = NULL;
+
+	stream.tli = tli;
+	stream.wal_segment_size = wal_segment_size;
+	stream.fp = NULL;
+	stream.segno = 0;
+	stream.page_ptr = InvalidXLogRecPtr;
+
+	/* start_lsn may not point to a record, so start from the page */
+	ptr = start_lsn - start_lsn % XLOG_BLCKSZ;
+	for (;;)
+	{
+		XLogRecord	header;
+		XLogRecPtr	record_ptr;
+		pg_crc32c	crc;
+
+		if (interrupted)
+			ereport(FATAL,
+				(errcode(ERROR_INTERRUPTED),
+				 errmsg("interrupted during reading WAL")));
+
+		if (!xlog_skip_page_header(&stream, &ptr))
+			break;
+		if (ptr >= end_lsn)
+		{
+			ok = true;
+			break;
+		}
+
+		record_ptr = ptr;
+		if (!xlog_read_record_bytes(&stream, &ptr, (char *) &header,
+									SizeOfXLogRecord))
+			break;
+		if (header.xl_tot_len < SizeOfXLogRecord ||
+			header.xl_tot_len > XLogRecordMaxSize)
+		{
+			elog(DEBUG, "invalid WAL record length %u at %X/%08X",
+				 header.xl_tot_len,
+				 (uint32) (record_ptr >> 32), (uint32) record_ptr);
+			break;
+		}
+
+		if (bufsize < header.xl_tot_len)
+		{
+			bufsize = Max(header.xl_tot_len, XLOG_BLCKSZ);
+			buf = pgut_realloc(buf, bufsize);
+		}
+		memcpy(buf, &header, SizeOfXLogRecord);
+		if (!xlog_read_record_bytes(&stream, &ptr, buf + SizeOfXLogRecord,
+									header.xl_tot_len - SizeOfXLogRecord))
+			break;
+
+		/* based on ValidXLogRecord() in src/backend/access/transam/xlogreader.c */
+		INIT_CRC32C(crc);
+		COMP_CRC32C(crc, buf + SizeOfXLogRecord,
+					header.xl_tot_len - SizeOfXLogRecord);
+		COMP_CRC32C(crc, buf, offsetof(XLogRecord, xl_crc));
+		FIN_CRC32C(crc);
+		if (!EQ_CRC32C(header.xl_crc, crc))
+		{
+			elog(DEBUG, "incorrect WAL record CRC at %X/%08X",
+				 (uint32) (record_ptr >> 32), (uint32) record_ptr);
+			break;
+		}
+
+		if (!xlog_record_add_blocks(map, (XLogRecord *) buf))
+		{
+			elog(DEBUG, "invalid WAL record at %X/%08X",
+				 (uint32) (record_ptr >> 32), (uint32) record_ptr);
+			break;
+		}
+		num_records++;
+
+		/* the rest of the segment is unused after a switch record */
+		if (header.xl_rmid == RM_XLOG_ID &&
+			(header.xl_info & ~XLR_INFO_MASK) == XLOG_SWITCH)
+		{
+			XLogSegNo	segno;
+
+			XLByteToPrevSeg(ptr, segno, wal_segment_size);
+			XLogSegNoOffsetToRecPtr(segno + 1, 0, wal_segment_size, ptr);
+		}
+		else
+			ptr = MAXALIGN64(ptr);
+	}
+
+	if (stream.fp)
+		fclose(stream.fp);
+	free(buf);
+
+	if (!ok)
+	{
+		xlog_free_block_map(map);
+		return NULL;
+	}
+
+	elog(DEBUG, "read " INT64_FORMAT " WAL records from %X/%08X to %X/%08X, "
+		 "%lu relations are modified",
+		 num_records, (uint32) (start_lsn >> 32), (uint32) start_lsn,
+		 (uint32) (end_lsn >> 32), (uint32) end_lsn,
+		 (unsigned long) parray_num(map->entries));
+
+	return map;
+}
+
+/*
+ * Parse the path of relation file relative to $PGDATA, which is one of:
+ *   global/<relNumber>[.<segno>]
+ *   base/<dbOid>/<relNumber>[.<segno>]
+ *   pg_tblspc/<spcOid>/<version directory>/<dbOid>/<relNumber>[.<segno>]
+ * Files of the other forks have suffix after relNumber, and are not parsed.
+ */
+static bool
+parse_relation_path(const char *path, Oid *spcOid, Oid *dbOid,
+					Oid *relNumber, BlockNumber *segno)
+{
+	const char *p;
+	char	   *end;
+
+#define PARSE_NUMBER(_dst, _terminator)	\
+	do { \
+		unsigned long	_value; \
+		if (!isdigit((unsigned char) *p)) \
+			return false; \
+		errno = 0; \
+		_value = strtoul(p, &end, 10); \
+		if (errno != 0 || _value > PG_UINT32_MAX || *end != (_terminator)) \
+			return false; \
+		*(_dst) = (uint32) _value; \
+		p = end + 1; \
+	} while (0)
+
+	if (strncmp(path, "global/", 7) == 0)
+	{
+		*spcOid = GLOBALTABLESPACE_OID;
+		*dbOid = InvalidOid;
+		p = path + 7;
+	}
+	else if (strncmp(path, "base/", 5) == 0)
+	{
+		*spcOid = DEFAULTTABLESPACE_OID;
+		p = path + 5;
+		PARSE_NUMBER(dbOid, '/');
+	}
+	else if (strncmp(path, "pg_tblspc/", 10) == 0)
+	{
+		p = path + 10;
+		PARSE_NUMBER(spcOid, '/');
+		if ((p = strchr(p, '/')) == NULL)
+			return false;
+		p++;
+		PARSE_NUMBER(dbOid, '/');
+	}
+	else
+		return false;
+
+	*segno = 0;
+	if (strchr(p, '.'))
+	{
+		PARSE_NUMBER(relNumber, '.');
+		PARSE_NUMBER(segno, '\0');
+	}
+	else
+		PARSE_NUMBER(relNumber, '\0');
+#undef PARSE_NUMBER
+
+	return true;
+}
+
+/*
+ * Get the blocks of the data file modified in WAL, as block numbers in the
+ * file.  rel_path is the path of the file relative to $PGDATA.  Returns
+ * false if all the blocks should be read, otherwise an ascending array of
+ * block numbers, which might be empty, is returned into *blocks.  The array
+ * should be freed by caller.
+ * This can be called by backup workers concurrently.
+ */
+bool
+xlog_block_map_get(const pgBlockMap *map, const char *rel_path,
+				   BlockNumber **blocks, int *num_blocks)
+{
+	Oid				spcOid;
+	Oid				dbOid;
+	Oid				relNumber;
+	BlockNumber		segno;
+	BlockMapEntry  *entry;
+	uint64			start;
+	uint64			blkno;
+	uint64			end;
+
+	*blocks = NULL;
+	*num_blocks = 0;
+
+	if (!parse_relation_path(rel_path, &spcOid, &dbOid, &relNumber, &segno))
+		return false;
+
+	/* the database is created while backup */
+	entry = block_map_find(map, spcOid, dbOid, InvalidOid, NULL);
+	if (entry && entry->all_blocks)
+		return false;
+
+	entry = block_map_find(map, spcOid, dbOid, relNumber, NULL);
+	if (entry && entry->all_blocks)
+		return false;
+
+	start = (uint64) segno * RELSEG_SIZE;
+	end = entry ? Min(start + RELSEG_SIZE, entry->nbits) : start;
+	for (blkno = start; blkno < end; blkno++)
+	{
+		if (entry->bitmap[blkno / 8] & (1 << (blkno % 8)))
+			(*num_blocks)++;
+	}
+
+	*blocks = pgut_newarray(BlockNumber, Max(*num_blocks, 1));
+	*num_blocks = 0;
+	for (blkno = start; blkno < end; blkno++)
+	{
+		if (entry->bitmap[blkno / 8] & (1 << (blkno % 8)))
+			(*blocks)[(*num_blocks)++] = (BlockNumber) (blkno - start);
+	}
+
+	return true;
+}
+
+void
+xlog_free_block_map(pgBlockMap *map)
+{
+	if (map == NULL)
+		return;
+	parray_walk(map->entries, block_map_free_entry);
+	parray_free(map->entries);
+	free(map);
+}